@@ -0,0 +1,132 @@
+#ifndef _itkDisplacementFieldLogarithm_h_
+#define _itkDisplacementFieldLogarithm_h_
+
+#include "itkImageToImageFilter.h"
+#include "rpiVectorFieldLookup.h"
+
+namespace itk
+{
+
+/**
+  * @description DisplacementFieldLogarithm (itk)
+  * The Filter computes the Lie group logarithm V = Log(Phi) of the transformation Phi = Id + U given by
+  * the input displacement field U, i.e. the stationary velocity field such that Exp(V) = Phi. Once the
+  * logarithm is known, the inverse of Phi is Exp(-V), and transformations are averaged by averaging
+  * their logarithms.
+  *
+  * The logarithm is computed by fixed point iterations similar to the updates of the log-domain demons:
+  * - the first approximation is V[0] = U,
+  * - the residual transformation Exp(-V[i]) o Phi = Id + R[i] is computed: R[i](x) = U(x) + E(x + U(x))
+  *   where E is the displacement field of Exp(-V[i]) (see StationaryVelocityFieldExponential),
+  * - since Phi = Exp(V[i]) o Exp(R[i]), the velocity is updated with the Baker-Campbell-Hausdorff formula
+  *   V[i+1] = BCH(V[i], R[i]) (see VelocityFieldBCHCompositionFilter).
+  * The iterations stop when the maximum norm of the residual R[i] is lower than the tolerance (a fraction
+  * of the smallest spacing of the field) or when the maximum number of iterations is reached. The
+  * logarithm exists only if Phi is close enough to the identity and is diffeomorphic: for large or folding
+  * displacements, the residual may not decrease, which can be checked with GetConverged()
+  * and GetResidualMaximumNorm(). When the iteration limit is reached, the residual of the output is still
+  * computed, at the cost of one more exponential.
+  *
+  * Each iteration computes one exponential, one multithreaded composition (see rpi::VectorFieldLookup)
+  * and the brackets of the BCH formula.
+  *
+  * The filter is templated over the input displacement field and the output velocity field
+  */
+
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT DisplacementFieldLogarithm : public ImageToImageFilter<TInputImage, TOutputImage>
+{
+
+public:
+
+    typedef  DisplacementFieldLogarithm                       Self;
+    typedef  ImageToImageFilter<TInputImage, TOutputImage>    Superclass;
+    typedef  SmartPointer<Self>                               Pointer;
+    typedef  SmartPointer<const Self>                         ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+    itkTypeMacro (DisplacementFieldLogarithm, ImageToImageFilter);
+
+    typedef TInputImage                                     InputImageType;
+    typedef typename InputImageType::Pointer                InputImagePointer;
+    typedef typename InputImageType::ConstPointer           InputImageConstPointer;
+    typedef typename InputImageType::PixelType              InputPixelType;
+
+    typedef TOutputImage                                    OutputImageType;
+    typedef typename OutputImageType::Pointer               OutputImagePointer;
+    typedef typename OutputImageType::PixelType             OutputPixelType;
+    typedef typename OutputPixelType::ValueType             OutputPixelRealValueType;
+
+    /** Image dimension. */
+    itkStaticConstMacro(ImageDimension, unsigned int, TInputImage::ImageDimension);
+    itkStaticConstMacro(PixelDimension, unsigned int, InputPixelType::Dimension);
+
+    /** Set/Get the maximum number of iterations (default 20) **/
+    itkSetMacro(MaximumNumberOfIterations, unsigned int);
+    itkGetConstMacro(MaximumNumberOfIterations, unsigned int);
+
+    /** Set/Get the tolerance on the maximum norm of the residual, as a fraction of the smallest spacing (default 0.01) **/
+    itkSetMacro(Tolerance, double);
+    itkGetConstMacro(Tolerance, double);
+
+    /** Set/Get the order of the Baker-Campbell-Hausdorff approximation used by the updates (1 to 4, default 2) **/
+    itkSetClampMacro(ApproximationOrder, unsigned int, 1, 4);
+    itkGetConstMacro(ApproximationOrder, unsigned int);
+
+    /** Get the number of iterations performed by the last update **/
+    itkGetConstMacro(NumberOfIterations, unsigned int);
+
+    /** Get the maximum norm (physical units) of the residual R of the output computed by the last update **/
+    itkGetConstMacro(ResidualMaximumNorm, double);
+
+    /** Get whether the residual of the output is lower than the tolerance **/
+    itkGetConstMacro(Converged, bool);
+
+protected:
+    DisplacementFieldLogarithm();
+    virtual ~DisplacementFieldLogarithm(){}
+
+    void PrintSelf(std::ostream& os,Indent indent) const ITK_OVERRIDE;
+    void GenerateInputRequestedRegion() ITK_OVERRIDE;
+    void EnlargeOutputRequestedRegion(DataObject * output) ITK_OVERRIDE;
+    void GenerateData() ITK_OVERRIDE;
+
+    typedef typename OutputImageType::RegionType            RegionType;
+    typedef rpi::VectorFieldLookup<OutputImageType>         FieldLookupType;
+
+    /** Allocates a field with the geometry of the input **/
+    OutputImagePointer AllocateField(void) const;
+
+    /** output = input (conversion of the input into the output type) **/
+    void CopyField(const InputImageType * input, OutputImageType * output);
+
+    /**
+     * Residual output(x) = warp(x) + field(x + warp(x)), i.e. the displacement of (Id + field) o (Id + warp).
+     * Returns the maximum squared norm of the residual.
+     */
+    double ComputeResidual(const InputImageType * warp, const OutputImageType * field, OutputImageType * output);
+
+private:
+
+    DisplacementFieldLogarithm(const Self&);
+    void operator=(const Self&);
+
+    unsigned int m_MaximumNumberOfIterations;
+    double       m_Tolerance;
+    unsigned int m_ApproximationOrder;
+    unsigned int m_NumberOfIterations;
+    double       m_ResidualMaximumNorm;
+    bool         m_Converged;
+};
+
+
+} // end of namespace itk
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkDisplacementFieldLogarithm.txx"
+#endif
+
+
+#endif
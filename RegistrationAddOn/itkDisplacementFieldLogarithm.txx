@@ -0,0 +1,261 @@
+#ifndef _itkDisplacementFieldLogarithm_txx_
+#define _itkDisplacementFieldLogarithm_txx_
+
+#include "itkDisplacementFieldLogarithm.h"
+#include "itkStationaryVelocityFieldExponential.h"
+#include "itkVelocityFieldBCHCompositionFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageScanlineIterator.h"
+#include "itkMultiThreaderBase.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+
+namespace itk
+{
+/**
+ * Constructor
+ */
+template <class TInputImage, class TOutputImage>
+DisplacementFieldLogarithm<TInputImage, TOutputImage>::DisplacementFieldLogarithm()
+{
+    m_MaximumNumberOfIterations = 20;    /** Default: 20 iterations **/
+    m_Tolerance                 = 0.01;  /** Default: 1% of the smallest spacing **/
+    m_ApproximationOrder        = 2;     /** Default: V + R + 1/2 [V,R] as in the log-domain demons **/
+    m_NumberOfIterations        = 0;
+    m_ResidualMaximumNorm       = 0.0;
+    m_Converged                 = false;
+}
+
+/**
+ * Print out a description of self
+ */
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogarithm<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+
+    os << indent << "MaximumNumberOfIterations: " << m_MaximumNumberOfIterations << std::endl;
+    os << indent << "Tolerance: "                 << m_Tolerance                 << std::endl;
+    os << indent << "ApproximationOrder: "        << m_ApproximationOrder        << std::endl;
+    os << indent << "NumberOfIterations: "        << m_NumberOfIterations        << std::endl;
+    os << indent << "ResidualMaximumNorm: "       << m_ResidualMaximumNorm       << std::endl;
+    os << indent << "Converged: "                 << m_Converged                 << std::endl;
+
+    return;
+}
+
+
+/**
+ * The whole input is needed to compose the fields
+ */
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogarithm<TInputImage,TOutputImage>
+::GenerateInputRequestedRegion()
+{
+    Superclass::GenerateInputRequestedRegion();
+
+    InputImagePointer inputPtr = const_cast<InputImageType *>(this->GetInput());
+    if (inputPtr)
+        inputPtr->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * The whole output is produced
+ */
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogarithm<TInputImage,TOutputImage>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+    Superclass::EnlargeOutputRequestedRegion(output);
+    output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * Allocates a field with the geometry of the input
+ */
+template <class TInputImage, class TOutputImage>
+typename DisplacementFieldLogarithm<TInputImage,TOutputImage>::OutputImagePointer
+DisplacementFieldLogarithm<TInputImage,TOutputImage>
+::AllocateField() const
+{
+    OutputImagePointer field = OutputImageType::New();
+    field->CopyInformation(this->GetInput());
+    field->SetRegions(this->GetInput()->GetLargestPossibleRegion());
+    field->Allocate();
+    return field;
+}
+
+
+/**
+ * output = input
+ */
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogarithm<TInputImage,TOutputImage>
+::CopyField(const InputImageType * input, OutputImageType * output)
+{
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [input, output](const RegionType & region)
+        {
+            ImageRegionConstIterator<InputImageType> inIt(input, region);
+            ImageRegionIterator<OutputImageType>     outIt(output, region);
+            for (; !outIt.IsAtEnd(); ++inIt, ++outIt)
+            {
+                const InputPixelType value = inIt.Get();
+                OutputPixelType      copy;
+                for (unsigned int k=0; k<PixelDimension; k++)
+                    copy[k] = static_cast<OutputPixelRealValueType>(value[k]);
+                outIt.Set(copy);
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
+/**
+ * Residual of the current approximation, computed as the composition step of StationaryVelocityFieldExponential.
+ * Each thread reduces the norm over its region, the results are merged under a lock.
+ */
+template <class TInputImage, class TOutputImage>
+double
+DisplacementFieldLogarithm<TInputImage,TOutputImage>
+::ComputeResidual(const InputImageType * warp, const OutputImageType * field, OutputImageType * output)
+{
+    FieldLookupType lookup;
+    lookup.SetField(field);
+
+    const RegionType bufferedRegion = field->GetBufferedRegion();
+    double           maxnorm2       = 0.0;
+    std::mutex       mutex;
+
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [&](const RegionType & region)
+        {
+            const SizeValueType lineLength = region.GetSize(0);
+            std::vector<double>          indices(lineLength * ImageDimension);
+            std::vector<OutputPixelType> values(lineLength);
+            double                       displacement[ImageDimension];
+            double                       shift[ImageDimension];
+            double                       localMax = 0.0;
+
+            ImageScanlineConstIterator<InputImageType> warpIt(warp, region);
+            ImageScanlineIterator<OutputImageType>     outIt(output, region);
+            while (!warpIt.IsAtEnd())
+            {
+                // Continuous index of x + warp(x)
+                const typename InputImageType::IndexType lineIndex = warpIt.GetIndex();
+                for (SizeValueType x=0; !warpIt.IsAtEndOfLine(); ++warpIt, ++x)
+                {
+                    const InputPixelType w = warpIt.Get();
+                    for (unsigned int i=0; i<ImageDimension; i++)
+                        displacement[i] = w[i];
+                    lookup.TransformPhysicalVectorToContinuousIndex(displacement, shift);
+
+                    double * index = &indices[x * ImageDimension];
+                    for (unsigned int i=0; i<ImageDimension; i++)
+                        index[i] = static_cast<double>(lineIndex[i] - bufferedRegion.GetIndex(i)) + shift[i];
+                    index[0] += x;
+                }
+
+                // Composition of the displacement fields
+                lookup.EvaluateAtContinuousIndices(indices.data(), values.data(), lineLength);
+                warpIt.GoToBeginOfLine();
+                for (SizeValueType x=0; !outIt.IsAtEndOfLine(); ++outIt, ++warpIt, ++x)
+                {
+                    const InputPixelType w = warpIt.Get();
+                    OutputPixelType      residual;
+                    for (unsigned int k=0; k<PixelDimension; k++)
+                        residual[k] = static_cast<OutputPixelRealValueType>(w[k] + values[x][k]);
+                    localMax = std::max(localMax, static_cast<double>(residual.GetSquaredNorm()));
+                    outIt.Set(residual);
+                }
+
+                warpIt.NextLine();
+                outIt.NextLine();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            maxnorm2 = std::max(maxnorm2, localMax);
+        },
+        ITK_NULLPTR);
+
+    return maxnorm2;
+}
+
+
+/**
+ * GenerateData
+ */
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogarithm<TInputImage,TOutputImage>
+::GenerateData()
+{
+    itkDebugMacro(<<"Actually executing");
+
+    typedef StationaryVelocityFieldExponential<OutputImageType, OutputImageType>   ExponentialType;
+    typedef VelocityFieldBCHCompositionFilter<OutputImageType, OutputImageType>    BCHFilterType;
+
+    InputImageConstPointer inputPtr = this->GetInput();
+
+    double minpixelspacing = inputPtr->GetSpacing()[0];
+    for (unsigned int i = 1;i < itkGetStaticConstMacro(ImageDimension);++i)
+        minpixelspacing = std::min(minpixelspacing, static_cast<double>(inputPtr->GetSpacing()[i]));
+    const double tolerance = m_Tolerance * minpixelspacing;
+
+    // First approximation: V[0] = U
+    OutputImagePointer velocity = this->AllocateField();
+    this->CopyField(inputPtr, velocity);
+
+    OutputImagePointer residual = this->AllocateField();
+    m_NumberOfIterations  = 0;
+    m_ResidualMaximumNorm = 0.0;
+    m_Converged           = false;
+    for (unsigned int i = 0;i <= m_MaximumNumberOfIterations;++i)
+    {
+        // Displacement field of Exp(-V[i])
+        typename ExponentialType::Pointer exponential = ExponentialType::New();
+        exponential->SetInput(velocity);
+        exponential->SetMultiplicativeFactor(-1.0);
+        exponential->Update();
+
+        // Residual transformation Exp(-V[i]) o Phi = Id + R[i]
+        m_ResidualMaximumNorm = std::sqrt(this->ComputeResidual(inputPtr, exponential->GetOutput(), residual));
+        itkDebugMacro(<< "Iteration " << i << ": residual maximum norm " << m_ResidualMaximumNorm);
+        // The residual of the last approximation is computed even if the iteration limit is reached
+        m_Converged = m_ResidualMaximumNorm < tolerance;
+        if (m_Converged || i == m_MaximumNumberOfIterations)
+            break;
+
+        // V[i+1] = BCH(V[i], R[i])
+        typename BCHFilterType::Pointer bch = BCHFilterType::New();
+        bch->SetFirstVelocityField(velocity);
+        bch->SetSecondVelocityField(residual);
+        bch->SetApproximationOrder(m_ApproximationOrder);
+        bch->Update();
+
+        velocity = bch->GetOutput();
+        velocity->DisconnectPipeline();
+        m_NumberOfIterations = i + 1;
+    }
+
+    this->GraftOutput(velocity);
+}
+
+
+} // end namespace itk
+
+#endif
@@ -19,10 +19,14 @@
 #include "itkImageToImageFilter.h"
 
 #include "itkWarpVectorImageFilter.h"
-#include "itkVectorLinearInterpolateImageFunction.h"
 #include "itkImageRegionIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageScanlineIterator.h"
+#include "rpiVectorFieldLookup.h"
 #include "itkTimeProbe.h"
 
+#include <vector>
+
 namespace itk
 {
 
@@ -41,6 +45,17 @@ namespace itk
  * Medical Physics, vol. 35, issue 1, p. 81,
  * is applied.
  *
+ * Since the fixed point iteration of a given output voxel only depends on the input field, the
+ * voxels are processed independently by the threads. A voxel is no longer updated once its
+ * residual (norm of the last update, i.e. inverse consistency error of the previous estimate)
+ * is lower than the tolerance. The iterations of a thread stop when the maximum (or RMS)
+ * residual over its region is lower than the residual threshold, when all its voxels have
+ * converged, or when the maximum number of iterations is reached. The residual achieved over
+ * the whole output is available after the update.
+ *
+ * The voxels of a scanline that still have to be updated are interpolated together, so that
+ * 3D float fields benefit from the vectorised lookup (see rpi::VectorFieldLookup).
+ *
  * \author Marcel L. Thi, Computer Science Department, University of Basel
  */
 
@@ -81,6 +96,7 @@ public:
   typedef typename OutputImageType::SizeType 	    OutputImageSizeType;
   typedef typename OutputImageType::SpacingType     OutputImageSpacingType;
   typedef typename TOutputImage::PointType   		OutputImageOriginPointType;
+  typedef typename OutputImageType::RegionType     OutputImageRegionType;
   typedef TimeProbe TimeType;
 
 
@@ -88,23 +104,56 @@ public:
   itkStaticConstMacro(ImageDimension, unsigned int,
                       TOutputImage::ImageDimension);
 
+  /** Image storing the residual of each output voxel. */
+  typedef Image<float, itkGetStaticConstMacro(ImageDimension)> ResidualImageType;
+  typedef typename ResidualImageType::Pointer                  ResidualImagePointer;
+  typedef ImageScanlineIterator<ResidualImageType>             ResidualIterator;
 
 
   typedef ImageRegionConstIterator<InputImageType> InputConstIterator;
   typedef ImageRegionIterator<InputImageType>      InputIterator;
   typedef ImageRegionConstIterator<OutputImageType> OutputConstIterator;
   typedef ImageRegionIterator<OutputImageType>     OutputIterator;
+  typedef ImageRegionIteratorWithIndex<OutputImageType> OutputIteratorWithIndex;
+  typedef ImageScanlineIterator<OutputImageType>   OutputScanlineIterator;
 
   typedef WarpVectorImageFilter<TOutputImage,TInputImage,TOutputImage> VectorWarperType;
 
-  typedef VectorLinearInterpolateImageFunction<TInputImage,double> FieldInterpolatorType;
-  typedef typename FieldInterpolatorType::Pointer                  FieldInterpolatorPointer;
-  typedef typename FieldInterpolatorType::OutputType               FieldInterpolatorOutputType;
+  typedef rpi::VectorFieldLookup<TInputImage>                      FieldLookupType;
+  typedef typename FieldLookupType::PixelType                      FieldLookupOutputType;
 
 
+  /** Set/Get the maximum number of iterations. */
   itkSetMacro(NumberOfIterations, unsigned int);
   itkGetConstMacro(NumberOfIterations, unsigned int);
 
+  /** Set/Get the per-voxel residual (physical units) below which a voxel has converged.
+   *  The default value 0 disables the early stop of the voxels. */
+  itkSetMacro(Tolerance, double);
+  itkGetConstMacro(Tolerance, double);
+
+  /** Set/Get the residual (physical units) below which the iterations stop. The maximum
+   *  residual is considered by default, the RMS residual if UseRMSResidual is on.
+   *  The default value 0 disables this stopping criterion. */
+  itkSetMacro(ResidualThreshold, double);
+  itkGetConstMacro(ResidualThreshold, double);
+  itkSetMacro(UseRMSResidual, bool);
+  itkGetConstMacro(UseRMSResidual, bool);
+  itkBooleanMacro(UseRMSResidual);
+
+  /** Set/Get whether the input field is copied into bricks in Morton order before the iterations
+   *  (see rpi::BrickedVectorField). This improves the cache locality of the interpolations for
+   *  large deformations, at the cost of a copy of the field. Off by default. */
+  itkSetMacro(UseBrickedLayout, bool);
+  itkGetConstMacro(UseBrickedLayout, bool);
+  itkBooleanMacro(UseBrickedLayout);
+
+  /** Get the maximum and RMS residuals achieved over the output, and the largest number of
+   *  iterations performed. Voxels mapped outside of the input field are not considered. */
+  itkGetConstMacro(MaximumResidual, double);
+  itkGetConstMacro(RMSResidual, double);
+  itkGetConstMacro(ElapsedIterations, unsigned int);
+
 
   /** Set the size of the output image. */
   itkSetMacro( Size, OutputImageSizeType );
@@ -135,8 +184,12 @@ protected:
 
   void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
 
-  void GenerateData() ITK_OVERRIDE;
+  void BeforeThreadedGenerateData() ITK_OVERRIDE;
+  void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
+                            ThreadIdType threadId) ITK_OVERRIDE;
+  void AfterThreadedGenerateData() ITK_OVERRIDE;
   void GenerateOutputInformation() ITK_OVERRIDE;
+  void GenerateInputRequestedRegion() ITK_OVERRIDE;
   unsigned int m_NumberOfIterations;
 
 private:
@@ -146,6 +199,22 @@ private:
   OutputImageSizeType                      m_Size;              // Size of the output image
   OutputImageSpacingType                   m_OutputSpacing;     // output image spacing
   OutputImageOriginPointType               m_OutputOrigin;      // output image origin
+
+  double                                   m_Tolerance;         // per-voxel residual tolerance
+  double                                   m_ResidualThreshold; // global residual threshold
+  bool                                     m_UseRMSResidual;    // RMS instead of maximum residual
+  bool                                     m_UseBrickedLayout;  // interpolate a bricked copy of the input
+  double                                   m_MaximumResidual;   // achieved maximum residual
+  double                                   m_RMSResidual;       // achieved RMS residual
+  unsigned int                             m_ElapsedIterations; // iterations performed
+
+  FieldLookupType                          m_FieldLookup;       // interpolator of the input field
+  ResidualImagePointer                     m_ResidualImage;     // residual of each output voxel
+
+  std::vector<double>                      m_ThreadMaximumResidual;
+  std::vector<double>                      m_ThreadSumOfSquaredResiduals;
+  std::vector<SizeValueType>               m_ThreadNumberOfResiduals;
+  std::vector<unsigned int>                m_ThreadElapsedIterations;
 };
 
 } // end namespace itk
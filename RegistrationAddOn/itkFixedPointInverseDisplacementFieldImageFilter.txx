@@ -15,6 +15,8 @@
 #define __itkFixedPointInverseDisplacementFieldImageFilter_txx
 
 #include "itkFixedPointInverseDisplacementFieldImageFilter.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 namespace itk {
@@ -22,7 +24,12 @@ namespace itk {
 // Constructor
 template<class TInputImage, class TOutputImage>
 FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::FixedPointInverseDisplacementFieldImageFilter() :
-	m_NumberOfIterations(5) {
+	m_NumberOfIterations(5), m_Tolerance(0.0), m_ResidualThreshold(0.0), m_UseRMSResidual(false),
+	m_UseBrickedLayout(false),
+	m_MaximumResidual(0.0), m_RMSResidual(0.0), m_ElapsedIterations(0) {
+
+	// The voxels are processed by the classic ThreadedGenerateData
+	this->DynamicMultiThreadingOff();
 
 	m_OutputSpacing.Fill(1.0);
 	m_OutputOrigin.Fill(0.0);
@@ -61,14 +68,11 @@ FixedPointInverseDisplacementFieldImageFilter<TInputImage,TOutputImage>
 
 //----------------------------------------------------------------------------
 template<class TInputImage, class TOutputImage>
-void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::GenerateData() {
-
-	const unsigned int ImageDimension = InputImageType::ImageDimension;
+void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::BeforeThreadedGenerateData() {
 
 	InputImageConstPointer inputPtr = this->GetInput(0);
 	OutputImagePointer outputPtr = this->GetOutput(0);
 
-
 	// some checks
 	if (inputPtr.IsNull()) {
 		itkExceptionMacro("\n Input is missing.");
@@ -77,71 +81,197 @@ void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::G
 		itkExceptionMacro("\n Image Dimensions must be the same.");
 	}
 
-	// The initial deformation field is simply the negative input deformation field.
-	// Here we create this deformation field.
-	InputImagePointer negField = InputImageType::New();
-	negField->SetRegions(inputPtr->GetLargestPossibleRegion());
-	negField->SetOrigin(inputPtr->GetOrigin());
-	negField->SetSpacing(inputPtr->GetSpacing());
-	negField->SetDirection(inputPtr->GetDirection());
-	negField->Allocate();
-
+	// The output deformation field is initialized to 0
+	OutputImagePixelType zero_pt;
+	zero_pt.Fill(0);
+	outputPtr->FillBuffer(zero_pt);
 
-	InputConstIterator InputIt = InputConstIterator(inputPtr,
-			inputPtr->GetRequestedRegion());
-	InputIterator negImageIt = InputIterator(negField,
-			negField->GetRequestedRegion());
+	// The residual of the voxels that have not been processed yet is infinite
+	m_ResidualImage = ResidualImageType::New();
+	m_ResidualImage->SetRegions(outputPtr->GetBufferedRegion());
+	m_ResidualImage->Allocate();
+	m_ResidualImage->FillBuffer(NumericTraits<float>::max());
 
-	for (negImageIt.GoToBegin(), InputIt.GoToBegin(); !negImageIt.IsAtEnd(); ++negImageIt) {
-		negImageIt.Set(-InputIt.Get());
-		++InputIt;
+	// In the fixed point iteration, we will need to access non-grid points.
+	// The input field is linearly interpolated directly and the negation is done
+	// on the fly, which avoids a copy of the field.
+	if (m_UseBrickedLayout)
+	{
+		typename FieldLookupType::BrickedFieldType::Pointer bricks = FieldLookupType::BrickedFieldType::New();
+		bricks->SetField(inputPtr);
+		m_FieldLookup.SetBrickedField(bricks);
 	}
+	else
+		m_FieldLookup.SetField(inputPtr);
+
+	// Per-thread statistics
+	const ThreadIdType numberOfThreads = this->GetNumberOfWorkUnits();
+	m_ThreadMaximumResidual.assign(numberOfThreads, 0.0);
+	m_ThreadSumOfSquaredResiduals.assign(numberOfThreads, 0.0);
+	m_ThreadNumberOfResiduals.assign(numberOfThreads, 0);
+	m_ThreadElapsedIterations.assign(numberOfThreads, 0);
+}
 
-	// We allocate a deformation field that holds the output
-	// and initialize it to 0
-	outputPtr->SetBufferedRegion( outputPtr->GetRequestedRegion() );
-	outputPtr->Allocate();
 
-	OutputIterator outputIt = OutputIterator(outputPtr,
-			outputPtr->GetRequestedRegion());
-	OutputImagePixelType zero_pt;
-	zero_pt.Fill(0);
-	for (outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++outputIt) {
-		outputIt.Set(zero_pt);
+
+//----------------------------------------------------------------------------
+template<class TInputImage, class TOutputImage>
+void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::ThreadedGenerateData(
+		const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId) {
+
+	const unsigned int ImageDimension = InputImageType::ImageDimension;
+
+	OutputImagePointer outputPtr = this->GetOutput(0);
+
+	OutputScanlineIterator outputIt(outputPtr, outputRegionForThread);
+	ResidualIterator residualIt(m_ResidualImage, outputRegionForThread);
+
+	// Physical step between two consecutive voxels of a scanline
+	double lineStep[ImageDimension];
+	for (unsigned int j = 0; j < ImageDimension; j++) {
+		lineStep[j] = outputPtr->GetDirection()[j][0] * outputPtr->GetSpacing()[0];
 	}
 
+	// Voxels of the current scanline to update, with the continuous index of their
+	// mapped point in the input field
+	const SizeValueType lineLength = outputRegionForThread.GetSize(0);
+	std::vector<SizeValueType> activeVoxels(lineLength);
+	std::vector<double> mappedIndices(lineLength * ImageDimension);
+	std::vector<FieldLookupOutputType> interpolatedValues(lineLength);
 
-	// In the fixed point iteration, we will need to access non-grid points.
-	// Currently, the best interpolator that is supported by itk for vector
-	// images is the linear interpolater.
-	typename FieldInterpolatorType::Pointer vectorInterpolator =
-			FieldInterpolatorType::New();
-	vectorInterpolator->SetInputImage(negField);
+	OutputImagePointType lineStart;
+	double mappedPt[ImageDimension];
+	OutputImagePixelType displacement, newDisplacement;
 
+	double maxResidual = 0.0;
+	double sumOfSquaredResiduals = 0.0;
+	SizeValueType numberOfResiduals = 0;
+	unsigned int iteration = 0;
 
 	// Finally, perform the fixed point iteration.
-	InputImagePointType mappedPt;
-	OutputImagePointType pt;
-	OutputImageIndexType index;
-	OutputImagePixelType displacement, interpolatedValue;
-
-	for (unsigned int i = 0; i <= m_NumberOfIterations; i++) {
-
-		for (outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++outputIt) {
-			index = outputIt.GetIndex();
-			outputPtr->TransformIndexToPhysicalPoint(index, pt);
-			displacement = outputIt.Get();
-			for (unsigned int j = 0; j < ImageDimension; j++) {
-				mappedPt[j] = pt[j] + displacement[j];
+	while (iteration <= m_NumberOfIterations) {
+
+		++iteration;
+		maxResidual = 0.0;
+		sumOfSquaredResiduals = 0.0;
+		numberOfResiduals = 0;
+		bool updated = false;
+
+		outputIt.GoToBegin();
+		residualIt.GoToBegin();
+		while (!outputIt.IsAtEnd()) {
+
+			outputPtr->TransformIndexToPhysicalPoint(outputIt.GetIndex(), lineStart);
+
+			// First pass: list the voxels to update
+			SizeValueType numberOfActiveVoxels = 0;
+			for (SizeValueType x = 0; !outputIt.IsAtEndOfLine(); ++outputIt, ++residualIt, ++x) {
+
+				float residual = residualIt.Get();
+
+				// A negative residual means that the voxel is mapped outside of the input field
+				if (residual < 0)
+					continue;
+
+				// Voxels that have converged are not updated anymore
+				if (residual > m_Tolerance) {
+					displacement = outputIt.Get();
+					for (unsigned int j = 0; j < ImageDimension; j++) {
+						mappedPt[j] = lineStart[j] + x * lineStep[j] + displacement[j];
+					}
+
+					double * index = &mappedIndices[numberOfActiveVoxels * ImageDimension];
+					m_FieldLookup.TransformPhysicalPointToContinuousIndex(mappedPt, index);
+					if (!m_FieldLookup.IsInsideBuffer(index)) {
+						residualIt.Set(-1.0);
+						continue;
+					}
+					activeVoxels[numberOfActiveVoxels++] = x;
+					continue;
+				}
+
+				maxResidual = std::max(maxResidual, static_cast<double>(residual));
+				sumOfSquaredResiduals += static_cast<double>(residual) * residual;
+				++numberOfResiduals;
 			}
 
-
-			if (vectorInterpolator->IsInsideBuffer(mappedPt)) {
-                interpolatedValue = vectorInterpolator->Evaluate(mappedPt);
-				outputIt.Set(interpolatedValue);
+			// Interpolate the input field at the mapped points
+			m_FieldLookup.EvaluateAtContinuousIndices(mappedIndices.data(), interpolatedValues.data(), numberOfActiveVoxels);
+
+			// Second pass: update the listed voxels
+			outputIt.GoToBeginOfLine();
+			residualIt.GoToBeginOfLine();
+			SizeValueType x = 0;
+			for (SizeValueType n = 0; n < numberOfActiveVoxels; n++) {
+				for (; x < activeVoxels[n]; ++x) {
+					++outputIt;
+					++residualIt;
+				}
+
+				displacement = outputIt.Get();
+				double squaredResidual = 0.0;
+				for (unsigned int j = 0; j < ImageDimension; j++) {
+					newDisplacement[j] = static_cast<OutputImageValueType>(-interpolatedValues[n][j]);
+					double diff = static_cast<double>(newDisplacement[j]) - static_cast<double>(displacement[j]);
+					squaredResidual += diff * diff;
+				}
+				outputIt.Set(newDisplacement);
+
+				float residual = static_cast<float>(std::sqrt(squaredResidual));
+				residualIt.Set(residual);
+				updated = true;
+
+				maxResidual = std::max(maxResidual, static_cast<double>(residual));
+				sumOfSquaredResiduals += static_cast<double>(residual) * residual;
+				++numberOfResiduals;
 			}
+
+			outputIt.NextLine();
+			residualIt.NextLine();
 		}
+
+		// All the voxels have converged
+		if (!updated)
+			break;
+
+		// The residual over the region is small enough
+		if (m_ResidualThreshold > 0.0) {
+			double regionResidual = maxResidual;
+			if (m_UseRMSResidual)
+				regionResidual = (numberOfResiduals > 0) ? std::sqrt(sumOfSquaredResiduals / numberOfResiduals) : 0.0;
+			if (regionResidual < m_ResidualThreshold)
+				break;
+		}
+	}
+
+	m_ThreadMaximumResidual[threadId] = maxResidual;
+	m_ThreadSumOfSquaredResiduals[threadId] = sumOfSquaredResiduals;
+	m_ThreadNumberOfResiduals[threadId] = numberOfResiduals;
+	m_ThreadElapsedIterations[threadId] = iteration;
+}
+
+
+
+//----------------------------------------------------------------------------
+template<class TInputImage, class TOutputImage>
+void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::AfterThreadedGenerateData() {
+
+	// Merge the statistics of the threads
+	double sumOfSquaredResiduals = 0.0;
+	SizeValueType numberOfResiduals = 0;
+	m_MaximumResidual = 0.0;
+	m_ElapsedIterations = 0;
+	for (unsigned int t = 0; t < m_ThreadMaximumResidual.size(); t++) {
+		m_MaximumResidual = std::max(m_MaximumResidual, m_ThreadMaximumResidual[t]);
+		sumOfSquaredResiduals += m_ThreadSumOfSquaredResiduals[t];
+		numberOfResiduals += m_ThreadNumberOfResiduals[t];
+		m_ElapsedIterations = std::max(m_ElapsedIterations, m_ThreadElapsedIterations[t]);
 	}
+	m_RMSResidual = (numberOfResiduals > 0) ? std::sqrt(sumOfSquaredResiduals / numberOfResiduals) : 0.0;
+
+	// Release the temporary data
+	m_ResidualImage = ITK_NULLPTR;
+	m_FieldLookup = FieldLookupType();
 }
 
 
@@ -176,6 +306,25 @@ FixedPointInverseDisplacementFieldImageFilter<TInputImage,TOutputImage>
 }
 
 
+/**
+ * The whole input field is needed whatever the output region
+ */
+template <class TInputImage, class TOutputImage>
+void
+FixedPointInverseDisplacementFieldImageFilter<TInputImage,TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImagePointer inputPtr = const_cast< InputImageType * >( this->GetInput() );
+  if ( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+
 //----------------------------------------------------------------------------
 template<class TInputImage, class TOutputImage>
 void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::PrintSelf(
@@ -185,6 +334,13 @@ void FixedPointInverseDisplacementFieldImageFilter<TInputImage, TOutputImage>::P
 
 	os << indent << "Number of iterations: " << m_NumberOfIterations
 			<< std::endl;
+	os << indent << "Tolerance: " << m_Tolerance << std::endl;
+	os << indent << "Residual threshold: " << m_ResidualThreshold
+			<< (m_UseRMSResidual ? " (RMS)" : " (maximum)") << std::endl;
+	os << indent << "Use bricked layout: " << m_UseBrickedLayout << std::endl;
+	os << indent << "Maximum residual: " << m_MaximumResidual << std::endl;
+	os << indent << "RMS residual: " << m_RMSResidual << std::endl;
+	os << indent << "Elapsed iterations: " << m_ElapsedIterations << std::endl;
 	os << std::endl;
 }
 
@@ -107,11 +107,21 @@ namespace itk
         typedef typename MatrixOffsetTransformType::ConstPointer MatrixOffsetTransformConstPointerType;
         /** type of transform lists */
         typedef  std::vector<TransformConstPointerType> TransformListType;
+        /** Number of points processed together by TransformPoints */
+        itkStaticConstMacro(PointsPerBlock, unsigned int, 4096);
         
         
         
         /**  Method to transform a point. */
         virtual OutputPointType TransformPoint(const InputPointType  & ) const ITK_OVERRIDE;
+        /**
+         Transform a set of points. The points are processed by blocks, each transform of the
+         stack being applied to the whole block before the next one: linear transforms are
+         applied through their matrix and offset, field transforms through their own batch
+         method, and other transforms point by point. Large sets of points are split across
+         threads. The input and output arrays can be the same.
+         */
+        virtual void TransformPoints(const InputPointType * input, OutputPointType * output, SizeValueType numberOfPoints) const;
         /**  Method to transform a vector. */
         virtual OutputVectorType    TransformVector(const InputVectorType &) const ITK_OVERRIDE;
         /**  Method to transform a vnl_vector. */
@@ -168,6 +178,14 @@ namespace itk
         virtual void SetIdentity(void);
         
         virtual MatrixOffsetTransformPointerType GetGlobalLinearTransform (void) const;
+        /**
+         Compile the stack into an equivalent and cheaper one before evaluating it.
+         Nested GeneralTransforms are flattened, identities are dropped, adjacent runs of
+         MatrixOffsetTransformBase are folded into one matrix, and a stationary velocity field
+         directly followed by its inverse (opposite field) is cancelled. The transforms of the
+         current stack are not modified.
+         */
+        virtual Pointer GetSimplifiedTransform (void) const;
         /**
          Get the number of transform currently in stack
          */
@@ -206,6 +224,21 @@ namespace itk
         void PrintSelf(std::ostream &os, Indent indent) const ITK_OVERRIDE;
         
         unsigned int RemoveTransform(TransformConstPointerType arg);
+
+        /** Append the transforms of the stack to a list, nested stacks being flattened. */
+        void AppendFlattenedTransforms(TransformListType & list) const;
+
+        /** Indicate if a transform is an identity. */
+        static bool IsIdentity(const TransformType * transform);
+
+        /** Indicate if the composition of two transforms is the identity. */
+        static bool AreInverse(const TransformType * first, const TransformType * second);
+
+        /** Transform a block of points with the stack, in the calling thread. */
+        void TransformBlockOfPoints(const InputPointType * input, OutputPointType * output, SizeValueType numberOfPoints) const;
+
+        /** Transform a block of points in place with a single transform of the stack. */
+        static void TransformBlockOfPoints(const TransformType * transform, OutputPointType * points, SizeValueType numberOfPoints);
         
         GeneralTransform();
         virtual ~GeneralTransform();
@@ -20,6 +20,15 @@ PURPOSE.  See the above copyright notices for more information.
 
 #include "itkGeneralTransform.h"
 
+#include "itkIdentityTransform.h"
+#include "itkMultiThreaderBase.h"
+#include "itkStationaryVelocityFieldTransform.h"
+#include "rpiDisplacementFieldTransform.h"
+#include "rpiBSplineDisplacementFieldTransform.h"
+
+#include <algorithm>
+#include <cmath>
+
 
 namespace itk
 {
@@ -117,6 +126,119 @@ TransformPoint(const InputPointType &point) const
 }
 
 
+// Transform a set of points
+template<class TScalarType, unsigned int NDimensions>
+void
+GeneralTransform<TScalarType, NDimensions>::
+TransformPoints(const InputPointType * input, OutputPointType * output, SizeValueType numberOfPoints) const
+{
+  const SizeValueType blockSize      = PointsPerBlock;
+  const SizeValueType numberOfBlocks = ( numberOfPoints + blockSize - 1 ) / blockSize;
+
+  // Small sets are not worth splitting across threads
+  if ( numberOfBlocks < 2 )
+  {
+    this->TransformBlockOfPoints( input, output, numberOfPoints );
+    return;
+  }
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfBlocks,
+    [this, input, output, numberOfPoints, blockSize](SizeValueType block)
+    {
+      const SizeValueType first = block * blockSize;
+      const SizeValueType count = std::min( blockSize, numberOfPoints - first );
+      this->TransformBlockOfPoints( input + first, output + first, count );
+    },
+    ITK_NULLPTR );
+}
+
+
+// Transform a block of points with the whole stack
+template<class TScalarType, unsigned int NDimensions>
+void
+GeneralTransform<TScalarType, NDimensions>::
+TransformBlockOfPoints(const InputPointType * input, OutputPointType * output, SizeValueType numberOfPoints) const
+{
+  if ( input != output )
+    std::copy( input, input + numberOfPoints, output );
+
+  // The last transform of the list is applied first
+  typename TransformListType::const_reverse_iterator it = m_TransformList.rbegin();
+  while(it != m_TransformList.rend())
+  {
+    TransformBlockOfPoints( it->GetPointer(), output, numberOfPoints );
+    it++;
+  }
+}
+
+
+// Transform a block of points in place with a single transform
+template<class TScalarType, unsigned int NDimensions>
+void
+GeneralTransform<TScalarType, NDimensions>::
+TransformBlockOfPoints(const TransformType * transform, OutputPointType * points, SizeValueType numberOfPoints)
+{
+  typedef IdentityTransform<TScalarType, NDimensions>                  IdentityTransformType;
+  typedef rpi::DisplacementFieldTransform<TScalarType, NDimensions>    DFTransformType;
+  typedef StationaryVelocityFieldTransform<TScalarType, NDimensions>   SVFTransformType;
+  typedef rpi::BSplineDisplacementFieldTransform<TScalarType, NDimensions> BSplineTransformType;
+
+  if ( dynamic_cast<const IdentityTransformType *>(transform) )
+    return;
+
+  const MatrixOffsetTransformType * linear = dynamic_cast<const MatrixOffsetTransformType *>(transform);
+  if ( linear )
+  {
+    const typename MatrixOffsetTransformType::MatrixType & matrix = linear->GetMatrix();
+    const typename MatrixOffsetTransformType::OffsetType & offset = linear->GetOffset();
+    for ( SizeValueType n = 0; n < numberOfPoints; ++n )
+    {
+      const InputPointType point = points[n];
+      for ( unsigned int i = 0; i < NDimensions; ++i )
+      {
+        TScalarType value = offset[i];
+        for ( unsigned int j = 0; j < NDimensions; ++j )
+          value += matrix[i][j] * point[j];
+        points[n][i] = value;
+      }
+    }
+    return;
+  }
+
+  const Self * stack = dynamic_cast<const Self *>(transform);
+  if ( stack )
+  {
+    stack->TransformBlockOfPoints( points, points, numberOfPoints );
+    return;
+  }
+
+  const DFTransformType * df = dynamic_cast<const DFTransformType *>(transform);
+  if ( df )
+  {
+    df->TransformPoints( points, points, numberOfPoints );
+    return;
+  }
+
+  const SVFTransformType * svf = dynamic_cast<const SVFTransformType *>(transform);
+  if ( svf )
+  {
+    svf->TransformPoints( points, points, numberOfPoints );
+    return;
+  }
+
+  const BSplineTransformType * bspline = dynamic_cast<const BSplineTransformType *>(transform);
+  if ( bspline )
+  {
+    bspline->TransformPoints( points, points, numberOfPoints );
+    return;
+  }
+
+  for ( SizeValueType n = 0; n < numberOfPoints; ++n )
+    points[n] = transform->TransformPoint( points[n] );
+}
+
+
 // Transform a vector
 template<class TScalarType, unsigned int NDimensions>
 typename GeneralTransform<TScalarType, NDimensions>::OutputVectorType
@@ -274,7 +396,7 @@ GetGlobalLinearTransform (void) const
       {
 	const Self *genTrs = dynamic_cast<const Self*>(it->GetPointer());
 	if(genTrs)
-	  ret->Compose(genTrs->GetGlobalLinearTransform());
+	  ret->Compose(genTrs->GetGlobalLinearTransform(), 1);
       }
       it++;
   }
@@ -282,6 +404,153 @@ GetGlobalLinearTransform (void) const
   return ret;
 }
 
+template<class TScalarType, unsigned int NDimensions>
+typename GeneralTransform<TScalarType, NDimensions>::Pointer
+GeneralTransform<TScalarType, NDimensions>::
+GetSimplifiedTransform (void) const
+{
+  TransformListType flattened;
+  this->AppendFlattenedTransforms( flattened );
+
+  // The simplified list is built like a stack: each transform is merged with, or cancels,
+  // the last transform kept, which lets simplifications cascade (e.g. A, B, B^-1, A^-1)
+  TransformListType simplified;
+  typename TransformListType::const_iterator it = flattened.begin();
+  while( it != flattened.end())
+  {
+    const TransformType * transform = it->GetPointer();
+    it++;
+
+    if ( IsIdentity(transform) )
+      continue;
+
+    if ( !simplified.empty() )
+    {
+      const TransformType * previous = simplified.back().GetPointer();
+
+      // Fold adjacent linear transforms into one matrix
+      const MatrixOffsetTransformType * previousMatrix = dynamic_cast<const MatrixOffsetTransformType *>(previous);
+      const MatrixOffsetTransformType * currentMatrix  = dynamic_cast<const MatrixOffsetTransformType *>(transform);
+      if ( previousMatrix && currentMatrix )
+      {
+        MatrixOffsetTransformPointerType folded = MatrixOffsetTransformType::New();
+        folded->SetIdentity();
+        folded->Compose( previousMatrix, 1 );
+        folded->Compose( currentMatrix, 1 );
+        simplified.pop_back();
+        if ( !IsIdentity(folded) )
+          simplified.push_back( folded.GetPointer() );
+        continue;
+      }
+
+      // Cancel a transform directly followed by its inverse
+      if ( AreInverse(previous, transform) )
+      {
+        simplified.pop_back();
+        continue;
+      }
+    }
+
+    simplified.push_back( transform );
+  }
+
+  Pointer ret = Self::New();
+  for ( it = simplified.begin(); it != simplified.end(); it++ )
+    ret->InsertTransform( *it );
+  return ret;
+}
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+GeneralTransform<TScalarType, NDimensions>::
+AppendFlattenedTransforms (TransformListType & list) const
+{
+  typename TransformListType::const_iterator it = this->m_TransformList.begin();
+  while( it != this->m_TransformList.end())
+  {
+    const Self * genTrs = dynamic_cast<const Self*>(it->GetPointer());
+    if ( genTrs )
+      genTrs->AppendFlattenedTransforms( list );
+    else
+      list.push_back( *it );
+    it++;
+  }
+}
+
+
+template<class TScalarType, unsigned int NDimensions>
+bool
+GeneralTransform<TScalarType, NDimensions>::
+IsIdentity (const TransformType * transform)
+{
+  if ( dynamic_cast<const IdentityTransform<TScalarType, NDimensions> *>(transform) )
+    return true;
+
+  const MatrixOffsetTransformType * linear = dynamic_cast<const MatrixOffsetTransformType *>(transform);
+  if ( !linear )
+    return false;
+
+  const double tolerance = 1e-10;
+  for ( unsigned int i = 0; i < NDimensions; ++i )
+  {
+    if ( std::abs( linear->GetOffset()[i] ) > tolerance )
+      return false;
+    for ( unsigned int j = 0; j < NDimensions; ++j )
+      if ( std::abs( linear->GetMatrix()[i][j] - ( i == j ? 1.0 : 0.0 ) ) > tolerance )
+        return false;
+  }
+  return true;
+}
+
+
+template<class TScalarType, unsigned int NDimensions>
+bool
+GeneralTransform<TScalarType, NDimensions>::
+AreInverse (const TransformType * first, const TransformType * second)
+{
+  typedef StationaryVelocityFieldTransform<TScalarType, NDimensions> SVFTransformType;
+  typedef typename SVFTransformType::VectorFieldType                 VectorFieldType;
+
+  // Linear transforms are handled by the folding. Inverse displacement fields are only
+  // numerical approximations, so only the stationary velocity fields v and -v are cancelled.
+  const SVFTransformType * svf1 = dynamic_cast<const SVFTransformType *>(first);
+  const SVFTransformType * svf2 = dynamic_cast<const SVFTransformType *>(second);
+  if ( !svf1 || !svf2 )
+    return false;
+
+  const VectorFieldType * field1 = svf1->GetParametersAsVectorField();
+  const VectorFieldType * field2 = svf2->GetParametersAsVectorField();
+  if ( !field1 || !field2 )
+    return false;
+
+  // Both fields must share the same grid
+  const double tolerance = 1e-6;
+  if ( field1->GetLargestPossibleRegion() != field2->GetLargestPossibleRegion() ||
+       field1->GetBufferedRegion()        != field2->GetBufferedRegion() )
+    return false;
+  for ( unsigned int i = 0; i < NDimensions; ++i )
+  {
+    if ( std::abs( field1->GetOrigin()[i]  - field2->GetOrigin()[i] )  > tolerance ||
+         std::abs( field1->GetSpacing()[i] - field2->GetSpacing()[i] ) > tolerance )
+      return false;
+    for ( unsigned int j = 0; j < NDimensions; ++j )
+      if ( std::abs( field1->GetDirection()[i][j] - field2->GetDirection()[i][j] ) > tolerance )
+        return false;
+  }
+
+  // The fields must be opposite; the comparison stops at the first mismatch
+  const typename VectorFieldType::PixelType * buffer1 = field1->GetBufferPointer();
+  const typename VectorFieldType::PixelType * buffer2 = field2->GetBufferPointer();
+  const SizeValueType numberOfPixels = field1->GetBufferedRegion().GetNumberOfPixels();
+  for ( SizeValueType n = 0; n < numberOfPixels; ++n )
+    for ( unsigned int i = 0; i < NDimensions; ++i )
+      if ( std::abs( buffer1[n][i] + buffer2[n][i] ) > tolerance * ( std::abs( buffer1[n][i] ) + std::abs( buffer2[n][i] ) ) )
+        return false;
+  return true;
+}
+
+
 template<class TScalarType, unsigned int NDimensions>
 bool
 GeneralTransform<TScalarType, NDimensions>::
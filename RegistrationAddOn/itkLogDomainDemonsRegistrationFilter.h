@@ -0,0 +1,215 @@
+#ifndef _itkLogDomainDemonsRegistrationFilter_h_
+#define _itkLogDomainDemonsRegistrationFilter_h_
+
+#include "itkImageToImageFilter.h"
+#include "itkCovariantVector.h"
+
+namespace itk
+{
+
+/**
+  * @description LogDomainDemonsRegistrationFilter (itk)
+  * The filter registers the moving image on the fixed image with the log-domain demons: the state of the
+  * registration is a stationary velocity field V, the transformation being Exp(V). Since the inverse of
+  * Exp(V) is Exp(-V), the inverse transformation is obtained by negating the output, without any fixed
+  * point inversion.
+  *
+  * Each iteration:
+  * - computes the displacement field of Exp(V) (see StationaryVelocityFieldExponential) and warps the
+  *   moving image M onto the grid of the fixed image F,
+  * - computes the demons update field U from the intensity differences and the gradient selected by
+  *   the gradient type, the length of the update vectors being bounded by the maximum step length,
+  * - optionally smoothes the update field (fluid-like regularization),
+  * - updates the velocity field with the Baker-Campbell-Hausdorff formula, Exp(V) <- Exp(V) o Exp(U),
+  *   i.e. V <- V + U + 1/2 [V,U] (see VelocityFieldBCHCompositionFilter),
+  * - optionally smoothes the velocity field (diffusion-like regularization).
+  *
+  * In symmetric mode, the backward registration of F on M is computed with the same velocity field:
+  * the backward update U' is computed from F o Exp(-V) and M, and the velocity field is updated by
+  * V <- 1/2 ( BCH(V,U) - BCH(-V,U') ), so that the result does not depend on the order of the images.
+  * The moving image is then resampled once on the grid of the fixed image.
+  *
+  * The standard deviations of the smoothings are given in voxels, as in PDEDeformableRegistrationFilter,
+  * a standard deviation lower than 0.1 disabling the smoothing. The output velocity field has the
+  * geometry of the fixed image. An initial velocity field with this geometry can be given.
+  *
+  * The filter is templated over the fixed image, the moving image and the velocity field
+  */
+
+template <class TFixedImage, class TMovingImage, class TField>
+class ITK_EXPORT LogDomainDemonsRegistrationFilter : public ImageToImageFilter<TFixedImage, TField>
+{
+
+public:
+
+    typedef  LogDomainDemonsRegistrationFilter                Self;
+    typedef  ImageToImageFilter<TFixedImage, TField>          Superclass;
+    typedef  SmartPointer<Self>                               Pointer;
+    typedef  SmartPointer<const Self>                         ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+    itkTypeMacro (LogDomainDemonsRegistrationFilter, ImageToImageFilter);
+
+    typedef TFixedImage                                     FixedImageType;
+    typedef typename FixedImageType::ConstPointer           FixedImageConstPointer;
+
+    typedef TMovingImage                                    MovingImageType;
+    typedef typename MovingImageType::ConstPointer          MovingImageConstPointer;
+
+    typedef TField                                          FieldType;
+    typedef typename FieldType::Pointer                     FieldPointer;
+    typedef typename FieldType::PixelType                   FieldPixelType;
+    typedef typename FieldPixelType::ValueType              FieldPixelRealValueType;
+    typedef typename FieldType::RegionType                  RegionType;
+
+    /** Image dimension. */
+    itkStaticConstMacro(ImageDimension, unsigned int, TFixedImage::ImageDimension);
+
+    typedef CovariantVector<float, itkGetStaticConstMacro(ImageDimension)>        GradientPixelType;
+    typedef Image<GradientPixelType, itkGetStaticConstMacro(ImageDimension)>      GradientImageType;
+    typedef typename GradientImageType::Pointer                                   GradientImagePointer;
+
+    /** Gradient used to compute the demons forces (same values as in ESMDemonsRegistrationFunction) **/
+    enum GradientType {
+        Symmetric = 0,          /** mean of the gradients of the fixed and warped moving images */
+        Fixed,                  /** gradient of the fixed image                                  */
+        WarpedMoving,           /** gradient of the warped moving image                          */
+        MappedMoving            /** gradient of the moving image, warped                         */
+    };
+
+    /** Set/Get the fixed image **/
+    void SetFixedImage(const FixedImageType * image)
+    {
+        this->SetNthInput(0, const_cast<FixedImageType *>(image));
+    }
+    const FixedImageType * GetFixedImage(void) const
+    {
+        return static_cast<const FixedImageType *>(this->GetInput(0));
+    }
+
+    /** Set/Get the moving image **/
+    void SetMovingImage(const MovingImageType * image)
+    {
+        this->SetNthInput(1, const_cast<MovingImageType *>(image));
+    }
+    const MovingImageType * GetMovingImage(void) const
+    {
+        return static_cast<const MovingImageType *>(this->GetInput(1));
+    }
+
+    /** Set/Get the initial velocity field (optional), with the geometry of the fixed image **/
+    void SetInitialVelocityField(const FieldType * field)
+    {
+        this->SetNthInput(2, const_cast<FieldType *>(field));
+    }
+    const FieldType * GetInitialVelocityField(void) const
+    {
+        return static_cast<const FieldType *>(this->ProcessObject::GetInput(2));
+    }
+
+    /** Set/Get the number of iterations (default 10) **/
+    itkSetMacro(NumberOfIterations, unsigned int);
+    itkGetConstMacro(NumberOfIterations, unsigned int);
+
+    /** Set/Get the maximum length of an update vector in voxels, 0 meaning no bound (default 2) **/
+    itkSetMacro(MaximumUpdateStepLength, double);
+    itkGetConstMacro(MaximumUpdateStepLength, double);
+
+    /** Set/Get the gradient used to compute the demons forces (default Symmetric) **/
+    itkSetMacro(UseGradientType, GradientType);
+    itkGetConstMacro(UseGradientType, GradientType);
+
+    /** Set/Get the standard deviation (voxels) of the smoothing of the update field (default 0) **/
+    itkSetMacro(UpdateFieldStandardDeviation, double);
+    itkGetConstMacro(UpdateFieldStandardDeviation, double);
+
+    /** Set/Get the standard deviation (voxels) of the smoothing of the velocity field (default 1.5) **/
+    itkSetMacro(VelocityFieldStandardDeviation, double);
+    itkGetConstMacro(VelocityFieldStandardDeviation, double);
+
+    /** Set/Get the intensity difference below which a voxel is considered matched (default 0.001) **/
+    itkSetMacro(IntensityDifferenceThreshold, double);
+    itkGetConstMacro(IntensityDifferenceThreshold, double);
+
+    /** Set/Get the symmetric mode (default off) **/
+    itkSetMacro(Symmetric, bool);
+    itkGetConstMacro(Symmetric, bool);
+    itkBooleanMacro(Symmetric);
+
+    /** Get the mean squared intensity difference computed by the last iteration **/
+    itkGetConstMacro(Metric, double);
+
+protected:
+    LogDomainDemonsRegistrationFilter();
+    virtual ~LogDomainDemonsRegistrationFilter(){}
+
+    void PrintSelf(std::ostream& os,Indent indent) const ITK_OVERRIDE;
+    void GenerateInputRequestedRegion() ITK_OVERRIDE;
+    void EnlargeOutputRequestedRegion(DataObject * output) ITK_OVERRIDE;
+    void GenerateData() ITK_OVERRIDE;
+
+    /** The moving image does not need to occupy the same physical space as the fixed image **/
+    void VerifyInputInformation() ITKv5_CONST ITK_OVERRIDE {}
+
+    /** Allocates a field with the geometry of the fixed image **/
+    FieldPointer AllocateField(void) const;
+
+    /** output = a * fieldA + b * fieldB, the output can be one of the inputs **/
+    void CombineFields(double a, const FieldType * fieldA, double b, const FieldType * fieldB, FieldType * output);
+
+    /** Displacement field of Exp(factor * velocity) **/
+    FieldPointer ComputeExponential(const FieldType * velocity, double factor) const;
+
+    /** Gaussian smoothing (standard deviation in voxels) of a field, the field itself if sigma < 0.1 **/
+    FieldPointer SmoothField(FieldType * field, double sigma) const;
+
+    /** Image resampled on the grid of the fixed image through the displacement field **/
+    template <class TImage>
+    typename TImage::Pointer WarpImage(const TImage * image, const FieldType * displacement) const;
+
+    /** Gradient image resampled on the grid of the fixed image through the displacement field **/
+    GradientImagePointer WarpGradient(const GradientImageType * gradient, const FieldType * displacement) const;
+
+    /** Gradient (physical units) of an image **/
+    template <class TImage>
+    GradientImagePointer ComputeGradient(const TImage * image) const;
+
+    /**
+     * Demons update field of the registration of the warped image on the reference image (both on the
+     * grid of the fixed image). The gradients not needed by the gradient type can be null.
+     * Returns the mean squared intensity difference.
+     */
+    template <class TReferenceImage, class TWarpedImage>
+    double ComputeUpdate(const TReferenceImage * reference, const TWarpedImage * warped,
+                         const GradientImageType * referenceGradient, const GradientImageType * warpedGradient,
+                         const GradientImageType * mappedGradient, FieldType * update);
+
+    /** BCH composition V + U + 1/2 [V,U] **/
+    FieldPointer ComposeVelocityFields(const FieldType * velocity, const FieldType * update) const;
+
+private:
+
+    LogDomainDemonsRegistrationFilter(const Self&);
+    void operator=(const Self&);
+
+    unsigned int m_NumberOfIterations;
+    double       m_MaximumUpdateStepLength;
+    GradientType m_UseGradientType;
+    double       m_UpdateFieldStandardDeviation;
+    double       m_VelocityFieldStandardDeviation;
+    double       m_IntensityDifferenceThreshold;
+    bool         m_Symmetric;
+    double       m_Metric;
+};
+
+
+} // end of namespace itk
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkLogDomainDemonsRegistrationFilter.txx"
+#endif
+
+
+#endif
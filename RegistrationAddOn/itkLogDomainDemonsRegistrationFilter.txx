@@ -0,0 +1,492 @@
+#ifndef _itkLogDomainDemonsRegistrationFilter_txx_
+#define _itkLogDomainDemonsRegistrationFilter_txx_
+
+#include "itkLogDomainDemonsRegistrationFilter.h"
+#include "itkStationaryVelocityFieldExponential.h"
+#include "itkVelocityFieldBCHCompositionFilter.h"
+#include "itkGaussianOperator.h"
+#include "itkGradientImageFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkMultiThreaderBase.h"
+#include "itkResampleImageFilter.h"
+#include "itkVectorNeighborhoodOperatorImageFilter.h"
+#include "itkWarpImageFilter.h"
+#include "itkWarpVectorImageFilter.h"
+
+#include <cmath>
+#include <mutex>
+
+
+namespace itk
+{
+/**
+ * Constructor
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::LogDomainDemonsRegistrationFilter()
+{
+    this->SetNumberOfRequiredInputs(2);
+    m_NumberOfIterations             = 10;
+    m_MaximumUpdateStepLength        = 2.0;
+    m_UseGradientType                = Symmetric;
+    m_UpdateFieldStandardDeviation   = 0.0;
+    m_VelocityFieldStandardDeviation = 1.5;
+    m_IntensityDifferenceThreshold   = 0.001;
+    m_Symmetric                      = false;
+    m_Metric                         = 0.0;
+}
+
+/**
+ * Print out a description of self
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+
+    os << indent << "NumberOfIterations: "             << m_NumberOfIterations             << std::endl;
+    os << indent << "MaximumUpdateStepLength: "        << m_MaximumUpdateStepLength        << std::endl;
+    os << indent << "UseGradientType: "                << m_UseGradientType                << std::endl;
+    os << indent << "UpdateFieldStandardDeviation: "   << m_UpdateFieldStandardDeviation   << std::endl;
+    os << indent << "VelocityFieldStandardDeviation: " << m_VelocityFieldStandardDeviation << std::endl;
+    os << indent << "IntensityDifferenceThreshold: "   << m_IntensityDifferenceThreshold   << std::endl;
+    os << indent << "Symmetric: "                      << m_Symmetric                      << std::endl;
+    os << indent << "Metric: "                         << m_Metric                         << std::endl;
+
+    return;
+}
+
+
+/**
+ * The whole inputs are needed: the images are warped and the initial field is composed
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GenerateInputRequestedRegion()
+{
+    Superclass::GenerateInputRequestedRegion();
+
+    for (unsigned int n=0; n<3; n++)
+    {
+        DataObject * inputPtr = const_cast<DataObject *>(this->ProcessObject::GetInput(n));
+        if (inputPtr)
+            inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+
+/**
+ * The whole output is produced
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+    Superclass::EnlargeOutputRequestedRegion(output);
+    output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * Allocates a field with the geometry of the fixed image
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::FieldPointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::AllocateField() const
+{
+    FieldPointer field = FieldType::New();
+    field->CopyInformation(this->GetFixedImage());
+    field->SetRegions(this->GetFixedImage()->GetLargestPossibleRegion());
+    field->Allocate();
+    return field;
+}
+
+
+/**
+ * output = a * fieldA + b * fieldB
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::CombineFields(double a, const FieldType * fieldA, double b, const FieldType * fieldB, FieldType * output)
+{
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [a, fieldA, b, fieldB, output](const RegionType & region)
+        {
+            ImageRegionConstIterator<FieldType> aIt(fieldA, region);
+            ImageRegionConstIterator<FieldType> bIt(fieldB, region);
+            ImageRegionIterator<FieldType>      outIt(output, region);
+            for (; !outIt.IsAtEnd(); ++aIt, ++bIt, ++outIt)
+            {
+                const FieldPixelType va = aIt.Get();
+                const FieldPixelType vb = bIt.Get();
+                FieldPixelType       value;
+                for (unsigned int k=0; k<FieldPixelType::Dimension; k++)
+                    value[k] = static_cast<FieldPixelRealValueType>(a * va[k] + b * vb[k]);
+                outIt.Set(value);
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
+/**
+ * Displacement field of Exp(factor * velocity)
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::FieldPointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ComputeExponential(const FieldType * velocity, double factor) const
+{
+    typedef StationaryVelocityFieldExponential<FieldType, FieldType>    ExponentialType;
+
+    typename ExponentialType::Pointer exponential = ExponentialType::New();
+    exponential->SetInput(velocity);
+    exponential->SetMultiplicativeFactor(factor);
+    exponential->Update();
+
+    FieldPointer displacement = exponential->GetOutput();
+    displacement->DisconnectPipeline();
+    return displacement;
+}
+
+
+/**
+ * Gaussian smoothing of a field, one direction after the other, as in PDEDeformableRegistrationFilter
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::FieldPointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::SmoothField(FieldType * field, double sigma) const
+{
+    typedef VectorNeighborhoodOperatorImageFilter<FieldType, FieldType>     SmootherType;
+    typedef GaussianOperator<FieldPixelRealValueType, ImageDimension>       OperatorType;
+
+    FieldPointer smoothed = field;
+    if (sigma < 0.1)
+        return smoothed;
+
+    for (unsigned int j=0; j<ImageDimension; j++)
+    {
+        OperatorType gaussian;
+        gaussian.SetDirection(j);
+        gaussian.SetVariance(sigma * sigma);
+        gaussian.SetMaximumError(0.1);
+        gaussian.SetMaximumKernelWidth(30);
+        gaussian.CreateDirectional();
+
+        typename SmootherType::Pointer smoother = SmootherType::New();
+        smoother->SetOperator(gaussian);
+        smoother->SetInput(smoothed);
+        smoother->Update();
+
+        smoothed = smoother->GetOutput();
+        smoothed->DisconnectPipeline();
+    }
+    return smoothed;
+}
+
+
+/**
+ * Image resampled on the grid of the fixed image through the displacement field
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+template <class TImage>
+typename TImage::Pointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::WarpImage(const TImage * image, const FieldType * displacement) const
+{
+    typedef WarpImageFilter<TImage, TImage, FieldType>    WarperType;
+
+    typename WarperType::Pointer warper = WarperType::New();
+    warper->SetInput(image);
+    warper->SetDisplacementField(displacement);
+    warper->SetOutputParametersFromImage(this->GetFixedImage());
+    warper->SetEdgePaddingValue(NumericTraits<typename TImage::PixelType>::ZeroValue());
+    warper->Update();
+
+    typename TImage::Pointer warped = warper->GetOutput();
+    warped->DisconnectPipeline();
+    return warped;
+}
+
+
+/**
+ * Gradient image resampled on the grid of the fixed image through the displacement field
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::GradientImagePointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::WarpGradient(const GradientImageType * gradient, const FieldType * displacement) const
+{
+    typedef WarpVectorImageFilter<GradientImageType, GradientImageType, FieldType>    WarperType;
+
+    typename WarperType::Pointer warper = WarperType::New();
+    warper->SetInput(gradient);
+    warper->SetDisplacementField(displacement);
+    warper->SetOutputOrigin(displacement->GetOrigin());
+    warper->SetOutputSpacing(displacement->GetSpacing());
+    warper->SetOutputDirection(displacement->GetDirection());
+    warper->Update();
+
+    GradientImagePointer warped = warper->GetOutput();
+    warped->DisconnectPipeline();
+    return warped;
+}
+
+
+/**
+ * Gradient of an image
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+template <class TImage>
+typename LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::GradientImagePointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ComputeGradient(const TImage * image) const
+{
+    typedef GradientImageFilter<TImage, float, float, GradientImageType>    GradientFilterType;
+
+    typename GradientFilterType::Pointer filter = GradientFilterType::New();
+    filter->SetInput(image);
+    filter->SetUseImageSpacing(true);
+    filter->SetUseImageDirection(true);
+    filter->Update();
+
+    GradientImagePointer gradient = filter->GetOutput();
+    gradient->DisconnectPipeline();
+    return gradient;
+}
+
+
+/**
+ * Demons update field. With G the gradient given by the gradient type (twice the gradient, or the sum of
+ * the gradients for the symmetric type) and D = reference - warped, the update is
+ *
+ *   U = 2 D G / ( |G|^2 + D^2 / (L^2 s^2) )
+ *
+ * where L is the maximum step length (voxels) and s^2 the mean squared spacing, so that |U| <= L s.
+ * Each thread reduces the squared differences over its region, the results are merged under a lock.
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+template <class TReferenceImage, class TWarpedImage>
+double
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ComputeUpdate(const TReferenceImage * reference, const TWarpedImage * warped,
+                const GradientImageType * referenceGradient, const GradientImageType * warpedGradient,
+                const GradientImageType * mappedGradient, FieldType * update)
+{
+    typedef ImageRegionConstIterator<GradientImageType>     GradientIteratorType;
+
+    // Normalization of the squared difference bounding the step length
+    double meanSquaredSpacing = 0.0;
+    for (unsigned int i=0; i<ImageDimension; i++)
+        meanSquaredSpacing += update->GetSpacing()[i] * update->GetSpacing()[i] / ImageDimension;
+    const double normalizer = m_MaximumUpdateStepLength > 0.0 ?
+                              1.0 / (m_MaximumUpdateStepLength * m_MaximumUpdateStepLength * meanSquaredSpacing) : 0.0;
+
+    const GradientType gradientType = m_UseGradientType;
+    const double       threshold    = m_IntensityDifferenceThreshold;
+    double             sum          = 0.0;
+    std::mutex         mutex;
+
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        update->GetBufferedRegion(),
+        [&](const RegionType & region)
+        {
+            ImageRegionConstIterator<TReferenceImage> refIt(reference, region);
+            ImageRegionConstIterator<TWarpedImage>    warpIt(warped, region);
+            ImageRegionIterator<FieldType>            outIt(update, region);
+            GradientIteratorType                      refGradIt, warpGradIt, mapGradIt;
+            if (referenceGradient)
+                refGradIt  = GradientIteratorType(referenceGradient, region);
+            if (warpedGradient)
+                warpGradIt = GradientIteratorType(warpedGradient, region);
+            if (mappedGradient)
+                mapGradIt  = GradientIteratorType(mappedGradient, region);
+
+            double localSum = 0.0;
+            for (; !outIt.IsAtEnd(); ++refIt, ++warpIt, ++outIt)
+            {
+                // Gradient (times 2) selected by the gradient type
+                GradientPixelType gradient;
+                switch (gradientType)
+                {
+                    case Fixed:        gradient = refGradIt.Get()  * 2.0f;             break;
+                    case WarpedMoving: gradient = warpGradIt.Get() * 2.0f;             break;
+                    case MappedMoving: gradient = mapGradIt.Get()  * 2.0f;             break;
+                    default:           gradient = refGradIt.Get()  + warpGradIt.Get(); break;
+                }
+                if (referenceGradient)
+                    ++refGradIt;
+                if (warpedGradient)
+                    ++warpGradIt;
+                if (mappedGradient)
+                    ++mapGradIt;
+
+                const double difference = static_cast<double>(refIt.Get()) - static_cast<double>(warpIt.Get());
+                localSum += difference * difference;
+
+                FieldPixelType value;
+                value.Fill(NumericTraits<FieldPixelRealValueType>::ZeroValue());
+                const double denominator = gradient.GetSquaredNorm() + difference * difference * normalizer;
+                if (std::abs(difference) >= threshold && denominator > 1e-9)
+                    for (unsigned int k=0; k<ImageDimension; k++)
+                        value[k] = static_cast<FieldPixelRealValueType>(2.0 * difference * gradient[k] / denominator);
+                outIt.Set(value);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            sum += localSum;
+        },
+        ITK_NULLPTR);
+
+    return sum / static_cast<double>(update->GetBufferedRegion().GetNumberOfPixels());
+}
+
+
+/**
+ * BCH composition V + U + 1/2 [V,U]
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::FieldPointer
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ComposeVelocityFields(const FieldType * velocity, const FieldType * update) const
+{
+    typedef VelocityFieldBCHCompositionFilter<FieldType, FieldType>    BCHFilterType;
+
+    typename BCHFilterType::Pointer bch = BCHFilterType::New();
+    bch->SetFirstVelocityField(velocity);
+    bch->SetSecondVelocityField(update);
+    bch->SetApproximationOrder(2);
+    bch->Update();
+
+    FieldPointer composed = bch->GetOutput();
+    composed->DisconnectPipeline();
+    return composed;
+}
+
+
+/**
+ * GenerateData
+ */
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GenerateData()
+{
+    itkDebugMacro(<<"Actually executing");
+
+    typedef ResampleImageFilter<MovingImageType, MovingImageType>    ResamplerType;
+
+    FixedImageConstPointer  fixedPtr  = this->GetFixedImage();
+    MovingImageConstPointer movingPtr = this->GetMovingImage();
+
+    // Initial velocity field
+    FieldPointer velocity = this->AllocateField();
+    const FieldType * initialField = this->GetInitialVelocityField();
+    if (initialField)
+    {
+        if (initialField->GetLargestPossibleRegion() != velocity->GetLargestPossibleRegion())
+            itkExceptionMacro(<< "The initial velocity field must have the geometry of the fixed image.");
+        this->CombineFields(1.0, initialField, 0.0, initialField, velocity);
+    }
+    else
+    {
+        FieldPixelType zero;
+        zero.Fill(NumericTraits<FieldPixelRealValueType>::ZeroValue());
+        velocity->FillBuffer(zero);
+    }
+
+    // Gradients that do not change during the iterations
+    const bool referenceGradientNeeded = m_UseGradientType == Symmetric || m_UseGradientType == Fixed;
+    const bool warpedGradientNeeded    = m_UseGradientType == Symmetric || m_UseGradientType == WarpedMoving;
+    const bool mappedGradientNeeded    = m_UseGradientType == MappedMoving;
+
+    GradientImagePointer fixedGradient;
+    GradientImagePointer movingGradient;
+    if (referenceGradientNeeded || (m_Symmetric && mappedGradientNeeded))
+        fixedGradient  = this->ComputeGradient(fixedPtr.GetPointer());
+    if (mappedGradientNeeded)
+        movingGradient = this->ComputeGradient(movingPtr.GetPointer());
+
+    // Symmetric mode: the moving image on the grid of the fixed image is the reference of the backward
+    // registration
+    typename MovingImageType::Pointer movingOnFixedGrid;
+    GradientImagePointer              movingOnFixedGridGradient;
+    if (m_Symmetric)
+    {
+        typename ResamplerType::Pointer resampler = ResamplerType::New();
+        resampler->SetInput(movingPtr);
+        resampler->SetOutputParametersFromImage(fixedPtr);
+        resampler->Update();
+        movingOnFixedGrid = resampler->GetOutput();
+        movingOnFixedGrid->DisconnectPipeline();
+        if (referenceGradientNeeded)
+            movingOnFixedGridGradient = this->ComputeGradient(movingOnFixedGrid.GetPointer());
+    }
+
+    m_Metric = 0.0;
+    for (unsigned int i = 0;i < m_NumberOfIterations;++i)
+    {
+        // Forward update: M o Exp(V) registered on F
+        FieldPointer displacement = this->ComputeExponential(velocity, 1.0);
+        typename MovingImageType::Pointer warpedMoving = this->WarpImage(movingPtr.GetPointer(), displacement);
+        GradientImagePointer warpedGradient = warpedGradientNeeded ? this->ComputeGradient(warpedMoving.GetPointer()) : GradientImagePointer();
+        GradientImagePointer mappedGradient = mappedGradientNeeded ? this->WarpGradient(movingGradient, displacement) : GradientImagePointer();
+        displacement = ITK_NULLPTR;
+
+        FieldPointer update = this->AllocateField();
+        m_Metric = this->ComputeUpdate(fixedPtr.GetPointer(), warpedMoving.GetPointer(), fixedGradient.GetPointer(),
+                                       warpedGradient.GetPointer(), mappedGradient.GetPointer(), update);
+        update = this->SmoothField(update, m_UpdateFieldStandardDeviation);
+
+        if (!m_Symmetric)
+        {
+            // Exp(V) <- Exp(V) o Exp(U)
+            velocity = this->ComposeVelocityFields(velocity, update);
+        }
+        else
+        {
+            // Backward update: F o Exp(-V) registered on M
+            displacement = this->ComputeExponential(velocity, -1.0);
+            typename FixedImageType::Pointer warpedFixed = this->WarpImage(fixedPtr.GetPointer(), displacement);
+            warpedGradient = warpedGradientNeeded ? this->ComputeGradient(warpedFixed.GetPointer()) : GradientImagePointer();
+            mappedGradient = mappedGradientNeeded ? this->WarpGradient(fixedGradient, displacement) : GradientImagePointer();
+            displacement = ITK_NULLPTR;
+
+            FieldPointer backwardUpdate = this->AllocateField();
+            const double backwardMetric = this->ComputeUpdate(movingOnFixedGrid.GetPointer(), warpedFixed.GetPointer(),
+                                                              movingOnFixedGridGradient.GetPointer(), warpedGradient.GetPointer(),
+                                                              mappedGradient.GetPointer(), backwardUpdate);
+            m_Metric = 0.5 * (m_Metric + backwardMetric);
+            backwardUpdate = this->SmoothField(backwardUpdate, m_UpdateFieldStandardDeviation);
+
+            // V <- 1/2 ( BCH(V,U) - BCH(-V,U') )
+            FieldPointer forwardVelocity  = this->ComposeVelocityFields(velocity, update);
+            this->CombineFields(-1.0, velocity, 0.0, velocity, velocity);
+            FieldPointer backwardVelocity = this->ComposeVelocityFields(velocity, backwardUpdate);
+            this->CombineFields(0.5, forwardVelocity, -0.5, backwardVelocity, velocity);
+        }
+
+        // Regularization of the velocity field
+        velocity = this->SmoothField(velocity, m_VelocityFieldStandardDeviation);
+
+        itkDebugMacro(<< "Iteration " << i << ": mean squared difference " << m_Metric);
+        this->InvokeEvent(IterationEvent());
+        this->UpdateProgress(static_cast<float>(i + 1) / static_cast<float>(m_NumberOfIterations));
+    }
+
+    this->GraftOutput(velocity);
+}
+
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef __itkMultiImageResampleImageFilter_h
+#define __itkMultiImageResampleImageFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkInterpolateImageFunction.h"
+#include "itkGeneralTransform.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class MultiImageResampleImageFilter
+ * \brief Resample several images through the same transform.
+ *
+ * The filter takes N input images (SetInput(i, image)) and produces N
+ * outputs sharing the same geometry. Output i is input i resampled through
+ * the transform, like ResampleImageFilter would do it, but the mapped
+ * position of each output voxel is computed once for all the inputs. The
+ * inputs can be different modalities (with different grids) or the frames
+ * of a series.
+ *
+ * The output is processed by slabs (one slice along the last dimension),
+ * which are distributed over the threads. For each slab, the mapped points
+ * are computed into a buffer of the size of the slab (with the batch
+ * GeneralTransform::TransformPoints method), and the inputs are then
+ * interpolated at these points one after the other. The memory overhead is
+ * thus one slab of points per thread.
+ *
+ * Each input can have its own interpolator (linear by default). Points
+ * mapped outside an input get the default pixel value.
+ *
+ * \ingroup GeometricTransforms
+ */
+template <class TImage, class TTransformPrecisionType=double>
+class ITK_EXPORT MultiImageResampleImageFilter:
+    public ImageToImageFilter<TImage, TImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef MultiImageResampleImageFilter           Self;
+  typedef ImageToImageFilter<TImage, TImage>      Superclass;
+  typedef SmartPointer<Self>                      Pointer;
+  typedef SmartPointer<const Self>                ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( MultiImageResampleImageFilter, ImageToImageFilter );
+
+  /** Number of dimensions. */
+  itkStaticConstMacro( ImageDimension, unsigned int, TImage::ImageDimension );
+
+  /** Typedefs for images. */
+  typedef TImage                                  ImageType;
+  typedef typename ImageType::Pointer             ImagePointer;
+  typedef typename ImageType::PixelType           PixelType;
+  typedef typename ImageType::RegionType          RegionType;
+  typedef typename ImageType::SizeType            SizeType;
+  typedef typename ImageType::IndexType           IndexType;
+  typedef typename ImageType::PointType           PointType;
+  typedef typename ImageType::SpacingType         SpacingType;
+  typedef typename ImageType::PointType           OriginType;
+  typedef typename ImageType::DirectionType       DirectionType;
+
+  /** Typedefs for transform. */
+  typedef Transform<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension ),
+    itkGetStaticConstMacro( ImageDimension )>     TransformType;
+  typedef typename TransformType::ConstPointer    TransformConstPointerType;
+  typedef GeneralTransform<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension )>     GeneralTransformType;
+  typedef typename GeneralTransformType::InputPointType  TransformPointType;
+
+  /** Typedefs for interpolators. */
+  typedef InterpolateImageFunction<ImageType, TTransformPrecisionType> InterpolatorType;
+  typedef typename InterpolatorType::Pointer      InterpolatorPointerType;
+
+  /** Set the coordinate transformation. It maps the points of the output
+   * grid to the points of the inputs. */
+  itkSetConstObjectMacro( Transform, TransformType );
+  itkGetConstObjectMacro( Transform, TransformType );
+
+  /** Set the input of index idx. An output is created for each input. */
+  virtual void SetInput( unsigned int idx, const ImageType * image ) ITK_OVERRIDE;
+  using Superclass::SetInput;
+
+  /** Set the interpolator of the input of index idx (linear by default). */
+  virtual void SetInterpolator( unsigned int idx, InterpolatorType * interpolator );
+
+  /** Set/Get the geometry of the outputs. */
+  itkSetMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Size, SizeType );
+  itkSetMacro( OutputStartIndex, IndexType );
+  itkGetConstReferenceMacro( OutputStartIndex, IndexType );
+  itkSetMacro( OutputSpacing, SpacingType );
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+  itkSetMacro( OutputOrigin, OriginType );
+  itkGetConstReferenceMacro( OutputOrigin, OriginType );
+  itkSetMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+
+  /** Set/Get the value of the voxels mapped outside of an input. */
+  itkSetMacro( DefaultPixelValue, PixelType );
+  itkGetConstReferenceMacro( DefaultPixelValue, PixelType );
+
+  /** Compute the Modified Time based on changes to the components. */
+  ModifiedTimeType GetMTime( void ) const ITK_OVERRIDE;
+
+protected:
+  MultiImageResampleImageFilter( void );
+  ~MultiImageResampleImageFilter( void ) {};
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  /** The outputs share the geometry set by the user. */
+  virtual void GenerateOutputInformation( void ) ITK_OVERRIDE;
+
+  /** The whole inputs are needed. */
+  virtual void GenerateInputRequestedRegion( void ) ITK_OVERRIDE;
+
+  /** The whole outputs are produced. */
+  virtual void EnlargeOutputRequestedRegion( DataObject * output ) ITK_OVERRIDE;
+
+  /** Resample the slabs in parallel. */
+  virtual void GenerateData( void ) ITK_OVERRIDE;
+
+  /** Resample one slab of all the outputs. */
+  void ResampleSlab( const RegionType & slab, const GeneralTransformType * mapper,
+                     const std::vector<InterpolatorPointerType> & interpolators );
+
+private:
+
+  MultiImageResampleImageFilter( const Self& ); //purposely not implemented
+  void operator=( const Self& ); //purposely not implemented
+
+  SizeType                              m_Size;              // size of the outputs
+  IndexType                             m_OutputStartIndex;  // start index of the outputs
+  SpacingType                           m_OutputSpacing;     // spacing of the outputs
+  OriginType                            m_OutputOrigin;      // origin of the outputs
+  DirectionType                         m_OutputDirection;   // direction of the outputs
+  PixelType                             m_DefaultPixelValue; // value outside of the inputs
+  TransformConstPointerType             m_Transform;         // transform
+  std::vector<InterpolatorPointerType>  m_Interpolators;     // interpolator of each input
+}; // end class MultiImageResampleImageFilter
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkMultiImageResampleImageFilter.txx"
+#endif
+
+#endif // end #ifndef __itkMultiImageResampleImageFilter_h
@@ -0,0 +1,316 @@
+#ifndef __itkMultiImageResampleImageFilter_txx
+#define __itkMultiImageResampleImageFilter_txx
+
+#include "itkMultiImageResampleImageFilter.h"
+
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkNumericTraits.h"
+
+#include <algorithm>
+
+namespace itk
+{
+
+// Constructor
+template <class TImage, class TTransformPrecisionType>
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::MultiImageResampleImageFilter()
+{
+  this->m_Size.Fill( 0 );
+  this->m_OutputStartIndex.Fill( 0 );
+  this->m_OutputSpacing.Fill( 1.0 );
+  this->m_OutputOrigin.Fill( 0.0 );
+  this->m_OutputDirection.SetIdentity();
+  this->m_DefaultPixelValue = NumericTraits<PixelType>::ZeroValue();
+  this->m_Transform = ITK_NULLPTR;
+}
+
+
+// Print out a description of self
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Size: " << this->m_Size << std::endl;
+  os << indent << "OutputStartIndex: " << this->m_OutputStartIndex << std::endl;
+  os << indent << "OutputSpacing: " << this->m_OutputSpacing << std::endl;
+  os << indent << "OutputOrigin: " << this->m_OutputOrigin << std::endl;
+  os << indent << "OutputDirection: " << this->m_OutputDirection << std::endl;
+  os << indent << "DefaultPixelValue: "
+     << static_cast<typename NumericTraits<PixelType>::PrintType>( this->m_DefaultPixelValue ) << std::endl;
+  os << indent << "Transform: " << this->m_Transform.GetPointer() << std::endl;
+  os << indent << "NumberOfInterpolators: " << this->m_Interpolators.size() << std::endl;
+}
+
+
+// Set an input, and create the corresponding output
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::SetInput( unsigned int idx, const ImageType * image )
+{
+  Superclass::SetInput( idx, image );
+
+  const unsigned int numberOfOutputs = this->GetNumberOfIndexedOutputs();
+  if( idx >= numberOfOutputs )
+    {
+    this->SetNumberOfRequiredOutputs( idx + 1 );
+    for( unsigned int i = numberOfOutputs; i <= idx; ++i )
+      {
+      this->SetNthOutput( i, this->MakeOutput( i ) );
+      }
+    }
+  if( idx >= this->m_Interpolators.size() )
+    {
+    this->m_Interpolators.resize( idx + 1 );
+    }
+}
+
+
+// Set the interpolator of an input
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::SetInterpolator( unsigned int idx, InterpolatorType * interpolator )
+{
+  if( idx >= this->m_Interpolators.size() )
+    {
+    this->m_Interpolators.resize( idx + 1 );
+    }
+  if( this->m_Interpolators[idx] != interpolator )
+    {
+    this->m_Interpolators[idx] = interpolator;
+    this->Modified();
+    }
+}
+
+
+// Compute the modified time
+template <class TImage, class TTransformPrecisionType>
+ModifiedTimeType
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::GetMTime( void ) const
+{
+  ModifiedTimeType latestTime = Object::GetMTime();
+
+  if( this->m_Transform && latestTime < this->m_Transform->GetMTime() )
+    {
+    latestTime = this->m_Transform->GetMTime();
+    }
+  for( unsigned int i = 0; i < this->m_Interpolators.size(); ++i )
+    {
+    if( this->m_Interpolators[i] && latestTime < this->m_Interpolators[i]->GetMTime() )
+      {
+      latestTime = this->m_Interpolators[i]->GetMTime();
+      }
+    }
+
+  return latestTime;
+}
+
+
+// Set the information of the outputs
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::GenerateOutputInformation( void )
+{
+  // Call the superclass' implementation of this method
+  Superclass::GenerateOutputInformation();
+
+  RegionType region;
+  region.SetSize( this->m_Size );
+  region.SetIndex( this->m_OutputStartIndex );
+
+  for( unsigned int i = 0; i < this->GetNumberOfIndexedOutputs(); ++i )
+    {
+    ImageType * output = this->GetOutput( i );
+    if( !output )
+      {
+      continue;
+      }
+    output->SetLargestPossibleRegion( region );
+    output->SetSpacing( this->m_OutputSpacing );
+    output->SetOrigin( this->m_OutputOrigin );
+    output->SetDirection( this->m_OutputDirection );
+    }
+}
+
+
+// Request the whole inputs
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::GenerateInputRequestedRegion( void )
+{
+  for( unsigned int i = 0; i < this->GetNumberOfIndexedInputs(); ++i )
+    {
+    ImageType * input = const_cast<ImageType *>( this->GetInput( i ) );
+    if( input )
+      {
+      input->SetRequestedRegionToLargestPossibleRegion();
+      }
+    }
+}
+
+
+// Produce the whole outputs
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::EnlargeOutputRequestedRegion( DataObject * output )
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+  for( unsigned int i = 0; i < this->GetNumberOfIndexedOutputs(); ++i )
+    {
+    if( this->GetOutput( i ) )
+      {
+      this->GetOutput( i )->SetRequestedRegionToLargestPossibleRegion();
+      }
+    }
+}
+
+
+// Resample the slabs in parallel
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::GenerateData( void )
+{
+  if( !this->m_Transform )
+    {
+    itkExceptionMacro(<< "Transform not set");
+    }
+
+  const unsigned int numberOfImages = this->GetNumberOfIndexedInputs();
+  if( numberOfImages == 0 )
+    {
+    itkExceptionMacro(<< "No input image");
+    }
+
+  // Allocate the outputs, and set up the interpolators (linear by default)
+  std::vector<InterpolatorPointerType> interpolators( numberOfImages );
+  for( unsigned int i = 0; i < numberOfImages; ++i )
+    {
+    if( !this->GetInput( i ) )
+      {
+      itkExceptionMacro(<< "Input " << i << " not set");
+      }
+
+    ImageType * output = this->GetOutput( i );
+    output->SetBufferedRegion( output->GetRequestedRegion() );
+    output->Allocate();
+
+    if( i < this->m_Interpolators.size() && this->m_Interpolators[i] )
+      {
+      interpolators[i] = this->m_Interpolators[i];
+      }
+    else
+      {
+      interpolators[i] = LinearInterpolateImageFunction<ImageType, TTransformPrecisionType>::New().GetPointer();
+      }
+    interpolators[i]->SetInputImage( this->GetInput( i ) );
+    }
+
+  // The transform is wrapped into a general transform, whose batch method dispatches
+  // on the type of the transform once per block of points
+  typename GeneralTransformType::Pointer mapper = GeneralTransformType::New();
+  mapper->InsertTransform( this->m_Transform );
+
+  // One slab per slice along the last dimension
+  const unsigned int LastDimension = ImageDimension - 1;
+  const RegionType   outputRegion  = this->GetOutput( 0 )->GetRequestedRegion();
+  const SizeValueType numberOfSlabs = outputRegion.GetSize( LastDimension );
+
+  this->GetMultiThreader()->ParallelizeArray(
+    0,
+    numberOfSlabs,
+    [this, &outputRegion, &mapper, &interpolators, LastDimension]( SizeValueType s )
+      {
+      RegionType slab = outputRegion;
+      slab.SetIndex( LastDimension, outputRegion.GetIndex( LastDimension ) + static_cast<IndexValueType>( s ) );
+      slab.SetSize( LastDimension, 1 );
+      this->ResampleSlab( slab, mapper.GetPointer(), interpolators );
+      },
+    this );
+}
+
+
+// Resample one slab of all the outputs
+template <class TImage, class TTransformPrecisionType>
+void
+MultiImageResampleImageFilter<TImage,TTransformPrecisionType>
+::ResampleSlab( const RegionType & slab, const GeneralTransformType * mapper,
+                const std::vector<InterpolatorPointerType> & interpolators )
+{
+  typedef typename InterpolatorType::OutputType              InterpolatorOutputType;
+  typedef typename InterpolatorType::ContinuousIndexType     ContinuousIndexType;
+  typedef ImageRegionConstIteratorWithIndex<ImageType>       IndexIteratorType;
+  typedef ImageRegionIterator<ImageType>                     OutputIteratorType;
+
+  const ImageType *   reference      = this->GetOutput( 0 );
+  const SizeValueType numberOfPoints = slab.GetNumberOfPixels();
+
+  // Output grid points of the slab
+  std::vector<TransformPointType> points( numberOfPoints );
+  PointType                       point;
+  SizeValueType                   n = 0;
+  for( IndexIteratorType it( reference, slab ); !it.IsAtEnd(); ++it, ++n )
+    {
+    reference->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      points[n][i] = point[i];
+      }
+    }
+
+  // Mapped points, computed in place. The blocks do not exceed the size the general
+  // transform processes sequentially, since the slabs are already processed in parallel.
+  const SizeValueType blockSize = GeneralTransformType::PointsPerBlock;
+  for( SizeValueType first = 0; first < numberOfPoints; first += blockSize )
+    {
+    const SizeValueType size = std::min( blockSize, numberOfPoints - first );
+    mapper->TransformPoints( &points[first], &points[first], size );
+    }
+
+  // Interpolate each input at the mapped points
+  const double minimum = static_cast<double>( NumericTraits<PixelType>::NonpositiveMin() );
+  const double maximum = static_cast<double>( NumericTraits<PixelType>::max() );
+  for( unsigned int k = 0; k < interpolators.size(); ++k )
+    {
+    const ImageType *         input        = this->GetInput( k );
+    const InterpolatorType *  interpolator = interpolators[k].GetPointer();
+    ContinuousIndexType       index;
+    PointType                 mapped;
+
+    OutputIteratorType outIt( this->GetOutput( k ), slab );
+    for( n = 0; !outIt.IsAtEnd(); ++outIt, ++n )
+      {
+      for( unsigned int i = 0; i < ImageDimension; ++i )
+        {
+        mapped[i] = points[n][i];
+        }
+      input->TransformPhysicalPointToContinuousIndex( mapped, index );
+      if( interpolator->IsInsideBuffer( index ) )
+        {
+        // Clamp the value to the range of the pixel type, as ResampleImageFilter does
+        const InterpolatorOutputType value = interpolator->EvaluateAtContinuousIndex( index );
+        const double clamped = std::max( minimum, std::min( maximum, static_cast<double>( value ) ) );
+        outIt.Set( static_cast<PixelType>( clamped ) );
+        }
+      else
+        {
+        outIt.Set( this->m_DefaultPixelValue );
+        }
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif // end #ifndef __itkMultiImageResampleImageFilter_txx
@@ -0,0 +1,79 @@
+#ifndef _itkPrecomputedMultiResolutionPyramidImageFilter_h_
+#define _itkPrecomputedMultiResolutionPyramidImageFilter_h_
+
+#include "itkMultiResolutionPyramidImageFilter.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/**
+  * @description PrecomputedMultiResolutionPyramidImageFilter (itk)
+  * Pyramid filter whose levels are images computed beforehand, e.g. by a
+  * RecursiveMultiResolutionPyramidImageFilter with the same schedule. It can replace the pyramid of a
+  * MultiResolutionPDEDeformableRegistration, so that the pyramid of a fixed image is computed once and
+  * shared by the registrations of several moving images to this fixed image.
+  *
+  * The outputs are shallow copies (grafts) of the level images: the level images are only read, and can
+  * be shared by pipelines running concurrently. The level images must have the regions given by the
+  * schedule and the input image.
+  *
+  * The filter is templated over the input image and the output image (images of the levels)
+  */
+
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT PrecomputedMultiResolutionPyramidImageFilter : public MultiResolutionPyramidImageFilter<TInputImage, TOutputImage>
+{
+
+public:
+
+    typedef  PrecomputedMultiResolutionPyramidImageFilter                  Self;
+    typedef  MultiResolutionPyramidImageFilter<TInputImage, TOutputImage>  Superclass;
+    typedef  SmartPointer<Self>                                            Pointer;
+    typedef  SmartPointer<const Self>                                      ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+    itkTypeMacro (PrecomputedMultiResolutionPyramidImageFilter, MultiResolutionPyramidImageFilter);
+
+    typedef TOutputImage                                    OutputImageType;
+    typedef typename OutputImageType::ConstPointer          OutputImageConstPointer;
+    typedef std::vector<OutputImageConstPointer>            LevelImagesType;
+
+    /** Set/Get the images of the levels, from the coarsest to the finest level **/
+    void SetLevelImages(const LevelImagesType & images)
+    {
+        m_LevelImages = images;
+        this->Modified();
+    }
+    const LevelImagesType & GetLevelImages(void) const
+    {
+        return m_LevelImages;
+    }
+
+protected:
+    PrecomputedMultiResolutionPyramidImageFilter(){}
+    virtual ~PrecomputedMultiResolutionPyramidImageFilter(){}
+
+    void PrintSelf(std::ostream& os,Indent indent) const ITK_OVERRIDE;
+    void GenerateData() ITK_OVERRIDE;
+
+private:
+
+    PrecomputedMultiResolutionPyramidImageFilter(const Self&);
+    void operator=(const Self&);
+
+    LevelImagesType m_LevelImages;
+};
+
+
+} // end of namespace itk
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkPrecomputedMultiResolutionPyramidImageFilter.txx"
+#endif
+
+
+#endif
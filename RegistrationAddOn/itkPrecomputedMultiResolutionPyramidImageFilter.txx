@@ -0,0 +1,55 @@
+#ifndef _itkPrecomputedMultiResolutionPyramidImageFilter_txx_
+#define _itkPrecomputedMultiResolutionPyramidImageFilter_txx_
+
+#include "itkPrecomputedMultiResolutionPyramidImageFilter.h"
+
+
+namespace itk
+{
+
+/**
+ * Print out a description of self
+ */
+template <class TInputImage, class TOutputImage>
+void
+PrecomputedMultiResolutionPyramidImageFilter<TInputImage,TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+
+    os << indent << "NumberOfLevelImages: " << m_LevelImages.size() << std::endl;
+
+    return;
+}
+
+
+/**
+ * GenerateData: each output is a shallow copy of the image of its level
+ */
+template <class TInputImage, class TOutputImage>
+void
+PrecomputedMultiResolutionPyramidImageFilter<TInputImage,TOutputImage>
+::GenerateData()
+{
+    itkDebugMacro(<<"Actually executing");
+
+    const unsigned int numberOfLevels = this->GetNumberOfLevels();
+    if (m_LevelImages.size() != numberOfLevels)
+        itkExceptionMacro(<< "The pyramid has " << numberOfLevels << " levels, but " << m_LevelImages.size() << " level images are given.");
+
+    for (unsigned int level = 0;level < numberOfLevels;++level)
+    {
+        OutputImageType *       output = this->GetOutput(level);
+        const OutputImageType * image  = m_LevelImages[level];
+        if (image == ITK_NULLPTR)
+            itkExceptionMacro(<< "The image of the level " << level << " is not set.");
+        if (image->GetLargestPossibleRegion() != output->GetLargestPossibleRegion())
+            itkExceptionMacro(<< "The image of the level " << level << " does not have the region given by the schedule.");
+        output->Graft(image);
+    }
+}
+
+
+} // end namespace itk
+
+#endif
@@ -2,13 +2,7 @@
 #define _itkStationaryVelocityFieldExponential_h_
 
 #include "itkImageToImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkCastImageFilter.h"
-#include <itkComposeDisplacementFieldsImageFilter.h>
-#include "itkWarpImageFilter.h"
-#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
-#include "itkAddImageFilter.h"
-#include <itkMultiplyImageFilter.h>
+#include "rpiVectorFieldLookup.h"
 
 namespace itk
 {
@@ -35,6 +29,17 @@ namespace itk
   * The iterative rule can be applied to both the "Scaling and squaring" and "Small steps update" schemes within the exponential computation cycle.
   * A first approximation for log(Exp(V))[0] is Div(V/2^N).
   *
+  * Implementation:
+  * - the maximum norm of the velocity is computed by a parallel reduction,
+  * - the scaled velocity V/2^N is written in a preallocated field, and each step composes a field
+  *   into a second preallocated field before the two are swapped (a third field keeps V/2^N for
+  *   the forward Euler scheme), so that no image is allocated during the iterations,
+  * - each step is multithreaded: the composition B(x) = W(x) + A(x + W(x)) and the update of the
+  *   log-Jacobian are done in the same pass, with a linear interpolation and a nearest neighbor
+  *   extrapolation (see rpi::VectorFieldLookup).
+  * The peak memory is thus two fields (scaling and squaring) or three fields (forward Euler), plus
+  * the log-Jacobian maps if they are computed.
+  *
   * The filter is templated over the input and output vector fields
   */
 
@@ -115,26 +120,29 @@ protected:
     virtual ~StationaryVelocityFieldExponential(){}
 
     void PrintSelf(std::ostream& os,Indent indent) const ITK_OVERRIDE;
+    void GenerateInputRequestedRegion() ITK_OVERRIDE;
+    void EnlargeOutputRequestedRegion(DataObject * output) ITK_OVERRIDE;
     void GenerateData() ITK_OVERRIDE;
 
+    typedef typename InputImageType::RegionType						RegionType;
+    typedef rpi::VectorFieldLookup<InputImageType>						FieldLookupType;
 
-    typedef DivideImageFilter<InputImageType, Image<InputPixelRealValueType, TInputImage::ImageDimension>, InputImageType>		DivideByConstantType;
-    typedef MultiplyImageFilter<InputImageType, Image<InputPixelRealValueType, TInputImage::ImageDimension>, InputImageType>	MultiplyByConstantType;
-
-    typedef ComposeDisplacementFieldsImageFilter< InputImageType, InputImageType>	VectorWarperType;
-    typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<InputImageType, double>	FieldInterpolatorType;
+    /** Allocates a field / scalar map with the geometry of the input **/
+    InputImagePointer  AllocateField(void) const;
+    ScalarImagePointer AllocateScalarImage(void) const;
 
-    typedef WarpImageFilter< ScalarImageType, ScalarImageType, InputImageType>				ScalarWarperType;
-    typedef AddImageFilter <ScalarImageType, ScalarImageType, ScalarImageType>				ScalarAdderType;
+    /** Computes the maximum squared norm of a field (parallel reduction) **/
+    double ComputeMaximumSquaredNorm(const InputImageType * field);
 
-    typedef typename MultiplyByConstantType::Pointer							MultiplyByConstantPointer;
-    
-    typedef typename DivideByConstantType::Pointer							DivideByConstantPointer;
-    typedef typename VectorWarperType::Pointer								VectorWarperPointer;
-    typedef typename ScalarWarperType::Pointer								ScalarWarperPointer;
-    typedef typename FieldInterpolatorType::OutputType							FieldInterpolatorOutputType;
+    /** Writes factor * input into a field **/
+    void ScaleField(const InputImageType * input, double factor, InputImageType * output);
 
-    typedef typename ScalarAdderType::Pointer								ScalarAdderPointer;
+    /**
+     * One step of the iterative scheme: output(x) = warp(x) + field(x + warp(x)) and, if the maps are given,
+     * outputLogJac(x) = logJac(x + warp(x)) + logJacOffset(x).
+     */
+    void ComposeFields(const InputImageType * warp, const InputImageType * field, InputImageType * output,
+                       const ScalarImageType * logJac, const ScalarImageType * logJacOffset, ScalarImageType * outputLogJac);
 
 private:
 
@@ -3,10 +3,17 @@
 
 #include "itkStationaryVelocityFieldExponential.h"
 #include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageScanlineIterator.h"
 #include "itkDerivativeImageFilter.h"
+#include "itkAddImageFilter.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
-#include "itkVectorIndexSelectionCastImageFilter.h"
-#include <itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h>
+#include "itkMultiThreaderBase.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
 
 /**
  * Given vector field V, the function Divergence(V) compute the divergence scalar map d/dx Vx + d/dy Vy + d/dz Vz.
@@ -105,6 +112,197 @@ StationaryVelocityFieldExponential<TInputImage, TOutputImage>
 }
 
 
+/**
+ * The whole input is needed to compose the fields
+ */
+template <class TInputImage, class TOutputImage>
+void
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::GenerateInputRequestedRegion()
+{
+    Superclass::GenerateInputRequestedRegion();
+
+    InputImagePointer inputPtr = const_cast<InputImageType *>(this->GetInput());
+    if (inputPtr)
+        inputPtr->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * The whole output is produced
+ */
+template <class TInputImage, class TOutputImage>
+void
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+    Superclass::EnlargeOutputRequestedRegion(output);
+    output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * Allocates a field with the geometry of the input
+ */
+template <class TInputImage, class TOutputImage>
+typename StationaryVelocityFieldExponential<TInputImage,TOutputImage>::InputImagePointer
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::AllocateField() const
+{
+    InputImagePointer field = InputImageType::New();
+    field->CopyInformation(this->GetInput());
+    field->SetRegions(this->GetInput()->GetLargestPossibleRegion());
+    field->Allocate();
+    return field;
+}
+
+
+/**
+ * Allocates a scalar map with the geometry of the input
+ */
+template <class TInputImage, class TOutputImage>
+typename StationaryVelocityFieldExponential<TInputImage,TOutputImage>::ScalarImagePointer
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::AllocateScalarImage() const
+{
+    ScalarImagePointer image = ScalarImageType::New();
+    image->CopyInformation(this->GetInput());
+    image->SetRegions(this->GetInput()->GetLargestPossibleRegion());
+    image->Allocate();
+    return image;
+}
+
+
+/**
+ * Maximum squared norm of a field: each thread reduces its region, the results are merged under a lock
+ */
+template <class TInputImage, class TOutputImage>
+double
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::ComputeMaximumSquaredNorm(const InputImageType * field)
+{
+    double     maxnorm2 = 0.0;
+    std::mutex mutex;
+
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        field->GetBufferedRegion(),
+        [field, &maxnorm2, &mutex](const RegionType & region)
+        {
+            double localMax = 0.0;
+            for (ImageRegionConstIterator<InputImageType> it(field, region); !it.IsAtEnd(); ++it)
+                localMax = std::max(localMax, static_cast<double>(it.Get().GetSquaredNorm()));
+
+            std::lock_guard<std::mutex> lock(mutex);
+            maxnorm2 = std::max(maxnorm2, localMax);
+        },
+        ITK_NULLPTR);
+
+    return maxnorm2;
+}
+
+
+/**
+ * output = factor * input
+ */
+template <class TInputImage, class TOutputImage>
+void
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::ScaleField(const InputImageType * input, double factor, InputImageType * output)
+{
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [input, factor, output](const RegionType & region)
+        {
+            ImageRegionConstIterator<InputImageType> inIt(input, region);
+            ImageRegionIterator<InputImageType>      outIt(output, region);
+            for (; !outIt.IsAtEnd(); ++inIt, ++outIt)
+            {
+                InputPixelType value = inIt.Get();
+                for (unsigned int k=0; k<PixelDimension; k++)
+                    value[k] = static_cast<InputPixelRealValueType>(factor * value[k]);
+                outIt.Set(value);
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
+/**
+ * One step of the iterative scheme. All the fields and maps share the buffered region of the input, so
+ * the neighbors found in the field can be used directly in the log-Jacobian map.
+ */
+template <class TInputImage, class TOutputImage>
+void
+StationaryVelocityFieldExponential<TInputImage,TOutputImage>
+::ComposeFields(const InputImageType * warp, const InputImageType * field, InputImageType * output,
+                const ScalarImageType * logJac, const ScalarImageType * logJacOffset, ScalarImageType * outputLogJac)
+{
+    FieldLookupType lookup;
+    lookup.SetField(field);
+
+    const RegionType bufferedRegion = field->GetBufferedRegion();
+
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [&](const RegionType & region)
+        {
+            const SizeValueType lineLength = region.GetSize(0);
+            std::vector<double>         indices(lineLength * ImageDimension);
+            std::vector<InputPixelType> values(lineLength);
+            double                      displacement[ImageDimension];
+            double                      shift[ImageDimension];
+            OffsetValueType             offsets[FieldLookupType::NumberOfNeighbors];
+            double                      weights[FieldLookupType::NumberOfNeighbors];
+
+            ImageScanlineConstIterator<InputImageType> warpIt(warp, region);
+            ImageScanlineIterator<InputImageType>      outIt(output, region);
+            while (!warpIt.IsAtEnd())
+            {
+                // Continuous index of x + warp(x): index of x plus the displacement converted into index units
+                const typename InputImageType::IndexType lineIndex = warpIt.GetIndex();
+                for (SizeValueType x=0; !warpIt.IsAtEndOfLine(); ++warpIt, ++x)
+                {
+                    const InputPixelType w = warpIt.Get();
+                    for (unsigned int i=0; i<ImageDimension; i++)
+                        displacement[i] = w[i];
+                    lookup.TransformPhysicalVectorToContinuousIndex(displacement, shift);
+
+                    double * index = &indices[x * ImageDimension];
+                    for (unsigned int i=0; i<ImageDimension; i++)
+                        index[i] = static_cast<double>(lineIndex[i] - bufferedRegion.GetIndex(i)) + shift[i];
+                    index[0] += x;
+                }
+
+                // Composition of the vector fields
+                lookup.EvaluateAtContinuousIndices(indices.data(), values.data(), lineLength);
+                warpIt.GoToBeginOfLine();
+                for (SizeValueType x=0; !outIt.IsAtEndOfLine(); ++outIt, ++warpIt, ++x)
+                    outIt.Set(warpIt.Get() + values[x]);
+
+                // Log-Jacobian at the same points
+                if (outputLogJac)
+                {
+                    const InputPixelRealValueType * logJacBuffer = logJac->GetBufferPointer();
+                    const OffsetValueType           lineOffset   = outputLogJac->ComputeOffset(lineIndex);
+                    for (SizeValueType x=0; x<lineLength; x++)
+                    {
+                        lookup.ComputeNeighbors(&indices[x * ImageDimension], offsets, weights);
+                        double value = 0.0;
+                        for (unsigned int n=0; n<FieldLookupType::NumberOfNeighbors; n++)
+                            value += weights[n] * logJacBuffer[offsets[n]];
+                        outputLogJac->GetBufferPointer()[lineOffset + x] = static_cast<InputPixelRealValueType>(
+                            value + logJacOffset->GetBufferPointer()[lineOffset + x]);
+                    }
+                }
+
+                warpIt.NextLine();
+                outIt.NextLine();
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
 /**
  * GenerateData
  */
@@ -115,30 +313,16 @@ StationaryVelocityFieldExponential<TInputImage,TOutputImage>
 {
     itkDebugMacro(<<"Actually executing");
 
-    InputImageConstPointer inputPtr;
-
-    /*Scaling the input velocity field*/
-    if (m_MultiplicativeFactor != 1.0)
-    {
-        MultiplyByConstantPointer multiplier = MultiplyByConstantType::New();
-        multiplier->SetInput(this->GetInput());
-        multiplier->SetConstant(m_MultiplicativeFactor);
-        inputPtr = multiplier->GetOutput();
-    }
-    else
-        inputPtr=this->GetInput();
-
-    unsigned int numiter = 0;
+    InputImageConstPointer inputPtr = this->GetInput();
 
     //* TODO: Add different scaling methods based on the iterative scheme **/
-    
+
     // Compute a good number of iterations based on the rationale
     // that the initial first order approximation,
     // exp(Phi/2^N) = Phi/2^N,
     // needs to be diffeomorphic. For this we simply impose to have
     // max(norm(Phi)/2^N) < 0.5*pixelspacing
-
-    InputPixelRealValueType maxnorm2 = 0.0;
+    // The multiplicative factor is applied along with the division by 2^N.
 
     double minpixelspacing = inputPtr->GetSpacing()[0];
     for (unsigned int i = 1;i < itkGetStaticConstMacro(ImageDimension);++i)
@@ -147,101 +331,78 @@ StationaryVelocityFieldExponential<TInputImage,TOutputImage>
             minpixelspacing = inputPtr->GetSpacing()[i];
     }
 
-    typedef ImageRegionConstIterator<InputImageType> InputConstIterator;
-    InputConstIterator InputIt = InputConstIterator(inputPtr, inputPtr->GetRequestedRegion());
-
-    for( InputIt.GoToBegin(); !InputIt.IsAtEnd(); ++InputIt )
-    {
-        InputPixelRealValueType norm2 = InputIt.Get().GetSquaredNorm();
-        if (norm2>maxnorm2)
-            maxnorm2 = norm2;
-    }
+    double maxnorm2 = this->ComputeMaximumSquaredNorm(inputPtr);
+    maxnorm2 *= static_cast<double>(m_MultiplicativeFactor) * static_cast<double>(m_MultiplicativeFactor);
 
     // Divide the norm by the minimum pixel spacing
     maxnorm2 /= (minpixelspacing * minpixelspacing);
 
-    InputPixelRealValueType numiterfloat = 2.0 +  0.5 * std::log(maxnorm2)/std::log(2.0);
+    double numiterfloat = 2.0 +  0.5 * std::log(maxnorm2)/std::log(2.0);
 
     // take the ceil and threshold
-    numiter = 0;
+    unsigned int numiter = 0;
     if (numiterfloat + 1 > 0)
         numiter = static_cast<unsigned int>(numiterfloat + 1.0);
 
     // Get the first order approximation (division by 2^numiter)
-    DivideByConstantPointer divider = DivideByConstantType::New();
-    divider->SetInput(inputPtr);
-    divider->SetConstant(static_cast<InputPixelRealValueType>(1<<numiter));
-
-    divider->Update();
-
-    /** Initialize the update for the exponential computation **/
-    InputImagePointer ActualVectorField = divider->GetOutput();
-    InputImagePointer outputField = divider->GetOutput();
+    InputImagePointer velocity = this->AllocateField();
+    this->ScaleField(inputPtr, static_cast<double>(m_MultiplicativeFactor) / static_cast<double>(1<<numiter), velocity);
 
+    /** The initial approximation for the log-Jacobian is the divergence **/
+    ScalarImagePointer initialLogJac;
     if (m_LogJacobianDeterminantComputation)
-        m_LogJacobianDetImage = Divergence<InputImageType,ScalarImageType>(divider->GetOutput());
+        initialLogJac = Divergence<InputImageType,ScalarImageType>(velocity);
 
     /**  Define the number of iteration based on the iterative scheme: scaling and squaring: N, small steps: 2^N **/
     if (m_IterativeScheme==FORWARD_EULER)
-        numiter=static_cast<InputPixelRealValueType>(1<<numiter)-1;
-
-    for (unsigned int i = 0;i < numiter;++i)
+        numiter = (1u<<numiter) - 1;
+
+    /**
+     * Compute the exponential by iterative composition between two buffers:
+     * - scaling and squaring: Exp[i+1](x) = Exp[i](x) + Exp[i](x + Exp[i](x))
+     * - forward Euler:        Exp[i+1](x) = Exp[0](x) + Exp[i](x + Exp[0](x))
+     * The log-Jacobian follows the same rule, log|Exp[i+1]| = log|Exp[i]| o W + log|Exp[i]| (or log|Exp[0]|).
+     * For the scaling and squaring scheme, the scaled velocity is the first buffer.
+     **/
+    InputImagePointer  current = velocity;
+    InputImagePointer  next;
+    ScalarImagePointer currentLogJac = initialLogJac;
+    ScalarImagePointer nextLogJac;
+    if (m_IterativeScheme==SCALING_AND_SQUARING)
+    {
+        // The scaled velocity is only used by the first step, its buffer is then reused
+        velocity = ITK_NULLPTR;
+        initialLogJac = ITK_NULLPTR;
+    }
+    if (numiter > 0)
     {
-        /** Compute the Log-Jacobian determinant inside whitin the exponential computation **/
+        next = this->AllocateField();
         if (m_LogJacobianDeterminantComputation)
-        {
-            ScalarWarperPointer scalarWarper = ScalarWarperType::New();
-            scalarWarper->SetOutputOrigin(this->GetOutput()->GetOrigin());
-            scalarWarper->SetOutputSpacing(this->GetOutput()->GetSpacing());
-            scalarWarper->SetOutputDirection(this->GetOutput()->GetDirection());
-
-            ScalarAdderPointer scalarAdder = ScalarAdderType::New();
-
-            if (i==0)  /**  The initial approximation for the Jacobian is the divergence **/
-                scalarWarper->SetInput(m_LogJacobianDetImage);
-            else
-                scalarWarper->SetInput(scalarAdder->GetOutput());
-
-            scalarWarper->SetDisplacementField(ActualVectorField);
-            scalarWarper->UpdateLargestPossibleRegion();
-
-            scalarAdder->SetInput1(scalarWarper->GetOutput());
-
-            if (i==0||m_IterativeScheme==FORWARD_EULER)
-                scalarAdder->SetInput2(m_LogJacobianDetImage);
-            else
-                scalarAdder->SetInput2(scalarAdder->GetOutput());
-
-            scalarAdder->Update();
-
-            m_LogJacobianDetImage=scalarAdder->GetOutput();
-        }
-
-        /** Compute the exponential by iterative composition **/
+            nextLogJac = this->AllocateScalarImage();
+    }
 
-        VectorWarperPointer vectorWarper = VectorWarperType::New();
-        typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction <InputImageType,
-                typename InputImageType::IOPixelType::ValueType> InterpolatorType;
-        typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+    for (unsigned int i = 0;i < numiter;++i)
+    {
+        const InputImageType *  warp         = (m_IterativeScheme==FORWARD_EULER) ? velocity.GetPointer()      : current.GetPointer();
+        const ScalarImageType * logJacOffset = (m_IterativeScheme==FORWARD_EULER) ? initialLogJac.GetPointer() : currentLogJac.GetPointer();
 
-        vectorWarper->SetDisplacementField(outputField);
-        vectorWarper->SetWarpingField(ActualVectorField);
-        vectorWarper->SetInterpolator(interpolator);
-        vectorWarper->Update();
+        this->ComposeFields(warp, current, next, currentLogJac, logJacOffset, nextLogJac);
 
-        outputField = vectorWarper->GetOutput();
+        std::swap(current, next);
+        std::swap(currentLogJac, nextLogJac);
 
-        if (m_IterativeScheme==SCALING_AND_SQUARING)
-            ActualVectorField = outputField;
+        // The forward Euler scheme keeps the scaled velocity: a third buffer is needed
+        if (next == velocity && i+1 < numiter)
+            next = this->AllocateField();
+        if (m_LogJacobianDeterminantComputation && nextLogJac == initialLogJac && i+1 < numiter)
+            nextLogJac = this->AllocateScalarImage();
     }
 
-    this->GraftOutput(outputField);
+    m_LogJacobianDetImage = currentLogJac;
+    this->GraftOutput(current);
 }
 
 
 } // end namespace itk
 
 #endif
-
-
-
@@ -6,6 +6,9 @@
 #include <itkImage.h>
 #include <itkStationaryVelocityFieldExponential.h>
 
+#include <atomic>
+#include <mutex>
+
 
 namespace itk
 {
@@ -141,6 +144,11 @@ public:
     itkStaticConstMacro(SpaceDimension, unsigned int, NDimensions);
     itkStaticConstMacro(ParametersDimension, unsigned int, NDimensions);
 
+    /**
+     * Number of points processed by each thread task in TransformPoints
+     */
+    itkStaticConstMacro(PointsPerBlock, unsigned int, 4096);
+
     /**
      * Generic constructors.
      */
@@ -221,15 +229,24 @@ public:
     virtual InverseTransformBasePointer GetInverseTransform(void) const ITK_OVERRIDE;
 
     /**
-     * Transforms a point. This method should be used to transform one or a few number of points.
-     * This method should not be used to resample an entire image using for instance a
-     * itk::ResampleImageFilter. Instead, first estimate the corresponding displacement field using
-     * GetDisplacementFieldAsVectorField, and second resample the image using this displacement field.
+     * Transforms a point. The exponential of the velocity field is computed once (scaling and
+     * squaring scheme) and cached, so that transforming a point only requires one interpolation
+     * in the cached displacement field. The cache is recomputed if the velocity field or the
+     * transform is modified. This method is thread-safe.
      * @param  point  point
      * @return transformed point
      */
     virtual OutputPointType             TransformPoint(const InputPointType  & point) const ITK_OVERRIDE;
 
+    /**
+     * Transforms a set of points. Large sets are split across threads. The input and output
+     * arrays can be the same.
+     * @param  input           input points
+     * @param  output          transformed points
+     * @param  numberOfPoints  number of points
+     */
+    virtual void                        TransformPoints(const InputPointType * input, OutputPointType * output, SizeValueType numberOfPoints) const;
+
     /**
      * Transforms a vector. See TransformPoint method for more details.
      * @param  vector  vector
@@ -273,6 +290,24 @@ public:
      */
     virtual ScalarImagePointerType      GetLogSpatialJacobianDeterminant(typename SVFExponentialType::NumericalScheme scheme = SVFExponentialType::SCALING_AND_SQUARING) const;
 
+    /**
+     * Gets the displacement field used by TransformPoint, i.e. the exponential of the velocity
+     * field computed using the scaling and squaring scheme. This field is computed on the first
+     * call and is then shared until the velocity field or the transform is modified. Unlike
+     * GetDisplacementFieldAsVectorField, the returned field must not be modified.
+     * @return cached displacement field
+     */
+    virtual const VectorFieldType *     GetCachedDisplacementField(void) const;
+
+    /**
+     * Sets the displacement field used by TransformPoint, e.g. an exponential computed beforehand
+     * and stored on disk. The field must be the exponential of the current velocity field computed
+     * using the scaling and squaring scheme; it is discarded as soon as the velocity field or the
+     * transform is modified.
+     * @param  field  displacement field
+     */
+    virtual void                        SetCachedDisplacementField(VectorFieldType * field);
+
     /**
      * Gets the origin of the field.
      * @retun origin
@@ -340,7 +375,23 @@ private:
     VectorFieldConstPointerType         m_VectorField;
 
     /**
-     * Interpolation function
+     * Displacement field (exponential of the velocity field) used by TransformPoint
+     */
+    mutable VectorFieldPointerType      m_DisplacementField;
+
+    /**
+     * Modification time of the velocity field and of the transform when the displacement field
+     * has been computed
+     */
+    mutable std::atomic<ModifiedTimeType> m_DisplacementFieldMTime;
+
+    /**
+     * Mutex protecting the computation of the displacement field
+     */
+    mutable std::mutex                  m_DisplacementFieldMutex;
+
+    /**
+     * Interpolation function of the displacement field
      */
     InterpolateFunctionPointerType      m_InterpolateFunction;
 
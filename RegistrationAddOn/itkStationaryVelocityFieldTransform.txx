@@ -9,10 +9,9 @@
 #include <itkInverseDisplacementFieldImageFilter.h>
 #include <itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h>
 #include <itkMultiplyImageFilter.h>
-#include <itkWarpVectorImageFilter.h>
-#include <itkImageRegionIterator.h>
-#include <itkDivideImageFilter.h>
+#include <itkMultiThreaderBase.h>
 
+#include <algorithm>
 #include <cmath>
 
 namespace itk
@@ -22,7 +21,7 @@ namespace itk
 
 template <class TScalarType, unsigned int NDimensions>
 StationaryVelocityFieldTransform<TScalarType, NDimensions>::
-StationaryVelocityFieldTransform() : Superclass( ParametersDimension )
+StationaryVelocityFieldTransform() : Superclass( ParametersDimension ), m_DisplacementFieldMTime( 0 )
 {
     this->m_InterpolateFunction = InterpolateFunctionType::New();
 }
@@ -40,6 +39,7 @@ SetIdentity(void)
     field->FillBuffer(value);
     field->Register();
     this->m_VectorField = field;
+    this->Modified();
 }
 
 
@@ -70,7 +70,6 @@ StationaryVelocityFieldTransform<TScalarType, NDimensions>::
 SetParametersAsVectorField(const VectorFieldType * field)
 {
     this->m_VectorField = field;
-    this->m_InterpolateFunction->SetInputImage(this->m_VectorField);
     this->Modified();
 }
 
@@ -123,73 +122,54 @@ typename StationaryVelocityFieldTransform<TScalarType, NDimensions>::OutputPoint
 StationaryVelocityFieldTransform<TScalarType, NDimensions>::
 TransformPoint(const InputPointType & point) const
 {
-    double minpixelspacing = m_VectorField->GetSpacing()[0];
-    for (unsigned int i = 0; i<3; ++i)
-    {
-        if ( m_VectorField->GetSpacing()[i] < minpixelspacing/2 )
-        {
-            minpixelspacing = m_VectorField->GetSpacing()[i];
-        }
-    }
-
-    typedef typename itk::ImageRegionIterator<VectorFieldType> IteratorType;
-
-    IteratorType InputIt(const_cast<VectorFieldType*>(m_VectorField.GetPointer()), m_VectorField->GetRequestedRegion());
-
-    float norm2,maxnorm2=0;
-    for( InputIt.GoToBegin(); !InputIt.IsAtEnd(); ++InputIt )
-    {
-        norm2 = InputIt.Get().GetSquaredNorm();
-        if (maxnorm2<norm2) maxnorm2=norm2;
-    }
-
-    maxnorm2 /= (minpixelspacing * minpixelspacing);
-
-    float numiterfloat = 2.0 +
-            0.5 * std::log(maxnorm2)/std::log(2.0);
-
-    unsigned int numiter = 0;
-    if (numiterfloat + 1 > 0)
-        numiter = static_cast<unsigned int>(numiterfloat + 1.0);
-
-    unsigned int constant = 1<<numiter;
-
-    typedef typename itk::DivideImageFilter<VectorFieldType,itk::Image<float,NDimensions>,VectorFieldType> DividerType;
-    typename DividerType::Pointer Divider=DividerType::New();
-    Divider->SetInput(m_VectorField);
-    Divider->SetConstant( constant );
+    // Make sure the displacement field is up to date
+    this->GetCachedDisplacementField();
 
-    Divider->Update();
-
-    VectorFieldPointerType UpdatedVector = Divider->GetOutput();
-
-    typedef typename itk::WarpVectorImageFilter<VectorFieldType,VectorFieldType,VectorFieldType> VectorWarperType;
-    typename VectorWarperType::Pointer VectorWarper=VectorWarperType::New();
+    // Displace the point
+    typename InterpolateFunctionType::OutputType vector = this->m_InterpolateFunction->Evaluate(point);
+    OutputPointType output;
+    for (unsigned int i=0; i<NDimensions; i++)
+        output[i] = point[i] + vector[i];
+    return output;
+}
 
-    VectorWarper->SetOutputOrigin(UpdatedVector->GetOrigin());
-    VectorWarper->SetOutputSpacing(UpdatedVector->GetSpacing());
-    VectorWarper->SetOutputDirection(UpdatedVector->GetDirection());
 
 
-    OutputPointType output = point;
+template<class TScalarType, unsigned int NDimensions>
+void
+StationaryVelocityFieldTransform<TScalarType, NDimensions>::
+TransformPoints(const InputPointType * input, OutputPointType * output, SizeValueType numberOfPoints) const
+{
+    // Make sure the displacement field is up to date before the threads start
+    this->GetCachedDisplacementField();
 
-    for (unsigned int i =0; i < constant;++i)
+    // Displaces the points of the range [first, last)
+    const InterpolateFunctionType * interpolator = this->m_InterpolateFunction.GetPointer();
+    auto transformRange = [interpolator, input, output](SizeValueType first, SizeValueType last)
     {
-        this->m_InterpolateFunction->SetInputImage(UpdatedVector);
-        typename InterpolateFunctionType::OutputType vector = m_InterpolateFunction->Evaluate(output);
-
-        for (unsigned int i=0; i<NDimensions; i++)
-            output[i] += vector[i];
-
-        VectorWarper->SetInput(UpdatedVector);
-        VectorWarper->SetDisplacementField(UpdatedVector);
-        VectorWarper->Update();
+        for (SizeValueType n=first; n<last; n++)
+        {
+            const InputPointType point = input[n];
+            typename InterpolateFunctionType::OutputType vector = interpolator->Evaluate(point);
+            for (unsigned int i=0; i<NDimensions; i++)
+                output[n][i] = point[i] + vector[i];
+        }
+    };
 
-        UpdatedVector=VectorWarper->GetOutput();
-        UpdatedVector->DisconnectPipeline();
+    // Small sets are not worth splitting across threads
+    const SizeValueType blockSize      = PointsPerBlock;
+    const SizeValueType numberOfBlocks = (numberOfPoints + blockSize - 1) / blockSize;
+    if (numberOfBlocks < 2)
+    {
+        transformRange(0, numberOfPoints);
+        return;
     }
 
-    return output;
+    MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+    threader->ParallelizeArray(0, numberOfBlocks, [&](SizeValueType block)
+    {
+        transformRange(block * blockSize, std::min(numberOfPoints, (block+1) * blockSize));
+    }, ITK_NULLPTR);
 }
 
 
@@ -255,12 +235,59 @@ GetLogSpatialJacobianDeterminant(typename SVFExponentialType::NumericalScheme sc
     typename SVFExponentialType::Pointer exp = SVFExponentialType::New();
     exp->SetInput( this->m_VectorField );
     exp->SetIterativeScheme( scheme );
+    exp->SetLogJacobianDeterminantComputation( true );
     exp->UpdateLargestPossibleRegion();
     return exp->GetLogJacobianDeterminant();
 }
 
 
 
+template<class TScalarType, unsigned int NDimensions>
+const typename StationaryVelocityFieldTransform<TScalarType, NDimensions>::VectorFieldType *
+StationaryVelocityFieldTransform<TScalarType, NDimensions>::
+GetCachedDisplacementField(void) const
+{
+    if (this->m_VectorField.IsNull())
+        itkExceptionMacro("No field has been set.");
+
+    // The cache is valid as long as neither the field nor the transform has been modified
+    ModifiedTimeType mtime = std::max( this->GetMTime(), this->m_VectorField->GetMTime() );
+
+    if ( this->m_DisplacementFieldMTime.load( std::memory_order_acquire ) != mtime )
+    {
+        std::lock_guard<std::mutex> lock( this->m_DisplacementFieldMutex );
+
+        // Another thread may have computed the field while we were waiting for the lock
+        if ( this->m_DisplacementFieldMTime.load( std::memory_order_relaxed ) != mtime )
+        {
+            this->m_DisplacementField = this->GetDisplacementFieldAsVectorField( SVFExponentialType::SCALING_AND_SQUARING );
+            this->m_InterpolateFunction->SetInputImage( this->m_DisplacementField );
+            this->m_DisplacementFieldMTime.store( mtime, std::memory_order_release );
+        }
+    }
+
+    return this->m_DisplacementField.GetPointer();
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+StationaryVelocityFieldTransform<TScalarType, NDimensions>::
+SetCachedDisplacementField(VectorFieldType * field)
+{
+    if (this->m_VectorField.IsNull())
+        itkExceptionMacro("No field has been set.");
+
+    std::lock_guard<std::mutex> lock( this->m_DisplacementFieldMutex );
+    ModifiedTimeType mtime = std::max( this->GetMTime(), this->m_VectorField->GetMTime() );
+    this->m_DisplacementField = field;
+    this->m_InterpolateFunction->SetInputImage( this->m_DisplacementField );
+    this->m_DisplacementFieldMTime.store( mtime, std::memory_order_release );
+}
+
+
+
 template<class TScalarType, unsigned int NDimensions>
 typename StationaryVelocityFieldTransform<TScalarType, NDimensions>::OriginType
 StationaryVelocityFieldTransform<TScalarType, NDimensions>::
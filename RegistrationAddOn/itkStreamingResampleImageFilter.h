@@ -0,0 +1,99 @@
+#ifndef __itkStreamingResampleImageFilter_h
+#define __itkStreamingResampleImageFilter_h
+
+#include "itkResampleImageFilter.h"
+
+namespace itk
+{
+
+/** \class StreamingResampleImageFilter
+ * \brief Resample an image, requesting only the part of the input needed
+ * by the requested output region.
+ *
+ * ResampleImageFilter only restricts the input requested region for linear
+ * transforms, and requests the whole input otherwise. This filter computes,
+ * for any transform, the bounding box of the input region needed to
+ * resample the output requested region. The output region is sampled on a
+ * grid (every SamplingStep voxels along each dimension, the borders always
+ * being included, or only the corners for linear transforms), the sampled
+ * points are mapped through the transform, and the bounding box of their
+ * continuous indices in the input is enlarged by the radius of the
+ * interpolator plus Padding voxels.
+ *
+ * Combined with an ImageFileWriter using several stream divisions, and a
+ * reader of a streamable format (uncompressed MetaImage, NRRD or NIfTI),
+ * this allows to resample images which do not fit in memory: only one slab
+ * of the output and the corresponding part of the input are loaded at a
+ * time.
+ *
+ * The transform must be smooth at the scale of the sampling step, otherwise
+ * the bounding box may miss some input voxels (the output voxels mapped on
+ * them then get the default pixel value). The padding can be increased for
+ * highly irregular displacement fields.
+ *
+ * \ingroup GeometricTransforms Streamed
+ */
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType=double>
+class ITK_EXPORT StreamingResampleImageFilter:
+    public ResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType>
+{
+public:
+  /** Standard class typedefs. */
+  typedef StreamingResampleImageFilter                                              Self;
+  typedef ResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType> Superclass;
+  typedef SmartPointer<Self>                                                        Pointer;
+  typedef SmartPointer<const Self>                                                  ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( StreamingResampleImageFilter, ResampleImageFilter );
+
+  /** Number of dimensions. */
+  itkStaticConstMacro( ImageDimension, unsigned int, TOutputImage::ImageDimension );
+
+  /** Typedefs inherited from the superclass. */
+  typedef typename Superclass::InputImageType         InputImageType;
+  typedef typename Superclass::OutputImageType        OutputImageType;
+  typedef typename Superclass::OutputImageRegionType  OutputImageRegionType;
+  typedef typename InputImageType::RegionType         InputImageRegionType;
+  typedef typename InputImageType::IndexType          InputIndexType;
+  typedef typename InputImageType::SizeType           InputSizeType;
+
+  /** Set/Get the distance, in output voxels, between two sampled points of the
+   * output requested region (4 by default). */
+  itkSetClampMacro( SamplingStep, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( SamplingStep, unsigned int );
+
+  /** Set/Get the number of input voxels added around the bounding box, in
+   * addition to the radius of the interpolator (2 by default). */
+  itkSetMacro( Padding, unsigned int );
+  itkGetConstMacro( Padding, unsigned int );
+
+protected:
+  StreamingResampleImageFilter( void );
+  ~StreamingResampleImageFilter( void ) {};
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  /** Request the bounding box of the input region mapped by the output
+   * requested region. */
+  virtual void GenerateInputRequestedRegion( void ) ITK_OVERRIDE;
+
+private:
+
+  StreamingResampleImageFilter( const Self& ); //purposely not implemented
+  void operator=( const Self& ); //purposely not implemented
+
+  unsigned int  m_SamplingStep;   // sampling step of the output region
+  unsigned int  m_Padding;        // padding of the input bounding box
+}; // end class StreamingResampleImageFilter
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkStreamingResampleImageFilter.txx"
+#endif
+
+#endif // end #ifndef __itkStreamingResampleImageFilter_h
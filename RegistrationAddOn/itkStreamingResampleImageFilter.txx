@@ -0,0 +1,165 @@
+#ifndef __itkStreamingResampleImageFilter_txx
+#define __itkStreamingResampleImageFilter_txx
+
+#include "itkStreamingResampleImageFilter.h"
+#include "itkContinuousIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace itk
+{
+
+// Constructor
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+StreamingResampleImageFilter<TInputImage,TOutputImage,TInterpolatorPrecisionType>
+::StreamingResampleImageFilter()
+{
+  this->m_SamplingStep = 4;
+  this->m_Padding      = 2;
+}
+
+
+// Print out a description of self
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+StreamingResampleImageFilter<TInputImage,TOutputImage,TInterpolatorPrecisionType>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "SamplingStep: " << this->m_SamplingStep << std::endl;
+  os << indent << "Padding: " << this->m_Padding << std::endl;
+}
+
+
+// Request the bounding box of the input region mapped by the output requested region
+template <class TInputImage, class TOutputImage, class TInterpolatorPrecisionType>
+void
+StreamingResampleImageFilter<TInputImage,TOutputImage,TInterpolatorPrecisionType>
+::GenerateInputRequestedRegion( void )
+{
+  typedef typename Superclass::TransformType              TransformType;
+  typedef typename TransformType::InputPointType          TransformPointType;
+  typedef ContinuousIndex<double, ImageDimension>         ContinuousIndexType;
+
+  InputImageType *        input  = const_cast<InputImageType *>( this->GetInput() );
+  const OutputImageType * output = this->GetOutput();
+  const TransformType *   transform = this->GetTransform();
+  if( !input || !output )
+    {
+    return;
+    }
+  if( !transform )
+    {
+    itkExceptionMacro(<< "Transform not set");
+    }
+
+  const InputImageRegionType  largestRegion = input->GetLargestPossibleRegion();
+  const OutputImageRegionType outputRegion  = output->GetRequestedRegion();
+  if( outputRegion.GetNumberOfPixels() == 0 )
+    {
+    input->SetRequestedRegionToLargestPossibleRegion();
+    return;
+    }
+
+  // Sampled positions along each dimension: every SamplingStep voxels, the last voxel
+  // being always included. The corners are enough for linear transforms.
+  std::vector<IndexValueType> positions[ImageDimension];
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    const IndexValueType first = outputRegion.GetIndex( i );
+    const IndexValueType last  = first + static_cast<IndexValueType>( outputRegion.GetSize( i ) ) - 1;
+    const IndexValueType step  = transform->IsLinear() ? std::max<IndexValueType>( last - first, 1 )
+                                                       : static_cast<IndexValueType>( this->m_SamplingStep );
+    for( IndexValueType p = first; p < last; p += step )
+      {
+      positions[i].push_back( p );
+      }
+    positions[i].push_back( last );
+    }
+
+  // Bounding box of the continuous indices of the mapped points in the input
+  double lower[ImageDimension];
+  double upper[ImageDimension];
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    lower[i] = NumericTraits<double>::max();
+    upper[i] = NumericTraits<double>::NonpositiveMin();
+    }
+
+  unsigned int               counter[ImageDimension] = {};
+  typename OutputImageType::IndexType index;
+  TransformPointType         point;
+  ContinuousIndexType        continuousIndex;
+  bool                       done = false;
+  while( !done )
+    {
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      index[i] = positions[i][counter[i]];
+      }
+    output->TransformIndexToPhysicalPoint( index, point );
+    input->TransformPhysicalPointToContinuousIndex( transform->TransformPoint( point ), continuousIndex );
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      lower[i] = std::min( lower[i], continuousIndex[i] );
+      upper[i] = std::max( upper[i], continuousIndex[i] );
+      }
+
+    // Next sampled point
+    done = true;
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      if( ++counter[i] < positions[i].size() )
+        {
+        done = false;
+        break;
+        }
+      counter[i] = 0;
+      }
+    }
+
+  // Enlarge the bounding box by the support of the interpolator and the padding
+  InputSizeType radius;
+  radius.Fill( 1 );
+  if( this->GetInterpolator() )
+    {
+    radius = this->GetInterpolator()->GetRadius();
+    }
+
+  InputImageRegionType requestedRegion;
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    const double margin = static_cast<double>( radius[i] + this->m_Padding );
+    const double first  = std::floor( lower[i] - margin );
+    const double last   = std::ceil(  upper[i] + margin );
+
+    // Clamp the bounds before the conversion, mapped points may be very far from the input
+    const double minimum = static_cast<double>( largestRegion.GetIndex( i ) ) - 1.0;
+    const double maximum = static_cast<double>( largestRegion.GetUpperIndex()[i] ) + 1.0;
+    const IndexValueType firstIndex = static_cast<IndexValueType>( std::max( minimum, std::min( maximum, first ) ) );
+    const IndexValueType lastIndex  = static_cast<IndexValueType>( std::max( minimum, std::min( maximum, last ) ) );
+
+    requestedRegion.SetIndex( i, firstIndex );
+    requestedRegion.SetSize(  i, static_cast<SizeValueType>( lastIndex - firstIndex + 1 ) );
+    }
+
+  // If the output region is mapped outside of the input, a single voxel is requested
+  // (the output then gets the default pixel value)
+  if( !requestedRegion.Crop( largestRegion ) )
+    {
+    InputSizeType size;
+    size.Fill( 1 );
+    requestedRegion.SetIndex( largestRegion.GetIndex() );
+    requestedRegion.SetSize( size );
+    }
+
+  itkDebugMacro(<< "Input requested region: " << requestedRegion);
+  input->SetRequestedRegion( requestedRegion );
+}
+
+} // end namespace itk
+
+#endif // end #ifndef __itkStreamingResampleImageFilter_txx
@@ -0,0 +1,235 @@
+#ifndef __itkTransformChainToDisplacementFieldSource_h
+#define __itkTransformChainToDisplacementFieldSource_h
+
+#include "itkTransform.h"
+#include "itkImageSource.h"
+#include "itkGeneralTransform.h"
+#include "rpiVectorFieldLookup.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class TransformChainToDisplacementFieldSource
+ * \brief Generate a displacement field from a transform, typically a
+ * GeneralTransform composing several transforms.
+ *
+ * Before the threads start, the transform is simplified (see
+ * GeneralTransform::GetSimplifiedTransform) and each of its elements is
+ * converted into an evaluation stage of a known type:
+ *  - MatrixOffsetTransformBase: matrix and offset,
+ *  - rpi::DisplacementFieldTransform: raw buffer linear lookup in its field,
+ *  - StationaryVelocityFieldTransform: raw buffer linear lookup in its
+ *    (cached) exponential,
+ *  - any other transform: call to its TransformPoint method.
+ *
+ * The output is then computed scanline by scanline. A leading linear stage
+ * is merged with the index to physical point mapping, and the continuous
+ * index of a field stage that directly follows is computed incrementally
+ * along the scanline. The values are the same as the ones given by
+ * TransformToDisplacementFieldFilter, fields being extrapolated with their
+ * nearest border voxel.
+ *
+ * If a mask image is set, only the voxels of the mask are computed, the
+ * displacement of the other voxels being zero. The mask must cover the output
+ * region, with the grid of the output image.
+ *
+ * Output information (spacing, size and direction) for the output
+ * image should be set. This information has the normal defaults of
+ * unit spacing, zero origin and identity direction. Optionally, the
+ * output information can be obtained from a reference image.
+ *
+ * This filter is implemented as a multithreaded filter.  It provides a
+ * ThreadedGenerateData() method for its implementation.
+ *
+ * \ingroup GeometricTransforms
+ */
+template <class TOutputImage,
+class TTransformPrecisionType=double>
+class ITK_EXPORT TransformChainToDisplacementFieldSource:
+    public ImageSource<TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef TransformChainToDisplacementFieldSource Self;
+  typedef ImageSource<TOutputImage>               Superclass;
+  typedef SmartPointer<Self>                      Pointer;
+  typedef SmartPointer<const Self>                ConstPointer;
+
+  typedef TOutputImage                            OutputImageType;
+  typedef typename OutputImageType::Pointer       OutputImagePointer;
+  typedef typename OutputImageType::ConstPointer  OutputImageConstPointer;
+  typedef typename OutputImageType::RegionType    OutputImageRegionType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( TransformChainToDisplacementFieldSource, ImageSource );
+
+  /** Number of dimensions. */
+  itkStaticConstMacro( ImageDimension, unsigned int,
+    TOutputImage::ImageDimension );
+
+  /** Typedefs for transform. */
+  typedef Transform<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension ),
+    itkGetStaticConstMacro( ImageDimension )>     TransformType;
+  typedef typename TransformType::ConstPointer    TransformConstPointerType;
+  typedef typename TransformType::Pointer         TransformPointerType;
+  typedef GeneralTransform<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension )>     GeneralTransformType;
+
+  /** Typedefs for output image. */
+  typedef typename OutputImageType::PixelType     PixelType;
+  typedef typename PixelType::ValueType           PixelValueType;
+  typedef typename OutputImageType::RegionType    RegionType;
+  typedef typename RegionType::SizeType           SizeType;
+  typedef typename OutputImageType::IndexType     IndexType;
+  typedef typename OutputImageType::PointType     PointType;
+  typedef typename OutputImageType::SpacingType   SpacingType;
+  typedef typename OutputImageType::PointType     OriginType;
+  typedef typename OutputImageType::DirectionType DirectionType;
+
+  /** Typedefs for the fields of the transforms. */
+  typedef Vector<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension )>     FieldVectorType;
+  typedef Image<FieldVectorType,
+    itkGetStaticConstMacro( ImageDimension )>     FieldType;
+  typedef rpi::VectorFieldLookup<FieldType>       FieldLookupType;
+
+  /** Typedefs for base image. */
+  typedef ImageBase< itkGetStaticConstMacro( ImageDimension ) > ImageBaseType;
+
+  /** Typedefs for the mask image. */
+  typedef Image<unsigned char,
+    itkGetStaticConstMacro( ImageDimension )>     MaskImageType;
+  typedef typename MaskImageType::ConstPointer    MaskImageConstPointer;
+
+  /** Set the coordinate transformation. It maps the points of the output
+   * grid to the displaced points. */
+  itkSetConstObjectMacro( Transform, TransformType );
+
+  /** Get a pointer to the coordinate transform. */
+  itkGetConstObjectMacro( Transform, TransformType );
+
+  /** Set the size of the output image. */
+  virtual void SetOutputSize( const SizeType & size );
+
+  /** Get the size of the output image. */
+  virtual const SizeType & GetOutputSize();
+
+  /** Set the start index of the output largest possible region.
+  * The default is an index of all zeros. */
+  virtual void SetOutputIndex( const IndexType & index );
+
+  /** Get the start index of the output largest possible region. */
+  virtual const IndexType & GetOutputIndex();
+
+  /** Set the region of the output image. */
+  itkSetMacro( OutputRegion, OutputImageRegionType );
+
+  /** Get the region of the output image. */
+  itkGetConstReferenceMacro( OutputRegion, OutputImageRegionType );
+
+  /** Set the output image spacing. */
+  itkSetMacro( OutputSpacing, SpacingType );
+  virtual void SetOutputSpacing( const double* values );
+
+  /** Get the output image spacing. */
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+
+  /** Set the output image origin. */
+  itkSetMacro( OutputOrigin, OriginType );
+  virtual void SetOutputOrigin( const double* values);
+
+  /** Get the output image origin. */
+  itkGetConstReferenceMacro( OutputOrigin, OriginType );
+
+  /** Set the output direction cosine matrix. */
+  itkSetMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+
+  /** Helper method to set the output parameters based on this image */
+  void SetOutputParametersFromImage( const ImageBaseType * image );
+
+  /** Set/Get the mask of the voxels computed (optional, all the voxels
+   * are computed by default). */
+  itkSetConstObjectMacro( MaskImage, MaskImageType );
+  itkGetConstObjectMacro( MaskImage, MaskImageType );
+
+  /** TransformChainToDisplacementFieldSource produces a vector image. */
+  virtual void GenerateOutputInformation( void ) ITK_OVERRIDE;
+
+  /** Builds the evaluation stages of the transform. */
+  virtual void BeforeThreadedGenerateData( void ) ITK_OVERRIDE;
+
+  /** Releases the evaluation stages. */
+  virtual void AfterThreadedGenerateData( void ) ITK_OVERRIDE;
+
+  /** Compute the Modified Time based on changes to the components. */
+  ModifiedTimeType GetMTime( void ) const ITK_OVERRIDE;
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkStaticConstMacro(PixelDimension, unsigned int,
+                      PixelType::Dimension );
+  itkConceptMacro(SameDimensionCheck,
+    (Concept::SameDimension<ImageDimension,PixelDimension>));
+  /** End concept checking */
+#endif
+
+protected:
+  TransformChainToDisplacementFieldSource( void );
+  ~TransformChainToDisplacementFieldSource( void ) {};
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  /** TransformChainToDisplacementFieldSource is implemented as a
+   * multithreaded filter. */
+  void ThreadedGenerateData(
+    const OutputImageRegionType & outputRegionForThread,
+    ThreadIdType threadId ) ITK_OVERRIDE;
+
+  /** Type of the evaluation stages. */
+  enum StageKind { MATRIX_STAGE, FIELD_STAGE, GENERIC_STAGE };
+
+  /** Evaluation stage, i.e. one element of the simplified transform. */
+  struct Stage
+  {
+    StageKind                 Kind;
+    double                    Matrix[ImageDimension][ImageDimension];
+    double                    Offset[ImageDimension];
+    FieldLookupType           Lookup;
+    TransformConstPointerType Transform;
+  };
+
+  /** Number of points of a scanline transformed together. */
+  itkStaticConstMacro( PointsPerChunk, unsigned int, 64 );
+
+  /** Applies a stage to a set of points (in place). */
+  void ApplyStage( const Stage & stage, double * points, SizeValueType numberOfPoints ) const;
+
+private:
+
+  TransformChainToDisplacementFieldSource( const Self& ); //purposely not implemented
+  void operator=( const Self& ); //purposely not implemented
+
+  /** Member variables. */
+  RegionType              m_OutputRegion;      // region of the output image
+  SpacingType             m_OutputSpacing;     // output image spacing
+  OriginType              m_OutputOrigin;      // output image origin
+  DirectionType           m_OutputDirection;   // output image direction cosines
+  TransformConstPointerType m_Transform;       // Input transform to use
+  MaskImageConstPointer   m_MaskImage;         // Mask of the voxels computed
+  std::vector<Stage>      m_Stages;            // Stages in the order they are applied
+}; // end class TransformChainToDisplacementFieldSource
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkTransformChainToDisplacementFieldSource.txx"
+#endif
+
+#endif // end #ifndef __itkTransformChainToDisplacementFieldSource_h
@@ -0,0 +1,531 @@
+#ifndef __itkTransformChainToDisplacementFieldSource_txx
+#define __itkTransformChainToDisplacementFieldSource_txx
+
+#include "itkTransformChainToDisplacementFieldSource.h"
+
+#include "itkIdentityTransform.h"
+#include "itkProgressReporter.h"
+#include "itkImageScanlineIterator.h"
+#include "itkMatrixOffsetTransformBase.h"
+#include "itkStationaryVelocityFieldTransform.h"
+#include "rpiDisplacementFieldTransform.h"
+
+#include <algorithm>
+
+namespace itk
+{
+
+// Constructor
+template <class TOutputImage, class TTransformPrecisionType>
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::TransformChainToDisplacementFieldSource()
+{
+  this->m_OutputSpacing.Fill(1.0);
+  this->m_OutputOrigin.Fill(0.0);
+  this->m_OutputDirection.SetIdentity();
+
+  SizeType size;
+  size.Fill( 0 );
+  this->m_OutputRegion.SetSize( size );
+
+  IndexType index;
+  index.Fill( 0 );
+  this->m_OutputRegion.SetIndex( index );
+
+  this->m_Transform
+    = IdentityTransform<TTransformPrecisionType, ImageDimension>::New();
+
+  // The output is computed by the classic ThreadedGenerateData
+  this->DynamicMultiThreadingOff();
+}
+
+
+// Print out a description of self
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "OutputRegion: " << this->m_OutputRegion << std::endl;
+  os << indent << "OutputSpacing: " << this->m_OutputSpacing << std::endl;
+  os << indent << "OutputOrigin: " << this->m_OutputOrigin << std::endl;
+  os << indent << "OutputDirection: " << this->m_OutputDirection << std::endl;
+  os << indent << "Transform: " << this->m_Transform.GetPointer() << std::endl;
+  os << indent << "MaskImage: " << this->m_MaskImage.GetPointer() << std::endl;
+}
+
+
+// Set the output image size.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::SetOutputSize( const SizeType & size )
+{
+  this->m_OutputRegion.SetSize( size );
+  this->Modified();
+}
+
+
+// Get the output image size.
+template <class TOutputImage, class TTransformPrecisionType>
+const typename TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::SizeType &
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::GetOutputSize()
+{
+  return this->m_OutputRegion.GetSize();
+}
+
+
+// Set the output image index.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::SetOutputIndex( const IndexType & index )
+{
+  this->m_OutputRegion.SetIndex( index );
+  this->Modified();
+}
+
+
+// Get the output image index.
+template <class TOutputImage, class TTransformPrecisionType>
+const typename TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::IndexType &
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::GetOutputIndex()
+{
+  return this->m_OutputRegion.GetIndex();
+}
+
+
+// Set the output image spacing.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::SetOutputSpacing( const double* spacing )
+{
+  SpacingType s( spacing );
+  this->SetOutputSpacing( s );
+}
+
+
+// Set the output image origin.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::SetOutputOrigin( const double* origin )
+{
+  OriginType p( origin );
+  this->SetOutputOrigin( p );
+}
+
+// Helper method to set the output parameters based on this image
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::SetOutputParametersFromImage ( const ImageBaseType * image )
+{
+  if( !image )
+    {
+    itkExceptionMacro(<< "Cannot use a null image reference");
+    }
+
+  this->SetOutputOrigin( image->GetOrigin() );
+  this->SetOutputSpacing( image->GetSpacing() );
+  this->SetOutputDirection( image->GetDirection() );
+  this->SetOutputRegion( image->GetLargestPossibleRegion() );
+}
+
+
+// Set up state of filter before multi-threading.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::BeforeThreadedGenerateData( void )
+{
+  if( !this->m_Transform )
+    {
+    itkExceptionMacro(<< "Transform not set");
+    }
+  if( this->m_MaskImage
+    && !this->m_MaskImage->GetBufferedRegion().IsInside( this->GetOutput()->GetRequestedRegion() ) )
+    {
+    itkExceptionMacro(<< "The mask does not cover the output region");
+    }
+
+  typedef IdentityTransform<TTransformPrecisionType, ImageDimension>                        IdTrsfType;
+  typedef MatrixOffsetTransformBase<TTransformPrecisionType, ImageDimension, ImageDimension> MatOffTrsfType;
+  typedef rpi::DisplacementFieldTransform<TTransformPrecisionType, ImageDimension>          DFTrsfType;
+  typedef StationaryVelocityFieldTransform<TTransformPrecisionType, ImageDimension>         SVFTrsfType;
+
+  // List the elements of the simplified transform in the order they are applied
+  std::vector<TransformConstPointerType> transforms;
+  const GeneralTransformType * chain = dynamic_cast<const GeneralTransformType*>( this->m_Transform.GetPointer() );
+  if( chain )
+    {
+    typename GeneralTransformType::Pointer simplified = chain->GetSimplifiedTransform();
+    for( unsigned int i = simplified->GetNumberOfTransformsInStack(); i > 0; --i )
+      {
+      transforms.push_back( simplified->GetTransform( i - 1 ) );
+      }
+    }
+  else
+    {
+    transforms.push_back( this->m_Transform );
+    }
+
+  // Convert each element into an evaluation stage
+  this->m_Stages.clear();
+  for( unsigned int n = 0; n < transforms.size(); ++n )
+    {
+    const TransformType * transform = transforms[n].GetPointer();
+    if( dynamic_cast<const IdTrsfType*>( transform ) )
+      {
+      continue;
+      }
+
+    Stage stage;
+    const MatOffTrsfType * mattrsf = dynamic_cast<const MatOffTrsfType*>( transform );
+    const DFTrsfType *     dftrsf  = dynamic_cast<const DFTrsfType*>( transform );
+    const SVFTrsfType *    svftrsf = dynamic_cast<const SVFTrsfType*>( transform );
+    if( mattrsf )
+      {
+      stage.Kind = MATRIX_STAGE;
+      for( unsigned int i = 0; i < ImageDimension; ++i )
+        {
+        stage.Offset[i] = mattrsf->GetOffset()[i];
+        for( unsigned int j = 0; j < ImageDimension; ++j )
+          {
+          stage.Matrix[i][j] = mattrsf->GetMatrix()[i][j];
+          }
+        }
+      }
+    else if( dftrsf && dftrsf->GetFieldGeometry() )
+      {
+      // The lookup of the transform handles the fields stored with 16-bit codes
+      stage.Kind = FIELD_STAGE;
+      stage.Lookup = dftrsf->GetFieldLookup();
+      }
+    else if( svftrsf )
+      {
+      stage.Kind = FIELD_STAGE;
+      stage.Lookup.SetField( svftrsf->GetCachedDisplacementField() );
+      }
+    else
+      {
+      stage.Kind = GENERIC_STAGE;
+      stage.Transform = transform;
+      }
+    this->m_Stages.push_back( stage );
+    }
+
+  itkDebugMacro(<< "Number of evaluation stages: " << this->m_Stages.size());
+}
+
+
+// Release the stages
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::AfterThreadedGenerateData( void )
+{
+  this->m_Stages.clear();
+}
+
+
+// Apply a stage to a set of points
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::ApplyStage( const Stage & stage, double * points, SizeValueType numberOfPoints ) const
+{
+  switch( stage.Kind )
+    {
+    case MATRIX_STAGE:
+      {
+      for( SizeValueType n = 0; n < numberOfPoints; ++n )
+        {
+        double * point = points + n * ImageDimension;
+        double   input[ImageDimension];
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          input[i] = point[i];
+          }
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          point[i] = stage.Offset[i];
+          for( unsigned int j = 0; j < ImageDimension; ++j )
+            {
+            point[i] += stage.Matrix[i][j] * input[j];
+            }
+          }
+        }
+      break;
+      }
+    case FIELD_STAGE:
+      {
+      const SizeValueType chunkSize = PointsPerChunk;
+      FieldVectorType     vectors[PointsPerChunk];
+      for( SizeValueType first = 0; first < numberOfPoints; first += chunkSize )
+        {
+        const SizeValueType size  = std::min( chunkSize, numberOfPoints - first );
+        double *            chunk = points + first * ImageDimension;
+        stage.Lookup.EvaluateAtPoints( chunk, vectors, size );
+        for( SizeValueType n = 0; n < size; ++n )
+          {
+          for( unsigned int i = 0; i < ImageDimension; ++i )
+            {
+            chunk[n * ImageDimension + i] += vectors[n][i];
+            }
+          }
+        }
+      break;
+      }
+    default:
+      {
+      for( SizeValueType n = 0; n < numberOfPoints; ++n )
+        {
+        double * point = points + n * ImageDimension;
+        typename TransformType::InputPointType input;
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          input[i] = point[i];
+          }
+        const typename TransformType::OutputPointType output = stage.Transform->TransformPoint( input );
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          point[i] = output[i];
+          }
+        }
+      }
+    }
+}
+
+
+// ThreadedGenerateData
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::ThreadedGenerateData(
+  const OutputImageRegionType & outputRegionForThread,
+  ThreadIdType threadId )
+{
+  // Get the output pointer
+  OutputImagePointer      outputPtr = this->GetOutput();
+
+  // Create an iterator that will walk the output region for this thread.
+  typedef ImageScanlineIterator<TOutputImage> OutputIteratorType;
+  OutputIteratorType outIt( outputPtr, outputRegionForThread );
+
+  // Support for progress methods/callbacks
+  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
+
+  // A leading linear stage is merged with the index to physical point mapping,
+  // and a field stage that directly follows is looked up with an incremental index
+  const unsigned int numberOfStages = this->m_Stages.size();
+  unsigned int       firstStage     = 0;
+  const Stage *      leadingMatrix  = ITK_NULLPTR;
+  const Stage *      leadingField   = ITK_NULLPTR;
+  if( firstStage < numberOfStages && this->m_Stages[firstStage].Kind == MATRIX_STAGE )
+    {
+    leadingMatrix = &this->m_Stages[firstStage++];
+    }
+  if( firstStage < numberOfStages && this->m_Stages[firstStage].Kind == FIELD_STAGE )
+    {
+    leadingField = &this->m_Stages[firstStage++];
+    }
+
+  // Physical step between two consecutive voxels of a scanline, before and after the
+  // leading linear stage, and the corresponding step of the continuous index
+  double pointStep[ImageDimension];
+  double mappedStep[ImageDimension];
+  double indexStep[ImageDimension];
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    pointStep[i] = outputPtr->GetDirection()[i][0] * outputPtr->GetSpacing()[0];
+    indexStep[i] = 0.0;
+    }
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    mappedStep[i] = pointStep[i];
+    if( leadingMatrix )
+      {
+      mappedStep[i] = 0.0;
+      for( unsigned int j = 0; j < ImageDimension; ++j )
+        {
+        mappedStep[i] += leadingMatrix->Matrix[i][j] * pointStep[j];
+        }
+      }
+    }
+  if( leadingField )
+    {
+    leadingField->Lookup.TransformPhysicalVectorToContinuousIndex( mappedStep, indexStep );
+    }
+
+  // The points of a scanline are transformed by chunks, stage after stage, so that the
+  // field lookups process several points at once. Only the voxels of the mask are transformed.
+  const MaskImageType * mask       = this->m_MaskImage.GetPointer();
+  const SizeValueType lineLength = outputRegionForThread.GetSize( 0 );
+  const SizeValueType chunkSize  = PointsPerChunk;
+  double              outputPoint[ImageDimension];          // Coordinates of the first pixel
+  double              mappedPoint[ImageDimension];          // Same after the leading linear stage
+  double              fieldIndex[ImageDimension] = {};      // Continuous index in the leading field
+  double              points[PointsPerChunk * ImageDimension];  // Transformed points
+  double              indices[PointsPerChunk * ImageDimension]; // Continuous indices in the leading field
+  FieldVectorType     vectors[PointsPerChunk];
+  SizeValueType       selected[PointsPerChunk];             // Positions of the voxels of the mask in the chunk
+  PointType           physicalPoint;
+  PixelType           displacement;
+  PixelType           zero;
+  zero.Fill( 0 );
+
+  while ( !outIt.IsAtEnd() )
+    {
+    // Determine the position of the first pixel in the scanline
+    outputPtr->TransformIndexToPhysicalPoint( outIt.GetIndex(), physicalPoint );
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      outputPoint[i] = physicalPoint[i];
+      mappedPoint[i] = physicalPoint[i];
+      }
+    if( leadingMatrix )
+      {
+      this->ApplyStage( *leadingMatrix, mappedPoint, 1 );
+      }
+    if( leadingField )
+      {
+      leadingField->Lookup.TransformPhysicalPointToContinuousIndex( mappedPoint, fieldIndex );
+      }
+    const unsigned char * maskLine = mask ? mask->GetBufferPointer() + mask->ComputeOffset( outIt.GetIndex() ) : ITK_NULLPTR;
+
+    for( SizeValueType first = 0; first < lineLength; first += chunkSize )
+      {
+      const SizeValueType size  = std::min( chunkSize, lineLength - first );
+      SizeValueType       count = 0;
+      for( SizeValueType n = 0; n < size; ++n )
+        {
+        if( !maskLine || maskLine[first + n] )
+          {
+          selected[count++] = first + n;
+          }
+        }
+
+      // Points after the leading linear stage
+      for( SizeValueType m = 0; m < count; ++m )
+        {
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          points[m * ImageDimension + i] = mappedPoint[i] + selected[m] * mappedStep[i];
+          }
+        }
+
+      // Leading field stage
+      if( leadingField && count > 0 )
+        {
+        for( SizeValueType m = 0; m < count; ++m )
+          {
+          for( unsigned int i = 0; i < ImageDimension; ++i )
+            {
+            indices[m * ImageDimension + i] = fieldIndex[i] + selected[m] * indexStep[i];
+            }
+          }
+        leadingField->Lookup.EvaluateAtContinuousIndices( indices, vectors, count );
+        for( SizeValueType m = 0; m < count; ++m )
+          {
+          for( unsigned int i = 0; i < ImageDimension; ++i )
+            {
+            points[m * ImageDimension + i] += vectors[m][i];
+            }
+          }
+        }
+
+      // Remaining stages
+      for( unsigned int s = firstStage; s < numberOfStages && count > 0; ++s )
+        {
+        this->ApplyStage( this->m_Stages[s], points, count );
+        }
+
+      // Compute the deformation, zero outside of the mask
+      for( SizeValueType n = first, m = 0; n < first + size; ++n )
+        {
+        if( m < count && selected[m] == n )
+          {
+          for( unsigned int i = 0; i < ImageDimension; ++i )
+            {
+            displacement[i] = static_cast<PixelValueType>(
+              points[m * ImageDimension + i] - ( outputPoint[i] + n * pointStep[i] ) );
+            }
+          outIt.Set( displacement );
+          ++m;
+          }
+        else
+          {
+          outIt.Set( zero );
+          }
+        ++outIt;
+        progress.CompletedPixel();
+        }
+      }
+
+    outIt.NextLine();
+    }
+}
+
+
+// Inform pipeline of required output region
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::GenerateOutputInformation( void )
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateOutputInformation();
+
+  // get pointer to the output
+  OutputImagePointer outputPtr = this->GetOutput();
+  if ( !outputPtr )
+    {
+    return;
+    }
+
+  outputPtr->SetLargestPossibleRegion( m_OutputRegion );
+
+  outputPtr->SetSpacing( m_OutputSpacing );
+  outputPtr->SetOrigin( m_OutputOrigin );
+  outputPtr->SetDirection( m_OutputDirection );
+}
+
+
+// Verify if any of the components has been modified.
+template <class TOutputImage, class TTransformPrecisionType>
+ModifiedTimeType
+TransformChainToDisplacementFieldSource<TOutputImage,TTransformPrecisionType>
+::GetMTime( void ) const
+{
+  ModifiedTimeType latestTime = Object::GetMTime();
+
+  if( this->m_Transform )
+    {
+    if( latestTime < this->m_Transform->GetMTime() )
+      {
+      latestTime = this->m_Transform->GetMTime();
+      }
+    }
+  if( this->m_MaskImage )
+    {
+    if( latestTime < this->m_MaskImage->GetMTime() )
+      {
+      latestTime = this->m_MaskImage->GetMTime();
+      }
+    }
+
+  return latestTime;
+}
+
+
+} // end namespace itk
+
+#endif // end #ifndef _itkTransformChainToDisplacementFieldSource_txx
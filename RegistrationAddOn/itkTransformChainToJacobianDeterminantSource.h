@@ -0,0 +1,270 @@
+#ifndef __itkTransformChainToJacobianDeterminantSource_h
+#define __itkTransformChainToJacobianDeterminantSource_h
+
+#include "itkTransform.h"
+#include "itkImageSource.h"
+#include "itkGeneralTransform.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "rpiVectorFieldLookup.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class TransformChainToJacobianDeterminantSource
+ * \brief Generate the map of the Jacobian determinant of a transform,
+ * typically a GeneralTransform composing several transforms.
+ *
+ * The determinant of a composition is computed with the chain rule, i.e. as
+ * the product of the determinants of its elements, each one being evaluated
+ * at the point mapped by the previous elements:
+ *   det J(T_n o ... o T_1)(x) = det J(T_n)(x_n-1) ... det J(T_1)(x)
+ * with x_k = T_k(x_k-1). No intermediate field is generated, and the
+ * composition is not differentiated numerically.
+ *
+ * As in TransformChainToDisplacementFieldSource, the transform is simplified
+ * before the threads start and each of its elements is converted into an
+ * evaluation stage of a known type:
+ *  - MatrixOffsetTransformBase: constant determinant of the matrix,
+ *  - rpi::DisplacementFieldTransform: centered finite differences of the
+ *    field along the axes of its grid, all the neighbors of a chunk of points
+ *    being interpolated at once. The stencil radius sets the number of
+ *    neighbors used along each axis (1: second order, 2: fourth order, 3:
+ *    sixth order); wider stencils are less sensitive to the noise of the
+ *    field,
+ *  - StationaryVelocityFieldTransform: the exponential and its log-Jacobian
+ *    determinant are computed once by StationaryVelocityFieldExponential;
+ *    the log-Jacobian is then linearly interpolated,
+ *  - rpi::BSplineDisplacementFieldTransform: analytic Jacobian of the
+ *    control grid,
+ *  - any other transform: centered finite differences of its TransformPoint
+ *    method along the physical axes, with the smallest output spacing as step.
+ *
+ * The output is the determinant, or its natural logarithm if UseLogarithm
+ * is on. Since the logarithm of a non positive determinant (folding) is not
+ * defined, the determinant is then clamped to MinimumDeterminant.
+ *
+ * Output information (spacing, size and direction) for the output
+ * image should be set. This information has the normal defaults of
+ * unit spacing, zero origin and identity direction. Optionally, the
+ * output information can be obtained from a reference image.
+ *
+ * This filter is implemented as a multithreaded filter.  It provides a
+ * ThreadedGenerateData() method for its implementation.
+ *
+ * \ingroup GeometricTransforms
+ */
+template <class TOutputImage,
+class TTransformPrecisionType=double>
+class ITK_EXPORT TransformChainToJacobianDeterminantSource:
+    public ImageSource<TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef TransformChainToJacobianDeterminantSource Self;
+  typedef ImageSource<TOutputImage>                 Superclass;
+  typedef SmartPointer<Self>                        Pointer;
+  typedef SmartPointer<const Self>                  ConstPointer;
+
+  typedef TOutputImage                            OutputImageType;
+  typedef typename OutputImageType::Pointer       OutputImagePointer;
+  typedef typename OutputImageType::ConstPointer  OutputImageConstPointer;
+  typedef typename OutputImageType::RegionType    OutputImageRegionType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( TransformChainToJacobianDeterminantSource, ImageSource );
+
+  /** Number of dimensions. */
+  itkStaticConstMacro( ImageDimension, unsigned int,
+    TOutputImage::ImageDimension );
+
+  /** Typedefs for transform. */
+  typedef Transform<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension ),
+    itkGetStaticConstMacro( ImageDimension )>     TransformType;
+  typedef typename TransformType::ConstPointer    TransformConstPointerType;
+  typedef typename TransformType::Pointer         TransformPointerType;
+  typedef GeneralTransform<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension )>     GeneralTransformType;
+
+  /** Typedefs for output image. */
+  typedef typename OutputImageType::PixelType     PixelType;
+  typedef typename OutputImageType::RegionType    RegionType;
+  typedef typename RegionType::SizeType           SizeType;
+  typedef typename OutputImageType::IndexType     IndexType;
+  typedef typename OutputImageType::PointType     PointType;
+  typedef typename OutputImageType::SpacingType   SpacingType;
+  typedef typename OutputImageType::PointType     OriginType;
+  typedef typename OutputImageType::DirectionType DirectionType;
+
+  /** Typedefs for the fields of the transforms. */
+  typedef Vector<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension )>     FieldVectorType;
+  typedef Image<FieldVectorType,
+    itkGetStaticConstMacro( ImageDimension )>     FieldType;
+  typedef rpi::VectorFieldLookup<FieldType>       FieldLookupType;
+
+  /** Typedefs for the log-Jacobian maps of the velocity fields. */
+  typedef Image<TTransformPrecisionType,
+    itkGetStaticConstMacro( ImageDimension )>     LogJacobianImageType;
+  typedef LinearInterpolateImageFunction<
+    LogJacobianImageType, double>                 LogJacobianInterpolatorType;
+
+  /** Typedefs for base image. */
+  typedef ImageBase< itkGetStaticConstMacro( ImageDimension ) > ImageBaseType;
+
+  /** Set the coordinate transformation. */
+  itkSetConstObjectMacro( Transform, TransformType );
+
+  /** Get a pointer to the coordinate transform. */
+  itkGetConstObjectMacro( Transform, TransformType );
+
+  /** Set/Get the output of the natural logarithm of the determinant.
+   * Default: off. */
+  itkSetMacro( UseLogarithm, bool );
+  itkGetConstMacro( UseLogarithm, bool );
+  itkBooleanMacro( UseLogarithm );
+
+  /** Set/Get the number of neighbors used along each axis by the finite
+   * differences of the displacement fields (1, 2 or 3). Default: 1. */
+  itkSetClampMacro( StencilRadius, unsigned int, 1, 3 );
+  itkGetConstMacro( StencilRadius, unsigned int );
+
+  /** Set/Get the value the determinant is clamped to before taking its
+   * logarithm. Default: 1e-6. */
+  itkSetMacro( MinimumDeterminant, double );
+  itkGetConstMacro( MinimumDeterminant, double );
+
+  /** Set the size of the output image. */
+  virtual void SetOutputSize( const SizeType & size );
+
+  /** Get the size of the output image. */
+  virtual const SizeType & GetOutputSize();
+
+  /** Set the start index of the output largest possible region.
+  * The default is an index of all zeros. */
+  virtual void SetOutputIndex( const IndexType & index );
+
+  /** Get the start index of the output largest possible region. */
+  virtual const IndexType & GetOutputIndex();
+
+  /** Set the region of the output image. */
+  itkSetMacro( OutputRegion, OutputImageRegionType );
+
+  /** Get the region of the output image. */
+  itkGetConstReferenceMacro( OutputRegion, OutputImageRegionType );
+
+  /** Set the output image spacing. */
+  itkSetMacro( OutputSpacing, SpacingType );
+  virtual void SetOutputSpacing( const double* values );
+
+  /** Get the output image spacing. */
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+
+  /** Set the output image origin. */
+  itkSetMacro( OutputOrigin, OriginType );
+  virtual void SetOutputOrigin( const double* values);
+
+  /** Get the output image origin. */
+  itkGetConstReferenceMacro( OutputOrigin, OriginType );
+
+  /** Set the output direction cosine matrix. */
+  itkSetMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+
+  /** Helper method to set the output parameters based on this image */
+  void SetOutputParametersFromImage( const ImageBaseType * image );
+
+  /** TransformChainToJacobianDeterminantSource produces a scalar image. */
+  virtual void GenerateOutputInformation( void ) ITK_OVERRIDE;
+
+  /** Builds the evaluation stages of the transform. */
+  virtual void BeforeThreadedGenerateData( void ) ITK_OVERRIDE;
+
+  /** Releases the evaluation stages. */
+  virtual void AfterThreadedGenerateData( void ) ITK_OVERRIDE;
+
+  /** Compute the Modified Time based on changes to the components. */
+  ModifiedTimeType GetMTime( void ) const ITK_OVERRIDE;
+
+protected:
+  TransformChainToJacobianDeterminantSource( void );
+  ~TransformChainToJacobianDeterminantSource( void ) {};
+
+  void PrintSelf( std::ostream& os, Indent indent ) const ITK_OVERRIDE;
+
+  /** TransformChainToJacobianDeterminantSource is implemented as a
+   * multithreaded filter. */
+  void ThreadedGenerateData(
+    const OutputImageRegionType & outputRegionForThread,
+    ThreadIdType threadId ) ITK_OVERRIDE;
+
+  /** Type of the evaluation stages. */
+  enum StageKind { MATRIX_STAGE, FIELD_STAGE, VELOCITY_STAGE, BSPLINE_STAGE, GENERIC_STAGE };
+
+  /** Evaluation stage, i.e. one element of the simplified transform. */
+  struct Stage
+  {
+    StageKind                                     Kind;
+    double                                        Matrix[ImageDimension][ImageDimension];
+    double                                        Offset[ImageDimension];
+    double                                        Determinant;
+    double                                        Step;
+    FieldLookupType                               Lookup;
+    typename FieldType::ConstPointer              Field;
+    typename LogJacobianInterpolatorType::Pointer LogJacobian;
+    TransformConstPointerType                     Transform;
+  };
+
+  /** Buffers used by a thread to evaluate the stages. */
+  struct Workspace
+  {
+    std::vector<double>          Indices;
+    std::vector<FieldVectorType> Vectors;
+  };
+
+  /** Number of points of a scanline transformed together. */
+  itkStaticConstMacro( PointsPerChunk, unsigned int, 64 );
+
+  /** Multiplies the determinants by the determinants of a stage at a set of
+   * points, then applies the stage to the points (in place). */
+  void ApplyStage( const Stage & stage, double * points, double * determinants,
+                   SizeValueType numberOfPoints, Workspace & workspace ) const;
+
+  /** Applies a field stage: the displacements and the finite differences of
+   * all the points are interpolated at once. */
+  void ApplyFieldStage( const Stage & stage, double * points, double * determinants,
+                        SizeValueType numberOfPoints, Workspace & workspace ) const;
+
+  /** Computes the determinant of a matrix (Gaussian elimination with
+   * partial pivoting, the matrix being modified). */
+  static double ComputeDeterminant( double matrix[ImageDimension][ImageDimension] );
+
+private:
+
+  TransformChainToJacobianDeterminantSource( const Self& ); //purposely not implemented
+  void operator=( const Self& ); //purposely not implemented
+
+  /** Member variables. */
+  RegionType              m_OutputRegion;      // region of the output image
+  SpacingType             m_OutputSpacing;     // output image spacing
+  OriginType              m_OutputOrigin;      // output image origin
+  DirectionType           m_OutputDirection;   // output image direction cosines
+  TransformConstPointerType m_Transform;       // Input transform to use
+  bool                    m_UseLogarithm;      // output the log of the determinant
+  unsigned int            m_StencilRadius;     // neighbors used along each axis
+  double                  m_MinimumDeterminant; // clamping before the logarithm
+  std::vector<Stage>      m_Stages;            // Stages in the order they are applied
+}; // end class TransformChainToJacobianDeterminantSource
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkTransformChainToJacobianDeterminantSource.txx"
+#endif
+
+#endif // end #ifndef __itkTransformChainToJacobianDeterminantSource_h
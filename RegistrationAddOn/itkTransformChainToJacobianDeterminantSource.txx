@@ -0,0 +1,657 @@
+#ifndef __itkTransformChainToJacobianDeterminantSource_txx
+#define __itkTransformChainToJacobianDeterminantSource_txx
+
+#include "itkTransformChainToJacobianDeterminantSource.h"
+
+#include "itkIdentityTransform.h"
+#include "itkProgressReporter.h"
+#include "itkImageScanlineIterator.h"
+#include "itkMatrixOffsetTransformBase.h"
+#include "itkStationaryVelocityFieldTransform.h"
+#include "rpiDisplacementFieldTransform.h"
+#include "rpiBSplineDisplacementFieldTransform.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+
+// Constructor
+template <class TOutputImage, class TTransformPrecisionType>
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::TransformChainToJacobianDeterminantSource()
+{
+  this->m_OutputSpacing.Fill(1.0);
+  this->m_OutputOrigin.Fill(0.0);
+  this->m_OutputDirection.SetIdentity();
+
+  SizeType size;
+  size.Fill( 0 );
+  this->m_OutputRegion.SetSize( size );
+
+  IndexType index;
+  index.Fill( 0 );
+  this->m_OutputRegion.SetIndex( index );
+
+  this->m_Transform
+    = IdentityTransform<TTransformPrecisionType, ImageDimension>::New();
+
+  this->m_UseLogarithm       = false;
+  this->m_StencilRadius      = 1;
+  this->m_MinimumDeterminant = 1e-6;
+
+  // The output is computed by the classic ThreadedGenerateData
+  this->DynamicMultiThreadingOff();
+}
+
+
+// Print out a description of self
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "OutputRegion: " << this->m_OutputRegion << std::endl;
+  os << indent << "OutputSpacing: " << this->m_OutputSpacing << std::endl;
+  os << indent << "OutputOrigin: " << this->m_OutputOrigin << std::endl;
+  os << indent << "OutputDirection: " << this->m_OutputDirection << std::endl;
+  os << indent << "Transform: " << this->m_Transform.GetPointer() << std::endl;
+  os << indent << "UseLogarithm: " << this->m_UseLogarithm << std::endl;
+  os << indent << "StencilRadius: " << this->m_StencilRadius << std::endl;
+  os << indent << "MinimumDeterminant: " << this->m_MinimumDeterminant << std::endl;
+}
+
+
+// Set the output image size.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::SetOutputSize( const SizeType & size )
+{
+  this->m_OutputRegion.SetSize( size );
+  this->Modified();
+}
+
+
+// Get the output image size.
+template <class TOutputImage, class TTransformPrecisionType>
+const typename TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::SizeType &
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::GetOutputSize()
+{
+  return this->m_OutputRegion.GetSize();
+}
+
+
+// Set the output image index.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::SetOutputIndex( const IndexType & index )
+{
+  this->m_OutputRegion.SetIndex( index );
+  this->Modified();
+}
+
+
+// Get the output image index.
+template <class TOutputImage, class TTransformPrecisionType>
+const typename TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::IndexType &
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::GetOutputIndex()
+{
+  return this->m_OutputRegion.GetIndex();
+}
+
+
+// Set the output image spacing.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::SetOutputSpacing( const double* spacing )
+{
+  SpacingType s( spacing );
+  this->SetOutputSpacing( s );
+}
+
+
+// Set the output image origin.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::SetOutputOrigin( const double* origin )
+{
+  OriginType p( origin );
+  this->SetOutputOrigin( p );
+}
+
+// Helper method to set the output parameters based on this image
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::SetOutputParametersFromImage ( const ImageBaseType * image )
+{
+  if( !image )
+    {
+    itkExceptionMacro(<< "Cannot use a null image reference");
+    }
+
+  this->SetOutputOrigin( image->GetOrigin() );
+  this->SetOutputSpacing( image->GetSpacing() );
+  this->SetOutputDirection( image->GetDirection() );
+  this->SetOutputRegion( image->GetLargestPossibleRegion() );
+}
+
+
+// Set up state of filter before multi-threading.
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::BeforeThreadedGenerateData( void )
+{
+  if( !this->m_Transform )
+    {
+    itkExceptionMacro(<< "Transform not set");
+    }
+
+  typedef IdentityTransform<TTransformPrecisionType, ImageDimension>                        IdTrsfType;
+  typedef MatrixOffsetTransformBase<TTransformPrecisionType, ImageDimension, ImageDimension> MatOffTrsfType;
+  typedef rpi::DisplacementFieldTransform<TTransformPrecisionType, ImageDimension>          DFTrsfType;
+  typedef StationaryVelocityFieldTransform<TTransformPrecisionType, ImageDimension>         SVFTrsfType;
+  typedef rpi::BSplineDisplacementFieldTransform<TTransformPrecisionType, ImageDimension>   BSplineTrsfType;
+  typedef typename SVFTrsfType::SVFExponentialType                                          ExponentialType;
+
+  // List the elements of the simplified transform in the order they are applied
+  std::vector<TransformConstPointerType> transforms;
+  const GeneralTransformType * chain = dynamic_cast<const GeneralTransformType*>( this->m_Transform.GetPointer() );
+  if( chain )
+    {
+    typename GeneralTransformType::Pointer simplified = chain->GetSimplifiedTransform();
+    for( unsigned int i = simplified->GetNumberOfTransformsInStack(); i > 0; --i )
+      {
+      transforms.push_back( simplified->GetTransform( i - 1 ) );
+      }
+    }
+  else
+    {
+    transforms.push_back( this->m_Transform );
+    }
+
+  // Step of the finite differences of the generic transforms
+  double step = this->m_OutputSpacing[0];
+  for( unsigned int i = 1; i < ImageDimension; ++i )
+    {
+    step = std::min( step, static_cast<double>( this->m_OutputSpacing[i] ) );
+    }
+
+  // Convert each element into an evaluation stage
+  this->m_Stages.clear();
+  for( unsigned int n = 0; n < transforms.size(); ++n )
+    {
+    const TransformType * transform = transforms[n].GetPointer();
+    if( dynamic_cast<const IdTrsfType*>( transform ) )
+      {
+      continue;
+      }
+
+    Stage stage;
+    stage.Determinant = 1.0;
+    stage.Step        = step;
+    const MatOffTrsfType *  mattrsf     = dynamic_cast<const MatOffTrsfType*>( transform );
+    const DFTrsfType *      dftrsf      = dynamic_cast<const DFTrsfType*>( transform );
+    const SVFTrsfType *     svftrsf     = dynamic_cast<const SVFTrsfType*>( transform );
+    const BSplineTrsfType * bsplinetrsf = dynamic_cast<const BSplineTrsfType*>( transform );
+    if( mattrsf )
+      {
+      stage.Kind = MATRIX_STAGE;
+      double matrix[ImageDimension][ImageDimension];
+      for( unsigned int i = 0; i < ImageDimension; ++i )
+        {
+        stage.Offset[i] = mattrsf->GetOffset()[i];
+        for( unsigned int j = 0; j < ImageDimension; ++j )
+          {
+          stage.Matrix[i][j] = mattrsf->GetMatrix()[i][j];
+          matrix[i][j]       = stage.Matrix[i][j];
+          }
+        }
+      stage.Determinant = ComputeDeterminant( matrix );
+      }
+    else if( dftrsf && dftrsf->GetFieldGeometry() )
+      {
+      // The lookup of the transform handles the encoded and bricked fields. The matrix maps
+      // the physical vectors to the index vectors of the field.
+      stage.Kind = FIELD_STAGE;
+      stage.Lookup = dftrsf->GetFieldLookup();
+      const ImageBaseType * geometry = dftrsf->GetFieldGeometry();
+      for( unsigned int k = 0; k < ImageDimension; ++k )
+        {
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          stage.Matrix[k][i] = geometry->GetDirection()[i][k] / geometry->GetSpacing()[k];
+          }
+        }
+      }
+    else if( svftrsf )
+      {
+      // The exponential and its log-Jacobian determinant are computed in the same pass
+      typename ExponentialType::Pointer exponential = ExponentialType::New();
+      exponential->SetInput( svftrsf->GetParametersAsVectorField() );
+      exponential->SetIterativeScheme( ExponentialType::SCALING_AND_SQUARING );
+      exponential->SetLogJacobianDeterminantComputation( true );
+      exponential->UpdateLargestPossibleRegion();
+
+      stage.Kind  = VELOCITY_STAGE;
+      stage.Field = exponential->GetOutput();
+      stage.Lookup.SetField( stage.Field );
+      stage.LogJacobian = LogJacobianInterpolatorType::New();
+      stage.LogJacobian->SetInputImage( exponential->GetLogJacobianDeterminant() );
+      }
+    else if( bsplinetrsf )
+      {
+      stage.Kind = BSPLINE_STAGE;
+      stage.Transform = transform;
+      }
+    else
+      {
+      stage.Kind = GENERIC_STAGE;
+      stage.Transform = transform;
+      }
+    this->m_Stages.push_back( stage );
+    }
+
+  itkDebugMacro(<< "Number of evaluation stages: " << this->m_Stages.size());
+}
+
+
+// Release the stages
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::AfterThreadedGenerateData( void )
+{
+  this->m_Stages.clear();
+}
+
+
+// Determinant of a small matrix
+template <class TOutputImage, class TTransformPrecisionType>
+double
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::ComputeDeterminant( double matrix[ImageDimension][ImageDimension] )
+{
+  double determinant = 1.0;
+  for( unsigned int k = 0; k < ImageDimension; ++k )
+    {
+    unsigned int pivot = k;
+    for( unsigned int i = k + 1; i < ImageDimension; ++i )
+      {
+      if( std::fabs( matrix[i][k] ) > std::fabs( matrix[pivot][k] ) )
+        {
+        pivot = i;
+        }
+      }
+    if( matrix[pivot][k] == 0.0 )
+      {
+      return 0.0;
+      }
+    if( pivot != k )
+      {
+      for( unsigned int j = k; j < ImageDimension; ++j )
+        {
+        std::swap( matrix[k][j], matrix[pivot][j] );
+        }
+      determinant = -determinant;
+      }
+    determinant *= matrix[k][k];
+    for( unsigned int i = k + 1; i < ImageDimension; ++i )
+      {
+      const double factor = matrix[i][k] / matrix[k][k];
+      for( unsigned int j = k + 1; j < ImageDimension; ++j )
+        {
+        matrix[i][j] -= factor * matrix[k][j];
+        }
+      }
+    }
+  return determinant;
+}
+
+
+// Apply a field stage to a set of points
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::ApplyFieldStage( const Stage & stage, double * points, double * determinants,
+                   SizeValueType numberOfPoints, Workspace & workspace ) const
+{
+  // Coefficients of the centered finite differences, for each stencil radius
+  static const double coefficients[3][3] = { { 1.0 / 2.0, 0.0,         0.0 },
+                                             { 2.0 / 3.0, -1.0 / 12.0, 0.0 },
+                                             { 3.0 / 4.0, -3.0 / 20.0, 1.0 / 60.0 } };
+  const unsigned int radius        = this->m_StencilRadius;
+  const double *     coefficient   = coefficients[radius - 1];
+  const bool         differentiate = ( stage.Kind == FIELD_STAGE );
+  const unsigned int indicesPerPoint = differentiate ? 1 + 2 * radius * ImageDimension : 1;
+
+  // Continuous indices of the points and, for the displacement fields, of their neighbors
+  double * indices = &workspace.Indices[0];
+  for( SizeValueType n = 0; n < numberOfPoints; ++n )
+    {
+    double * center = indices + n * indicesPerPoint * ImageDimension;
+    stage.Lookup.TransformPhysicalPointToContinuousIndex( points + n * ImageDimension, center );
+    if( differentiate )
+      {
+      double * neighbor = center + ImageDimension;
+      for( unsigned int k = 0; k < ImageDimension; ++k )
+        {
+        for( unsigned int m = 1; m <= radius; ++m )
+          {
+          for( unsigned int i = 0; i < ImageDimension; ++i )
+            {
+            neighbor[i]                  = center[i];
+            neighbor[ImageDimension + i] = center[i];
+            }
+          neighbor[k]                  += m;
+          neighbor[ImageDimension + k] -= m;
+          neighbor += 2 * ImageDimension;
+          }
+        }
+      }
+    }
+
+  // All the values are interpolated at once
+  FieldVectorType * vectors = &workspace.Vectors[0];
+  stage.Lookup.EvaluateAtContinuousIndices( indices, vectors, numberOfPoints * indicesPerPoint );
+
+  for( SizeValueType n = 0; n < numberOfPoints; ++n )
+    {
+    const FieldVectorType * values = vectors + n * indicesPerPoint;
+    if( differentiate )
+      {
+      // Derivatives of the displacement with respect to the index, then Jacobian of the warp
+      double gradient[ImageDimension][ImageDimension];
+      const FieldVectorType * neighbor = values + 1;
+      for( unsigned int k = 0; k < ImageDimension; ++k )
+        {
+        for( unsigned int j = 0; j < ImageDimension; ++j )
+          {
+          gradient[j][k] = 0.0;
+          }
+        for( unsigned int m = 0; m < radius; ++m )
+          {
+          for( unsigned int j = 0; j < ImageDimension; ++j )
+            {
+            gradient[j][k] += coefficient[m] * ( static_cast<double>( neighbor[0][j] ) - static_cast<double>( neighbor[1][j] ) );
+            }
+          neighbor += 2;
+          }
+        }
+      double jacobian[ImageDimension][ImageDimension];
+      for( unsigned int j = 0; j < ImageDimension; ++j )
+        {
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          jacobian[j][i] = ( i == j ) ? 1.0 : 0.0;
+          for( unsigned int k = 0; k < ImageDimension; ++k )
+            {
+            jacobian[j][i] += gradient[j][k] * stage.Matrix[k][i];
+            }
+          }
+        }
+      determinants[n] *= ComputeDeterminant( jacobian );
+      }
+    else
+      {
+      // Log-Jacobian of the exponential, extrapolated with the nearest border voxel
+      const typename LogJacobianImageType::RegionType & region = stage.LogJacobian->GetInputImage()->GetBufferedRegion();
+      ContinuousIndex<double, ImageDimension> index;
+      const double * center = indices + n * indicesPerPoint * ImageDimension;
+      for( unsigned int i = 0; i < ImageDimension; ++i )
+        {
+        const double lower = static_cast<double>( region.GetIndex( i ) );
+        const double upper = lower + static_cast<double>( region.GetSize( i ) ) - 1.0;
+        index[i] = std::min( std::max( center[i], lower ), upper );
+        }
+      determinants[n] *= std::exp( stage.LogJacobian->EvaluateAtContinuousIndex( index ) );
+      }
+
+    // Displacement of the point
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      points[n * ImageDimension + i] += values[0][i];
+      }
+    }
+}
+
+
+// Apply a stage to a set of points
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::ApplyStage( const Stage & stage, double * points, double * determinants,
+              SizeValueType numberOfPoints, Workspace & workspace ) const
+{
+  typedef rpi::BSplineDisplacementFieldTransform<TTransformPrecisionType, ImageDimension> BSplineTrsfType;
+  typedef typename TransformType::InputPointType                                         InputPointType;
+  typedef typename TransformType::OutputPointType                                        OutputPointType;
+
+  switch( stage.Kind )
+    {
+    case MATRIX_STAGE:
+      {
+      for( SizeValueType n = 0; n < numberOfPoints; ++n )
+        {
+        double * point = points + n * ImageDimension;
+        double   input[ImageDimension];
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          input[i] = point[i];
+          }
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          point[i] = stage.Offset[i];
+          for( unsigned int j = 0; j < ImageDimension; ++j )
+            {
+            point[i] += stage.Matrix[i][j] * input[j];
+            }
+          }
+        determinants[n] *= stage.Determinant;
+        }
+      break;
+      }
+    case FIELD_STAGE:
+    case VELOCITY_STAGE:
+      {
+      this->ApplyFieldStage( stage, points, determinants, numberOfPoints, workspace );
+      break;
+      }
+    case BSPLINE_STAGE:
+      {
+      const BSplineTrsfType * bspline = static_cast<const BSplineTrsfType *>( stage.Transform.GetPointer() );
+      for( SizeValueType n = 0; n < numberOfPoints; ++n )
+        {
+        double *       point = points + n * ImageDimension;
+        InputPointType input;
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          input[i] = point[i];
+          }
+        determinants[n] *= static_cast<double>( bspline->GetSpatialJacobianDeterminant( input ) );
+        const OutputPointType output = bspline->TransformPoint( input );
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          point[i] = output[i];
+          }
+        }
+      break;
+      }
+    default:
+      {
+      for( SizeValueType n = 0; n < numberOfPoints; ++n )
+        {
+        double *       point = points + n * ImageDimension;
+        InputPointType input;
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          input[i] = point[i];
+          }
+
+        // Centered finite differences along the physical axes
+        double jacobian[ImageDimension][ImageDimension];
+        for( unsigned int k = 0; k < ImageDimension; ++k )
+          {
+          InputPointType previous = input;
+          InputPointType next     = input;
+          previous[k] -= stage.Step;
+          next[k]     += stage.Step;
+          const OutputPointType previousOutput = stage.Transform->TransformPoint( previous );
+          const OutputPointType nextOutput     = stage.Transform->TransformPoint( next );
+          for( unsigned int j = 0; j < ImageDimension; ++j )
+            {
+            jacobian[j][k] = ( nextOutput[j] - previousOutput[j] ) / ( 2.0 * stage.Step );
+            }
+          }
+        determinants[n] *= ComputeDeterminant( jacobian );
+
+        const OutputPointType output = stage.Transform->TransformPoint( input );
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          point[i] = output[i];
+          }
+        }
+      }
+    }
+}
+
+
+// ThreadedGenerateData
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::ThreadedGenerateData(
+  const OutputImageRegionType & outputRegionForThread,
+  ThreadIdType threadId )
+{
+  // Get the output pointer
+  OutputImagePointer      outputPtr = this->GetOutput();
+
+  // Create an iterator that will walk the output region for this thread.
+  typedef ImageScanlineIterator<TOutputImage> OutputIteratorType;
+  OutputIteratorType outIt( outputPtr, outputRegionForThread );
+
+  // Support for progress methods/callbacks
+  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
+
+  // Buffers of the field stages: each point and its neighbors
+  const unsigned int indicesPerPoint = 1 + 2 * this->m_StencilRadius * ImageDimension;
+  Workspace workspace;
+  workspace.Indices.resize( PointsPerChunk * indicesPerPoint * ImageDimension );
+  workspace.Vectors.resize( PointsPerChunk * indicesPerPoint );
+
+  // Physical step between two consecutive voxels of a scanline
+  double pointStep[ImageDimension];
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    pointStep[i] = outputPtr->GetDirection()[i][0] * outputPtr->GetSpacing()[0];
+    }
+
+  // The points of a scanline are transformed by chunks, stage after stage, the determinants
+  // of the stages being multiplied along the way
+  const unsigned int  numberOfStages = this->m_Stages.size();
+  const SizeValueType lineLength     = outputRegionForThread.GetSize( 0 );
+  const SizeValueType chunkSize      = PointsPerChunk;
+  double              points[PointsPerChunk * ImageDimension];
+  double              determinants[PointsPerChunk];
+  PointType           physicalPoint;
+
+  while ( !outIt.IsAtEnd() )
+    {
+    // Determine the position of the first pixel in the scanline
+    outputPtr->TransformIndexToPhysicalPoint( outIt.GetIndex(), physicalPoint );
+
+    for( SizeValueType first = 0; first < lineLength; first += chunkSize )
+      {
+      const SizeValueType size = std::min( chunkSize, lineLength - first );
+      for( SizeValueType n = 0; n < size; ++n )
+        {
+        for( unsigned int i = 0; i < ImageDimension; ++i )
+          {
+          points[n * ImageDimension + i] = physicalPoint[i] + ( first + n ) * pointStep[i];
+          }
+        determinants[n] = 1.0;
+        }
+
+      for( unsigned int s = 0; s < numberOfStages; ++s )
+        {
+        this->ApplyStage( this->m_Stages[s], points, determinants, size, workspace );
+        }
+
+      for( SizeValueType n = 0; n < size; ++n )
+        {
+        double value = determinants[n];
+        if( this->m_UseLogarithm )
+          {
+          value = std::log( std::max( value, this->m_MinimumDeterminant ) );
+          }
+        outIt.Set( static_cast<PixelType>( value ) );
+        ++outIt;
+        progress.CompletedPixel();
+        }
+      }
+
+    outIt.NextLine();
+    }
+}
+
+
+// Inform pipeline of required output region
+template <class TOutputImage, class TTransformPrecisionType>
+void
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::GenerateOutputInformation( void )
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateOutputInformation();
+
+  // get pointer to the output
+  OutputImagePointer outputPtr = this->GetOutput();
+  if ( !outputPtr )
+    {
+    return;
+    }
+
+  outputPtr->SetLargestPossibleRegion( m_OutputRegion );
+
+  outputPtr->SetSpacing( m_OutputSpacing );
+  outputPtr->SetOrigin( m_OutputOrigin );
+  outputPtr->SetDirection( m_OutputDirection );
+}
+
+
+// Verify if any of the components has been modified.
+template <class TOutputImage, class TTransformPrecisionType>
+ModifiedTimeType
+TransformChainToJacobianDeterminantSource<TOutputImage,TTransformPrecisionType>
+::GetMTime( void ) const
+{
+  ModifiedTimeType latestTime = Object::GetMTime();
+
+  if( this->m_Transform )
+    {
+    if( latestTime < this->m_Transform->GetMTime() )
+      {
+      latestTime = this->m_Transform->GetMTime();
+      }
+    }
+
+  return latestTime;
+}
+
+
+} // end namespace itk
+
+#endif // end #ifndef _itkTransformChainToJacobianDeterminantSource_txx
@@ -0,0 +1,134 @@
+#ifndef _itkVelocityFieldBCHCompositionFilter_h_
+#define _itkVelocityFieldBCHCompositionFilter_h_
+
+#include "itkImageToImageFilter.h"
+
+namespace itk
+{
+
+/**
+  * @description VelocityFieldBCHCompositionFilter (itk)
+  * The filter computes an approximation of the velocity field Z such that Exp(Z) = Exp(V) o Exp(U),
+  * where V is the first input and U the second input, using the Baker-Campbell-Hausdorff formula:
+  *
+  *   Z = V + U + 1/2 [V,U] + 1/12 ( [V,[V,U]] + [U,[U,V]] ) - 1/24 [U,[V,[V,U]]] + ...
+  *
+  * The Lie bracket of two vector fields is [V,U] = Jac(V).U - Jac(U).V. The approximation order sets the
+  * number of terms of the series which are computed:
+  * - order 1: V + U (the velocity fields commute),
+  * - order 2: V + U + 1/2 [V,U],
+  * - order 3: up to the brackets of degree 2 (default),
+  * - order 4: up to the bracket of degree 3.
+  * The approximation is accurate when the velocity fields are small or nearly commute.
+  *
+  * Implementation:
+  * - the Jacobians are computed with centered finite differences along the axes of the grid
+  *   (one-sided differences on the borders) and expressed in physical coordinates,
+  * - each bracket is computed in a single multithreaded pass, without computing the Jacobian fields,
+  * - the brackets are accumulated into the output as soon as they are computed, so at most two
+  *   brackets are stored at the same time.
+  * No exponential is computed: the composition takes a few passes over the fields.
+  *
+  * Both inputs must share the same geometry (origin, spacing, direction and largest possible region).
+  *
+  * The filter is templated over the input and output vector fields
+  */
+
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT VelocityFieldBCHCompositionFilter : public ImageToImageFilter<TInputImage, TOutputImage>
+{
+
+public:
+
+    typedef  VelocityFieldBCHCompositionFilter                Self;
+    typedef  ImageToImageFilter<TInputImage, TOutputImage>    Superclass;
+    typedef  SmartPointer<Self>                               Pointer;
+    typedef  SmartPointer<const Self>                         ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+    itkTypeMacro (VelocityFieldBCHCompositionFilter, ImageToImageFilter);
+
+    typedef TInputImage                                     InputImageType;
+    typedef typename InputImageType::Pointer                InputImagePointer;
+    typedef typename InputImageType::ConstPointer           InputImageConstPointer;
+    typedef typename InputImageType::PixelType              InputPixelType;
+
+    typedef TOutputImage                                    OutputImageType;
+    typedef typename OutputImageType::Pointer               OutputImagePointer;
+    typedef typename OutputImageType::PixelType             OutputPixelType;
+    typedef typename OutputPixelType::ValueType             OutputPixelRealValueType;
+
+    /** Image dimension. */
+    itkStaticConstMacro(ImageDimension, unsigned int, TInputImage::ImageDimension);
+    itkStaticConstMacro(PixelDimension, unsigned int, InputPixelType::Dimension);
+
+    /** Set/Get the first velocity field V (applied last) **/
+    void SetFirstVelocityField(const InputImageType * field)
+    {
+        this->SetNthInput(0, const_cast<InputImageType *>(field));
+    }
+    const InputImageType * GetFirstVelocityField(void) const
+    {
+        return static_cast<const InputImageType *>(this->GetInput(0));
+    }
+
+    /** Set/Get the second velocity field U (applied first) **/
+    void SetSecondVelocityField(const InputImageType * field)
+    {
+        this->SetNthInput(1, const_cast<InputImageType *>(field));
+    }
+    const InputImageType * GetSecondVelocityField(void) const
+    {
+        return static_cast<const InputImageType *>(this->GetInput(1));
+    }
+
+    /** Set/Get the approximation order (1 to 4, default 3) **/
+    itkSetClampMacro(ApproximationOrder, unsigned int, 1, 4);
+    itkGetConstMacro(ApproximationOrder, unsigned int);
+
+protected:
+    VelocityFieldBCHCompositionFilter();
+    virtual ~VelocityFieldBCHCompositionFilter(){}
+
+    void PrintSelf(std::ostream& os,Indent indent) const ITK_OVERRIDE;
+    void GenerateInputRequestedRegion() ITK_OVERRIDE;
+    void EnlargeOutputRequestedRegion(DataObject * output) ITK_OVERRIDE;
+    void GenerateData() ITK_OVERRIDE;
+
+    typedef typename OutputImageType::RegionType        RegionType;
+
+    /** Allocates a field with the geometry of the output **/
+    OutputImagePointer AllocateField(void) const;
+
+    /** output = a + b **/
+    void AddFields(const InputImageType * a, const InputImageType * b, OutputImageType * output);
+
+    /** output += factor * field **/
+    void AccumulateField(const OutputImageType * field, double factor, OutputImageType * output);
+
+    /**
+     * Lie bracket output = [a,b] = Jac(a).b - Jac(b).a. The fields a and b can be of the input or of the
+     * output type.
+     */
+    template <class TFieldA, class TFieldB>
+    void ComputeLieBracket(const TFieldA * a, const TFieldB * b, OutputImageType * output);
+
+private:
+
+    VelocityFieldBCHCompositionFilter(const Self&);
+    void operator=(const Self&);
+
+    unsigned int m_ApproximationOrder;
+};
+
+
+} // end of namespace itk
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVelocityFieldBCHCompositionFilter.txx"
+#endif
+
+
+#endif
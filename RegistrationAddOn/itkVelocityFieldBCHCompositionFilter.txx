@@ -0,0 +1,293 @@
+#ifndef _itkVelocityFieldBCHCompositionFilter_txx_
+#define _itkVelocityFieldBCHCompositionFilter_txx_
+
+#include "itkVelocityFieldBCHCompositionFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkImageScanlineIterator.h"
+#include "itkMultiThreaderBase.h"
+
+
+namespace itk
+{
+/**
+ * Constructor
+ */
+template <class TInputImage, class TOutputImage>
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>::VelocityFieldBCHCompositionFilter()
+{
+    this->SetNumberOfRequiredInputs(2);
+    m_ApproximationOrder = 3;  /** Default: brackets of degree 2 **/
+}
+
+/**
+ * Print out a description of self
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+
+    os << indent << "ApproximationOrder: "
+       << m_ApproximationOrder << std::endl;
+
+    return;
+}
+
+
+/**
+ * The whole inputs are needed to compute the finite differences
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::GenerateInputRequestedRegion()
+{
+    Superclass::GenerateInputRequestedRegion();
+
+    for (unsigned int n=0; n<2; n++)
+    {
+        InputImagePointer inputPtr = const_cast<InputImageType *>(static_cast<const InputImageType *>(this->GetInput(n)));
+        if (inputPtr)
+            inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+
+/**
+ * The whole output is produced
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+    Superclass::EnlargeOutputRequestedRegion(output);
+    output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * Allocates a field with the geometry of the output
+ */
+template <class TInputImage, class TOutputImage>
+typename VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>::OutputImagePointer
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::AllocateField() const
+{
+    OutputImagePointer field = OutputImageType::New();
+    field->CopyInformation(this->GetOutput());
+    field->SetRegions(this->GetOutput()->GetLargestPossibleRegion());
+    field->Allocate();
+    return field;
+}
+
+
+/**
+ * output = a + b
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::AddFields(const InputImageType * a, const InputImageType * b, OutputImageType * output)
+{
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [a, b, output](const RegionType & region)
+        {
+            ImageRegionConstIterator<InputImageType> aIt(a, region);
+            ImageRegionConstIterator<InputImageType> bIt(b, region);
+            ImageRegionIterator<OutputImageType>     outIt(output, region);
+            for (; !outIt.IsAtEnd(); ++aIt, ++bIt, ++outIt)
+            {
+                const InputPixelType va = aIt.Get();
+                const InputPixelType vb = bIt.Get();
+                OutputPixelType value;
+                for (unsigned int k=0; k<PixelDimension; k++)
+                    value[k] = static_cast<OutputPixelRealValueType>(va[k] + vb[k]);
+                outIt.Set(value);
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
+/**
+ * output += factor * field
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::AccumulateField(const OutputImageType * field, double factor, OutputImageType * output)
+{
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        output->GetBufferedRegion(),
+        [field, factor, output](const RegionType & region)
+        {
+            ImageRegionConstIterator<OutputImageType> inIt(field, region);
+            ImageRegionIterator<OutputImageType>      outIt(output, region);
+            for (; !outIt.IsAtEnd(); ++inIt, ++outIt)
+            {
+                const OutputPixelType term  = inIt.Get();
+                OutputPixelType       value = outIt.Get();
+                for (unsigned int k=0; k<PixelDimension; k++)
+                    value[k] = static_cast<OutputPixelRealValueType>(value[k] + factor * term[k]);
+                outIt.Set(value);
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
+/**
+ * Lie bracket [a,b] = Jac(a).b - Jac(b).a. The directional derivative Jac(a).b is computed as the sum over
+ * the axes m of the grid of d(a)/d(index_m) * (b expressed in index units)_m, so the Jacobians are never
+ * stored. All the fields share the buffered region of the output.
+ */
+template <class TInputImage, class TOutputImage>
+template <class TFieldA, class TFieldB>
+void
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::ComputeLieBracket(const TFieldA * a, const TFieldB * b, OutputImageType * output)
+{
+    typedef typename TFieldA::PixelType  PixelAType;
+    typedef typename TFieldB::PixelType  PixelBType;
+
+    const RegionType bufferedRegion = output->GetBufferedRegion();
+
+    // Conversion of a physical vector into index units: toIndex[m][i] = direction[i][m] / spacing[m]
+    double toIndex[ImageDimension][ImageDimension];
+    for (unsigned int m=0; m<ImageDimension; m++)
+        for (unsigned int i=0; i<ImageDimension; i++)
+            toIndex[m][i] = output->GetDirection()[i][m] / output->GetSpacing()[m];
+
+    // Offsets between neighbors along each axis
+    OffsetValueType strides[ImageDimension];
+    strides[0] = 1;
+    for (unsigned int m=1; m<ImageDimension; m++)
+        strides[m] = strides[m-1] * static_cast<OffsetValueType>(bufferedRegion.GetSize(m-1));
+
+    const PixelAType * aBuffer = a->GetBufferPointer();
+    const PixelBType * bBuffer = b->GetBufferPointer();
+
+    this->GetMultiThreader()->template ParallelizeImageRegion<ImageDimension>(
+        bufferedRegion,
+        [&](const RegionType & region)
+        {
+            double aIndex[ImageDimension];
+            double bIndex[ImageDimension];
+            double value[ImageDimension];
+
+            ImageScanlineIterator<OutputImageType> outIt(output, region);
+            while (!outIt.IsAtEnd())
+            {
+                typename OutputImageType::IndexType index = outIt.GetIndex();
+                for (; !outIt.IsAtEndOfLine(); ++outIt, ++index[0])
+                {
+                    OffsetValueType offset = 0;
+                    for (unsigned int m=0; m<ImageDimension; m++)
+                        offset += (index[m] - bufferedRegion.GetIndex(m)) * strides[m];
+
+                    // Velocities at the voxel in index units
+                    const PixelAType & va = aBuffer[offset];
+                    const PixelBType & vb = bBuffer[offset];
+                    for (unsigned int m=0; m<ImageDimension; m++)
+                    {
+                        aIndex[m] = 0.0;
+                        bIndex[m] = 0.0;
+                        for (unsigned int i=0; i<ImageDimension; i++)
+                        {
+                            aIndex[m] += toIndex[m][i] * va[i];
+                            bIndex[m] += toIndex[m][i] * vb[i];
+                        }
+                    }
+
+                    // Centered differences, one-sided on the borders
+                    for (unsigned int k=0; k<ImageDimension; k++)
+                        value[k] = 0.0;
+                    for (unsigned int m=0; m<ImageDimension; m++)
+                    {
+                        const SizeValueType   size     = bufferedRegion.GetSize(m);
+                        const OffsetValueType position = index[m] - bufferedRegion.GetIndex(m);
+                        if (size < 2)
+                            continue;
+                        const OffsetValueType next  = (position + 1 < static_cast<OffsetValueType>(size)) ? strides[m] : 0;
+                        const OffsetValueType prev  = (position > 0) ? strides[m] : 0;
+                        const double          scale = (next != 0 && prev != 0) ? 0.5 : 1.0;
+
+                        const PixelAType & aNext = aBuffer[offset + next];
+                        const PixelAType & aPrev = aBuffer[offset - prev];
+                        const PixelBType & bNext = bBuffer[offset + next];
+                        const PixelBType & bPrev = bBuffer[offset - prev];
+                        for (unsigned int k=0; k<ImageDimension; k++)
+                            value[k] += scale * ( (static_cast<double>(aNext[k]) - aPrev[k]) * bIndex[m]
+                                                - (static_cast<double>(bNext[k]) - bPrev[k]) * aIndex[m] );
+                    }
+
+                    OutputPixelType bracket;
+                    for (unsigned int k=0; k<ImageDimension; k++)
+                        bracket[k] = static_cast<OutputPixelRealValueType>(value[k]);
+                    outIt.Set(bracket);
+                }
+                outIt.NextLine();
+            }
+        },
+        ITK_NULLPTR);
+}
+
+
+/**
+ * GenerateData
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage,TOutputImage>
+::GenerateData()
+{
+    itkDebugMacro(<<"Actually executing");
+
+    if (static_cast<unsigned int>(PixelDimension) != static_cast<unsigned int>(ImageDimension))
+        itkExceptionMacro(<< "The dimension of the vectors must be the dimension of the fields.");
+
+    InputImageConstPointer v = this->GetFirstVelocityField();
+    InputImageConstPointer u = this->GetSecondVelocityField();
+    if (v->GetLargestPossibleRegion() != u->GetLargestPossibleRegion())
+        itkExceptionMacro(<< "The velocity fields must share the same largest possible region.");
+
+    // The output shares the geometry of the first input (see GenerateOutputInformation)
+    OutputImagePointer output = this->GetOutput();
+    output->SetBufferedRegion(output->GetRequestedRegion());
+    output->Allocate();
+
+    // Order 1: V + U
+    this->AddFields(v, u, output);
+    if (m_ApproximationOrder < 2)
+        return;
+
+    // Order 2: 1/2 [V,U]
+    OutputImagePointer vu = this->AllocateField();
+    this->ComputeLieBracket(v.GetPointer(), u.GetPointer(), vu.GetPointer());
+    this->AccumulateField(vu, 0.5, output);
+    if (m_ApproximationOrder < 3)
+        return;
+
+    // Order 3: 1/12 [V,[V,U]] + 1/12 [U,[U,V]] = 1/12 [V,[V,U]] - 1/12 [U,[V,U]]
+    OutputImagePointer bracket = this->AllocateField();
+    this->ComputeLieBracket(u.GetPointer(), vu.GetPointer(), bracket.GetPointer());
+    this->AccumulateField(bracket, -1.0/12.0, output);
+    this->ComputeLieBracket(v.GetPointer(), vu.GetPointer(), bracket.GetPointer());
+    this->AccumulateField(bracket, 1.0/12.0, output);
+    if (m_ApproximationOrder < 4)
+        return;
+
+    // Order 4: -1/24 [U,[V,[V,U]]], computed into the buffer of [V,U] which is no longer needed
+    this->ComputeLieBracket(u.GetPointer(), bracket.GetPointer(), vu.GetPointer());
+    this->AccumulateField(vu, -1.0/24.0, output);
+}
+
+
+} // end of namespace itk
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef _rpiBSplineDisplacementFieldTransform_h_
+#define _rpiBSplineDisplacementFieldTransform_h_
+
+#include <itkTransform.h>
+#include <itkImage.h>
+#include <itkImageBase.h>
+
+#include <vnl/vnl_matrix.h>
+
+#include <vector>
+
+
+namespace rpi
+{
+
+
+/**
+ *
+ * This class defines a displacement field represented by a cubic B-spline control grid.
+ *
+ * There are two templates for this class:
+ *
+ *   TScalarType  Type of the transformation parameters. Can be "float" or "double".
+ *
+ *   NDimensions  Dimension of the transformation space.
+ *
+ * The displacement at a point is the sum of the control vectors (coefficients) of the 4^NDimensions
+ * neighboring control points, weighted by the cubic B-spline basis. The weights are separable: the
+ * sum is computed as 4-tap reductions along the first axis of the grid, weighted by the products of
+ * the weights along the other axes.
+ *
+ * The coefficients are stored into an itk::Image whose geometry is the one of the control grid
+ * (control point i is located at origin + direction * spacing * i). They can be set directly with
+ * SetCoefficients, or computed with FitVectorField as the least squares approximation of a dense
+ * displacement field for the control point spacing given by SetControlPointSpacing. The fit is
+ * separable as well: the control grid is aligned with the field, so that the least squares
+ * solution is obtained by applying the pseudo-inverse of the 1D B-spline collocation matrix along
+ * each axis. The maximum and RMS errors of the fit are then available.
+ *
+ * Within the fitted field, the grid is evaluated as it is. Outside of it, the continuous index is
+ * clamped to the grid, which gives a constant extrapolation similar to the nearest neighbor
+ * extrapolation of DisplacementFieldTransform.
+ *
+ * As DisplacementFieldTransform, this transform does not handle any parameters and cannot transform
+ * covariant vectors.
+ *
+ * @brief  B-spline displacement field transformation
+ *
+ * @class  BSplineDisplacementFieldTransform (rpi)
+ */
+template <class TScalarType=float, unsigned int NDimensions=3>
+class ITK_EXPORT BSplineDisplacementFieldTransform : public itk::Transform<TScalarType, NDimensions, NDimensions>
+{
+
+
+public:
+
+    typedef BSplineDisplacementFieldTransform                      Self;
+    typedef itk::Transform<TScalarType, NDimensions, NDimensions>  Superclass;
+    typedef itk::SmartPointer<Self>                                Pointer;
+    typedef itk::SmartPointer<const Self>                          ConstPointer;
+
+    /**
+     * Type of the scalar representing coordinate and vector elements
+     */
+    typedef TScalarType                                       ScalarType;
+
+    /**
+     * Type of the input parameters
+     */
+    typedef typename Superclass::ParametersType               ParametersType;
+    typedef typename Superclass::FixedParametersType          FixedParametersType;
+
+    /**
+     * Type of the Jacobian matrix
+     */
+    typedef typename Superclass::JacobianType                 JacobianType;
+
+    /**
+     * Standard vector types for this class
+     */
+    typedef typename Superclass::InputVectorType              InputVectorType;
+    typedef typename Superclass::OutputVectorType             OutputVectorType;
+    typedef typename Superclass::InputVnlVectorType           InputVnlVectorType;
+    typedef typename Superclass::OutputVnlVectorType          OutputVnlVectorType;
+    typedef typename Superclass::InputCovariantVectorType     InputCovariantVectorType;
+    typedef typename Superclass::OutputCovariantVectorType    OutputCovariantVectorType;
+
+    /**
+     * Standard coordinate point type for this class
+     */
+    typedef typename Superclass::InputPointType               InputPointType;
+    typedef typename Superclass::OutputPointType              OutputPointType;
+
+    /**
+     * Type of the dense fields and of the coefficients (control grid)
+     */
+    typedef itk::Vector<ScalarType, NDimensions>              VectorType;
+    typedef itk::Image<VectorType, NDimensions>               VectorFieldType;
+    typedef typename VectorFieldType::Pointer                 VectorFieldPointerType;
+    typedef typename VectorFieldType::ConstPointer            VectorFieldConstPointerType;
+    typedef VectorFieldType                                   CoefficientImageType;
+
+    /**
+     * Type relative to the geometry of the grid and of the fitted field
+     */
+    typedef typename VectorFieldType::PointType               OriginType;
+    typedef typename VectorFieldType::SpacingType             SpacingType;
+    typedef typename VectorFieldType::DirectionType           DirectionType;
+    typedef typename VectorFieldType::RegionType              RegionType;
+    typedef itk::ImageBase<NDimensions>                       FieldGeometryType;
+
+    /**
+     * Dimension of the domain space
+     */
+    itkStaticConstMacro(SpaceDimension, unsigned int, NDimensions);
+    itkStaticConstMacro(ParametersDimension, unsigned int, NDimensions);
+
+    /**
+     * Number of points processed by each thread task in TransformPoints
+     */
+    itkStaticConstMacro(PointsPerBlock, unsigned int, 4096);
+
+    /**
+     * Generic constructors.
+     */
+    itkNewMacro( Self );
+    itkTypeMacro( BSplineDisplacementFieldTransform, Transform );
+
+    /**
+     * This type of transform does not handle any parameters.
+     */
+    virtual const ParametersType&       GetParameters(void) const ITK_OVERRIDE
+    {
+        itkExceptionMacro("This type of transform does not handle any parameters.");
+    }
+    virtual void                        SetParameters( const ParametersType & ) ITK_OVERRIDE
+    {
+        itkExceptionMacro("This type of transform does not handle any parameters.");
+    }
+    virtual void                        SetFixedParameters( const FixedParametersType & ) ITK_OVERRIDE
+    {
+        itkExceptionMacro("This type of transform does not handle any parameters.");
+    }
+    virtual void                        SetParametersByValue( const ParametersType & ) ITK_OVERRIDE
+    {
+        itkExceptionMacro("This type of transform does not handle any parameters.");
+    }
+
+    /**
+     * Sets all the coefficients to zero (the control grid must have been set).
+     */
+    virtual void                        SetIdentity(void);
+
+    /**
+     * The transformation is not linear.
+     */
+    virtual bool                        IsLinear(void) const ITK_OVERRIDE
+    {
+        return false;
+    }
+
+    /**
+     * Sets/Gets the coefficients. The geometry of the image is the one of the control grid.
+     */
+    virtual void                        SetCoefficients(const CoefficientImageType * coefficients);
+    const CoefficientImageType *        GetCoefficients(void) const
+    {
+        return this->m_Coefficients.GetPointer();
+    }
+
+    /**
+     * Sets/Gets the spacing (physical units) of the control points used by FitVectorField.
+     */
+    itkSetMacro( ControlPointSpacing, SpacingType );
+    itkGetConstReferenceMacro( ControlPointSpacing, SpacingType );
+
+    /**
+     * Computes the coefficients approximating a dense displacement field (least squares), with the
+     * control point spacing given by SetControlPointSpacing. The control grid has the direction of
+     * the field and extends one control point beyond it on each side.
+     * @param field  dense displacement field
+     */
+    virtual void                        FitVectorField(const VectorFieldType * field);
+
+    /**
+     * Gets the maximum and RMS norms of the difference between the field given to FitVectorField
+     * and its approximation.
+     */
+    itkGetConstMacro( FitMaximumError, double );
+    itkGetConstMacro( FitRMSError, double );
+
+    /**
+     * Sets/Gets the geometry of the field approximated by the grid (null if unknown). It is set by
+     * FitVectorField, and used to generate a dense field with the original geometry.
+     */
+    void                                SetFieldGeometry(const FieldGeometryType * geometry);
+    const FieldGeometryType *           GetFieldGeometry(void) const
+    {
+        return this->m_FieldGeometry.GetPointer();
+    }
+
+    /**
+     * Transforms a point.
+     */
+    virtual OutputPointType             TransformPoint(const InputPointType  & point) const ITK_OVERRIDE;
+
+    /**
+     * Transforms a set of points. Large sets are split across threads. The input and output
+     * arrays can be the same.
+     */
+    virtual void                        TransformPoints(const InputPointType * input, OutputPointType * output, itk::SizeValueType numberOfPoints) const;
+
+    /**
+     * Transforms a vector.
+     */
+    virtual OutputVectorType            TransformVector(const InputVectorType & vector) const ITK_OVERRIDE;
+
+    /**
+     * Transforms a vnl_vector.
+     */
+    virtual OutputVnlVectorType         TransformVector(const InputVnlVectorType & vector) const ITK_OVERRIDE;
+
+    /**
+     * Transform a CovariantVector.
+     */
+    virtual OutputCovariantVectorType   TransformCovariantVector(const InputCovariantVectorType &) const ITK_OVERRIDE
+    {
+        itkExceptionMacro("Cannot transform covariant vector!");
+    }
+
+    /**
+     * Gets the jacobian of the transformation with respect to the coordinates at a specific point
+     * (computed from the derivatives of the B-spline basis).
+     */
+    virtual vnl_matrix_fixed<double,NDimensions,NDimensions>
+                                        GetSpatialJacobian(const InputPointType  & point) const;
+
+    /**
+     * Gets the jacobian determinant of transformation with respect to the coordinates at a specific point.
+     */
+    virtual ScalarType                  GetSpatialJacobianDeterminant(const InputPointType  & point) const;
+
+    // Purposedly not implemented
+    void ComputeJacobianWithRespectToParameters(const InputPointType  & itkNotUsed(p),
+                                                JacobianType & itkNotUsed(jacobian) ) const ITK_OVERRIDE
+    {}
+
+protected:
+
+    /**
+     * Prints contents.
+     */
+    void PrintSelf(std::ostream &os, itk::Indent indent) const ITK_OVERRIDE;
+
+    /**
+     * Default constructor.
+     */
+    BSplineDisplacementFieldTransform(void);
+
+    /**
+     * Destructor.
+     */
+    virtual ~BSplineDisplacementFieldTransform(){};
+
+    /**
+     * Computes the continuous index of a point in the control grid.
+     */
+    void                                TransformPhysicalPointToContinuousIndex(const double * point, double * index) const;
+
+    /**
+     * Evaluates the displacement at a continuous index of the control grid.
+     */
+    VectorType                          EvaluateAtContinuousIndex(const double * index) const;
+
+    /**
+     * Computes the first control point of the support of a continuous index along a dimension, and
+     * the 4 B-spline weights (and optionally their derivatives) of the support.
+     */
+    void                                ComputeWeights(const double * index, itk::OffsetValueType * first, double weights[][4],
+                                                       double derivatives[][4] = ITK_NULLPTR) const;
+
+    /**
+     * Computes the 4 cubic B-spline weights of a support for a position t in [0,1] relative to its
+     * second control point, and optionally their derivatives.
+     */
+    static void                         ComputeBasis(double t, double * weights, double * derivatives);
+
+    /**
+     * Computes the 1D collocation matrix of the B-spline basis: the value at row i is the weight of
+     * the control point j for the sample located at the continuous index origin + step * i.
+     */
+    static vnl_matrix<double>           ComputeCollocationMatrix(itk::SizeValueType numberOfSamples, itk::SizeValueType numberOfControlPoints,
+                                                                 double origin, double step);
+
+    /**
+     * Applies a matrix along a dimension of a buffer of vectors (NDimensions components each).
+     * The size of the buffer is updated.
+     */
+    template <class TInputValue>
+    static void                         ApplyAlongDimension(const TInputValue * input, itk::SizeValueType * size, unsigned int dimension,
+                                                            const vnl_matrix<double> & matrix, std::vector<double> & output);
+
+private:
+
+    /**
+     * Coefficients and their buffer description
+     */
+    VectorFieldConstPointerType         m_Coefficients;
+    const VectorType *                  m_Buffer;
+    itk::OffsetValueType                m_Size[NDimensions];
+    itk::OffsetValueType                m_Stride[NDimensions];
+    double                              m_Origin[NDimensions];
+    double                              m_PhysicalToIndex[NDimensions][NDimensions];
+
+    /**
+     * Fit parameters and errors
+     */
+    SpacingType                         m_ControlPointSpacing;
+    double                              m_FitMaximumError;
+    double                              m_FitRMSError;
+
+    /**
+     * Geometry of the fitted field
+     */
+    typename FieldGeometryType::ConstPointer  m_FieldGeometry;
+
+};
+
+
+} // end of namespace rpi
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "rpiBSplineDisplacementFieldTransform.txx"
+#endif
+
+#endif // _rpiBSplineDisplacementFieldTransform_h_
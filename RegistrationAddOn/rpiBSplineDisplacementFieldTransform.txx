@@ -0,0 +1,595 @@
+#ifndef _rpiBSplineDisplacementFieldTransform_cxx_
+#define _rpiBSplineDisplacementFieldTransform_cxx_
+
+#include "rpiBSplineDisplacementFieldTransform.h"
+
+#include <itkMultiThreaderBase.h>
+#include <vnl/vnl_det.h>
+#include <vnl/algo/vnl_svd.h>
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace rpi
+{
+
+
+
+template <class TScalarType, unsigned int NDimensions>
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+BSplineDisplacementFieldTransform() : Superclass( ParametersDimension ),
+    m_Buffer( ITK_NULLPTR ),
+    m_FitMaximumError( 0.0 ),
+    m_FitRMSError( 0.0 )
+{
+    this->m_ControlPointSpacing.Fill(10.0);
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        this->m_Size[i]   = 0;
+        this->m_Stride[i] = 0;
+        this->m_Origin[i] = 0.0;
+        for (unsigned int j=0; j<NDimensions; j++)
+            this->m_PhysicalToIndex[i][j] = 0.0;
+    }
+}
+
+
+
+template <class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+SetIdentity(void)
+{
+    if (!this->m_Coefficients)
+        itkExceptionMacro("No control grid has been set.");
+
+    VectorType             zero(static_cast<TScalarType>(0));
+    VectorFieldPointerType coefficients = VectorFieldType::New();
+    coefficients->CopyInformation(   this->m_Coefficients );
+    coefficients->SetBufferedRegion( this->m_Coefficients->GetBufferedRegion() );
+    coefficients->Allocate();
+    coefficients->FillBuffer(zero);
+    this->SetCoefficients(coefficients);
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+PrintSelf(std::ostream &os, itk::Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+    os << indent << "ControlPointSpacing: " << this->m_ControlPointSpacing << std::endl;
+    os << indent << "FitMaximumError: "     << this->m_FitMaximumError     << std::endl;
+    os << indent << "FitRMSError: "         << this->m_FitRMSError         << std::endl;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+SetCoefficients(const CoefficientImageType * coefficients)
+{
+    // Size of the buffer and strides
+    const RegionType & region = coefficients->GetBufferedRegion();
+    itk::OffsetValueType stride = 1;
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        if (region.GetSize(i) < 4)
+            itkExceptionMacro("The control grid must contain at least 4 control points along each dimension.");
+        this->m_Size[i]   = static_cast<itk::OffsetValueType>(region.GetSize(i));
+        this->m_Stride[i] = stride;
+        stride *= this->m_Size[i];
+    }
+
+    // The continuous index is relative to the first control point of the buffer
+    OriginType origin;
+    coefficients->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+    const DirectionType & matrix = coefficients->GetPhysicalPointToIndexMatrix();
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        this->m_Origin[i] = origin[i];
+        for (unsigned int j=0; j<NDimensions; j++)
+            this->m_PhysicalToIndex[i][j] = matrix[i][j];
+    }
+
+    this->m_Coefficients = coefficients;
+    this->m_Buffer       = coefficients->GetBufferPointer();
+    this->Modified();
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+SetFieldGeometry(const FieldGeometryType * geometry)
+{
+    if (!geometry)
+    {
+        this->m_FieldGeometry = ITK_NULLPTR;
+        return;
+    }
+
+    // Only the geometry is kept, not the field itself
+    typename FieldGeometryType::Pointer copy = FieldGeometryType::New();
+    copy->CopyInformation(   geometry );
+    copy->SetBufferedRegion( geometry->GetLargestPossibleRegion() );
+    copy->SetRequestedRegion( geometry->GetLargestPossibleRegion() );
+    this->m_FieldGeometry = copy;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+FitVectorField(const VectorFieldType * field)
+{
+    if (!field)
+        itkExceptionMacro("No field to fit.");
+
+    const RegionType    & region    = field->GetBufferedRegion();
+    const SpacingType   & spacing   = field->GetSpacing();
+    const DirectionType & direction = field->GetDirection();
+
+    // Size of the control grid, and distance between two voxels in control grid units. The voxel
+    // i is located at the continuous index 1 + step * i of the grid.
+    itk::SizeValueType numberOfSamples[NDimensions];
+    itk::SizeValueType numberOfControlPoints[NDimensions];
+    double             step[NDimensions];
+    for (unsigned int d=0; d<NDimensions; d++)
+    {
+        if (!(this->m_ControlPointSpacing[d] > 0.0))
+            itkExceptionMacro("The control point spacing must be strictly positive.");
+        numberOfSamples[d]       = region.GetSize(d);
+        step[d]                  = spacing[d] / this->m_ControlPointSpacing[d];
+        numberOfControlPoints[d] = static_cast<itk::SizeValueType>(std::floor((numberOfSamples[d] - 1) * step[d])) + 4;
+    }
+
+    // Least squares coefficients: pseudo-inverse of the collocation matrix applied along each
+    // dimension (small singular values are discarded for grids finer than the field)
+    itk::SizeValueType  size[NDimensions];
+    std::vector<double> buffer, next;
+    for (unsigned int d=0; d<NDimensions; d++)
+        size[d] = numberOfSamples[d];
+    for (unsigned int d=0; d<NDimensions; d++)
+    {
+        vnl_svd<double> svd(ComputeCollocationMatrix(numberOfSamples[d], numberOfControlPoints[d], 1.0, step[d]));
+        svd.zero_out_relative(1e-10);
+        const vnl_matrix<double> pseudoInverse = svd.pinverse();
+        if (d == 0)
+            ApplyAlongDimension(reinterpret_cast<const TScalarType *>(field->GetBufferPointer()), size, d, pseudoInverse, next);
+        else
+            ApplyAlongDimension(&buffer[0], size, d, pseudoInverse, next);
+        buffer.swap(next);
+    }
+
+    // Control grid: direction of the field, first control point one control spacing before the
+    // first voxel
+    OriginType first;
+    field->TransformIndexToPhysicalPoint(region.GetIndex(), first);
+    OriginType origin;
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        origin[i] = first[i];
+        for (unsigned int j=0; j<NDimensions; j++)
+            origin[i] -= direction[i][j] * this->m_ControlPointSpacing[j];
+    }
+
+    RegionType gridRegion;
+    for (unsigned int d=0; d<NDimensions; d++)
+        gridRegion.SetSize(d, numberOfControlPoints[d]);
+
+    VectorFieldPointerType coefficients = VectorFieldType::New();
+    coefficients->SetRegions(   gridRegion );
+    coefficients->SetOrigin(    origin );
+    coefficients->SetSpacing(   this->m_ControlPointSpacing );
+    coefficients->SetDirection( direction );
+    coefficients->Allocate();
+
+    VectorType * values = coefficients->GetBufferPointer();
+    const itk::SizeValueType numberOfCoefficients = gridRegion.GetNumberOfPixels();
+    for (itk::SizeValueType n=0; n<numberOfCoefficients; n++)
+        for (unsigned int k=0; k<NDimensions; k++)
+            values[n][k] = static_cast<TScalarType>(buffer[n*NDimensions + k]);
+
+    this->SetCoefficients(coefficients);
+    this->SetFieldGeometry(field);
+
+    // Fit errors, computed slice by slice along the last dimension
+    const itk::SizeValueType numberOfSlices = numberOfSamples[NDimensions-1];
+    const itk::SizeValueType sliceSize      = region.GetNumberOfPixels() / numberOfSlices;
+    std::vector<double> maxima(numberOfSlices, 0.0);
+    std::vector<double> sums(numberOfSlices, 0.0);
+    const VectorType * samples = field->GetBufferPointer();
+
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(0, numberOfSlices, [&](itk::SizeValueType slice)
+    {
+        double index[NDimensions];
+        index[NDimensions-1] = 1.0 + step[NDimensions-1] * slice;
+        for (itk::SizeValueType n=0; n<sliceSize; n++)
+        {
+            itk::SizeValueType rest = n;
+            for (unsigned int d=0; d+1<NDimensions; d++)
+            {
+                index[d] = 1.0 + step[d] * (rest % numberOfSamples[d]);
+                rest    /= numberOfSamples[d];
+            }
+
+            const VectorType   approximation = this->EvaluateAtContinuousIndex(index);
+            const VectorType & sample        = samples[slice * sliceSize + n];
+            double error = 0.0;
+            for (unsigned int k=0; k<NDimensions; k++)
+            {
+                const double difference = static_cast<double>(approximation[k]) - static_cast<double>(sample[k]);
+                error += difference * difference;
+            }
+            maxima[slice] = std::max(maxima[slice], error);
+            sums[slice]  += error;
+        }
+    }, ITK_NULLPTR);
+
+    double maximum = 0.0, sum = 0.0;
+    for (itk::SizeValueType slice=0; slice<numberOfSlices; slice++)
+    {
+        maximum = std::max(maximum, maxima[slice]);
+        sum    += sums[slice];
+    }
+    this->m_FitMaximumError = std::sqrt(maximum);
+    this->m_FitRMSError     = std::sqrt(sum / region.GetNumberOfPixels());
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+ComputeBasis(double t, double * weights, double * derivatives)
+{
+    const double s = 1.0 - t;
+    weights[0] = s * s * s / 6.0;
+    weights[1] = (3.0 * t * t * t - 6.0 * t * t + 4.0) / 6.0;
+    weights[2] = (-3.0 * t * t * t + 3.0 * t * t + 3.0 * t + 1.0) / 6.0;
+    weights[3] = t * t * t / 6.0;
+    if (derivatives)
+    {
+        derivatives[0] = -0.5 * s * s;
+        derivatives[1] = (3.0 * t * t - 4.0 * t) / 2.0;
+        derivatives[2] = (-3.0 * t * t + 2.0 * t + 1.0) / 2.0;
+        derivatives[3] = 0.5 * t * t;
+    }
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+vnl_matrix<double>
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+ComputeCollocationMatrix(itk::SizeValueType numberOfSamples, itk::SizeValueType numberOfControlPoints, double origin, double step)
+{
+    vnl_matrix<double> matrix(numberOfSamples, numberOfControlPoints, 0.0);
+    const double last = static_cast<double>(numberOfControlPoints - 3);
+    for (itk::SizeValueType i=0; i<numberOfSamples; i++)
+    {
+        const double index = std::max(1.0, origin + step * i);
+        const double base  = std::min(std::floor(index), last);
+        double weights[4];
+        ComputeBasis(std::min(index - base, 1.0), weights, ITK_NULLPTR);
+        for (unsigned int c=0; c<4; c++)
+            matrix(i, static_cast<unsigned int>(base) - 1 + c) = weights[c];
+    }
+    return matrix;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+template<class TInputValue>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+ApplyAlongDimension(const TInputValue * input, itk::SizeValueType * size, unsigned int dimension,
+                    const vnl_matrix<double> & matrix, std::vector<double> & output)
+{
+    // The buffer is seen as [outer][size[dimension]][inner] blocks of vectors
+    itk::SizeValueType inner = NDimensions, outer = 1;
+    for (unsigned int d=0; d<dimension; d++)
+        inner *= size[d];
+    for (unsigned int d=dimension+1; d<NDimensions; d++)
+        outer *= size[d];
+    const itk::SizeValueType rows    = matrix.rows();
+    const itk::SizeValueType columns = matrix.cols();
+
+    output.assign(outer * rows * inner, 0.0);
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(0, outer * rows, [&](itk::SizeValueType n)
+    {
+        const itk::SizeValueType o = n / rows;
+        const itk::SizeValueType r = n % rows;
+        double * out = &output[(o * rows + r) * inner];
+        for (itk::SizeValueType c=0; c<columns; c++)
+        {
+            const double coefficient = matrix(r, c);
+            if (coefficient == 0.0)
+                continue;
+            const TInputValue * in = input + (o * columns + c) * inner;
+            for (itk::SizeValueType x=0; x<inner; x++)
+                out[x] += coefficient * static_cast<double>(in[x]);
+        }
+    }, ITK_NULLPTR);
+
+    size[dimension] = rows;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+TransformPhysicalPointToContinuousIndex(const double * point, double * index) const
+{
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        index[i] = 0.0;
+        for (unsigned int j=0; j<NDimensions; j++)
+            index[i] += this->m_PhysicalToIndex[i][j] * (point[j] - this->m_Origin[j]);
+    }
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+ComputeWeights(const double * index, itk::OffsetValueType * first, double weights[][4], double derivatives[][4]) const
+{
+    // The index is clamped to [1, size-2] so that the support stays in the grid. The derivatives
+    // are null where the index is actually clamped, i.e. outside of [1, size-2].
+    for (unsigned int d=0; d<NDimensions; d++)
+    {
+        const double last    = static_cast<double>(this->m_Size[d] - 2);
+        const bool   clamped = index[d] < 1.0 || index[d] > last;
+        const double value   = std::max(1.0, std::min(last, index[d]));
+        const itk::OffsetValueType base = std::min(static_cast<itk::OffsetValueType>(value), this->m_Size[d] - 3);
+        first[d] = base - 1;
+        ComputeBasis(value - base, weights[d], derivatives ? derivatives[d] : ITK_NULLPTR);
+        if (derivatives && clamped)
+            for (unsigned int c=0; c<4; c++)
+                derivatives[d][c] = 0.0;
+    }
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+typename BSplineDisplacementFieldTransform<TScalarType, NDimensions>::VectorType
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+EvaluateAtContinuousIndex(const double * index) const
+{
+    itk::OffsetValueType first[NDimensions];
+    double               weights[NDimensions][4];
+    this->ComputeWeights(index, first, weights);
+
+    itk::OffsetValueType base = 0;
+    for (unsigned int d=0; d<NDimensions; d++)
+        base += first[d] * this->m_Stride[d];
+
+    // 4-tap reduction along the first dimension for each of the 4^(NDimensions-1) lines of the
+    // support, weighted by the product of the weights along the other dimensions
+    double sum[NDimensions];
+    for (unsigned int k=0; k<NDimensions; k++)
+        sum[k] = 0.0;
+
+    const unsigned int numberOfLines = 1u << (2 * (NDimensions - 1));
+    for (unsigned int line=0; line<numberOfLines; line++)
+    {
+        double               weight = 1.0;
+        itk::OffsetValueType offset = base;
+        unsigned int         rest   = line;
+        for (unsigned int d=1; d<NDimensions; d++)
+        {
+            const unsigned int c = rest & 3u;
+            rest   >>= 2;
+            weight  *= weights[d][c];
+            offset  += c * this->m_Stride[d];
+        }
+        if (weight == 0.0)
+            continue;
+
+        const VectorType * values = this->m_Buffer + offset;
+        for (unsigned int k=0; k<NDimensions; k++)
+            sum[k] += weight * ( weights[0][0] * values[0][k] + weights[0][1] * values[1][k] +
+                                 weights[0][2] * values[2][k] + weights[0][3] * values[3][k] );
+    }
+
+    VectorType output;
+    for (unsigned int k=0; k<NDimensions; k++)
+        output[k] = static_cast<TScalarType>(sum[k]);
+    return output;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+typename BSplineDisplacementFieldTransform<TScalarType, NDimensions>::OutputPointType
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+TransformPoint(const InputPointType & point) const
+{
+    if (!this->m_Coefficients)
+        itkExceptionMacro("No control grid has been set.");
+
+    double coordinates[NDimensions], index[NDimensions];
+    for (unsigned int i=0; i<NDimensions; i++)
+        coordinates[i] = point[i];
+    this->TransformPhysicalPointToContinuousIndex(coordinates, index);
+
+    const VectorType vector = this->EvaluateAtContinuousIndex(index);
+    OutputPointType  output = point;
+    for (unsigned int i=0; i<NDimensions; i++)
+        output[i] += vector[i];
+    return output;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+TransformPoints(const InputPointType * input, OutputPointType * output, itk::SizeValueType numberOfPoints) const
+{
+    if (!this->m_Coefficients)
+        itkExceptionMacro("No control grid has been set.");
+
+    auto transformRange = [this, input, output](itk::SizeValueType first, itk::SizeValueType last)
+    {
+        double coordinates[NDimensions], index[NDimensions];
+        for (itk::SizeValueType n=first; n<last; n++)
+        {
+            for (unsigned int i=0; i<NDimensions; i++)
+                coordinates[i] = input[n][i];
+            this->TransformPhysicalPointToContinuousIndex(coordinates, index);
+            const VectorType vector = this->EvaluateAtContinuousIndex(index);
+            for (unsigned int i=0; i<NDimensions; i++)
+                output[n][i] = coordinates[i] + vector[i];
+        }
+    };
+
+    // Small sets are not worth splitting across threads
+    const itk::SizeValueType blockSize      = PointsPerBlock;
+    const itk::SizeValueType numberOfBlocks = (numberOfPoints + blockSize - 1) / blockSize;
+    if (numberOfBlocks < 2)
+    {
+        transformRange(0, numberOfPoints);
+        return;
+    }
+
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(0, numberOfBlocks, [&](itk::SizeValueType block)
+    {
+        transformRange(block * blockSize, std::min(numberOfPoints, (block+1) * blockSize));
+    }, ITK_NULLPTR);
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+typename BSplineDisplacementFieldTransform<TScalarType, NDimensions>::OutputVectorType
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+TransformVector(const InputVectorType & vector) const
+{
+    // Convert vector into point
+    InputPointType point_0;
+    for (unsigned int i=0; i<NDimensions; i++)
+        point_0[i] = vector[i];
+
+    // Transform point
+    InputPointType point_1 = TransformPoint(point_0);
+
+    // Convert point into vector
+    OutputVectorType vector_1;
+    for (unsigned int i=0; i<NDimensions; i++)
+        vector_1[i] = point_1[i];
+    return vector_1;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+typename BSplineDisplacementFieldTransform<TScalarType, NDimensions>::OutputVnlVectorType
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+TransformVector(const InputVnlVectorType & vector) const
+{
+    // Convert vector into point
+    InputPointType point_0;
+    for (unsigned int i=0; i<NDimensions; i++)
+        point_0[i] = vector[i];
+
+    // Transform point
+    InputPointType point_1 = TransformPoint(point_0);
+    return point_1.GetVnlVector();
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+vnl_matrix_fixed<double,NDimensions,NDimensions>
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+GetSpatialJacobian( const InputPointType & point) const
+{
+    if (!this->m_Coefficients)
+        itkExceptionMacro("No control grid has been set, cannot compute Jacobian !");
+
+    double coordinates[NDimensions], index[NDimensions];
+    for (unsigned int i=0; i<NDimensions; i++)
+        coordinates[i] = point[i];
+    this->TransformPhysicalPointToContinuousIndex(coordinates, index);
+
+    itk::OffsetValueType first[NDimensions];
+    double               weights[NDimensions][4];
+    double               derivatives[NDimensions][4];
+    this->ComputeWeights(index, first, weights, derivatives);
+
+    itk::OffsetValueType base = 0;
+    for (unsigned int d=0; d<NDimensions; d++)
+        base += first[d] * this->m_Stride[d];
+
+    // Derivatives of the displacement with respect to the continuous index
+    double gradient[NDimensions][NDimensions];
+    for (unsigned int k=0; k<NDimensions; k++)
+        for (unsigned int d=0; d<NDimensions; d++)
+            gradient[k][d] = 0.0;
+
+    const unsigned int numberOfNeighbors = 1u << (2 * NDimensions);
+    for (unsigned int neighbor=0; neighbor<numberOfNeighbors; neighbor++)
+    {
+        unsigned int         c[NDimensions];
+        unsigned int         rest   = neighbor;
+        itk::OffsetValueType offset = base;
+        for (unsigned int d=0; d<NDimensions; d++)
+        {
+            c[d]    = rest & 3u;
+            rest  >>= 2;
+            offset += c[d] * this->m_Stride[d];
+        }
+
+        const VectorType & value = this->m_Buffer[offset];
+        for (unsigned int d=0; d<NDimensions; d++)
+        {
+            double weight = 1.0;
+            for (unsigned int e=0; e<NDimensions; e++)
+                weight *= (e == d) ? derivatives[e][c[e]] : weights[e][c[e]];
+            for (unsigned int k=0; k<NDimensions; k++)
+                gradient[k][d] += weight * value[k];
+        }
+    }
+
+    // Chain rule with the physical to index matrix, plus identity to consider the warp
+    vnl_matrix_fixed<double,NDimensions,NDimensions> J;
+    for (unsigned int k=0; k<NDimensions; k++)
+        for (unsigned int j=0; j<NDimensions; j++)
+        {
+            J[k][j] = (k == j) ? 1.0 : 0.0;
+            for (unsigned int d=0; d<NDimensions; d++)
+                J[k][j] += gradient[k][d] * this->m_PhysicalToIndex[d][j];
+        }
+    return J;
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+typename BSplineDisplacementFieldTransform<TScalarType, NDimensions>::ScalarType
+BSplineDisplacementFieldTransform<TScalarType, NDimensions>::
+GetSpatialJacobianDeterminant( const InputPointType & point) const
+{
+    return static_cast<ScalarType>(vnl_det(this->GetSpatialJacobian(point)));
+}
+
+
+} // namespace
+
+#endif // _rpiBSplineDisplacementFieldTransform_cxx_
@@ -0,0 +1,200 @@
+#ifndef _rpiBrickedVectorField_h_
+#define _rpiBrickedVectorField_h_
+
+#include <itkObject.h>
+#include <itkObjectFactory.h>
+#include <itkImage.h>
+#include <itkImageBase.h>
+
+#include <vector>
+
+
+namespace rpi
+{
+
+
+/**
+ *
+ * This class stores a vector field as bricks of 8^Dimension voxels instead of the row-major buffer
+ * of itk::Image. The voxels of a brick are contiguous (row-major order inside the brick), and the
+ * bricks are stored in Morton (Z-curve) order of their position in the field. A linear
+ * interpolation at a displaced position then touches one brick (sometimes two to four along the
+ * brick borders) instead of two to four distant lines of the field, and neighboring bricks are
+ * usually close in memory: the cache misses of the scattered accesses of the composition and
+ * inversion of fields are reduced once the displacements exceed a few voxels.
+ *
+ * The field is padded to a whole number of bricks along each dimension. The padding voxels are set
+ * to zero and are never read by the interpolation, which clamps the indices to the field.
+ *
+ * The bricked field is built from an itk::Image with SetField and converted back with GetField.
+ * The field is interpolated by rpi::VectorFieldLookup (see SetBrickedField).
+ *
+ * @brief  Vector field stored as bricks in Morton order
+ *
+ * @class  BrickedVectorField (rpi)
+ */
+template <class TVectorField>
+class ITK_EXPORT BrickedVectorField : public itk::Object
+{
+
+public:
+
+    typedef BrickedVectorField                          Self;
+    typedef itk::Object                                 Superclass;
+    typedef itk::SmartPointer<Self>                     Pointer;
+    typedef itk::SmartPointer<const Self>               ConstPointer;
+
+    /**
+     * Generic constructors.
+     */
+    itkNewMacro( Self );
+    itkTypeMacro( BrickedVectorField, Object );
+
+    /**
+     * Type of the field
+     */
+    typedef TVectorField                                FieldType;
+    typedef typename FieldType::Pointer                 FieldPointerType;
+    typedef typename FieldType::PixelType               PixelType;
+
+    /**
+     * Dimension of the field
+     */
+    static const unsigned int Dimension = FieldType::ImageDimension;
+
+    /**
+     * Type of the geometry of the field
+     */
+    typedef itk::ImageBase<Dimension>                   GeometryType;
+
+    /**
+     * Size of the bricks: 2^BrickEdgeBits voxels along each dimension
+     */
+    static const unsigned int BrickEdgeBits  = 3;
+    static const unsigned int BrickEdge      = 1u << BrickEdgeBits;
+    static const unsigned int VoxelsPerBrick = 1u << (BrickEdgeBits * Dimension);
+
+    /**
+     * Builds the bricks from a field (its buffered region).
+     * @param field  vector field
+     */
+    void                                SetField(const FieldType * field);
+
+    /**
+     * Converts the bricks back into a field.
+     * @return vector field having the geometry and the buffered region of the initial field
+     */
+    FieldPointerType                    GetField(void) const;
+
+    /**
+     * Gets the geometry of the field (origin, spacing, direction, regions).
+     */
+    const GeometryType *                GetGeometry(void) const
+    {
+        return this->m_Geometry.GetPointer();
+    }
+
+    /**
+     * Gets the buffer of the bricks.
+     */
+    const PixelType *                   GetBuffer(void) const
+    {
+        return this->m_Buffer.empty() ? ITK_NULLPTR : &this->m_Buffer[0];
+    }
+
+    /**
+     * Gets the number of bricks.
+     */
+    itk::SizeValueType                  GetNumberOfBricks(void) const
+    {
+        return static_cast<itk::SizeValueType>(this->m_BrickOffsets.size());
+    }
+
+    /**
+     * Gets the offset in the buffer of a voxel.
+     * @param  voxel  index of the voxel, relative to the first voxel of the buffered region
+     * @return offset of the voxel
+     */
+    itk::OffsetValueType                GetOffset(const itk::OffsetValueType * voxel) const
+    {
+        itk::OffsetValueType brick = 0;
+        itk::OffsetValueType inner = 0;
+        for (unsigned int i=Dimension; i>0; i--)
+        {
+            brick = brick * this->m_NumberOfBricks[i-1] + (voxel[i-1] >> BrickEdgeBits);
+            inner = (inner << BrickEdgeBits) | (voxel[i-1] & (BrickEdge - 1));
+        }
+        return this->m_BrickOffsets[brick] + inner;
+    }
+
+    /**
+     * Gets the offset between two consecutive voxels of a brick along a dimension.
+     * @param  dimension  dimension
+     * @return offset
+     */
+    static itk::OffsetValueType         GetInnerStride(unsigned int dimension)
+    {
+        return static_cast<itk::OffsetValueType>(1) << (BrickEdgeBits * dimension);
+    }
+
+protected:
+
+    /**
+     * Prints contents.
+     */
+    void PrintSelf(std::ostream &os, itk::Indent indent) const ITK_OVERRIDE;
+
+    /**
+     * Default constructor.
+     */
+    BrickedVectorField(void);
+
+    /**
+     * Destructor.
+     */
+    virtual ~BrickedVectorField(){};
+
+private:
+
+    BrickedVectorField(const Self&);  // purposely not implemented
+    void operator=(const Self&);      // purposely not implemented
+
+    /**
+     * Computes the Morton code of a brick (bits of the brick position interleaved).
+     * @param  brick  position of the brick
+     * @return Morton code
+     */
+    static unsigned long long           ComputeMortonCode(const itk::OffsetValueType * brick);
+
+    /**
+     * Geometry of the field
+     */
+    typename GeometryType::Pointer      m_Geometry;
+
+    /**
+     * Size of the field and number of bricks along each dimension
+     */
+    itk::OffsetValueType                m_Size[Dimension];
+    itk::OffsetValueType                m_NumberOfBricks[Dimension];
+
+    /**
+     * Offset in the buffer of each brick, indexed by the row-major position of the brick
+     */
+    std::vector<itk::OffsetValueType>   m_BrickOffsets;
+
+    /**
+     * Voxels of the bricks
+     */
+    std::vector<PixelType>              m_Buffer;
+
+};
+
+
+} // end of namespace rpi
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "rpiBrickedVectorField.txx"
+#endif
+
+#endif // _rpiBrickedVectorField_h_
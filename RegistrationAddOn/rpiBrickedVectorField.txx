@@ -0,0 +1,166 @@
+#ifndef _rpiBrickedVectorField_cxx_
+#define _rpiBrickedVectorField_cxx_
+
+#include "rpiBrickedVectorField.h"
+
+#include <itkMultiThreaderBase.h>
+
+#include <algorithm>
+#include <utility>
+
+
+namespace rpi
+{
+
+
+
+template <class TVectorField>
+BrickedVectorField<TVectorField>::
+BrickedVectorField(void)
+{
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        this->m_Size[i]           = 0;
+        this->m_NumberOfBricks[i] = 0;
+    }
+}
+
+
+
+template <class TVectorField>
+void
+BrickedVectorField<TVectorField>::
+PrintSelf(std::ostream &os, itk::Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+    os << indent << "NumberOfBricks: " << this->GetNumberOfBricks() << std::endl;
+}
+
+
+
+template <class TVectorField>
+unsigned long long
+BrickedVectorField<TVectorField>::
+ComputeMortonCode(const itk::OffsetValueType * brick)
+{
+    const unsigned int bitsPerDimension = 64 / Dimension;
+    unsigned long long code = 0;
+    for (unsigned int b=0; b<bitsPerDimension; b++)
+        for (unsigned int i=0; i<Dimension; i++)
+            code |= static_cast<unsigned long long>((brick[i] >> b) & 1) << (b * Dimension + i);
+    return code;
+}
+
+
+
+template <class TVectorField>
+void
+BrickedVectorField<TVectorField>::
+SetField(const FieldType * field)
+{
+    // Geometry of the field (without its buffer)
+    const typename FieldType::RegionType & region = field->GetBufferedRegion();
+    this->m_Geometry = GeometryType::New();
+    this->m_Geometry->CopyInformation(    field );
+    this->m_Geometry->SetBufferedRegion(  region );
+    this->m_Geometry->SetRequestedRegion( region );
+
+    // Number of bricks
+    itk::SizeValueType numberOfBricks = 1;
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        this->m_Size[i]           = static_cast<itk::OffsetValueType>(region.GetSize(i));
+        this->m_NumberOfBricks[i] = (this->m_Size[i] + BrickEdge - 1) >> BrickEdgeBits;
+        numberOfBricks           *= this->m_NumberOfBricks[i];
+    }
+
+    // Order of the bricks: Morton codes of their positions, sorted
+    std::vector< std::pair<unsigned long long, itk::SizeValueType> > codes(numberOfBricks);
+    for (itk::SizeValueType n=0; n<numberOfBricks; n++)
+    {
+        itk::OffsetValueType brick[Dimension];
+        itk::SizeValueType   rest = n;
+        for (unsigned int i=0; i<Dimension; i++)
+        {
+            brick[i] = static_cast<itk::OffsetValueType>(rest % this->m_NumberOfBricks[i]);
+            rest    /= this->m_NumberOfBricks[i];
+        }
+        codes[n] = std::make_pair(ComputeMortonCode(brick), n);
+    }
+    std::sort(codes.begin(), codes.end());
+
+    this->m_BrickOffsets.resize(numberOfBricks);
+    for (itk::SizeValueType rank=0; rank<numberOfBricks; rank++)
+        this->m_BrickOffsets[codes[rank].second] = static_cast<itk::OffsetValueType>(rank * VoxelsPerBrick);
+
+    // Copy of the voxels, slice by slice along the last dimension
+    PixelType zero;
+    zero.Fill(0);
+    this->m_Buffer.assign(numberOfBricks * VoxelsPerBrick, zero);
+
+    const PixelType *        input          = field->GetBufferPointer();
+    const itk::SizeValueType numberOfSlices = this->m_Size[Dimension-1];
+    const itk::SizeValueType sliceSize      = region.GetNumberOfPixels() / numberOfSlices;
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(0, numberOfSlices, [&](itk::SizeValueType slice)
+    {
+        itk::OffsetValueType voxel[Dimension];
+        voxel[Dimension-1] = static_cast<itk::OffsetValueType>(slice);
+        for (itk::SizeValueType n=0; n<sliceSize; n++)
+        {
+            itk::SizeValueType rest = n;
+            for (unsigned int i=0; i+1<Dimension; i++)
+            {
+                voxel[i] = static_cast<itk::OffsetValueType>(rest % this->m_Size[i]);
+                rest    /= this->m_Size[i];
+            }
+            this->m_Buffer[this->GetOffset(voxel)] = input[slice * sliceSize + n];
+        }
+    }, ITK_NULLPTR);
+
+    this->Modified();
+}
+
+
+
+template <class TVectorField>
+typename BrickedVectorField<TVectorField>::FieldPointerType
+BrickedVectorField<TVectorField>::
+GetField(void) const
+{
+    if (!this->m_Geometry)
+        itkExceptionMacro("No field has been set.");
+
+    FieldPointerType field = FieldType::New();
+    field->CopyInformation(    this->m_Geometry );
+    field->SetBufferedRegion(  this->m_Geometry->GetBufferedRegion() );
+    field->SetRequestedRegion( this->m_Geometry->GetBufferedRegion() );
+    field->Allocate();
+
+    PixelType *              output         = field->GetBufferPointer();
+    const itk::SizeValueType numberOfSlices = this->m_Size[Dimension-1];
+    const itk::SizeValueType sliceSize      = field->GetBufferedRegion().GetNumberOfPixels() / numberOfSlices;
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(0, numberOfSlices, [&](itk::SizeValueType slice)
+    {
+        itk::OffsetValueType voxel[Dimension];
+        voxel[Dimension-1] = static_cast<itk::OffsetValueType>(slice);
+        for (itk::SizeValueType n=0; n<sliceSize; n++)
+        {
+            itk::SizeValueType rest = n;
+            for (unsigned int i=0; i+1<Dimension; i++)
+            {
+                voxel[i] = static_cast<itk::OffsetValueType>(rest % this->m_Size[i]);
+                rest    /= this->m_Size[i];
+            }
+            output[slice * sliceSize + n] = this->m_Buffer[this->GetOffset(voxel)];
+        }
+    }, ITK_NULLPTR);
+
+    return field;
+}
+
+
+} // namespace
+
+#endif // _rpiBrickedVectorField_cxx_
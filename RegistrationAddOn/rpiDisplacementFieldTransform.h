@@ -23,7 +23,9 @@ PURPOSE.  See the above copyright notices for more information.
 #include <itkProcessObject.h>
 #include <itkConstNeighborhoodIterator.h>
 #include <itkImage.h>
-#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
+#include "rpiVectorFieldLookup.h"
+
+#include <mutex>
 
 
 namespace rpi
@@ -56,6 +58,19 @@ namespace rpi
  * determinant of the transformation with respect its parameters can not be computed as there is no
  * parametric handling.
  *
+ * The field can be stored with 16 bits per component (float16 or int16 codes with a scale and an
+ * offset per component, see rpiVectorFieldEncoding.h) instead of ScalarType values, which divides
+ * the memory used by 2 (float) or 4 (double). The storage is chosen with SetStorageEncoding before
+ * calling SetParametersAsVectorField, or an encoded field can be directly set with
+ * SetParametersAsEncodedVectorField. The codes are decoded on the fly by the interpolation.
+ * GetParametersAsVectorField then decodes the whole field on its first call, which gives back the
+ * memory saving; GetFieldGeometry should be used when only the geometry of the field is needed.
+ *
+ * With BrickedLayout on, the float fields given to SetParametersAsVectorField are stored as bricks
+ * in Morton order (see rpiBrickedVectorField.h), which reduces the cache misses of the scattered
+ * interpolations done when composing or inverting large deformations. As for the encoded fields,
+ * GetParametersAsVectorField then converts the bricks back into an image on its first call.
+ *
  * There is no I/O support as there is no parameters, the user might save the
  * vector field instead.
  *
@@ -145,11 +160,26 @@ public:
     typedef typename VectorFieldType::RegionType              RegionType;
 
     /**
-     * Interpolation type
+     * Interpolation type (linear interpolation, nearest neighbor extrapolation)
+     */
+    typedef rpi::VectorFieldLookup<VectorFieldType>           FieldLookupType;
+
+    /**
+     * Type of the field stored with 16 bits per component
+     */
+    typedef typename FieldLookupType::EncodedFieldType        EncodedVectorFieldType;
+    typedef typename EncodedVectorFieldType::ConstPointer     EncodedVectorFieldConstPointerType;
+
+    /**
+     * Type of the field stored as bricks
+     */
+    typedef typename FieldLookupType::BrickedFieldType        BrickedVectorFieldType;
+    typedef typename BrickedVectorFieldType::ConstPointer     BrickedVectorFieldConstPointerType;
+
+    /**
+     * Type of the geometry of the field
      */
-    typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<VectorFieldType, ScalarType>
-                                                              InterpolateFunctionType;
-    typedef typename InterpolateFunctionType::Pointer         InterpolateFunctionPointerType;
+    typedef itk::ImageBase<NDimensions>                       FieldGeometryType;
 
     /**
      * Dimension of the domain space
@@ -157,6 +187,11 @@ public:
     itkStaticConstMacro(SpaceDimension, unsigned int, NDimensions);
     itkStaticConstMacro(ParametersDimension, unsigned int, NDimensions);
 
+    /**
+     * Number of points processed by each thread task in TransformPoints
+     */
+    itkStaticConstMacro(PointsPerBlock, unsigned int, 4096);
+
     /**
      * Generic constructors.
      */
@@ -210,11 +245,103 @@ public:
      */
     virtual void                        SetParametersAsVectorField(const VectorFieldType * field);
 
+    /**
+     * Sets/Gets the encoding used to store the fields given to SetParametersAsVectorField
+     * (FIELD_ENCODING_FLOAT by default, i.e. the field is kept as it is).
+     */
+    itkSetMacro( StorageEncoding, FieldEncoding );
+    itkGetConstMacro( StorageEncoding, FieldEncoding );
+
+    /**
+     * Sets the parameters as a vector field stored with 16 bits per component. The displacement
+     * is offset + scale * decoded code for each component.
+     * @param field     encoded vector field
+     * @param encoding  encoding of the field (FIELD_ENCODING_FLOAT16 or FIELD_ENCODING_INT16)
+     * @param scale     scale of each component
+     * @param offset    offset of each component
+     */
+    virtual void                        SetParametersAsEncodedVectorField(const EncodedVectorFieldType * field, FieldEncoding encoding,
+                                                                          const double * scale, const double * offset);
+
+    /**
+     * Gets the encoded vector field (null if the field is not encoded), and its decoding parameters.
+     */
+    const EncodedVectorFieldType *      GetEncodedVectorField(void) const
+    {
+        return this->m_EncodedVectorField.GetPointer();
+    }
+    FieldEncoding                       GetEncoding(void) const
+    {
+        return this->m_FieldLookup.GetEncoding();
+    }
+    const double *                      GetEncodingScale(void) const
+    {
+        return this->m_EncodingScale;
+    }
+    const double *                      GetEncodingOffset(void) const
+    {
+        return this->m_EncodingOffset;
+    }
+
+    /**
+     * Sets/Gets whether the float fields given to SetParametersAsVectorField are stored as bricks
+     * (off by default).
+     */
+    itkSetMacro( BrickedLayout, bool );
+    itkGetConstMacro( BrickedLayout, bool );
+    itkBooleanMacro( BrickedLayout );
+
+    /**
+     * Gets the field stored as bricks (null if the field is not bricked).
+     */
+    const BrickedVectorFieldType *      GetBrickedVectorField(void) const
+    {
+        return this->m_BrickedVectorField.GetPointer();
+    }
+
+    /**
+     * Gets the geometry of the field, without decoding an encoded field.
+     */
+    const FieldGeometryType *           GetFieldGeometry(void) const;
+
+    /**
+     * Gets the interpolation of the field, which handles both the plain and the encoded fields.
+     */
+    const FieldLookupType &             GetFieldLookup(void) const
+    {
+        return this->m_FieldLookup;
+    }
+
+    /**
+     * Sets/Gets the maximum number of fixed point iterations used by GetInverse (20 by default).
+     */
+    itkSetMacro( InverseNumberOfIterations, unsigned int );
+    itkGetConstMacro( InverseNumberOfIterations, unsigned int );
+
+    /**
+     * Sets/Gets the per-voxel residual (physical units) below which the fixed point iteration of
+     * a voxel stops in GetInverse (0.001 by default).
+     */
+    itkSetMacro( InverseTolerance, double );
+    itkGetConstMacro( InverseTolerance, double );
+
+    /**
+     * Gets the maximum and RMS residuals achieved by the last call to GetInverse.
+     */
+    itkGetConstMacro( InverseMaximumResidual, double );
+    itkGetConstMacro( InverseRMSResidual, double );
+
     /**
      * Gets an inverse of this transformation.
      */
     virtual bool                        GetInverse(Self* inverse) const;
 
+    /**
+     * Gets an inverse of this transformation, only solved over a region of the field. The inverse
+     * field has the geometry of this region: it is only valid for the points mapped into it.
+     */
+    virtual bool                        GetInverse(Self* inverse, const RegionType & region) const;
+
     /**
      * Gets an inverse of this transformation.
      */
@@ -225,6 +352,12 @@ public:
      */
     virtual OutputPointType             TransformPoint(const InputPointType  & point) const ITK_OVERRIDE;
 
+    /**
+     * Transforms a set of points. Large sets are split across threads. The input and output
+     * arrays can be the same.
+     */
+    virtual void                        TransformPoints(const InputPointType * input, OutputPointType * output, itk::SizeValueType numberOfPoints) const;
+
     /**
      * Transforms a vector.
      */
@@ -316,15 +449,48 @@ private:
     VectorFieldConstPointerType     m_VectorField;
 
     /**
-     * Interpolation function
+     * Parameters stored with 16 bits per component, and their decoding parameters
+     */
+    EncodedVectorFieldConstPointerType  m_EncodedVectorField;
+    FieldEncoding                   m_StorageEncoding;
+    double                          m_EncodingScale[NDimensions];
+    double                          m_EncodingOffset[NDimensions];
+
+    /**
+     * Parameters stored as bricks
+     */
+    BrickedVectorFieldConstPointerType  m_BrickedVectorField;
+    bool                            m_BrickedLayout;
+
+    /**
+     * Encoded or bricked field converted by GetParametersAsVectorField, and mutex protecting its
+     * computation
      */
-    InterpolateFunctionPointerType  m_InterpolateFunction;
+    mutable VectorFieldConstPointerType m_DecodedVectorField;
+    mutable std::mutex              m_DecodedVectorFieldMutex;
+
+    /**
+     * Interpolation of the field
+     */
+    FieldLookupType                 m_FieldLookup;
 
     /**
      * Weights used to scale partial derivatives during Jacobian computation
      */
     double                          m_DerivativeWeights[NDimensions];
 
+    /**
+     * Parameters of the fixed point inversion
+     */
+    unsigned int                    m_InverseNumberOfIterations;
+    double                          m_InverseTolerance;
+
+    /**
+     * Residuals achieved by the last inversion
+     */
+    mutable double                  m_InverseMaximumResidual;
+    mutable double                  m_InverseRMSResidual;
+
 };
 
 
@@ -8,6 +8,9 @@
 
 #include <itkInverseDisplacementFieldImageFilter.h>
 #include "itkFixedPointInverseDisplacementFieldImageFilter.h"
+#include <itkMultiThreaderBase.h>
+
+#include <algorithm>
 
 
 namespace rpi
@@ -17,9 +20,19 @@ namespace rpi
 
 template <class TScalarType, unsigned int NDimensions>
 DisplacementFieldTransform<TScalarType, NDimensions>::
-DisplacementFieldTransform() : Superclass( ParametersDimension )
+DisplacementFieldTransform() : Superclass( ParametersDimension ),
+    m_StorageEncoding( FIELD_ENCODING_FLOAT ),
+    m_BrickedLayout( false ),
+    m_InverseNumberOfIterations( 20 ),
+    m_InverseTolerance( 0.001 ),
+    m_InverseMaximumResidual( 0.0 ),
+    m_InverseRMSResidual( 0.0 )
 {
-    this->m_InterpolateFunction = InterpolateFunctionType::New();
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        this->m_EncodingScale[i]  = 1.0;
+        this->m_EncodingOffset[i] = 0.0;
+    }
 }
 
 
@@ -34,7 +47,11 @@ SetIdentity(void)
     field->Allocate();
     field->FillBuffer(value);
     field->Register();
-    this->m_VectorField = field;
+    this->m_VectorField        = field;
+    this->m_EncodedVectorField = ITK_NULLPTR;
+    this->m_BrickedVectorField = ITK_NULLPTR;
+    this->m_DecodedVectorField = ITK_NULLPTR;
+    this->m_FieldLookup.SetField(this->m_VectorField);
 }
 
 
@@ -54,6 +71,33 @@ const typename DisplacementFieldTransform<TScalarType, NDimensions>::VectorField
 DisplacementFieldTransform<TScalarType, NDimensions>::
 GetParametersAsVectorField(void) const
 {
+    if (this->m_VectorField || (!this->m_EncodedVectorField && !this->m_BrickedVectorField))
+        return this->m_VectorField.GetPointer();
+
+    // The encoded or bricked field is converted once
+    std::lock_guard<std::mutex> lock(this->m_DecodedVectorFieldMutex);
+    if (!this->m_DecodedVectorField)
+    {
+        if (this->m_EncodedVectorField)
+            this->m_DecodedVectorField = decodeVectorField<VectorFieldType>(
+                        this->m_EncodedVectorField, this->m_FieldLookup.GetEncoding(), this->m_EncodingScale, this->m_EncodingOffset);
+        else
+            this->m_DecodedVectorField = this->m_BrickedVectorField->GetField();
+    }
+    return this->m_DecodedVectorField.GetPointer();
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+const typename DisplacementFieldTransform<TScalarType, NDimensions>::FieldGeometryType *
+DisplacementFieldTransform<TScalarType, NDimensions>::
+GetFieldGeometry(void) const
+{
+    if (this->m_EncodedVectorField)
+        return this->m_EncodedVectorField.GetPointer();
+    if (this->m_BrickedVectorField)
+        return this->m_BrickedVectorField->GetGeometry();
     return this->m_VectorField.GetPointer();
 }
 
@@ -64,9 +108,61 @@ void
 DisplacementFieldTransform<TScalarType, NDimensions>::
 SetParametersAsVectorField(const VectorFieldType * field)
 {
-    // Set displacement field and affect it to the interpolate object
-    this->m_VectorField = field;
-    this->m_InterpolateFunction->SetInputImage(this->m_VectorField);
+    // Encode the field if a compact storage is requested
+    if (this->m_StorageEncoding != FIELD_ENCODING_FLOAT)
+    {
+        double scale[NDimensions];
+        double offset[NDimensions];
+        typename EncodedVectorFieldType::Pointer encoded = encodeVectorField<VectorFieldType>(field, this->m_StorageEncoding, scale, offset);
+        this->SetParametersAsEncodedVectorField(encoded, this->m_StorageEncoding, scale, offset);
+        return;
+    }
+
+    // Set displacement field and affect it to the interpolate object, as bricks if requested
+    this->m_EncodedVectorField = ITK_NULLPTR;
+    this->m_DecodedVectorField = ITK_NULLPTR;
+    if (this->m_BrickedLayout)
+    {
+        typename BrickedVectorFieldType::Pointer bricks = BrickedVectorFieldType::New();
+        bricks->SetField(field);
+        this->m_VectorField        = ITK_NULLPTR;
+        this->m_BrickedVectorField = bricks;
+        this->m_FieldLookup.SetBrickedField(bricks);
+    }
+    else
+    {
+        this->m_VectorField        = field;
+        this->m_BrickedVectorField = ITK_NULLPTR;
+        this->m_FieldLookup.SetField(this->m_VectorField);
+    }
+
+    // Compute the derivative weights
+    itk::Vector<double, NDimensions> spacing = GetSpacing();
+    for (unsigned int i=0; i<NDimensions; i++)
+        m_DerivativeWeights[i] = (double)(1.0/spacing[i]);
+
+    this->Modified();
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+void
+DisplacementFieldTransform<TScalarType, NDimensions>::
+SetParametersAsEncodedVectorField(const EncodedVectorFieldType * field, FieldEncoding encoding,
+                                  const double * scale, const double * offset)
+{
+    // Set the encoded field and affect it to the interpolate object
+    this->m_VectorField        = ITK_NULLPTR;
+    this->m_EncodedVectorField = field;
+    this->m_BrickedVectorField = ITK_NULLPTR;
+    this->m_DecodedVectorField = ITK_NULLPTR;
+    for (unsigned int i=0; i<NDimensions; i++)
+    {
+        this->m_EncodingScale[i]  = scale[i];
+        this->m_EncodingOffset[i] = offset[i];
+    }
+    this->m_FieldLookup.SetEncodedField(field, encoding, scale, offset);
 
     // Compute the derivative weights
     itk::Vector<double, NDimensions> spacing = GetSpacing();
@@ -82,27 +178,50 @@ template<class TScalarType, unsigned int NDimensions>
 bool
 DisplacementFieldTransform<TScalarType, NDimensions>::
 GetInverse( Self* inverse ) const
+{
+    if (!this->GetFieldGeometry())
+        itkExceptionMacro("No field has been set.");
+
+    return this->GetInverse( inverse, this->GetFieldGeometry()->GetLargestPossibleRegion() );
+}
+
+
+
+template<class TScalarType, unsigned int NDimensions>
+bool
+DisplacementFieldTransform<TScalarType, NDimensions>::
+GetInverse( Self* inverse, const RegionType & region ) const
 {
     // Initial field
-    VectorFieldConstPointerType initial_field = this->m_VectorField;//GetParametersAsVectorField();
+    VectorFieldConstPointerType initial_field = this->GetParametersAsVectorField();
+
+    // Origin of the region
+    OriginType origin;
+    initial_field->TransformIndexToPhysicalPoint( region.GetIndex(), origin );
 
     // Initialize the field inverter
     typedef itk::FixedPointInverseDisplacementFieldImageFilter<VectorFieldType, VectorFieldType> FPInverseType;
     typename FPInverseType::Pointer filter = FPInverseType::New();
     filter->SetInput(         initial_field );
-    filter->SetOutputOrigin(  initial_field->GetOrigin() );
-    filter->SetSize(          initial_field->GetLargestPossibleRegion().GetSize() );
+    filter->SetOutputOrigin(  origin );
+    filter->SetSize(          region.GetSize() );
     filter->SetOutputSpacing( initial_field->GetSpacing() );
-    filter->SetNumberOfIterations( 20 );
+    filter->SetNumberOfIterations( this->m_InverseNumberOfIterations );
+    filter->SetTolerance(          this->m_InverseTolerance );
+    filter->SetUseBrickedLayout(   this->m_BrickedLayout );
 
     // Update the filter
     filter->UpdateLargestPossibleRegion();
+    this->m_InverseMaximumResidual = filter->GetMaximumResidual();
+    this->m_InverseRMSResidual     = filter->GetRMSResidual();
 
     // Get the inverted field and set the orientation that has been lost
     VectorFieldPointerType inverted_field = filter->GetOutput();
     inverted_field->SetDirection( initial_field->GetDirection() );
 
-    // Set the displacement field to the current objet
+    // Set the displacement field to the current objet, with the same storage as this one
+    inverse->SetStorageEncoding( this->GetEncoding() );
+    inverse->SetBrickedLayout( this->m_BrickedLayout );
     inverse->SetParametersAsVectorField( inverted_field );
 
     return true;
@@ -127,11 +246,11 @@ DisplacementFieldTransform<TScalarType, NDimensions>::
 TransformPoint(const InputPointType & point) const
 {
 
-    if (this->m_VectorField.IsNull())
+    if (!this->GetFieldGeometry())
         itkExceptionMacro("No field has been set.");
 
     OutputPointType output = point;
-    typename InterpolateFunctionType::OutputType vector = m_InterpolateFunction->Evaluate(output);
+    VectorType vector = this->m_FieldLookup.EvaluateAtPoint(point);
     for (unsigned int i=0; i<NDimensions; i++)
         output[i] += vector[i];
 
@@ -140,6 +259,53 @@ TransformPoint(const InputPointType & point) const
 
 
 
+template<class TScalarType, unsigned int NDimensions>
+void
+DisplacementFieldTransform<TScalarType, NDimensions>::
+TransformPoints(const InputPointType * input, OutputPointType * output, itk::SizeValueType numberOfPoints) const
+{
+    if (!this->GetFieldGeometry())
+        itkExceptionMacro("No field has been set.");
+
+    // Displaces the points of the range [first, last). The points are interpolated by
+    // chunks so that the lookup can process several of them at once.
+    const FieldLookupType * lookup = &this->m_FieldLookup;
+    auto transformRange = [lookup, input, output](itk::SizeValueType first, itk::SizeValueType last)
+    {
+        const itk::SizeValueType chunkSize = 64;
+        double     points[chunkSize * NDimensions];
+        VectorType vectors[chunkSize];
+        for (itk::SizeValueType start=first; start<last; start+=chunkSize)
+        {
+            const itk::SizeValueType size = std::min(chunkSize, last - start);
+            for (itk::SizeValueType n=0; n<size; n++)
+                for (unsigned int i=0; i<NDimensions; i++)
+                    points[n*NDimensions + i] = input[start+n][i];
+            lookup->EvaluateAtPoints(points, vectors, size);
+            for (itk::SizeValueType n=0; n<size; n++)
+                for (unsigned int i=0; i<NDimensions; i++)
+                    output[start+n][i] = points[n*NDimensions + i] + vectors[n][i];
+        }
+    };
+
+    // Small sets are not worth splitting across threads
+    const itk::SizeValueType blockSize      = PointsPerBlock;
+    const itk::SizeValueType numberOfBlocks = (numberOfPoints + blockSize - 1) / blockSize;
+    if (numberOfBlocks < 2)
+    {
+        transformRange(0, numberOfPoints);
+        return;
+    }
+
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->ParallelizeArray(0, numberOfBlocks, [&](itk::SizeValueType block)
+    {
+        transformRange(block * blockSize, std::min(numberOfPoints, (block+1) * blockSize));
+    }, ITK_NULLPTR);
+}
+
+
+
 template<class TScalarType, unsigned int NDimensions>
 typename DisplacementFieldTransform<TScalarType, NDimensions>::OutputVectorType
 DisplacementFieldTransform<TScalarType, NDimensions>::
@@ -184,9 +350,9 @@ typename DisplacementFieldTransform<TScalarType, NDimensions>::OriginType
 DisplacementFieldTransform<TScalarType, NDimensions>::
 GetOrigin(void)
 {
-    if (this->m_VectorField.IsNull())
+    if (!this->GetFieldGeometry())
         itkExceptionMacro("No field has been set.");
-    return this->m_VectorField->GetOrigin();
+    return this->GetFieldGeometry()->GetOrigin();
 }
 
 
@@ -196,9 +362,9 @@ typename DisplacementFieldTransform<TScalarType, NDimensions>::SpacingType
 DisplacementFieldTransform<TScalarType, NDimensions>::
 GetSpacing(void)
 {
-    if (this->m_VectorField.IsNull())
+    if (!this->GetFieldGeometry())
         itkExceptionMacro("No field has been set.");
-    return this->m_VectorField->GetSpacing();
+    return this->GetFieldGeometry()->GetSpacing();
 }
 
 
@@ -208,9 +374,9 @@ typename DisplacementFieldTransform<TScalarType, NDimensions>::DirectionType
 DisplacementFieldTransform<TScalarType, NDimensions>::
 GetDirection(void)
 {
-    if (this->m_VectorField.IsNull())
+    if (!this->GetFieldGeometry())
         itkExceptionMacro("No field has been set.");
-    return this->m_VectorField->GetDirection();
+    return this->GetFieldGeometry()->GetDirection();
 }
 
 
@@ -220,9 +386,9 @@ typename DisplacementFieldTransform<TScalarType, NDimensions>::RegionType
 DisplacementFieldTransform<TScalarType, NDimensions>::
 GetLargestPossibleRegion(void)
 {
-    if (this->m_VectorField.IsNull())
+    if (!this->GetFieldGeometry())
         itkExceptionMacro("No field has been set.");
-    return this->m_VectorField->GetLargestPossibleRegion();
+    return this->GetFieldGeometry()->GetLargestPossibleRegion();
 }
 
 
@@ -236,29 +402,37 @@ GetSpatialJacobian( const InputPointType & point) const
     unsigned int i, j;
     vnl_matrix_fixed<double,NDimensions,NDimensions> J;
 
-    if (!this->m_VectorField)
+    if (!this->GetFieldGeometry())
         itkExceptionMacro("No field has been set, cannot compute Jacobian !");
 
     double weight;
-    itk::Vector<double, NDimensions> spacing = m_VectorField->GetSpacing();
-
-    InputPointType point_prev, point_next;
+    itk::Vector<double, NDimensions> spacing = this->GetFieldGeometry()->GetSpacing();
 
+    // Previous and next points along each axis, interpolated at once
+    double     points[2 * NDimensions * NDimensions];
+    VectorType vectors[2 * NDimensions];
     for (i = 0; i < NDimensions; ++i)
     {
-        point_prev[i] = static_cast<double>(point[i]) - spacing[i];
-        point_next[i] = static_cast<double>(point[i]) + spacing[i];
+        double * point_prev = points + (2*i)   * NDimensions;
+        double * point_next = points + (2*i+1) * NDimensions;
+        for (j = 0; j < NDimensions; ++j)
+        {
+            point_prev[j] = static_cast<double>(point[j]);
+            point_next[j] = static_cast<double>(point[j]);
+        }
+        point_prev[i] -= spacing[i];
+        point_next[i] += spacing[i];
     }
-
-    typename InterpolateFunctionType::OutputType vector_prev = m_InterpolateFunction->Evaluate(point_prev);
-    typename InterpolateFunctionType::OutputType vector_next = m_InterpolateFunction->Evaluate(point_next);
+    this->m_FieldLookup.EvaluateAtPoints(points, vectors, 2 * NDimensions);
 
     for (i = 0; i < NDimensions; ++i)
     {
         weight = 0.5 * m_DerivativeWeights[i];
 
+        const VectorType & vector_prev = vectors[2*i];
+        const VectorType & vector_next = vectors[2*i+1];
         for (j = 0; j < NDimensions; ++j)
-            J[i][j] = weight * ( static_cast<double>(vector_next[j]) - static_cast<double>(vector_prev[j]) );
+            J[j][i] = weight * ( static_cast<double>(vector_next[j]) - static_cast<double>(vector_prev[j]) );
 
         // Add one on the diagonal to consider the warp and not only the deformation field
         J[i][i] += 1.0;
@@ -0,0 +1,109 @@
+#ifndef _rpiMappedImageContainer_h_
+#define _rpiMappedImageContainer_h_
+
+#include <itkImportImageContainer.h>
+#include <itkObjectFactory.h>
+
+#include <string>
+
+
+namespace rpi
+{
+
+
+/**
+ *
+ * This class is an image container whose elements are the pages of a file mapped in memory
+ * (POSIX mmap), instead of a buffer filled by a reader. Nothing is read when the file is mapped:
+ * the pages are loaded by the system when the elements are accessed for the first time, so that
+ * an image of which only a part is used is only partly read.
+ *
+ * The mapping is private: the elements can be modified, the modified pages being copied in memory,
+ * and the file is never written. The mapping is released when the container is destroyed.
+ *
+ * Memory mapping is not available on Windows: MapFile then returns false and the image must be
+ * read with a reader.
+ *
+ * @brief  Image container mapping a file in memory
+ *
+ * @class  MappedImageContainer (rpi)
+ */
+template <typename TElementIdentifier, typename TElement>
+class ITK_EXPORT MappedImageContainer : public itk::ImportImageContainer<TElementIdentifier, TElement>
+{
+
+public:
+
+    typedef MappedImageContainer                                      Self;
+    typedef itk::ImportImageContainer<TElementIdentifier, TElement>   Superclass;
+    typedef itk::SmartPointer<Self>                                   Pointer;
+    typedef itk::SmartPointer<const Self>                             ConstPointer;
+
+    /**
+     * Generic constructors.
+     */
+    itkNewMacro( Self );
+    itkTypeMacro( MappedImageContainer, ImportImageContainer );
+
+    typedef TElementIdentifier                                        ElementIdentifier;
+    typedef TElement                                                  Element;
+
+    /**
+     * Maps the elements stored in a file. The elements must be stored contiguously, with the
+     * memory layout and the byte order of TElement, from a given position in the file.
+     * @param  fileName          path to the file
+     * @param  offset            position of the first element in the file (bytes)
+     * @param  numberOfElements  number of elements
+     * @return true if the file has been mapped, false otherwise (the container is then unchanged)
+     */
+    bool                                MapFile(const std::string & fileName, std::size_t offset, ElementIdentifier numberOfElements);
+
+protected:
+
+    /**
+     * Prints contents.
+     */
+    void PrintSelf(std::ostream &os, itk::Indent indent) const ITK_OVERRIDE;
+
+    /**
+     * Default constructor.
+     */
+    MappedImageContainer(void);
+
+    /**
+     * Destructor: releases the mapping.
+     */
+    virtual ~MappedImageContainer();
+
+private:
+
+    MappedImageContainer(const Self&);  // purposely not implemented
+    void operator=(const Self&);        // purposely not implemented
+
+    /**
+     * Releases the mapping, if any.
+     */
+    void                                UnmapFile(void);
+
+    /**
+     * Start and length of the mapping (the start is aligned on a page)
+     */
+    void *                              m_Mapping;
+    std::size_t                         m_MappingLength;
+
+    /**
+     * Path to the mapped file
+     */
+    std::string                         m_FileName;
+
+};
+
+
+} // end of namespace rpi
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "rpiMappedImageContainer.txx"
+#endif
+
+#endif // _rpiMappedImageContainer_h_
@@ -0,0 +1,113 @@
+#ifndef _rpiMappedImageContainer_cxx_
+#define _rpiMappedImageContainer_cxx_
+
+#include "rpiMappedImageContainer.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace rpi
+{
+
+
+
+template <typename TElementIdentifier, typename TElement>
+MappedImageContainer<TElementIdentifier, TElement>::
+MappedImageContainer(void) : m_Mapping(ITK_NULLPTR), m_MappingLength(0)
+{}
+
+
+
+template <typename TElementIdentifier, typename TElement>
+MappedImageContainer<TElementIdentifier, TElement>::
+~MappedImageContainer()
+{
+    this->UnmapFile();
+}
+
+
+
+template <typename TElementIdentifier, typename TElement>
+void
+MappedImageContainer<TElementIdentifier, TElement>::
+PrintSelf(std::ostream &os, itk::Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+    os << indent << "FileName: "      << this->m_FileName      << std::endl;
+    os << indent << "MappingLength: " << this->m_MappingLength << std::endl;
+}
+
+
+
+template <typename TElementIdentifier, typename TElement>
+bool
+MappedImageContainer<TElementIdentifier, TElement>::
+MapFile(const std::string & fileName, std::size_t offset, ElementIdentifier numberOfElements)
+{
+#if defined(_WIN32)
+    (void)fileName;
+    (void)offset;
+    (void)numberOfElements;
+    return false;
+#else
+    const std::size_t dataSize = static_cast<std::size_t>(numberOfElements) * sizeof(Element);
+    if (dataSize == 0)
+        return false;
+
+    const int descriptor = ::open(fileName.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return false;
+
+    // The file must contain all the elements
+    struct stat status;
+    if (::fstat(descriptor, &status) != 0 || static_cast<std::size_t>(status.st_size) < offset + dataSize)
+    {
+        ::close(descriptor);
+        return false;
+    }
+
+    // The mapping starts on a page boundary
+    const std::size_t pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    const std::size_t start    = offset - offset % pageSize;
+    const std::size_t length   = offset + dataSize - start;
+    void * mapping = ::mmap(ITK_NULLPTR, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, static_cast<off_t>(start));
+    ::close(descriptor);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    // The container does not manage the mapped memory
+    this->UnmapFile();
+    this->m_Mapping       = mapping;
+    this->m_MappingLength = length;
+    this->m_FileName      = fileName;
+    Element * elements = reinterpret_cast<Element *>(static_cast<char *>(mapping) + (offset - start));
+    this->SetImportPointer(elements, numberOfElements, false);
+    return true;
+#endif
+}
+
+
+
+template <typename TElementIdentifier, typename TElement>
+void
+MappedImageContainer<TElementIdentifier, TElement>::
+UnmapFile(void)
+{
+#if !defined(_WIN32)
+    if (this->m_Mapping)
+        ::munmap(this->m_Mapping, this->m_MappingLength);
+#endif
+    this->m_Mapping       = ITK_NULLPTR;
+    this->m_MappingLength = 0;
+    this->m_FileName.clear();
+}
+
+
+} // namespace
+
+#endif // _rpiMappedImageContainer_cxx_
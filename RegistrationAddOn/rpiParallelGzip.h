@@ -0,0 +1,163 @@
+#ifndef _rpiParallelGzip_h_
+#define _rpiParallelGzip_h_
+
+#include <itk_zlib.h>
+#include <itkMultiThreaderBase.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace rpi
+{
+
+
+/**
+ * Compresses a block of a gzip stream (see compressFileWithGzip): raw deflate stream ended by a
+ * sync flush, or by the final deflate block if the block is the last one of the file.
+ * @param  data      uncompressed data
+ * @param  size      size of the data in bytes
+ * @param  level     zlib compression level
+ * @param  last      true if the block is the last one of the file
+ * @param  output    compressed data
+ * @return true if the block could be compressed
+ */
+inline bool compressGzipBlock(const unsigned char * data, std::size_t size, int level, bool last,
+                              std::vector<unsigned char> & output)
+{
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree  = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    // The bound covers a final block, a sync flush needs a few more bytes
+    output.resize(deflateBound(&stream, static_cast<uLong>(size)) + 16);
+    stream.next_in   = const_cast<Bytef *>(data);
+    stream.avail_in  = static_cast<uInt>(size);
+    stream.next_out  = &output[0];
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    const int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool done  = last ? (status == Z_STREAM_END) : (status == Z_OK && stream.avail_in == 0 && stream.avail_out > 0);
+    output.resize(output.size() - stream.avail_out);
+    deflateEnd(&stream);
+    return done;
+}
+
+
+/**
+ * Writes a 32-bit integer in little endian order, as in the gzip trailer.
+ * @param  stream  output stream
+ * @param  value   value
+ */
+inline void writeGzipInteger(std::ofstream & stream, unsigned long value)
+{
+    for (unsigned int i=0; i<4; i++)
+        stream.put(static_cast<char>((value >> (8*i)) & 0xff));
+}
+
+
+/**
+ * Compresses a file into a gzip file, the blocks of the file being compressed concurrently.
+ * As done by pigz, each block is compressed independently into a raw deflate stream ended by a sync
+ * flush, so that the concatenation of the blocks is a single deflate stream: the output is a standard
+ * single-member gzip file, readable by any gzip decoder. The CRC of the file is combined from the
+ * CRCs of the blocks. The file is processed by batches of a few blocks per thread, so the memory
+ * used does not depend on the size of the file.
+ * @param  inputFileName    uncompressed file
+ * @param  outputFileName   gzip file
+ * @param  level            zlib compression level, from 1 (fastest) to 9 (best), or -1 (default, 6)
+ * @param  blockSize        size of the uncompressed blocks in bytes
+ */
+inline void compressFileWithGzip(const std::string & inputFileName, const std::string & outputFileName,
+                                 int level = Z_DEFAULT_COMPRESSION, std::size_t blockSize = 1 << 20)
+{
+    std::ifstream input(inputFileName.c_str(), std::ios::binary);
+    if (!input)
+        throw std::runtime_error("Could not open the file " + inputFileName + ".");
+    std::ofstream output(outputFileName.c_str(), std::ios::binary);
+    if (!output)
+        throw std::runtime_error("Could not create the file " + outputFileName + ".");
+
+    // Header: no file name, no modification time, unknown operating system
+    const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    output.write(reinterpret_cast<const char *>(header), 10);
+
+    itk::MultiThreaderBase::Pointer threader   = itk::MultiThreaderBase::New();
+    const unsigned int              batchSize  = 4 * std::max(1u, threader->GetNumberOfWorkUnits());
+
+    std::vector< std::vector<unsigned char> > blocks(batchSize);
+    std::vector< std::vector<unsigned char> > compressed(batchSize);
+    std::vector<uLong>                        crcs(batchSize);
+    std::vector<char>                         failed(batchSize);
+    uLong                                     crc    = crc32(0L, Z_NULL, 0);
+    unsigned long                             length = 0;
+    bool                                      last   = false;
+
+    while (!last)
+    {
+        // Read a batch of blocks
+        unsigned int numberOfBlocks = 0;
+        while (numberOfBlocks < batchSize)
+        {
+            std::vector<unsigned char> & block = blocks[numberOfBlocks];
+            block.resize(blockSize);
+            input.read(reinterpret_cast<char *>(&block[0]), static_cast<std::streamsize>(blockSize));
+            block.resize(static_cast<std::size_t>(input.gcount()));
+            if (!block.empty())
+                numberOfBlocks++;
+            if (input.peek() == std::ifstream::traits_type::eof())
+            {
+                last = true;
+                break;
+            }
+        }
+
+        // An empty file still needs a final deflate block
+        if (numberOfBlocks == 0)
+        {
+            blocks[0].clear();
+            numberOfBlocks = 1;
+        }
+
+        // Compress the blocks concurrently
+        const bool lastBatch = last;
+        threader->ParallelizeArray(
+            0, numberOfBlocks,
+            [&](itk::SizeValueType b)
+            {
+                const std::vector<unsigned char> & block = blocks[b];
+                const unsigned char * data = block.empty() ? ITK_NULLPTR : &block[0];
+                failed[b] = !compressGzipBlock(data, block.size(), level, lastBatch && b + 1 == numberOfBlocks, compressed[b]);
+                crcs[b]   = crc32(0L, data, static_cast<uInt>(block.size()));
+            },
+            ITK_NULLPTR);
+
+        // Write them in order
+        for (unsigned int b=0; b<numberOfBlocks; b++)
+        {
+            if (failed[b])
+                throw std::runtime_error("Could not compress the file " + inputFileName + ".");
+            output.write(reinterpret_cast<const char *>(compressed[b].data()), static_cast<std::streamsize>(compressed[b].size()));
+            crc     = crc32_combine(crc, crcs[b], static_cast<z_off_t>(blocks[b].size()));
+            length += static_cast<unsigned long>(blocks[b].size());
+        }
+    }
+
+    // Trailer: CRC and length modulo 2^32
+    writeGzipInteger(output, crc);
+    writeGzipInteger(output, length & 0xffffffffUL);
+    if (!output)
+        throw std::runtime_error("Could not write the file " + outputFileName + ".");
+}
+
+
+} // namespace
+
+#endif // _rpiParallelGzip_h_
@@ -0,0 +1,324 @@
+#ifndef _rpiVectorFieldEncoding_h_
+#define _rpiVectorFieldEncoding_h_
+
+#include <itkImage.h>
+#include <itkVector.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIterator.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+
+namespace rpi
+{
+
+
+/**
+ * Storage encodings of the vector fields. The 16-bit encodings store each component as a code
+ * (an int16 or the bits of an IEEE 754 half-precision float), the actual value being
+ * offset + scale * decoded code, with a scale and an offset per component.
+ */
+enum FieldEncoding
+{
+    FIELD_ENCODING_FLOAT,
+    FIELD_ENCODING_FLOAT16,
+    FIELD_ENCODING_INT16
+};
+
+
+/**
+ * Type of the encoded fields: same dimension as the field TVectorField, 16-bit codes.
+ */
+template <class TVectorField>
+struct EncodedVectorFieldTraits
+{
+    static const unsigned int                                     Dimension = TVectorField::ImageDimension;
+    static const unsigned int                                     NumberOfComponents = TVectorField::PixelType::Dimension;
+    typedef itk::Vector<short, NumberOfComponents>                EncodedPixelType;
+    typedef itk::Image<EncodedPixelType, Dimension>               EncodedFieldType;
+};
+
+
+/**
+ * Gets the name of an encoding, as written in the header of the encoded files.
+ * @param  encoding  field encoding
+ * @return name of the encoding
+ */
+inline std::string getFieldEncodingAsString(FieldEncoding encoding)
+{
+    switch (encoding)
+    {
+        case FIELD_ENCODING_FLOAT:
+            return "float";
+        case FIELD_ENCODING_FLOAT16:
+            return "float16";
+        case FIELD_ENCODING_INT16:
+            return "int16";
+        default:
+            throw std::runtime_error("Field encoding not supported.");
+    }
+}
+
+
+/**
+ * Gets an encoding from its name.
+ * @param  name  name of the encoding ("float", "float16" or "int16")
+ * @return field encoding
+ */
+inline FieldEncoding getFieldEncodingFromString(const std::string & name)
+{
+    if (name == "float")
+        return FIELD_ENCODING_FLOAT;
+    if (name == "float16")
+        return FIELD_ENCODING_FLOAT16;
+    if (name == "int16")
+        return FIELD_ENCODING_INT16;
+    throw std::runtime_error("Field encoding not recognized: " + name);
+}
+
+
+/**
+ * Converts an IEEE 754 half-precision float into a float.
+ * @param  bits  bits of the half-precision float
+ * @return float value
+ */
+inline float halfToFloat(unsigned short bits)
+{
+    const unsigned int sign     = static_cast<unsigned int>(bits & 0x8000u) << 16;
+    unsigned int       exponent = (bits >> 10) & 0x1fu;
+    unsigned int       mantissa = bits & 0x3ffu;
+    unsigned int       result;
+
+    if (exponent == 0)
+    {
+        if (mantissa == 0)
+            result = sign;
+        else
+        {
+            // Subnormal half, normal float
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400u))
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            result = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+        }
+    }
+    else if (exponent == 0x1fu)
+        result = sign | 0x7f800000u | (mantissa << 13);
+    else
+        result = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+
+    float value;
+    std::memcpy(&value, &result, sizeof(value));
+    return value;
+}
+
+
+/**
+ * Converts a float into an IEEE 754 half-precision float (rounded to the nearest, ties to even).
+ * @param  value  float value
+ * @return bits of the half-precision float
+ */
+inline unsigned short floatToHalf(float value)
+{
+    unsigned int bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const unsigned int sign     = (bits >> 16) & 0x8000u;
+    const unsigned int absolute = bits & 0x7fffffffu;
+
+    // Infinity and NaN
+    if (absolute >= 0x7f800000u)
+        return static_cast<unsigned short>(sign | 0x7c00u | (absolute > 0x7f800000u ? 0x200u : 0u));
+
+    // Overflow (65520 and above round to infinity)
+    if (absolute >= 0x477ff000u)
+        return static_cast<unsigned short>(sign | 0x7c00u);
+
+    // Subnormal halfs (below 2^-14), zero below 2^-25
+    if (absolute < 0x38800000u)
+    {
+        if (absolute < 0x33000000u)
+            return static_cast<unsigned short>(sign);
+        const unsigned int exponent  = absolute >> 23;
+        const unsigned int mantissa  = (absolute & 0x7fffffu) | 0x800000u;
+        const unsigned int shift     = 126 - exponent;
+        const unsigned int halfway   = 1u << (shift - 1);
+        const unsigned int remainder = mantissa & ((1u << shift) - 1);
+        unsigned int       result    = mantissa >> shift;
+        if (remainder > halfway || (remainder == halfway && (result & 1u)))
+            result++;
+        return static_cast<unsigned short>(sign | result);
+    }
+
+    // Normal halfs (a carry of the rounding into the exponent is correct)
+    unsigned int       result    = (absolute >> 13) - ((127 - 15) << 10);
+    const unsigned int remainder = absolute & 0x1fffu;
+    if (remainder > 0x1000u || (remainder == 0x1000u && (result & 1u)))
+        result++;
+    return static_cast<unsigned short>(sign | result);
+}
+
+
+/**
+ * Decodes a 16-bit code (without the scale and the offset).
+ * @param  code      code
+ * @param  encoding  field encoding (FIELD_ENCODING_FLOAT16 or FIELD_ENCODING_INT16)
+ * @return decoded value
+ */
+inline double decodeFieldComponent(short code, FieldEncoding encoding)
+{
+    if (encoding == FIELD_ENCODING_FLOAT16)
+        return static_cast<double>(halfToFloat(static_cast<unsigned short>(code)));
+    return static_cast<double>(code);
+}
+
+
+/**
+ * Encodes a vector field with 16 bits per component. The scale and the offset of each component
+ * are computed from the range of the component:
+ *  - int16: the range is mapped onto [-32767, 32767], the quantization error being at most
+ *    half of the scale,
+ *  - float16: the values are stored as they are (relative precision 2^-11), unless they exceed
+ *    the range of half-precision floats, in which case they are scaled down.
+ * @param  field     vector field
+ * @param  encoding  field encoding (FIELD_ENCODING_FLOAT16 or FIELD_ENCODING_INT16)
+ * @param  scale     scale of each component (output)
+ * @param  offset    offset of each component (output)
+ * @return encoded field, with the geometry of the input field
+ */
+template <class TVectorField>
+typename EncodedVectorFieldTraits<TVectorField>::EncodedFieldType::Pointer
+encodeVectorField(const TVectorField * field, FieldEncoding encoding, double * scale, double * offset)
+{
+    typedef EncodedVectorFieldTraits<TVectorField>            TraitsType;
+    typedef typename TraitsType::EncodedFieldType             EncodedFieldType;
+    typedef typename TraitsType::EncodedPixelType             EncodedPixelType;
+    const unsigned int                                        NumberOfComponents = TraitsType::NumberOfComponents;
+
+    if (encoding != FIELD_ENCODING_FLOAT16 && encoding != FIELD_ENCODING_INT16)
+        throw std::runtime_error("Only the 16-bit field encodings can be used to encode a field.");
+
+    const typename TVectorField::RegionType region = field->GetBufferedRegion();
+
+    // Range of each component
+    double minimum[NumberOfComponents];
+    double maximum[NumberOfComponents];
+    for (unsigned int k=0; k<NumberOfComponents; k++)
+    {
+        minimum[k] = 0.0;
+        maximum[k] = 0.0;
+    }
+    bool first = true;
+    for (itk::ImageRegionConstIterator<TVectorField> it(field, region); !it.IsAtEnd(); ++it)
+    {
+        const typename TVectorField::PixelType & vector = it.Get();
+        for (unsigned int k=0; k<NumberOfComponents; k++)
+        {
+            const double value = static_cast<double>(vector[k]);
+            minimum[k] = first ? value : std::min(minimum[k], value);
+            maximum[k] = first ? value : std::max(maximum[k], value);
+        }
+        first = false;
+    }
+
+    // Scale and offset of each component
+    for (unsigned int k=0; k<NumberOfComponents; k++)
+    {
+        if (encoding == FIELD_ENCODING_INT16)
+        {
+            offset[k] = 0.5 * (minimum[k] + maximum[k]);
+            scale[k]  = (maximum[k] - minimum[k]) / 65534.0;
+        }
+        else
+        {
+            const double largest = std::max(std::fabs(minimum[k]), std::fabs(maximum[k]));
+            offset[k] = 0.0;
+            scale[k]  = (largest > 60000.0) ? largest / 60000.0 : 1.0;
+        }
+        if (!(scale[k] > 0.0))
+            scale[k] = 1.0;
+    }
+
+    // Encoded field
+    typename EncodedFieldType::Pointer encoded = EncodedFieldType::New();
+    encoded->SetRegions(   region );
+    encoded->SetOrigin(    field->GetOrigin() );
+    encoded->SetSpacing(   field->GetSpacing() );
+    encoded->SetDirection( field->GetDirection() );
+    encoded->Allocate();
+
+    itk::ImageRegionConstIterator<TVectorField> inIt(field, region);
+    itk::ImageRegionIterator<EncodedFieldType>  outIt(encoded, region);
+    for (; !inIt.IsAtEnd(); ++inIt, ++outIt)
+    {
+        const typename TVectorField::PixelType & vector = inIt.Get();
+        EncodedPixelType                         code;
+        for (unsigned int k=0; k<NumberOfComponents; k++)
+        {
+            const double value = (static_cast<double>(vector[k]) - offset[k]) / scale[k];
+            if (encoding == FIELD_ENCODING_INT16)
+                code[k] = static_cast<short>(std::max(-32767.0, std::min(32767.0, std::floor(value + 0.5))));
+            else
+                code[k] = static_cast<short>(floatToHalf(static_cast<float>(value)));
+        }
+        outIt.Set(code);
+    }
+
+    return encoded;
+}
+
+
+/**
+ * Decodes a vector field encoded with encodeVectorField.
+ * @param  encoded   encoded field
+ * @param  encoding  field encoding (FIELD_ENCODING_FLOAT16 or FIELD_ENCODING_INT16)
+ * @param  scale     scale of each component
+ * @param  offset    offset of each component
+ * @return vector field, with the geometry of the encoded field
+ */
+template <class TVectorField>
+typename TVectorField::Pointer
+decodeVectorField(const typename EncodedVectorFieldTraits<TVectorField>::EncodedFieldType * encoded,
+                  FieldEncoding encoding, const double * scale, const double * offset)
+{
+    typedef EncodedVectorFieldTraits<TVectorField>            TraitsType;
+    typedef typename TraitsType::EncodedFieldType             EncodedFieldType;
+    typedef typename TVectorField::PixelType                  PixelType;
+    typedef typename PixelType::ValueType                     ValueType;
+    const unsigned int                                        NumberOfComponents = TraitsType::NumberOfComponents;
+
+    const typename EncodedFieldType::RegionType region = encoded->GetBufferedRegion();
+
+    typename TVectorField::Pointer field = TVectorField::New();
+    field->SetRegions(   region );
+    field->SetOrigin(    encoded->GetOrigin() );
+    field->SetSpacing(   encoded->GetSpacing() );
+    field->SetDirection( encoded->GetDirection() );
+    field->Allocate();
+
+    itk::ImageRegionConstIterator<EncodedFieldType> inIt(encoded, region);
+    itk::ImageRegionIterator<TVectorField>          outIt(field, region);
+    for (; !inIt.IsAtEnd(); ++inIt, ++outIt)
+    {
+        const typename TraitsType::EncodedPixelType & code = inIt.Get();
+        PixelType                                     vector;
+        for (unsigned int k=0; k<NumberOfComponents; k++)
+            vector[k] = static_cast<ValueType>(offset[k] + scale[k] * decodeFieldComponent(code[k], encoding));
+        outIt.Set(vector);
+    }
+
+    return field;
+}
+
+
+} // end of namespace rpi
+
+
+#endif // _rpiVectorFieldEncoding_h_
@@ -0,0 +1,334 @@
+#ifndef _rpiVectorFieldLookup_h_
+#define _rpiVectorFieldLookup_h_
+
+#include <itkImage.h>
+#include "rpiVectorFieldLookupKernels.h"
+#include "rpiVectorFieldEncoding.h"
+#include "rpiBrickedVectorField.h"
+
+
+namespace rpi
+{
+
+
+/**
+ * Tells whether the fields of a given pixel type can be interpolated by the vectorised
+ * kernels. Only 3D fields of 3-component float vectors can.
+ */
+template <class TPixel, unsigned int NDimension>
+struct VectorFieldLookupTraits
+{
+    static const bool Vectorizable = false;
+};
+
+template <>
+struct VectorFieldLookupTraits<itk::Vector<float, 3>, 3>
+{
+    static const bool Vectorizable = true;
+};
+
+
+/**
+ *
+ * This class performs the linear interpolation of a vector field directly on the buffer of the
+ * field. It gives the same values as itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction
+ * (points located outside of the field get the value of the closest border voxel), but it avoids
+ * the virtual calls and the generic index conversions of the ITK image functions. It is meant to
+ * be used in the inner loops of the filters processing displacement fields.
+ *
+ * The template TVectorField is the type of the field, i.e. an itk::Image whose pixels are
+ * itk::Vector objects.
+ *
+ * Sets of points can be interpolated at once. For 3D fields of itk::Vector<float,3>, the
+ * points are then processed 4 or 8 at a time with SSE2 or AVX2 instructions, depending on
+ * the processor (see rpiVectorFieldLookupKernels.h). The other fields, and the processors
+ * without these instruction sets, use the scalar code.
+ *
+ * The field can also be stored with 16 bits per component (see rpiVectorFieldEncoding.h and
+ * SetEncodedField). The codes are then decoded on the fly while interpolating, with the scalar
+ * code.
+ *
+ * The field can also be stored as bricks in Morton order (see rpiBrickedVectorField.h and
+ * SetBrickedField), which improves the cache locality of the scattered interpolations. The voxels
+ * are then addressed through the bricks, with the scalar code.
+ *
+ * Once the field is set, all the methods are const and can be called concurrently by several
+ * threads. The lookup keeps a reference on the field.
+ *
+ * @brief  Raw buffer linear interpolation of vector fields
+ *
+ * @class  VectorFieldLookup (rpi)
+ */
+template <class TVectorField>
+class VectorFieldLookup
+{
+
+public:
+
+    /**
+     * Type of the field
+     */
+    typedef TVectorField                                FieldType;
+    typedef typename FieldType::ConstPointer            FieldConstPointerType;
+    typedef typename FieldType::PixelType               PixelType;
+    typedef typename PixelType::ValueType               ValueType;
+
+    /**
+     * Type of the encoded fields
+     */
+    typedef EncodedVectorFieldTraits<FieldType>         EncodedFieldTraitsType;
+    typedef typename EncodedFieldTraitsType::EncodedFieldType EncodedFieldType;
+    typedef typename EncodedFieldTraitsType::EncodedPixelType EncodedPixelType;
+    typedef typename EncodedFieldType::ConstPointer     EncodedFieldConstPointerType;
+
+    /**
+     * Type of the bricked fields
+     */
+    typedef BrickedVectorField<FieldType>               BrickedFieldType;
+    typedef typename BrickedFieldType::ConstPointer     BrickedFieldConstPointerType;
+
+    /**
+     * Dimension of the field
+     */
+    static const unsigned int Dimension = FieldType::ImageDimension;
+
+    /**
+     * Number of voxels involved in the interpolation of a point
+     */
+    static const unsigned int NumberOfNeighbors = 1u << Dimension;
+
+    /**
+     * Default constructor.
+     */
+    VectorFieldLookup(void);
+
+    /**
+     * Sets the field to interpolate.
+     * @param field vector field
+     */
+    void                                SetField(const FieldType * field);
+
+    /**
+     * Sets the field to interpolate, stored with 16 bits per component. The interpolated values
+     * are offset + scale * decoded code.
+     * @param field     encoded vector field
+     * @param encoding  encoding of the field (FIELD_ENCODING_FLOAT16 or FIELD_ENCODING_INT16)
+     * @param scale     scale of each component
+     * @param offset    offset of each component
+     */
+    void                                SetEncodedField(const EncodedFieldType * field, FieldEncoding encoding,
+                                                        const double * scale, const double * offset);
+
+    /**
+     * Sets the field to interpolate, stored as bricks.
+     * @param field  bricked vector field
+     */
+    void                                SetBrickedField(const BrickedFieldType * field);
+
+    /**
+     * Gets the encoding of the field to interpolate.
+     * @return field encoding (FIELD_ENCODING_FLOAT if the field was set with SetField)
+     */
+    FieldEncoding                       GetEncoding(void) const
+    {
+        return this->m_Encoding;
+    }
+
+    /**
+     * Gets the field to interpolate.
+     * @return vector field (null if the field is encoded)
+     */
+    const FieldType *                   GetField(void) const
+    {
+        return this->m_Field.GetPointer();
+    }
+
+    /**
+     * Gets the encoded field to interpolate.
+     * @return encoded vector field (null if the field is not encoded)
+     */
+    const EncodedFieldType *            GetEncodedField(void) const
+    {
+        return this->m_EncodedField.GetPointer();
+    }
+
+    /**
+     * Gets the bricked field to interpolate.
+     * @return bricked vector field (null if the field is not bricked)
+     */
+    const BrickedFieldType *            GetBrickedField(void) const
+    {
+        return this->m_BrickedField.GetPointer();
+    }
+
+    /**
+     * Converts a physical point into a continuous index relative to the buffer of the field.
+     * @param point  physical point
+     * @param index  continuous index
+     */
+    void                                TransformPhysicalPointToContinuousIndex(const double * point, double * index) const;
+
+    /**
+     * Converts a physical displacement into the corresponding change of continuous index.
+     * @param vector  physical displacement
+     * @param index   change of continuous index
+     */
+    void                                TransformPhysicalVectorToContinuousIndex(const double * vector, double * index) const;
+
+    /**
+     * Interpolates the field at a given continuous index (relative to the buffer of the field).
+     * @param  index  continuous index
+     * @return interpolated vector
+     */
+    PixelType                           EvaluateAtContinuousIndex(const double * index) const;
+
+    /**
+     * Computes the voxels involved in the interpolation at a given continuous index and their
+     * weights. The offsets are relative to the first voxel of the buffer, they can be used with
+     * any image having the same buffered region as the field (e.g. a scalar map). They are
+     * row-major offsets, even if the field is bricked.
+     * @param index    continuous index
+     * @param offsets  offsets of the NumberOfNeighbors voxels
+     * @param weights  weights of the NumberOfNeighbors voxels
+     */
+    void                                ComputeNeighbors(const double * index, itk::OffsetValueType * offsets, double * weights) const;
+
+    /**
+     * Interpolates the field at a set of continuous indices (relative to the buffer of the field).
+     * @param indices         continuous indices (Dimension values per point)
+     * @param output          interpolated vectors
+     * @param numberOfPoints  number of points
+     */
+    void                                EvaluateAtContinuousIndices(const double * indices, PixelType * output, itk::SizeValueType numberOfPoints) const;
+
+    /**
+     * Interpolates the field at a set of physical points.
+     * @param points          physical points (Dimension values per point)
+     * @param output          interpolated vectors
+     * @param numberOfPoints  number of points
+     */
+    void                                EvaluateAtPoints(const double * points, PixelType * output, itk::SizeValueType numberOfPoints) const;
+
+    /**
+     * Checks whether a continuous index lies in the buffer of the field, with the convention
+     * of itk::ImageFunction::IsInsideBuffer (half a voxel around the voxel centers).
+     * @param  index  continuous index
+     * @return true if the index is inside the buffer
+     */
+    bool                                IsInsideBuffer(const double * index) const
+    {
+        for (unsigned int i=0; i<Dimension; i++)
+            if (!(index[i] >= -0.5 && index[i] < this->m_Size[i] - 0.5))
+                return false;
+        return true;
+    }
+
+    /**
+     * Interpolates the field at a given physical point.
+     * @param  point  physical point
+     * @return interpolated vector
+     */
+    PixelType                           Evaluate(const double * point) const
+    {
+        double index[Dimension];
+        this->TransformPhysicalPointToContinuousIndex(point, index);
+        return this->EvaluateAtContinuousIndex(index);
+    }
+
+    /**
+     * Interpolates the field at a given physical point.
+     * @param  point  physical point (e.g. itk::Point)
+     * @return interpolated vector
+     */
+    template <class TPoint>
+    PixelType                           EvaluateAtPoint(const TPoint & point) const
+    {
+        double p[Dimension];
+        for (unsigned int i=0; i<Dimension; i++)
+            p[i] = static_cast<double>(point[i]);
+        return this->Evaluate(p);
+    }
+
+
+private:
+
+    /**
+     * Sets the geometry of the buffer from the field (or the encoded field).
+     * @param field  field
+     */
+    void                                SetGeometry(const itk::ImageBase<Dimension> * field);
+
+    /**
+     * Clamps a continuous index to the buffer and splits it into the lower voxel, the distance to
+     * it, and the existence of an upper neighbor along each dimension.
+     * @param index     continuous index
+     * @param lower     index of the lower voxel
+     * @param distance  distance to the lower voxel
+     * @param upper     true if the upper neighbor is used
+     */
+    void                                ClampContinuousIndex(const double * index, itk::OffsetValueType * lower,
+                                                             double * distance, bool * upper) const;
+
+    /**
+     * Same as ComputeNeighbors, the offsets being the ones of the voxels in the bricks.
+     */
+    void                                ComputeBrickedNeighbors(const double * index, itk::OffsetValueType * offsets, double * weights) const;
+
+    /**
+     * Number of points converted into continuous indices at once by EvaluateAtPoints
+     */
+    static const unsigned int           PointsPerChunk = 64;
+
+    /**
+     * Interpolated field
+     */
+    FieldConstPointerType               m_Field;
+
+    /**
+     * Buffer of the field
+     */
+    const PixelType *                   m_Buffer;
+
+    /**
+     * Encoded field, its buffer, and the decoding parameters of each component
+     */
+    EncodedFieldConstPointerType        m_EncodedField;
+    const EncodedPixelType *            m_Codes;
+    FieldEncoding                       m_Encoding;
+    double                              m_Scale[PixelType::Dimension];
+    double                              m_Offset[PixelType::Dimension];
+
+    /**
+     * Bricked field (its buffer is m_Buffer)
+     */
+    BrickedFieldConstPointerType        m_BrickedField;
+
+    /**
+     * Size of the buffer and offsets between two consecutive voxels along each dimension
+     */
+    itk::OffsetValueType                m_Size[Dimension];
+    itk::OffsetValueType                m_Stride[Dimension];
+
+    /**
+     * Physical point to continuous index conversion: index = M * (point - origin)
+     */
+    double                              m_Origin[Dimension];
+    double                              m_PhysicalToIndex[Dimension][Dimension];
+
+    /**
+     * Description of the field for the vectorised kernels, used only if m_Vectorized is true
+     */
+    TrilinearFloatField                 m_FloatField;
+    bool                                m_Vectorized;
+
+};
+
+
+} // end of namespace rpi
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "rpiVectorFieldLookup.txx"
+#endif
+
+#endif // _rpiVectorFieldLookup_h_
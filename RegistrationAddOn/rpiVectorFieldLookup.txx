@@ -0,0 +1,376 @@
+#ifndef _rpiVectorFieldLookup_cxx_
+#define _rpiVectorFieldLookup_cxx_
+
+#include "rpiVectorFieldLookup.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace rpi
+{
+
+
+
+template <class TVectorField>
+VectorFieldLookup<TVectorField>::
+VectorFieldLookup(void) : m_Buffer(ITK_NULLPTR), m_Codes(ITK_NULLPTR), m_Encoding(FIELD_ENCODING_FLOAT), m_Vectorized(false)
+{
+    for (unsigned int k=0; k<PixelType::Dimension; k++)
+    {
+        this->m_Scale[k]  = 1.0;
+        this->m_Offset[k] = 0.0;
+    }
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        this->m_Size[i]   = 0;
+        this->m_Stride[i] = 0;
+        this->m_Origin[i] = 0.0;
+        for (unsigned int j=0; j<Dimension; j++)
+            this->m_PhysicalToIndex[i][j] = 0.0;
+    }
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+SetField(const FieldType * field)
+{
+    this->m_Field        = field;
+    this->m_Buffer       = field->GetBufferPointer();
+    this->m_EncodedField = ITK_NULLPTR;
+    this->m_Codes        = ITK_NULLPTR;
+    this->m_Encoding     = FIELD_ENCODING_FLOAT;
+    this->m_BrickedField = ITK_NULLPTR;
+    this->SetGeometry(field);
+
+    // Description of the field for the vectorised kernels
+    this->m_Vectorized = false;
+    if (VectorFieldLookupTraits<PixelType, Dimension>::Vectorizable && getSIMDInstructionSet()!=SIMD_NONE)
+    {
+        this->m_FloatField.Buffer = reinterpret_cast<const float *>(this->m_Buffer);
+        for (unsigned int i=0; i<3; i++)
+        {
+            this->m_FloatField.Size[i]   = this->m_Size[i];
+            this->m_FloatField.Stride[i] = this->m_Stride[i];
+        }
+        this->m_Vectorized = isTrilinearFloatFieldAddressable(this->m_FloatField);
+    }
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+SetEncodedField(const EncodedFieldType * field, FieldEncoding encoding, const double * scale, const double * offset)
+{
+    if (encoding != FIELD_ENCODING_FLOAT16 && encoding != FIELD_ENCODING_INT16)
+        throw std::runtime_error("Only the 16-bit field encodings can be used with an encoded field.");
+
+    this->m_Field        = ITK_NULLPTR;
+    this->m_Buffer       = ITK_NULLPTR;
+    this->m_EncodedField = field;
+    this->m_Codes        = field->GetBufferPointer();
+    this->m_Encoding     = encoding;
+    this->m_BrickedField = ITK_NULLPTR;
+    for (unsigned int k=0; k<PixelType::Dimension; k++)
+    {
+        this->m_Scale[k]  = scale[k];
+        this->m_Offset[k] = offset[k];
+    }
+    this->SetGeometry(field);
+
+    // The vectorised kernels only handle float fields
+    this->m_Vectorized = false;
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+SetBrickedField(const BrickedFieldType * field)
+{
+    this->m_Field        = ITK_NULLPTR;
+    this->m_Buffer       = field->GetBuffer();
+    this->m_EncodedField = ITK_NULLPTR;
+    this->m_Codes        = ITK_NULLPTR;
+    this->m_Encoding     = FIELD_ENCODING_FLOAT;
+    this->m_BrickedField = field;
+    this->SetGeometry(field->GetGeometry());
+
+    // The vectorised kernels only handle row-major buffers
+    this->m_Vectorized = false;
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+SetGeometry(const itk::ImageBase<Dimension> * field)
+{
+    // Size of the buffer and strides
+    const typename FieldType::RegionType & region = field->GetBufferedRegion();
+    itk::OffsetValueType stride = 1;
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        this->m_Size[i]   = static_cast<itk::OffsetValueType>(region.GetSize(i));
+        this->m_Stride[i] = stride;
+        stride *= this->m_Size[i];
+    }
+
+    // The continuous index is relative to the first voxel of the buffer:
+    // index = M * (point - origin) - start = M * (point - origin')
+    typename FieldType::PointType origin;
+    field->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+    const typename FieldType::DirectionType & matrix = field->GetPhysicalPointToIndexMatrix();
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        this->m_Origin[i] = origin[i];
+        for (unsigned int j=0; j<Dimension; j++)
+            this->m_PhysicalToIndex[i][j] = matrix[i][j];
+    }
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+TransformPhysicalPointToContinuousIndex(const double * point, double * index) const
+{
+    double centered[Dimension];
+    for (unsigned int j=0; j<Dimension; j++)
+        centered[j] = point[j] - this->m_Origin[j];
+    this->TransformPhysicalVectorToContinuousIndex(centered, index);
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+TransformPhysicalVectorToContinuousIndex(const double * vector, double * index) const
+{
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        index[i] = 0.0;
+        for (unsigned int j=0; j<Dimension; j++)
+            index[i] += this->m_PhysicalToIndex[i][j] * vector[j];
+    }
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+ClampContinuousIndex(const double * index, itk::OffsetValueType * lower, double * distance, bool * upper) const
+{
+    // The index is clamped to the buffer, which reproduces the nearest neighbor extrapolation
+    // outside of the field.
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        const itk::OffsetValueType last = this->m_Size[i] - 1;
+        double value = index[i];
+        if (value <= 0.0)
+            value = 0.0;
+        else if (value >= last)
+            value = static_cast<double>(last);
+
+        lower[i] = static_cast<itk::OffsetValueType>(value);
+        if (lower[i] >= last)
+        {
+            lower[i]    = last;
+            distance[i] = 0.0;
+            upper[i]    = false;
+        }
+        else
+        {
+            distance[i] = value - lower[i];
+            upper[i]    = true;
+        }
+    }
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+ComputeNeighbors(const double * index, itk::OffsetValueType * offsets, double * weights) const
+{
+    // Base voxel, distance to the base voxel and offset to the upper neighbor along each
+    // dimension
+    itk::OffsetValueType lower[Dimension];
+    itk::OffsetValueType upper[Dimension];
+    double               distance[Dimension];
+    bool                 hasUpper[Dimension];
+    this->ClampContinuousIndex(index, lower, distance, hasUpper);
+
+    itk::OffsetValueType base = 0;
+    for (unsigned int i=0; i<Dimension; i++)
+    {
+        upper[i] = hasUpper[i] ? this->m_Stride[i] : 0;
+        base    += lower[i] * this->m_Stride[i];
+    }
+
+    // Offsets and weights of the 2^Dimension neighbors
+    for (unsigned int corner=0; corner<NumberOfNeighbors; corner++)
+    {
+        double               weight = 1.0;
+        itk::OffsetValueType offset = base;
+        for (unsigned int i=0; i<Dimension; i++)
+        {
+            if (corner & (1u<<i))
+            {
+                weight *= distance[i];
+                offset += upper[i];
+            }
+            else
+                weight *= 1.0 - distance[i];
+        }
+        offsets[corner] = offset;
+        weights[corner] = weight;
+    }
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+ComputeBrickedNeighbors(const double * index, itk::OffsetValueType * offsets, double * weights) const
+{
+    itk::OffsetValueType lower[Dimension];
+    double               distance[Dimension];
+    bool                 hasUpper[Dimension];
+    this->ClampContinuousIndex(index, lower, distance, hasUpper);
+
+    // Most of the time, the upper neighbors are in the brick of the lower voxel and are reached
+    // with the strides of the brick
+    bool sameBrick = true;
+    for (unsigned int i=0; i<Dimension; i++)
+        if (hasUpper[i] && (lower[i] & (BrickedFieldType::BrickEdge - 1)) == BrickedFieldType::BrickEdge - 1)
+            sameBrick = false;
+    const itk::OffsetValueType base = this->m_BrickedField->GetOffset(lower);
+
+    for (unsigned int corner=0; corner<NumberOfNeighbors; corner++)
+    {
+        double               weight = 1.0;
+        itk::OffsetValueType offset = base;
+        itk::OffsetValueType voxel[Dimension];
+        for (unsigned int i=0; i<Dimension; i++)
+        {
+            voxel[i] = lower[i];
+            if (corner & (1u<<i))
+            {
+                weight *= distance[i];
+                if (hasUpper[i])
+                {
+                    voxel[i]++;
+                    offset += BrickedFieldType::GetInnerStride(i);
+                }
+            }
+            else
+                weight *= 1.0 - distance[i];
+        }
+        offsets[corner] = sameBrick ? offset : this->m_BrickedField->GetOffset(voxel);
+        weights[corner] = weight;
+    }
+}
+
+
+
+template <class TVectorField>
+typename VectorFieldLookup<TVectorField>::PixelType
+VectorFieldLookup<TVectorField>::
+EvaluateAtContinuousIndex(const double * index) const
+{
+    itk::OffsetValueType offsets[NumberOfNeighbors];
+    double               weights[NumberOfNeighbors];
+    if (this->m_BrickedField)
+        this->ComputeBrickedNeighbors(index, offsets, weights);
+    else
+        this->ComputeNeighbors(index, offsets, weights);
+
+    // Weighted sum over the neighbors
+    double sum[PixelType::Dimension];
+    for (unsigned int k=0; k<PixelType::Dimension; k++)
+        sum[k] = 0.0;
+
+    PixelType output;
+    if (this->m_Codes)
+    {
+        // Encoded field: the codes are decoded, interpolated, then scaled (the weights sum to one)
+        for (unsigned int corner=0; corner<NumberOfNeighbors; corner++)
+        {
+            if (weights[corner] == 0.0)
+                continue;
+
+            const EncodedPixelType & neighbor = this->m_Codes[offsets[corner]];
+            for (unsigned int k=0; k<PixelType::Dimension; k++)
+                sum[k] += weights[corner] * decodeFieldComponent(neighbor[k], this->m_Encoding);
+        }
+        for (unsigned int k=0; k<PixelType::Dimension; k++)
+            output[k] = static_cast<ValueType>(this->m_Offset[k] + this->m_Scale[k] * sum[k]);
+        return output;
+    }
+
+    for (unsigned int corner=0; corner<NumberOfNeighbors; corner++)
+    {
+        if (weights[corner] == 0.0)
+            continue;
+
+        const PixelType & neighbor = this->m_Buffer[offsets[corner]];
+        for (unsigned int k=0; k<PixelType::Dimension; k++)
+            sum[k] += weights[corner] * static_cast<double>(neighbor[k]);
+    }
+
+    for (unsigned int k=0; k<PixelType::Dimension; k++)
+        output[k] = static_cast<ValueType>(sum[k]);
+    return output;
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+EvaluateAtContinuousIndices(const double * indices, PixelType * output, itk::SizeValueType numberOfPoints) const
+{
+    // Vectorised kernels (only for 3D float fields, see SetField)
+    itk::SizeValueType done = 0;
+    if (this->m_Vectorized)
+        done = trilinearInterpolation(this->m_FloatField, indices, reinterpret_cast<float *>(output), numberOfPoints);
+
+    // Remaining points
+    for (itk::SizeValueType n=done; n<numberOfPoints; n++)
+        output[n] = this->EvaluateAtContinuousIndex(indices + n*Dimension);
+}
+
+
+
+template <class TVectorField>
+void
+VectorFieldLookup<TVectorField>::
+EvaluateAtPoints(const double * points, PixelType * output, itk::SizeValueType numberOfPoints) const
+{
+    double indices[PointsPerChunk * Dimension];
+    for (itk::SizeValueType first=0; first<numberOfPoints; first+=PointsPerChunk)
+    {
+        const itk::SizeValueType size = std::min<itk::SizeValueType>(PointsPerChunk, numberOfPoints - first);
+        for (itk::SizeValueType n=0; n<size; n++)
+            this->TransformPhysicalPointToContinuousIndex(points + (first+n)*Dimension, indices + n*Dimension);
+        this->EvaluateAtContinuousIndices(indices, output + first, size);
+    }
+}
+
+
+} // namespace
+
+#endif // _rpiVectorFieldLookup_cxx_
@@ -0,0 +1,301 @@
+#ifndef _rpiVectorFieldLookupKernels_h_
+#define _rpiVectorFieldLookupKernels_h_
+
+#include <itkIntTypes.h>
+
+#include <climits>
+
+// The vectorised kernels rely on the GCC/Clang "target" attribute, which allows to compile
+// AVX2 code without building the whole project with -mavx2. The instruction set is chosen
+// at run time.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RPI_VECTOR_FIELD_LOOKUP_SIMD 1
+#include <immintrin.h>
+#endif
+
+
+namespace rpi
+{
+
+
+/**
+ * Instruction sets used by the vectorised trilinear interpolation.
+ */
+enum SIMDInstructionSet
+{
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+
+/**
+ * Gets the best instruction set supported by the processor. The detection is done once.
+ * @return instruction set
+ */
+inline SIMDInstructionSet getSIMDInstructionSet(void)
+{
+#ifdef RPI_VECTOR_FIELD_LOOKUP_SIMD
+    static const SIMDInstructionSet instructionSet = []()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return SIMD_AVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return SIMD_SSE2;
+        return SIMD_NONE;
+    }();
+    return instructionSet;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+
+/**
+ * Buffer of a 3D field of 3-component float vectors, as seen by the vectorised kernels.
+ * The offsets are expressed in voxels.
+ */
+struct TrilinearFloatField
+{
+    const float *           Buffer;
+    itk::OffsetValueType    Size[3];
+    itk::OffsetValueType    Stride[3];
+};
+
+
+/**
+ * Checks that the components of a field can be addressed with 32-bit offsets, as required
+ * by the gather instructions.
+ * @param  field  field
+ * @return true if the field can be processed by the vectorised kernels
+ */
+inline bool isTrilinearFloatFieldAddressable(const TrilinearFloatField & field)
+{
+    const itk::OffsetValueType numberOfVoxels = field.Size[0] * field.Size[1] * field.Size[2];
+    return 3 * numberOfVoxels < static_cast<itk::OffsetValueType>(INT_MAX);
+}
+
+
+/**
+ * Computes, for a set of continuous indices, the base voxel, the offset to the upper
+ * neighbor along each dimension (0 on the last voxel) and the distance to the base voxel.
+ * The indices are clamped to the buffer, which reproduces the nearest neighbor
+ * extrapolation. This is done in double precision so that the fractions are exact even
+ * for large fields.
+ * @param field     field
+ * @param indices   continuous indices (3 values per point)
+ * @param lanes     number of points
+ * @param base      base voxel of each point
+ * @param upper     offsets to the upper neighbors (lanes values per dimension)
+ * @param distance  distances to the base voxel (lanes values per dimension)
+ */
+inline void prepareTrilinearLanes(const TrilinearFloatField & field, const double * indices, unsigned int lanes,
+                                  int * base, int * upper, float * distance)
+{
+    for (unsigned int l=0; l<lanes; l++)
+    {
+        itk::OffsetValueType offset = 0;
+        for (unsigned int i=0; i<3; i++)
+        {
+            const itk::OffsetValueType last = field.Size[i] - 1;
+            double value = indices[3*l+i];
+            if (value <= 0.0)
+                value = 0.0;
+            else if (value >= last)
+                value = static_cast<double>(last);
+
+            itk::OffsetValueType lower = static_cast<itk::OffsetValueType>(value);
+            if (lower >= last)
+            {
+                lower                 = last;
+                distance[i*lanes + l] = 0.0f;
+                upper[i*lanes + l]    = 0;
+            }
+            else
+            {
+                distance[i*lanes + l] = static_cast<float>(value - lower);
+                upper[i*lanes + l]    = static_cast<int>(field.Stride[i]);
+            }
+            offset += lower * field.Stride[i];
+        }
+        base[l] = static_cast<int>(offset);
+    }
+}
+
+
+#ifdef RPI_VECTOR_FIELD_LOOKUP_SIMD
+
+
+/**
+ * Trilinear interpolation of 4 points at a time with SSE2 instructions. The corners are
+ * loaded one by one (SSE2 has no gather instruction), the weighting is vectorised.
+ * @param  field            field
+ * @param  indices          continuous indices (3 values per point)
+ * @param  output           interpolated vectors (3 values per point)
+ * @param  numberOfPoints   number of points
+ * @return number of points processed (multiple of 4), the remaining ones are left to the caller
+ */
+__attribute__((target("sse2")))
+inline itk::SizeValueType trilinearInterpolationSSE2(const TrilinearFloatField & field, const double * indices,
+                                                     float * output, itk::SizeValueType numberOfPoints)
+{
+    const unsigned int Lanes = 4;
+    alignas(16) int   base[Lanes];
+    alignas(16) int   upper[3*Lanes];
+    alignas(16) float distance[3*Lanes];
+    alignas(16) float result[Lanes];
+
+    itk::SizeValueType p = 0;
+    for (; p+Lanes<=numberOfPoints; p+=Lanes)
+    {
+        prepareTrilinearLanes(field, indices + 3*p, Lanes, base, upper, distance);
+
+        // Offsets of the 8 corners, in floats
+        int corner[8][Lanes];
+        for (unsigned int l=0; l<Lanes; l++)
+        {
+            for (unsigned int c=0; c<8; c++)
+            {
+                int offset = base[l];
+                if (c & 1) offset += upper[l];
+                if (c & 2) offset += upper[Lanes + l];
+                if (c & 4) offset += upper[2*Lanes + l];
+                corner[c][l] = 3 * offset;
+            }
+        }
+
+        const __m128 dx = _mm_load_ps(distance);
+        const __m128 dy = _mm_load_ps(distance + Lanes);
+        const __m128 dz = _mm_load_ps(distance + 2*Lanes);
+
+        for (unsigned int k=0; k<3; k++)
+        {
+            const float * buffer = field.Buffer + k;
+            __m128 v[8];
+            for (unsigned int c=0; c<8; c++)
+                v[c] = _mm_setr_ps(buffer[corner[c][0]], buffer[corner[c][1]], buffer[corner[c][2]], buffer[corner[c][3]]);
+
+            // Along x, then y, then z
+            const __m128 v00 = _mm_add_ps(v[0], _mm_mul_ps(dx, _mm_sub_ps(v[1], v[0])));
+            const __m128 v10 = _mm_add_ps(v[2], _mm_mul_ps(dx, _mm_sub_ps(v[3], v[2])));
+            const __m128 v01 = _mm_add_ps(v[4], _mm_mul_ps(dx, _mm_sub_ps(v[5], v[4])));
+            const __m128 v11 = _mm_add_ps(v[6], _mm_mul_ps(dx, _mm_sub_ps(v[7], v[6])));
+            const __m128 v0  = _mm_add_ps(v00,  _mm_mul_ps(dy, _mm_sub_ps(v10,  v00)));
+            const __m128 v1  = _mm_add_ps(v01,  _mm_mul_ps(dy, _mm_sub_ps(v11,  v01)));
+            _mm_store_ps(result, _mm_add_ps(v0, _mm_mul_ps(dz, _mm_sub_ps(v1, v0))));
+
+            for (unsigned int l=0; l<Lanes; l++)
+                output[3*(p+l) + k] = result[l];
+        }
+    }
+    return p;
+}
+
+
+/**
+ * Trilinear interpolation of 8 points at a time with AVX2 instructions (corners loaded
+ * with gather instructions).
+ * @param  field            field
+ * @param  indices          continuous indices (3 values per point)
+ * @param  output           interpolated vectors (3 values per point)
+ * @param  numberOfPoints   number of points
+ * @return number of points processed (multiple of 8), the remaining ones are left to the caller
+ */
+__attribute__((target("avx2")))
+inline itk::SizeValueType trilinearInterpolationAVX2(const TrilinearFloatField & field, const double * indices,
+                                                     float * output, itk::SizeValueType numberOfPoints)
+{
+    const unsigned int Lanes = 8;
+    alignas(32) int   base[Lanes];
+    alignas(32) int   upper[3*Lanes];
+    alignas(32) float distance[3*Lanes];
+    alignas(32) float result[Lanes];
+
+    itk::SizeValueType p = 0;
+    for (; p+Lanes<=numberOfPoints; p+=Lanes)
+    {
+        prepareTrilinearLanes(field, indices + 3*p, Lanes, base, upper, distance);
+
+        // Offsets of the 8 corners, in voxels, then in floats
+        const __m256i b   = _mm256_load_si256(reinterpret_cast<const __m256i *>(base));
+        const __m256i ux  = _mm256_load_si256(reinterpret_cast<const __m256i *>(upper));
+        const __m256i uy  = _mm256_load_si256(reinterpret_cast<const __m256i *>(upper + Lanes));
+        const __m256i uz  = _mm256_load_si256(reinterpret_cast<const __m256i *>(upper + 2*Lanes));
+        __m256i corner[8];
+        corner[0] = b;
+        corner[1] = _mm256_add_epi32(b, ux);
+        corner[2] = _mm256_add_epi32(b, uy);
+        corner[3] = _mm256_add_epi32(corner[1], uy);
+        corner[4] = _mm256_add_epi32(b, uz);
+        corner[5] = _mm256_add_epi32(corner[1], uz);
+        corner[6] = _mm256_add_epi32(corner[2], uz);
+        corner[7] = _mm256_add_epi32(corner[3], uz);
+        for (unsigned int c=0; c<8; c++)
+            corner[c] = _mm256_add_epi32(corner[c], _mm256_add_epi32(corner[c], corner[c]));
+
+        const __m256 dx = _mm256_load_ps(distance);
+        const __m256 dy = _mm256_load_ps(distance + Lanes);
+        const __m256 dz = _mm256_load_ps(distance + 2*Lanes);
+
+        for (unsigned int k=0; k<3; k++)
+        {
+            const float * buffer = field.Buffer + k;
+            __m256 v[8];
+            for (unsigned int c=0; c<8; c++)
+                v[c] = _mm256_i32gather_ps(buffer, corner[c], 4);
+
+            // Along x, then y, then z
+            const __m256 v00 = _mm256_add_ps(v[0], _mm256_mul_ps(dx, _mm256_sub_ps(v[1], v[0])));
+            const __m256 v10 = _mm256_add_ps(v[2], _mm256_mul_ps(dx, _mm256_sub_ps(v[3], v[2])));
+            const __m256 v01 = _mm256_add_ps(v[4], _mm256_mul_ps(dx, _mm256_sub_ps(v[5], v[4])));
+            const __m256 v11 = _mm256_add_ps(v[6], _mm256_mul_ps(dx, _mm256_sub_ps(v[7], v[6])));
+            const __m256 v0  = _mm256_add_ps(v00,  _mm256_mul_ps(dy, _mm256_sub_ps(v10,  v00)));
+            const __m256 v1  = _mm256_add_ps(v01,  _mm256_mul_ps(dy, _mm256_sub_ps(v11,  v01)));
+            _mm256_store_ps(result, _mm256_add_ps(v0, _mm256_mul_ps(dz, _mm256_sub_ps(v1, v0))));
+
+            for (unsigned int l=0; l<Lanes; l++)
+                output[3*(p+l) + k] = result[l];
+        }
+    }
+    return p;
+}
+
+
+#endif // RPI_VECTOR_FIELD_LOOKUP_SIMD
+
+
+/**
+ * Trilinear interpolation of a set of points with the best instruction set available.
+ * @param  field            field
+ * @param  indices          continuous indices (3 values per point)
+ * @param  output           interpolated vectors (3 values per point)
+ * @param  numberOfPoints   number of points
+ * @return number of points processed, the remaining ones (less than 8) are left to the caller
+ */
+inline itk::SizeValueType trilinearInterpolation(const TrilinearFloatField & field, const double * indices,
+                                                 float * output, itk::SizeValueType numberOfPoints)
+{
+#ifdef RPI_VECTOR_FIELD_LOOKUP_SIMD
+    switch (getSIMDInstructionSet())
+    {
+        case SIMD_AVX2:
+        {
+            // The remaining points are processed 4 at a time
+            itk::SizeValueType done = trilinearInterpolationAVX2(field, indices, output, numberOfPoints);
+            return done + trilinearInterpolationSSE2(field, indices + 3*done, output + 3*done, numberOfPoints - done);
+        }
+        case SIMD_SSE2:
+            return trilinearInterpolationSSE2(field, indices, output, numberOfPoints);
+        default:
+            break;
+    }
+#endif
+    return 0;
+}
+
+
+} // end of namespace rpi
+
+
+#endif // _rpiVectorFieldLookupKernels_h_
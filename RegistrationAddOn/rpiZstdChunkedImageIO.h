@@ -0,0 +1,392 @@
+#ifndef _rpiZstdChunkedImageIO_h_
+#define _rpiZstdChunkedImageIO_h_
+
+#include <itkImageIOBase.h>
+#include <itkObjectFactoryBase.h>
+#include <itkVersion.h>
+#include <itkByteSwapper.h>
+#include <itkMetaDataObject.h>
+#include <itkMultiThreaderBase.h>
+#include <itksys/SystemTools.hxx>
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace rpi
+{
+
+
+/**
+ * Image IO of the zstd chunked container (extension ".zvf"), designed for the large vector fields.
+ *
+ * The file starts with a text header similar to the MetaImage headers (geometry, pixel and component
+ * types, byte order, size of the chunks) ended by the line "HeaderEnd". The string entries of the
+ * metadata dictionary (e.g. the encoding of a 16-bit field) are kept in the header. The buffer of the
+ * image follows, cut into chunks of ChunkSize bytes, each chunk being compressed independently with
+ * zstd. The chunks are compressed and decompressed concurrently, so the reading and the writing scale
+ * with the number of threads, unlike the single-threaded gzip streams of NIfTI and MetaImage files.
+ *
+ * The files are only read on a machine having the byte order of the machine which wrote them.
+ */
+class ZstdChunkedImageIO : public itk::ImageIOBase
+{
+public:
+    /** Standard class typedefs. */
+    typedef ZstdChunkedImageIO              Self;
+    typedef itk::ImageIOBase                Superclass;
+    typedef itk::SmartPointer<Self>         Pointer;
+    typedef itk::SmartPointer<const Self>   ConstPointer;
+
+    /** Method for creation through the object factory. */
+    itkNewMacro(Self);
+
+    /** Run-time type information (and related methods). */
+    itkTypeMacro(ZstdChunkedImageIO, ImageIOBase);
+
+    /** Set/Get the zstd compression level (1 to 19, or negative levels for faster compression). Default: 3. */
+    itkSetMacro(ZstdCompressionLevel, int);
+    itkGetConstMacro(ZstdCompressionLevel, int);
+
+    /** Set/Get the size of the uncompressed chunks in bytes. Default: 4 MiB. */
+    itkSetClampMacro(ChunkSize, itk::SizeValueType, 1, itk::NumericTraits<itk::SizeValueType>::max());
+    itkGetConstMacro(ChunkSize, itk::SizeValueType);
+
+    /** Checks the first line of the file, reading only the bytes of the magic line. */
+    bool CanReadFile(const char * fileName) ITK_OVERRIDE
+    {
+        std::ifstream file(fileName, std::ios::binary);
+        return file && ReadMagicLine(file);
+    }
+
+    /** Reads the header. */
+    void ReadImageInformation(void) ITK_OVERRIDE
+    {
+        std::ifstream file(this->GetFileName(), std::ios::binary);
+        std::string   line;
+        if (!file || !ReadMagicLine(file))
+            itkExceptionMacro(<< "The file " << this->GetFileName() << " is not a zstd chunked container.");
+
+        itk::MetaDataDictionary & dictionary = this->GetMetaDataDictionary();
+        m_CompressedChunkSizes.clear();
+        bool ended = false;
+        while (std::getline(file, line))
+        {
+            if (line == "HeaderEnd")
+            {
+                ended = true;
+                break;
+            }
+            const std::string::size_type separator = line.find(" = ");
+            if (separator == std::string::npos)
+                itkExceptionMacro(<< "Invalid header line \"" << line << "\" in " << this->GetFileName() << ".");
+            const std::string  key   = line.substr(0, separator);
+            const std::string  value = line.substr(separator + 3);
+            std::istringstream values(value);
+            const unsigned int n     = this->GetNumberOfDimensions();
+
+            if (key == "NDims")
+            {
+                unsigned int dimension = 0;
+                values >> dimension;
+                this->SetNumberOfDimensions(dimension);
+            }
+            else if (key == "DimSize")
+                for (unsigned int i=0; i<n; i++)
+                {
+                    itk::SizeValueType size = 0;
+                    values >> size;
+                    this->SetDimensions(i, size);
+                }
+            else if (key == "ElementSpacing")
+                for (unsigned int i=0; i<n; i++)
+                {
+                    double spacing = 1.0;
+                    values >> spacing;
+                    this->SetSpacing(i, spacing);
+                }
+            else if (key == "Offset")
+                for (unsigned int i=0; i<n; i++)
+                {
+                    double origin = 0.0;
+                    values >> origin;
+                    this->SetOrigin(i, origin);
+                }
+            else if (key == "Direction")
+                for (unsigned int i=0; i<n; i++)
+                {
+                    std::vector<double> axis(n);
+                    for (unsigned int j=0; j<n; j++)
+                        values >> axis[j];
+                    this->SetDirection(i, axis);
+                }
+            else if (key == "PixelType")
+                this->SetPixelType(itk::ImageIOBase::GetPixelTypeFromString(value));
+            else if (key == "ComponentType")
+                this->SetComponentType(itk::ImageIOBase::GetComponentTypeFromString(value));
+            else if (key == "NumberOfComponents")
+            {
+                unsigned int components = 1;
+                values >> components;
+                this->SetNumberOfComponents(components);
+            }
+            else if (key == "ByteOrder")
+            {
+                if (value != SystemByteOrder())
+                    itkExceptionMacro(<< "The file " << this->GetFileName() << " was written with another byte order.");
+            }
+            else if (key == "ChunkSize")
+                values >> m_ChunkSize;
+            else if (key == "CompressedChunkSizes")
+            {
+                itk::SizeValueType size = 0;
+                while (values >> size)
+                    m_CompressedChunkSizes.push_back(size);
+            }
+            else if (key.compare(0, 5, "Meta:") == 0)
+                itk::EncapsulateMetaData<std::string>(dictionary, key.substr(5), value);
+            if (values.bad())
+                itkExceptionMacro(<< "Invalid header line \"" << line << "\" in " << this->GetFileName() << ".");
+        }
+        if (!ended)
+            itkExceptionMacro(<< "The header of " << this->GetFileName() << " is truncated.");
+        m_DataOffset = static_cast<itk::SizeValueType>(file.tellg());
+
+        const itk::SizeValueType imageSize = static_cast<itk::SizeValueType>(this->GetImageSizeInBytes());
+        if (m_ChunkSize == 0 || m_CompressedChunkSizes.size() != (imageSize + m_ChunkSize - 1) / m_ChunkSize)
+            itkExceptionMacro(<< "The chunks of " << this->GetFileName() << " do not match the size of the image.");
+    }
+
+    /** Reads the chunks and decompresses them concurrently. */
+    void Read(void * buffer) ITK_OVERRIDE
+    {
+        const itk::SizeValueType imageSize      = static_cast<itk::SizeValueType>(this->GetImageSizeInBytes());
+        const itk::SizeValueType numberOfChunks = m_CompressedChunkSizes.size();
+
+        std::vector<itk::SizeValueType> offsets(numberOfChunks + 1, 0);
+        for (itk::SizeValueType c=0; c<numberOfChunks; c++)
+            offsets[c+1] = offsets[c] + m_CompressedChunkSizes[c];
+
+        std::vector<char> compressed(offsets[numberOfChunks]);
+        std::ifstream     file(this->GetFileName(), std::ios::binary);
+        file.seekg(static_cast<std::streamoff>(m_DataOffset));
+        if (!compressed.empty())
+            file.read(&compressed[0], static_cast<std::streamsize>(compressed.size()));
+        if (!file)
+            itkExceptionMacro(<< "Could not read the chunks of " << this->GetFileName() << ".");
+
+        std::vector<char> failed(numberOfChunks, 0);
+        char *            output = static_cast<char *>(buffer);
+        itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+        threader->ParallelizeArray(
+            0, numberOfChunks,
+            [&](itk::SizeValueType c)
+            {
+                const itk::SizeValueType start = c * m_ChunkSize;
+                const itk::SizeValueType size  = std::min(m_ChunkSize, imageSize - start);
+                const std::size_t decompressed = ZSTD_decompress(output + start, size, &compressed[offsets[c]], m_CompressedChunkSizes[c]);
+                failed[c] = ZSTD_isError(decompressed) || decompressed != size;
+            },
+            ITK_NULLPTR);
+
+        if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+            itkExceptionMacro(<< "The chunks of " << this->GetFileName() << " are corrupted.");
+    }
+
+    /** Only the files with the extension ".zvf" are written. */
+    bool CanWriteFile(const char * fileName) ITK_OVERRIDE
+    {
+        return itksys::SystemTools::LowerCase(itksys::SystemTools::GetFilenameLastExtension(fileName)) == ".zvf";
+    }
+
+    /** The header is written with the chunks, since it contains their compressed sizes. */
+    void WriteImageInformation(void) ITK_OVERRIDE
+    {}
+
+    /** Compresses the chunks concurrently, then writes the header and the chunks. */
+    void Write(const void * buffer) ITK_OVERRIDE
+    {
+        const itk::SizeValueType imageSize      = static_cast<itk::SizeValueType>(this->GetImageSizeInBytes());
+        const itk::SizeValueType numberOfChunks = (imageSize + m_ChunkSize - 1) / m_ChunkSize;
+        const int                level          = std::max(ZSTD_minCLevel(), std::min(ZSTD_maxCLevel(), m_ZstdCompressionLevel));
+
+        std::vector< std::vector<char> > chunks(numberOfChunks);
+        std::vector<char>                failed(numberOfChunks, 0);
+        const char *                     input = static_cast<const char *>(buffer);
+        itk::MultiThreaderBase::Pointer  threader = itk::MultiThreaderBase::New();
+        threader->ParallelizeArray(
+            0, numberOfChunks,
+            [&](itk::SizeValueType c)
+            {
+                const itk::SizeValueType start = c * m_ChunkSize;
+                const itk::SizeValueType size  = std::min(m_ChunkSize, imageSize - start);
+                std::vector<char> & chunk = chunks[c];
+                chunk.resize(ZSTD_compressBound(size));
+                const std::size_t compressed = ZSTD_compress(&chunk[0], chunk.size(), input + start, size, level);
+                failed[c] = ZSTD_isError(compressed);
+                chunk.resize(failed[c] ? 0 : compressed);
+            },
+            ITK_NULLPTR);
+        if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+            itkExceptionMacro(<< "Could not compress the image written into " << this->GetFileName() << ".");
+
+        // Header
+        const unsigned int n = this->GetNumberOfDimensions();
+        std::ostringstream header;
+        header << std::setprecision(17);
+        header << MagicLine() << "\n";
+        header << "NDims = " << n << "\n";
+        header << "DimSize =";
+        for (unsigned int i=0; i<n; i++)
+            header << " " << this->GetDimensions(i);
+        header << "\nElementSpacing =";
+        for (unsigned int i=0; i<n; i++)
+            header << " " << this->GetSpacing(i);
+        header << "\nOffset =";
+        for (unsigned int i=0; i<n; i++)
+            header << " " << this->GetOrigin(i);
+        header << "\nDirection =";
+        for (unsigned int i=0; i<n; i++)
+            for (unsigned int j=0; j<n; j++)
+                header << " " << this->GetDirection(i)[j];
+        header << "\nPixelType = "          << itk::ImageIOBase::GetPixelTypeAsString(this->GetPixelType());
+        header << "\nComponentType = "      << itk::ImageIOBase::GetComponentTypeAsString(this->GetComponentType());
+        header << "\nNumberOfComponents = " << this->GetNumberOfComponents();
+        header << "\nByteOrder = "          << SystemByteOrder();
+        header << "\nChunkSize = "          << m_ChunkSize;
+        header << "\nCompressedChunkSizes =";
+        for (itk::SizeValueType c=0; c<numberOfChunks; c++)
+            header << " " << chunks[c].size();
+        header << "\n";
+
+        // String entries of the metadata dictionary, on a single line each
+        const itk::MetaDataDictionary & dictionary = this->GetMetaDataDictionary();
+        const std::vector<std::string>  keys       = dictionary.GetKeys();
+        for (unsigned int k=0; k<keys.size(); k++)
+        {
+            std::string value;
+            if (itk::ExposeMetaData<std::string>(dictionary, keys[k], value) &&
+                keys[k].find(" = ") == std::string::npos && keys[k].find('\n') == std::string::npos &&
+                value.find('\n') == std::string::npos)
+                header << "Meta:" << keys[k] << " = " << value << "\n";
+        }
+        header << "HeaderEnd\n";
+
+        // Chunks
+        std::ofstream file(this->GetFileName(), std::ios::binary);
+        const std::string text = header.str();
+        file.write(text.data(), static_cast<std::streamsize>(text.size()));
+        for (itk::SizeValueType c=0; c<numberOfChunks; c++)
+            file.write(chunks[c].data(), static_cast<std::streamsize>(chunks[c].size()));
+        if (!file)
+            itkExceptionMacro(<< "Could not write the file " << this->GetFileName() << ".");
+    }
+
+protected:
+    ZstdChunkedImageIO(void) : m_ZstdCompressionLevel(3), m_ChunkSize(4 << 20), m_DataOffset(0)
+    {
+        this->AddSupportedWriteExtension(".zvf");
+        this->AddSupportedReadExtension(".zvf");
+    }
+
+    ~ZstdChunkedImageIO() {}
+
+    void PrintSelf(std::ostream & os, itk::Indent indent) const ITK_OVERRIDE
+    {
+        Superclass::PrintSelf(os, indent);
+        os << indent << "ZstdCompressionLevel: " << m_ZstdCompressionLevel << std::endl;
+        os << indent << "ChunkSize: "            << m_ChunkSize            << std::endl;
+    }
+
+private:
+    ZstdChunkedImageIO(const Self &);   // purposely not implemented
+    void operator=(const Self &);       // purposely not implemented
+
+    static std::string MagicLine(void)
+    {
+        return "RPIZVF 1";
+    }
+
+    /** Reads the magic line and its end of line, without reading further in any other file. */
+    static bool ReadMagicLine(std::istream & file)
+    {
+        const std::string magic = MagicLine() + "\n";
+        std::string       buffer(magic.size(), '\0');
+        file.read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+        return file.gcount() == static_cast<std::streamsize>(buffer.size()) && buffer == magic;
+    }
+
+    static std::string SystemByteOrder(void)
+    {
+        return itk::ByteSwapper<int>::SystemIsBigEndian() ? "BigEndian" : "LittleEndian";
+    }
+
+    int                             m_ZstdCompressionLevel;  // zstd compression level
+    itk::SizeValueType              m_ChunkSize;             // size of the uncompressed chunks
+    itk::SizeValueType              m_DataOffset;            // position of the first chunk in the file
+    std::vector<itk::SizeValueType> m_CompressedChunkSizes;  // sizes of the compressed chunks
+};
+
+
+
+/**
+ * Object factory registering ZstdChunkedImageIO, so that the ".zvf" files are read by
+ * itk::ImageFileReader.
+ */
+class ZstdChunkedImageIOFactory : public itk::ObjectFactoryBase
+{
+public:
+    /** Standard class typedefs. */
+    typedef ZstdChunkedImageIOFactory       Self;
+    typedef itk::ObjectFactoryBase          Superclass;
+    typedef itk::SmartPointer<Self>         Pointer;
+    typedef itk::SmartPointer<const Self>   ConstPointer;
+
+    /** Class methods used to interface with the registered factories. */
+    const char * GetITKSourceVersion(void) const ITK_OVERRIDE
+    {
+        return ITK_SOURCE_VERSION;
+    }
+
+    const char * GetDescription(void) const ITK_OVERRIDE
+    {
+        return "zstd chunked container ImageIO factory";
+    }
+
+    /** Method for class instantiation. */
+    itkFactorylessNewMacro(Self);
+
+    /** Run-time type information (and related methods). */
+    itkTypeMacro(ZstdChunkedImageIOFactory, ObjectFactoryBase);
+
+    /** Register one factory of this type. */
+    static void RegisterOneFactory(void)
+    {
+        Pointer factory = ZstdChunkedImageIOFactory::New();
+        itk::ObjectFactoryBase::RegisterFactory(factory);
+    }
+
+protected:
+    ZstdChunkedImageIOFactory(void)
+    {
+        this->RegisterOverride("itkImageIOBase", "rpiZstdChunkedImageIO", "zstd chunked container ImageIO", true,
+                               itk::CreateObjectFunction<ZstdChunkedImageIO>::New());
+    }
+
+    ~ZstdChunkedImageIOFactory() {}
+
+private:
+    ZstdChunkedImageIOFactory(const Self &);   // purposely not implemented
+    void operator=(const Self &);              // purposely not implemented
+};
+
+
+} // namespace
+
+#endif // _rpiZstdChunkedImageIO_h_
@@ -0,0 +1,182 @@
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkTimeProbe.h>
+
+#include <itkGeneralTransform.h>
+#include <itkTransformChainToDisplacementFieldSource.h>
+#include <rpiDisplacementFieldTransform.h>
+
+
+
+/**
+ * Measures the effect of the bricked layout of the displacement fields (see rpi::BrickedVectorField)
+ * on the composition of fields by itk::TransformChainToDisplacementFieldSource.
+ *
+ * Two synthetic smooth fields, whose displacements reach a given number of voxels, are composed
+ * with their row-major buffers, then stored as bricks. The mean time of the compositions and the
+ * largest difference between the two results are printed. Float fields are interpolated by the
+ * vectorised kernels in row-major layout but not as bricks; double fields use the scalar code in
+ * both layouts, which isolates the effect of the memory layout.
+ *
+ * Usage: rpiBrickedFieldBenchmark [size [amplitude [repetitions]]]
+ *   size         number of voxels along each dimension (default 160)
+ *   amplitude    largest displacement in voxels (default 12)
+ *   repetitions  number of compositions timed for each layout (default 3)
+ */
+
+
+
+/**
+ * Creates a smooth synthetic displacement field.
+ * @param size       number of voxels along each dimension
+ * @param amplitude  largest displacement (voxels)
+ * @param phase      phase of the sine waves, to get different fields
+ * @return displacement field
+ */
+template<class TField>
+typename TField::Pointer
+createField(unsigned int size, double amplitude, double phase)
+{
+    typename TField::RegionType region;
+    for (unsigned int i=0; i<3; i++)
+        region.SetSize(i, size);
+
+    typename TField::Pointer field = TField::New();
+    field->SetRegions(region);
+    field->Allocate();
+
+    const double frequency = 2.0 * 3.14159265358979 / size;
+    itk::ImageRegionIteratorWithIndex<TField> it(field, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        const typename TField::IndexType index = it.GetIndex();
+        typename TField::PixelType vector;
+        for (unsigned int i=0; i<3; i++)
+            vector[i] = amplitude * std::sin(frequency * index[(i+1)%3] + phase + i) * std::cos(frequency * index[(i+2)%3] - phase);
+        it.Set(vector);
+    }
+    return field;
+}
+
+
+
+/**
+ * Times the composition of two fields for a given layout.
+ * @param first        first field
+ * @param second       second field
+ * @param bricked      true to store the fields as bricks
+ * @param repetitions  number of compositions
+ * @param result       composed field (output)
+ * @return mean time of a composition (seconds)
+ */
+template<class TScalarType>
+double
+timeComposition(const typename rpi::DisplacementFieldTransform<TScalarType,3>::VectorFieldType * first,
+                const typename rpi::DisplacementFieldTransform<TScalarType,3>::VectorFieldType * second,
+                bool bricked, unsigned int repetitions,
+                typename rpi::DisplacementFieldTransform<TScalarType,3>::VectorFieldType::Pointer & result)
+{
+    typedef rpi::DisplacementFieldTransform<TScalarType,3>                         TransformType;
+    typedef typename TransformType::VectorFieldType                                FieldType;
+    typedef itk::GeneralTransform<TScalarType,3>                                   ListType;
+    typedef itk::TransformChainToDisplacementFieldSource<FieldType, TScalarType>   GeneratorType;
+
+    typename TransformType::Pointer transform1 = TransformType::New();
+    typename TransformType::Pointer transform2 = TransformType::New();
+    transform1->SetBrickedLayout(bricked);
+    transform2->SetBrickedLayout(bricked);
+    transform1->SetParametersAsVectorField(first);
+    transform2->SetParametersAsVectorField(second);
+
+    typename ListType::Pointer list = ListType::New();
+    list->InsertTransform(transform1.GetPointer());
+    list->InsertTransform(transform2.GetPointer());
+
+    itk::TimeProbe probe;
+    for (unsigned int n=0; n<repetitions; n++)
+    {
+        typename GeneratorType::Pointer generator = GeneratorType::New();
+        generator->SetTransform(list);
+        generator->SetOutputOrigin(    first->GetOrigin() );
+        generator->SetOutputSpacing(   first->GetSpacing() );
+        generator->SetOutputDirection( first->GetDirection() );
+        generator->SetOutputSize(      first->GetLargestPossibleRegion().GetSize() );
+        generator->SetOutputIndex(     first->GetLargestPossibleRegion().GetIndex() );
+
+        probe.Start();
+        generator->Update();
+        probe.Stop();
+
+        result = generator->GetOutput();
+        result->DisconnectPipeline();
+    }
+    return probe.GetMean();
+}
+
+
+
+/**
+ * Runs the benchmark for a given scalar type.
+ */
+template<class TScalarType>
+void
+run(const char * name, unsigned int size, double amplitude, unsigned int repetitions)
+{
+    typedef typename rpi::DisplacementFieldTransform<TScalarType,3>::VectorFieldType FieldType;
+
+    typename FieldType::Pointer first  = createField<FieldType>(size, amplitude, 0.0);
+    typename FieldType::Pointer second = createField<FieldType>(size, amplitude, 1.0);
+
+    typename FieldType::Pointer rowMajor, bricked;
+    const double rowMajorTime = timeComposition<TScalarType>(first, second, false, repetitions, rowMajor);
+    const double brickedTime  = timeComposition<TScalarType>(first, second, true,  repetitions, bricked);
+
+    // The two layouts must give the same field
+    double difference = 0.0;
+    const itk::SizeValueType numberOfVoxels = rowMajor->GetBufferedRegion().GetNumberOfPixels();
+    for (itk::SizeValueType n=0; n<numberOfVoxels; n++)
+        for (unsigned int i=0; i<3; i++)
+            difference = std::max(difference, std::fabs(static_cast<double>(rowMajor->GetBufferPointer()[n][i] - bricked->GetBufferPointer()[n][i])));
+
+    std::cout << name << " fields" << std::endl;
+    std::cout << "  Row-major composition : " << rowMajorTime << " s" << std::endl;
+    std::cout << "  Bricked composition   : " << brickedTime  << " s" << std::endl;
+    std::cout << "  Speed-up              : " << rowMajorTime / brickedTime << std::endl;
+    std::cout << "  Largest difference    : " << difference << std::endl;
+}
+
+
+
+/**
+ * Main function.
+ */
+int main(int argc, char** argv)
+{
+    const unsigned int size        = (argc > 1) ? std::atoi(argv[1]) : 160;
+    const double       amplitude   = (argc > 2) ? std::atof(argv[2]) : 12.0;
+    const unsigned int repetitions = (argc > 3) ? std::atoi(argv[3]) : 3;
+    if (size < 2 || repetitions < 1)
+    {
+        std::cerr << "Usage: " << argv[0] << " [size [amplitude [repetitions]]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Field size " << size << "^3, displacements up to " << amplitude << " voxels, "
+              << repetitions << " repetitions" << std::endl;
+    try
+    {
+        run<float>( "Float",  size, amplitude, repetitions);
+        run<double>("Double", size, amplitude, repetitions);
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
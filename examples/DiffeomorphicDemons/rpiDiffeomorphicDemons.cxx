@@ -8,6 +8,12 @@
 #include <itkDiffeomorphicDemonsRegistrationFilter.h>
 #include <itkFastSymmetricForcesDemonsRegistrationFilter.h>
 #include <itkNearestNeighborInterpolateImageFunction.h>
+#include <itkRecursiveMultiResolutionPyramidImageFilter.h>
+#include <itkResampleImageFilter.h>
+#include <itkVectorLinearInterpolateImageFunction.h>
+#include <itkDisplacementFieldLogarithm.h>
+#include <itkLogDomainDemonsRegistrationFilter.h>
+#include <itkPrecomputedMultiResolutionPyramidImageFilter.h>
 #include "rpiDiffeomorphicDemons.hxx"
 
 
@@ -91,8 +97,12 @@ DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
         return ( type = "diffeomorphic" );
     else if ( this->m_updateRule == UPDATE_ADDITIVE )
         return ( type = "additive" );
-    else // m_updateRule == UPDATE_COMPOSITIVE
+    else if ( this->m_updateRule == UPDATE_COMPOSITIVE )
         return ( type = "compositive" );
+    else if ( this->m_updateRule == UPDATE_LOG_DOMAIN )
+        return ( type = "log-domain" );
+    else // m_updateRule == UPDATE_SYMMETRIC_LOG_DOMAIN
+        return ( type = "symmetric log-domain" );
 }
 
 
@@ -254,33 +264,137 @@ DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
 
 
 
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+const typename DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >::FixedImagePyramidType &
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::GetFixedImagePyramid(void) const
+{
+    return this->m_fixedImagePyramid;
+}
+
+
+
 template < class TFixedImage, class TMovingImage, class TTransformScalarType >
 void
 DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
-::StartRegistration(void)
+::SetFixedImagePyramid(const FixedImagePyramidType & pyramid)
 {
+    this->m_fixedImagePyramid = pyramid;
+}
 
 
-    // Check if fixed image has been set
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::ComputeFixedImagePyramid(void)
+{
     if (this->m_fixedImage.IsNull())
         throw std::runtime_error( "Fixed image has not been set." );
+    if (this->m_iterations.empty())
+        throw std::runtime_error( "The number of iterations must be given for at least one level." );
+
+    // Same pyramid as the default pyramid of itk::MultiResolutionPDEDeformableRegistration
+    typedef itk::RecursiveMultiResolutionPyramidImageFilter< TFixedImage, TFixedImage > PyramidFilterType;
+    typename PyramidFilterType::Pointer pyramid = PyramidFilterType::New();
+    pyramid->SetInput(          this->m_fixedImage );
+    pyramid->SetNumberOfLevels( this->m_iterations.size() );
+    try
+    {
+        pyramid->UpdateLargestPossibleRegion();
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::string message = "Could not compute the fixed image pyramid: ";
+        message += err.GetDescription();
+        throw std::runtime_error( message );
+    }
 
+    this->m_fixedImagePyramid.clear();
+    for (unsigned int level=0; level<this->m_iterations.size(); level++)
+    {
+        typename TFixedImage::Pointer image = pyramid->GetOutput(level);
+        image->DisconnectPipeline();
+        this->m_fixedImagePyramid.push_back( image.GetPointer() );
+    }
+}
 
-    // Check if moving image has been set
-    if (this->m_movingImage.IsNull())
-        throw std::runtime_error( "Moving image has not been set." );
 
 
-    // Type definition
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+const typename DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >::HistogramType *
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::GetHistogramMatchingReference(void) const
+{
+    return this->m_histogramMatchingReference.GetPointer();
+}
 
-    typedef  typename  TransformType::VectorFieldType
-            VectorFieldType;
 
-    typedef  typename  itk::MultiResolutionPDEDeformableRegistration< TFixedImage, TMovingImage, VectorFieldType, typename TFixedImage::PixelType >
-            MultiResRegistrationFilterType;
 
-    typedef  typename  itk::PDEDeformableRegistrationFilter< TFixedImage, TMovingImage, VectorFieldType >
-            BaseRegistrationFilterType;
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::SetHistogramMatchingReference(const HistogramType * histogram)
+{
+    this->m_histogramMatchingReference = histogram;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::ComputeHistogramMatchingReference(void)
+{
+    if (this->m_fixedImage.IsNull())
+        throw std::runtime_error( "Fixed image has not been set." );
+
+    // The matcher builds the reference histogram from the fixed image and keeps it as an input
+    typename HistogramMatchingFilterType::Pointer matcher = NewHistogramMatchingFilter();
+    matcher->SetInput(          this->m_fixedImage );
+    matcher->SetReferenceImage( this->m_fixedImage );
+    try
+    {
+        matcher->Update();
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        throw std::runtime_error( "Could not compute the histogram of the fixed image." );
+    }
+    this->m_histogramMatchingReference = matcher->GetReferenceHistogram();
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+typename DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >::HistogramMatchingFilterType::Pointer
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::NewHistogramMatchingFilter(void)
+{
+    typename HistogramMatchingFilterType::Pointer matcher = HistogramMatchingFilterType::New();
+    matcher->SetNumberOfHistogramLevels( 1024 );
+    matcher->SetNumberOfMatchPoints(     7 );
+    matcher->ThresholdAtMeanIntensityOn();
+    return matcher;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::StartRegistration(void)
+{
+
+
+    // Check if fixed image has been set
+    if (this->m_fixedImage.IsNull())
+        throw std::runtime_error( "Fixed image has not been set." );
+
+
+    // Check if moving image has been set
+    if (this->m_movingImage.IsNull())
+        throw std::runtime_error( "Moving image has not been set." );
 
 
     // Local images
@@ -291,14 +405,18 @@ DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
     // Match the histogram between the fixed and moving images
     if ( this->m_useHistogramMatching )
     {
-        // Create and set the historgam matcher
-        typedef itk::HistogramMatchingImageFilter< TMovingImage, TMovingImage> MatchingFilterType;
-        typename MatchingFilterType::Pointer matcher = MatchingFilterType::New();
-        matcher->SetInput(                   this->m_movingImage );
-        matcher->SetReferenceImage(          this->m_fixedImage );
-        matcher->SetNumberOfHistogramLevels( 1024 );
-        matcher->SetNumberOfMatchPoints(     7 );
-        matcher->ThresholdAtMeanIntensityOn();
+        // Create and set the historgam matcher. A reference histogram set by the user is shared: the
+        // matcher works on a shallow copy of it, instead of computing it from the fixed image.
+        typename HistogramMatchingFilterType::Pointer matcher = NewHistogramMatchingFilter();
+        matcher->SetInput(          this->m_movingImage );
+        matcher->SetReferenceImage( this->m_fixedImage );
+        if ( this->m_histogramMatchingReference.IsNotNull() )
+        {
+            typename HistogramType::Pointer histogram = HistogramType::New();
+            histogram->Graft( this->m_histogramMatchingReference );
+            matcher->SetReferenceHistogram( histogram );
+            matcher->GenerateReferenceHistogramFromImageOff();
+        }
 
         // Update the matcher
         try
@@ -316,6 +434,66 @@ DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
     }
 
 
+    // Fixed images of the levels, computed here unless a pyramid has been set
+    if ( this->m_iterations.empty() )
+        throw std::runtime_error( "The number of iterations must be given for at least one level." );
+    const bool computeFixedImagePyramid = this->m_fixedImagePyramid.empty();
+    if ( computeFixedImagePyramid )
+        this->ComputeFixedImagePyramid();
+    else if ( this->m_fixedImagePyramid.size()!=this->m_iterations.size() )
+        throw std::runtime_error( "The fixed image pyramid must contain one image per level." );
+
+
+    // Registration: the log-domain update rules estimate a stationary velocity field, the other update
+    // rules a displacement field
+    try
+    {
+        if ( this->m_updateRule == UPDATE_LOG_DOMAIN || this->m_updateRule == UPDATE_SYMMETRIC_LOG_DOMAIN )
+            this->StartLogDomainRegistration( fixedImage, movingImage );
+        else
+            this->StartDisplacementFieldRegistration( fixedImage, movingImage );
+    }
+    catch( ... )
+    {
+        if ( computeFixedImagePyramid )
+            this->m_fixedImagePyramid.clear();
+        throw;
+    }
+
+
+    // Free the fixed image pyramid, a pyramid set by the user being kept
+    if ( computeFixedImagePyramid )
+        this->m_fixedImagePyramid.clear();
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::StartDisplacementFieldRegistration(const TFixedImage * fixedImage, const TMovingImage * movingImage)
+{
+
+
+    // Type definition
+
+    typedef  typename  TransformType::VectorFieldType
+            VectorFieldType;
+
+    typedef  typename  itk::MultiResolutionPDEDeformableRegistration< TFixedImage, TMovingImage, VectorFieldType, typename TFixedImage::PixelType >
+            MultiResRegistrationFilterType;
+
+    typedef  typename  itk::PDEDeformableRegistrationFilter< TFixedImage, TMovingImage, VectorFieldType >
+            BaseRegistrationFilterType;
+
+    typedef  typename  itk::PrecomputedMultiResolutionPyramidImageFilter< TFixedImage, TFixedImage >
+            FixedPyramidType;
+
+
+    if ( dynamic_cast< TransformType * >( this->m_transform.GetPointer() ) == ITK_NULLPTR )
+        this->m_transform = TransformType::New();
+
+
     // Initialize the filter
     typename BaseRegistrationFilterType::Pointer filter;
     switch ( this->m_updateRule )
@@ -390,8 +568,15 @@ DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
     //filter->SetIntensityDifferenceThreshold( 0.001 );
 
 
+    // The fixed image pyramid is precomputed (see ComputeFixedImagePyramid)
+    typename FixedPyramidType::Pointer fixedPyramid = FixedPyramidType::New();
+    fixedPyramid->SetNumberOfLevels( this->m_iterations.size() );
+    fixedPyramid->SetLevelImages(    this->m_fixedImagePyramid );
+
+
     // Define the multi-resolution filter
     typename MultiResRegistrationFilterType::Pointer multires = MultiResRegistrationFilterType::New();
+    multires->SetFixedImagePyramid(  fixedPyramid );
     multires->SetFixedImage(         fixedImage );
     multires->SetMovingImage(        movingImage );
     multires->SetRegistrationFilter( filter );
@@ -432,6 +617,138 @@ DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
 }
 
 
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+::StartLogDomainRegistration(const TFixedImage * fixedImage, const TMovingImage * movingImage)
+{
+
+
+    // Type definition
+
+    typedef  typename  SVFTransformType::VectorFieldType
+            VelocityFieldType;
+
+    typedef  typename  TransformType::VectorFieldType
+            DisplacementFieldType;
+
+    typedef  typename  itk::LogDomainDemonsRegistrationFilter< TFixedImage, TMovingImage, VelocityFieldType >
+            RegistrationFilterType;
+
+    typedef  typename  RegistrationFilterType::GradientType
+            Gradient;
+
+    typedef  typename  itk::RecursiveMultiResolutionPyramidImageFilter< TMovingImage, TMovingImage >
+            MovingPyramidType;
+
+    typedef  typename  itk::ResampleImageFilter< VelocityFieldType, VelocityFieldType, double >
+            FieldResamplerType;
+
+    typedef  typename  itk::VectorLinearInterpolateImageFunction< VelocityFieldType, double >
+            FieldInterpolatorType;
+
+    typedef  typename  itk::DisplacementFieldLogarithm< DisplacementFieldType, VelocityFieldType >
+            LogarithmFilterType;
+
+
+    const unsigned int numberOfLevels = this->m_iterations.size();
+    typename VelocityFieldType::Pointer velocity;
+
+    try
+    {
+
+        // Moving image pyramid, from the coarsest (level 0) to the finest level (input image). The fixed
+        // image pyramid is precomputed (see ComputeFixedImagePyramid).
+        typename MovingPyramidType::Pointer movingPyramid = MovingPyramidType::New();
+        movingPyramid->SetInput(          movingImage );
+        movingPyramid->SetNumberOfLevels( numberOfLevels );
+        movingPyramid->UpdateLargestPossibleRegion();
+
+
+        // The initial velocity field is the logarithm of the initial displacement field
+        if (this->m_initialTransform.IsNotNull())
+        {
+            typename TransformType::Pointer     transform = this->m_initialTransform;
+            typename LogarithmFilterType::Pointer logarithm = LogarithmFilterType::New();
+            logarithm->SetInput( transform->GetParametersAsVectorField() );
+            logarithm->Update();
+            velocity = logarithm->GetOutput();
+            velocity->DisconnectPipeline();
+        }
+
+
+        // Estimate the velocity field level by level
+        for (unsigned int level=0; level<numberOfLevels; level++)
+        {
+            // The images of the fixed pyramid are shared: the filter works on a shallow copy of them, so
+            // that its pipeline never modifies the shared images
+            typename TFixedImage::Pointer fixedLevelImage = TFixedImage::New();
+            fixedLevelImage->Graft( this->m_fixedImagePyramid[level] );
+
+            // Resample the velocity field of the previous level on the grid of the current level
+            if ( velocity.IsNotNull() &&
+                 ( velocity->GetLargestPossibleRegion() != fixedLevelImage->GetLargestPossibleRegion() ||
+                   velocity->GetSpacing()               != fixedLevelImage->GetSpacing() ||
+                   velocity->GetOrigin()                != fixedLevelImage->GetOrigin() ||
+                   velocity->GetDirection()             != fixedLevelImage->GetDirection() ) )
+            {
+                typename FieldResamplerType::Pointer resampler = FieldResamplerType::New();
+                resampler->SetInput(                       velocity );
+                resampler->SetInterpolator(                FieldInterpolatorType::New() );
+                resampler->SetOutputParametersFromImage(   fixedLevelImage );
+                resampler->Update();
+                velocity = resampler->GetOutput();
+                velocity->DisconnectPipeline();
+            }
+
+            if ( this->m_iterations[level]==0 )
+                continue;
+
+            // Register the images of the current level
+            typename RegistrationFilterType::Pointer filter = RegistrationFilterType::New();
+            filter->SetFixedImage(                     fixedLevelImage );
+            filter->SetMovingImage(                    movingPyramid->GetOutput(level) );
+            filter->SetNumberOfIterations(             this->m_iterations[level] );
+            filter->SetMaximumUpdateStepLength(        this->m_maximumUpdateStepLength );
+            filter->SetUseGradientType(                static_cast<Gradient>( this->m_gradientType ) );
+            filter->SetUpdateFieldStandardDeviation(   this->m_updateFieldStandardDeviation );
+            filter->SetVelocityFieldStandardDeviation( this->m_displacementFieldStandardDeviation );
+            filter->SetSymmetric(                      this->m_updateRule == UPDATE_SYMMETRIC_LOG_DOMAIN );
+            if ( velocity.IsNotNull() )
+                filter->SetInitialVelocityField( velocity );
+            filter->Update();
+            velocity = filter->GetOutput();
+            velocity->DisconnectPipeline();
+        }
+
+
+        // Velocity field on the grid of the fixed image (all levels may have been skipped)
+        if ( velocity.IsNull() )
+        {
+            velocity = VelocityFieldType::New();
+            velocity->CopyInformation( fixedImage );
+            velocity->SetRegions( fixedImage->GetLargestPossibleRegion() );
+            velocity->Allocate();
+            velocity->FillBuffer( itk::NumericTraits<typename VelocityFieldType::PixelType>::ZeroValue() );
+        }
+
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::string message = "Unexpected error: ";
+        message += err.GetDescription();
+        throw std::runtime_error( message  );
+    }
+
+
+    // Set the velocity field to the transformation object
+    typename SVFTransformType::Pointer transform = SVFTransformType::New();
+    transform->SetParametersAsVectorField( velocity.GetPointer() );
+    this->m_transform = transform;
+}
+
+
 } // End of namespace
 
 
@@ -4,8 +4,12 @@
 
 
 
+#include <vector>
+
 #include "rpiRegistrationMethod.hxx"
 #include <rpiDisplacementFieldTransform.h>
+#include <itkStationaryVelocityFieldTransform.h>
+#include <itkHistogramMatchingImageFilter.h>
 
 // Namespace RPI : Registration Programming Interface
 namespace rpi
@@ -16,6 +20,15 @@ namespace rpi
  * Diffeomorphic demons registration method. This class is based on the ITK diffeormorphic demons
  * implementation (filter).
  *
+ * The log-domain update rules keep a stationary velocity field as the state of the registration (see
+ * itk::LogDomainDemonsRegistrationFilter): the transformation estimated is then an
+ * itk::StationaryVelocityFieldTransform, whose inverse is obtained by negating the velocity field.
+ * The other update rules estimate a rpi::DisplacementFieldTransform.
+ *
+ * The fixed image pyramid and the reference histogram of the histogram matching only depend on the
+ * fixed image: they can be computed once and shared by the registrations of several moving images to
+ * the same fixed image (see SetFixedImagePyramid and SetHistogramMatchingReference).
+ *
  * There are three templates for this class:
  *
  *   TFixedImage           Type of the fixed image. Must be an itk::Image< TPixel, 3 > where
@@ -41,9 +54,11 @@ public:
      * Update rule
      */
     enum UpdateRule {
-        UPDATE_DIFFEOMORPHIC, /** s <- s o exp(u)                       */
-        UPDATE_ADDITIVE,      /** s <- s + u      (ITK basic)           */
-        UPDATE_COMPOSITIVE    /** s <- s o (Id+u) (Thirion's proposal?) */
+        UPDATE_DIFFEOMORPHIC,        /** s <- s o exp(u)                       */
+        UPDATE_ADDITIVE,             /** s <- s + u      (ITK basic)           */
+        UPDATE_COMPOSITIVE,          /** s <- s o (Id+u) (Thirion's proposal?) */
+        UPDATE_LOG_DOMAIN,           /** exp(v) <- exp(v) o exp(u)             */
+        UPDATE_SYMMETRIC_LOG_DOMAIN  /** symmetric log-domain update           */
     };
 
     /**
@@ -62,6 +77,18 @@ public:
     typedef typename TransformType::Pointer
             TransformPointerType;
 
+    typedef itk::StationaryVelocityFieldTransform< TTransformScalarType, TFixedImage::ImageDimension >
+            SVFTransformType;
+
+    typedef std::vector< typename TFixedImage::ConstPointer >
+            FixedImagePyramidType;
+
+    typedef itk::HistogramMatchingImageFilter< TMovingImage, TMovingImage >
+            HistogramMatchingFilterType;
+
+    typedef typename HistogramMatchingFilterType::HistogramType
+            HistogramType;
+
 
 protected:
 
@@ -113,6 +140,45 @@ protected:
     bool                        m_useHistogramMatching;
 
 
+    /**
+     * Fixed images of the levels of resolution (from coarse to fine levels).
+     */
+    FixedImagePyramidType       m_fixedImagePyramid;
+
+
+    /**
+     * Reference histogram of the histogram matching.
+     */
+    typename HistogramType::ConstPointer
+                                m_histogramMatchingReference;
+
+
+    /**
+     * Creates the histogram matching filter with the parameters used by the registration.
+     * @return  histogram matching filter
+     */
+    static typename HistogramMatchingFilterType::Pointer
+                                NewHistogramMatchingFilter(void);
+
+
+    /**
+     * Performs the image registration with an update rule estimating a displacement field, with the
+     * multi-resolution demons of ITK.
+     * @param  fixedImage   fixed image
+     * @param  movingImage  moving image, after the histogram matching
+     */
+    void                        StartDisplacementFieldRegistration(const TFixedImage * fixedImage, const TMovingImage * movingImage);
+
+
+    /**
+     * Performs the image registration with a log-domain update rule: the velocity field is estimated
+     * from the coarsest to the finest level of the image pyramids.
+     * @param  fixedImage   fixed image
+     * @param  movingImage  moving image, after the histogram matching
+     */
+    void                        StartLogDomainRegistration(const TFixedImage * fixedImage, const TMovingImage * movingImage);
+
+
 public:
 
     /**
@@ -160,6 +226,8 @@ public:
      *   UPDATE_DIFFEOMORPHIC : s <- s o exp(u)
      *   UPDATE_ADDITIVE      : s <- s + u        (ITK basic)
      *   UPDATE_COMPOSITIVE   : s <- s o (Id+u)   (Thirion's proposal?)
+     *   UPDATE_LOG_DOMAIN    : exp(v) <- exp(v) o exp(u)
+     *   UPDATE_SYMMETRIC_LOG_DOMAIN : v <- 1/2 ( BCH(v,u) - BCH(-v,u') ), u' being the backward update
      * @param  value  update rule
      */
     void                        SetUpdateRule(UpdateRule value);
@@ -253,14 +321,61 @@ public:
 
 
     /**
-     * Sets the initial transformation.
+     * Sets the initial transformation. With a log-domain update rule, the initial velocity field is the
+     * logarithm of the displacement field.
      * @param  transform  initial transformation
      */
     void                        SetInitialTransformation(TransformType * transform);
 
 
     /**
-     * Performs the image registration. Must be called before GetTransformation().
+     * Gets the fixed image pyramid set by SetFixedImagePyramid or computed by ComputeFixedImagePyramid.
+     * @return  fixed images, one per level of resolution
+     */
+    const FixedImagePyramidType &  GetFixedImagePyramid(void) const;
+
+
+    /**
+     * Sets the fixed image pyramid, computed by ComputeFixedImagePyramid on a registration using the
+     * same fixed image and number of levels. The images are only read, so that the pyramid can be shared
+     * by registrations running concurrently. If no pyramid is set, it is computed by StartRegistration.
+     * @param  pyramid  fixed images, one per level of resolution
+     */
+    void                        SetFixedImagePyramid(const FixedImagePyramidType & pyramid);
+
+
+    /**
+     * Computes the fixed image pyramid from the fixed image and the number of levels of resolution.
+     */
+    void                        ComputeFixedImagePyramid(void);
+
+
+    /**
+     * Gets the reference histogram of the histogram matching.
+     * @return  reference histogram, null if it has not been set or computed
+     */
+    const HistogramType *       GetHistogramMatchingReference(void) const;
+
+
+    /**
+     * Sets the reference histogram of the histogram matching, computed by ComputeHistogramMatchingReference
+     * on a registration using the same fixed image. The histogram is only read, so that it can be shared
+     * by registrations running concurrently. If no histogram is set, the histogram matching computes it
+     * from the fixed image.
+     * @param  histogram  reference histogram
+     */
+    void                        SetHistogramMatchingReference(const HistogramType * histogram);
+
+
+    /**
+     * Computes the reference histogram of the histogram matching from the fixed image.
+     */
+    void                        ComputeHistogramMatchingReference(void);
+
+
+    /**
+     * Performs the image registration. Must be called before GetTransformation(). The transformation is
+     * a SVFTransformType for the log-domain update rules, and a TransformType otherwise.
      */
     virtual void                StartRegistration(void);
 
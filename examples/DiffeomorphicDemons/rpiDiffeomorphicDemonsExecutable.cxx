@@ -1,9 +1,13 @@
 #include <iostream>
+#include <algorithm>
 #include <cstdlib>
 #include <stdexcept>
+#include <thread>
 
 #include <tclap/CmdLine.h>
+#include <itkMultiThreaderBase.h>
 #include <rpiCommonTools.hxx>
+#include <rpiBatchProcessing.hxx>
 #include "rpiDiffeomorphicDemons.hxx"
 
 
@@ -34,6 +38,9 @@ struct Param{
     float        displacementFieldStandardDeviation;
     bool         useHistogramMatching;
     rpi::ImageInterpolatorType interpolatorType;
+    std::string  manifestPath;
+    unsigned int batchThreads;
+    unsigned int memoryBudget;
 };
 
 
@@ -49,7 +56,11 @@ void parseParameters(int argc, char** argv, struct Param & param)
     // Program description
     std::string description = "\b\b\bDESCRIPTION\n";
     description += "Diffeomorphic demons registration method. ";
-    description += "The transformation computed is a dense displacement field.";
+    description += "The transformation computed is a dense displacement field. ";
+    description += "In batch mode (--manifest), the moving images listed in the manifest are registered to the ";
+    description += "same fixed image, whose pyramid and histogram are computed once, several subjects being registered ";
+    description += "concurrently. Each line of the manifest contains a moving image, an output transformation and ";
+    description += "optionally an output image, separated by spaces ('#' starts a comment line).";
     description += "\nAuthors : Vincent Garcia and Tom Vercauteren";
 
     // Option description
@@ -73,7 +84,9 @@ void parseParameters(int argc, char** argv, struct Param & param)
     des_maxStepLength                   += "Setting it to 0 implies no restrictions will be made on the step length.";
 
     std::string des_updateRule           = "Update rule:  0: s <- s o exp(u) (diffeomorphic) ; ";
-    des_updateRule                      += "1: s <- s + u (additive, ITK basic); 2: s <- s o (Id+u) (compositive, Thirion's proposal?) (default 0).";
+    des_updateRule                      += "1: s <- s + u (additive, ITK basic); 2: s <- s o (Id+u) (compositive, Thirion's proposal?); ";
+    des_updateRule                      += "3: exp(v) <- exp(v) o exp(u) (log-domain); 4: symmetric log-domain (default 0). ";
+    des_updateRule                      += "The log-domain rules write a stationary velocity field.";
 
     std::string des_iterations           = "Number of iterations per level of resolution (from coarse to fine levels). ";
     des_iterations                      += "Levels must be separated by \"x\" (default 15x10x5).";
@@ -86,10 +99,17 @@ void parseParameters(int argc, char** argv, struct Param & param)
 
     std::string des_outputTransform      = "Path of the output transformation (default output_transform.nii).";
 
-    std::string des_movingImage          = "Path to the moving image.";
+    std::string des_movingImage          = "Path to the moving image (required unless --manifest is set).";
 
     std::string des_fixedImage           = "Path to the fixed image.";
 
+    std::string des_manifest             = "Batch mode: path to the manifest listing the moving images and the output paths (replaces -m, -t and -i).";
+
+    std::string des_batchThreads         = "Batch mode: maximum number of subjects registered concurrently (default 0, i.e. the number of cores).";
+
+    std::string des_memoryBudget         = "Batch mode: memory (MB) shared by the subjects registered concurrently, a subject starting ";
+    des_memoryBudget                    += "once its estimated memory fits into the budget (default 0, i.e. no limit).";
+
 
     try {
 
@@ -97,6 +117,9 @@ void parseParameters(int argc, char** argv, struct Param & param)
         TCLAP::CmdLine cmd( description, ' ', "1.0", true );
 
         // Set options
+        TCLAP::ValueArg<unsigned int> arg_memoryBudget( "", "memory-budget", des_memoryBudget, false, 0, "uint", cmd );
+        TCLAP::ValueArg<unsigned int> arg_batchThreads( "", "batch-threads", des_batchThreads, false, 0, "uint", cmd );
+        TCLAP::ValueArg<std::string>  arg_manifest( "", "manifest", des_manifest, false, "", "string", cmd );
         TCLAP::ValueArg<unsigned int> arg_interpolatorType( "", "interpolator-type", des_interpolatorType, false, 1, "int", cmd);
         TCLAP::SwitchArg              arg_useHistogramMatching( "",  "use-histogram-matching", des_useHistogramMatching, cmd, false);
         TCLAP::ValueArg<float>        arg_disFieldSigma( "d", "displacement-field-sigma", des_disFieldSigma, false, 1.5, "float", cmd );
@@ -109,7 +132,7 @@ void parseParameters(int argc, char** argv, struct Param & param)
         TCLAP::ValueArg<std::string>  arg_initFieldTransform( "", "initial-transform", des_initFieldTransform,  false, "", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_outputImage( "i", "output-image", des_outputImage, false, "output_image.nii", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_outputTransform( "t", "output-transform", des_outputTransform, false, "output_transform.nii", "string", cmd );
-        TCLAP::ValueArg<std::string>  arg_movingImage( "m", "moving-image", des_movingImage, true, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_movingImage( "m", "moving-image", des_movingImage, false, "", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_fixedImage( "f", "fixed-image", des_fixedImage, true, "", "string", cmd );
 
         // Parse the command line
@@ -129,6 +152,9 @@ void parseParameters(int argc, char** argv, struct Param & param)
         param.updateFieldStandardDeviation       = arg_upFieldSigma.getValue();
         param.displacementFieldStandardDeviation = arg_disFieldSigma.getValue();
         param.useHistogramMatching               = arg_useHistogramMatching.getValue();
+        param.manifestPath                       = arg_manifest.getValue();
+        param.batchThreads                       = arg_batchThreads.getValue();
+        param.memoryBudget                       = arg_memoryBudget.getValue();
 
         // Set the interpolator type
         unsigned int interpolator_type = arg_interpolatorType.getValue();
@@ -148,6 +174,12 @@ void parseParameters(int argc, char** argv, struct Param & param)
         std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
         throw std::runtime_error("Unable to parse the command line arguments.");
     }
+
+    // Either a moving image or a manifest
+    if (param.movingImagePath.empty() == param.manifestPath.empty())
+        throw std::runtime_error("Either a moving image (-m) or a manifest (--manifest) must be set.");
+    if (!param.manifestPath.empty() && (!param.intialLinearTransformPath.empty() || !param.intialFieldTransformPath.empty()))
+        throw std::runtime_error("The initial transformations are not supported in batch mode.");
 }
 
 
@@ -201,6 +233,214 @@ void PrintParameters( std::string fixedImagePath,
 
 
 
+/**
+  * Sets the parameters of the registration method (images and initial transformation excepted).
+  * @param  param         parameters
+  * @param  registration  registration object
+  */
+template< class TFixedImage, class TMovingImage, class TTransformScalarType >
+void SetMethodParameters( const struct Param & param,
+                          rpi::DiffeomorphicDemons<TFixedImage, TMovingImage, TTransformScalarType> * registration )
+{
+    typedef rpi::DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+            RegistrationMethod;
+
+    registration->SetNumberOfIterations(                 rpi::StringToVector<unsigned int>( param.iterations ) );
+    registration->SetMaximumUpdateStepLength(            param.maximumUpdateStepLength );
+    registration->SetUpdateFieldStandardDeviation(       param.updateFieldStandardDeviation );
+    registration->SetDisplacementFieldStandardDeviation( param.displacementFieldStandardDeviation );
+    registration->SetUseHistogramMatching(               param.useHistogramMatching );
+
+
+    // Set update rule
+    switch( param.updateRule )
+    {
+    case 0:
+        registration->SetUpdateRule( RegistrationMethod::UPDATE_DIFFEOMORPHIC ); break;
+    case 1:
+        registration->SetUpdateRule( RegistrationMethod::UPDATE_ADDITIVE );      break;
+    case 2:
+        registration->SetUpdateRule( RegistrationMethod::UPDATE_COMPOSITIVE );   break;
+    case 3:
+        registration->SetUpdateRule( RegistrationMethod::UPDATE_LOG_DOMAIN );    break;
+    case 4:
+        registration->SetUpdateRule( RegistrationMethod::UPDATE_SYMMETRIC_LOG_DOMAIN ); break;
+    default:
+        throw std::runtime_error( "Update rule must fit in the range [0,4]." );
+    }
+
+
+    // Set gradient type
+    switch( param.gradientType )
+    {
+    case 0:
+        registration->SetGradientType( RegistrationMethod::GRADIENT_SYMMETRIZED );         break;
+    case 1:
+        registration->SetGradientType( RegistrationMethod::GRADIENT_FIXED_IMAGE );         break;
+    case 2:
+        registration->SetGradientType( RegistrationMethod::GRADIENT_WARPED_MOVING_IMAGE ); break;
+    case 3:
+        registration->SetGradientType( RegistrationMethod::GRADIENT_MAPPED_MOVING_IMAGE ); break;
+    default:
+        throw std::runtime_error( "Gradient type must fit in the range [0,3]." );
+    }
+}
+
+
+
+/**
+  * Writes the transformation computed by the registration: a stationary velocity field for the
+  * log-domain update rules, a displacement field otherwise.
+  * @param  registration  registration object
+  * @param  fileName      path to the output transformation
+  */
+template< class TFixedImage, class TMovingImage, class TTransformScalarType >
+void WriteTransformation( const rpi::DiffeomorphicDemons<TFixedImage, TMovingImage, TTransformScalarType> * registration,
+                          const std::string & fileName )
+{
+    typedef rpi::DiffeomorphicDemons< TFixedImage, TMovingImage, TTransformScalarType >
+            RegistrationMethod;
+
+    if ( registration->GetUpdateRule()==RegistrationMethod::UPDATE_LOG_DOMAIN ||
+         registration->GetUpdateRule()==RegistrationMethod::UPDATE_SYMMETRIC_LOG_DOMAIN )
+        rpi::writeStationaryVelocityFieldTransformation<TTransformScalarType, TFixedImage::ImageDimension>(
+                    registration->GetTransformation(),
+                    fileName );
+    else
+        rpi::writeDisplacementFieldTransformation<TTransformScalarType, TFixedImage::ImageDimension>(
+                    registration->GetTransformation(),
+                    fileName );
+}
+
+
+
+/**
+  * Starts the batch program: registers the moving images of the manifest to the fixed image.
+  * @param   param  parameters needed for the image registration process
+  * @return  EXIT_SUCCESS if all the registrations succeded, EXIT_FAILURE otherwise
+  */
+template< class TFixedImage, class TMovingImage >
+int StartBatchProgram(struct Param param)
+{
+
+    typedef float
+            TransformScalarType;
+
+    typedef rpi::DiffeomorphicDemons< TFixedImage, TMovingImage, TransformScalarType >
+            RegistrationMethod;
+
+    try
+    {
+        // Read the manifest and the fixed image
+        std::vector<rpi::BatchSubject> subjects   = rpi::readBatchManifest( param.manifestPath );
+        typename TFixedImage::Pointer  fixedImage = rpi::readImage< TFixedImage >( param.fixedImagePath );
+
+
+        // Print parameters
+        RegistrationMethod prototype;
+        prototype.SetFixedImage( fixedImage );
+        SetMethodParameters< TFixedImage, TMovingImage, TransformScalarType >( param, &prototype );
+        std::cout << std::endl;
+        std::cout << "I/O PARAMETERS"                             << std::endl;
+        std::cout << "  Fixed image path                      : " << param.fixedImagePath << std::endl;
+        std::cout << "  Manifest path                         : " << param.manifestPath   << std::endl;
+        std::cout << "  Number of subjects                    : " << subjects.size()      << std::endl;
+        std::cout << "  Memory budget (MB)                    : " << param.memoryBudget   << std::endl << std::endl;
+        std::cout << "METHOD PARAMETERS"                          << std::endl;
+        std::cout << "  Iterations                            : " << rpi::VectorToString<unsigned int>( prototype.GetNumberOfIterations() ) << std::endl;
+        std::cout << "  Update rule                           : " << prototype.GetUpdateRuleAsString()                                      << std::endl;
+        std::cout << "  Maximum step length                   : " << prototype.GetMaximumUpdateStepLength()              << " (voxel unit)" << std::endl;
+        std::cout << "  Gradient type                         : " << prototype.GetGradientTypeAsString()                                    << std::endl;
+        std::cout << "  Update field standard deviation       : " << prototype.GetUpdateFieldStandardDeviation()         << " (voxel unit)" << std::endl;
+        std::cout << "  Displacement field standard deviation : " << prototype.GetDisplacementFieldStandardDeviation()   << " (voxel unit)" << std::endl;
+        std::cout << "  Use histogram matching?               : " << rpi::BooleanToString( prototype.GetUseHistogramMatching() )            << std::endl;
+        std::cout << "  Interpolator type                     : " << rpi::getImageInterpolatorTypeAsString(param.interpolatorType)          << std::endl;
+        std::cout << std::endl;
+
+
+        // Display
+        std::cout << "STARTING BATCH PROGRAM" << std::endl;
+
+
+        // The fixed image pyramid and the reference histogram are computed once and shared by the subjects
+        std::cout << "  Computing fixed pyramid               : " << std::flush;
+        prototype.ComputeFixedImagePyramid();
+        const typename RegistrationMethod::FixedImagePyramidType pyramid = prototype.GetFixedImagePyramid();
+        std::cout << "OK" << std::endl;
+
+        typename RegistrationMethod::HistogramType::ConstPointer histogram;
+        if ( param.useHistogramMatching )
+        {
+            std::cout << "  Computing fixed histogram             : " << std::flush;
+            prototype.ComputeHistogramMatchingReference();
+            histogram = prototype.GetHistogramMatchingReference();
+            std::cout << "OK" << std::endl;
+        }
+
+
+        // The cores are shared between the subjects registered concurrently
+        unsigned int numberOfThreads = param.batchThreads;
+        if (numberOfThreads==0)
+            numberOfThreads = std::max( 1u, std::thread::hardware_concurrency() );
+        numberOfThreads = std::min<unsigned int>( numberOfThreads, subjects.size() );
+        itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(
+                std::max( 1u, itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() / numberOfThreads ) );
+
+
+        // Estimated memory of a subject: moving image, its histogram-matched copy and its pyramid, and
+        // about eight vector fields (output, update, smoothing and exponential buffers) and three images
+        // (warped image, gradient) on the grid of the fixed image
+        const std::size_t fixedVoxels = fixedImage->GetLargestPossibleRegion().GetNumberOfPixels();
+        auto estimate = [&](const rpi::BatchSubject & subject) -> std::size_t
+        {
+            return rpi::getImageMemorySize( subject.movingImagePath ) * 3 +
+                   fixedVoxels * ( 8 * TFixedImage::ImageDimension * sizeof(TransformScalarType) +
+                                   3 * sizeof(typename TMovingImage::PixelType) );
+        };
+
+
+        // Registration of a subject. The fixed image is shared: each subject works on a shallow copy.
+        auto process = [&](const rpi::BatchSubject & subject)
+        {
+            typename TFixedImage::Pointer  fixed  = TFixedImage::New();
+            fixed->Graft( fixedImage );
+            typename TMovingImage::Pointer moving = rpi::readImage< TMovingImage >( subject.movingImagePath );
+
+            RegistrationMethod registration;
+            registration.SetFixedImage(  fixed );
+            registration.SetMovingImage( moving );
+            SetMethodParameters< TFixedImage, TMovingImage, TransformScalarType >( param, &registration );
+            registration.SetFixedImagePyramid( pyramid );
+            registration.SetHistogramMatchingReference( histogram );
+            registration.StartRegistration();
+
+            WriteTransformation< TFixedImage, TMovingImage, TransformScalarType >( &registration, subject.outputTransformPath );
+            if (!subject.outputImagePath.empty())
+                rpi::resampleAndWriteImage<TFixedImage, TMovingImage, TransformScalarType>(
+                        fixed,
+                        moving,
+                        registration.GetTransformation(),
+                        subject.outputImagePath,
+                        param.interpolatorType );
+        };
+
+        const unsigned int failures = rpi::processBatch( subjects, process, estimate, numberOfThreads,
+                                                         static_cast<std::size_t>(param.memoryBudget) << 20 );
+        std::cout << "  Subjects registered                   : " << subjects.size() - failures << "/" << subjects.size() << std::endl << std::endl;
+        if (failures>0)
+            return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    };
+
+    return EXIT_SUCCESS;
+}
+
+
+
 /**
   * Starts the image registration.
   * @param   param  parameters needed for the image registration process
@@ -210,6 +450,10 @@ template< class TFixedImage, class TMovingImage >
 int StartMainProgram(struct Param param)
 {
 
+    // Batch mode
+    if (!param.manifestPath.empty())
+        return StartBatchProgram< TFixedImage, TMovingImage >(param);
+
     typedef float
             TransformScalarType;
 
@@ -237,41 +481,7 @@ int StartMainProgram(struct Param param)
         // Set parameters
         registration->SetFixedImage(                         fixedImage );
         registration->SetMovingImage(                        movingImage );
-        registration->SetNumberOfIterations(                 rpi::StringToVector<unsigned int>( param.iterations ) );
-        registration->SetMaximumUpdateStepLength(            param.maximumUpdateStepLength );
-        registration->SetUpdateFieldStandardDeviation(       param.updateFieldStandardDeviation );
-        registration->SetDisplacementFieldStandardDeviation( param.displacementFieldStandardDeviation );
-        registration->SetUseHistogramMatching(               param.useHistogramMatching );
-
-
-        // Set update rule
-        switch( param.updateRule )
-        {
-        case 0:
-            registration->SetUpdateRule( RegistrationMethod::UPDATE_DIFFEOMORPHIC ); break;
-        case 1:
-            registration->SetUpdateRule( RegistrationMethod::UPDATE_ADDITIVE );      break;
-        case 2:
-            registration->SetUpdateRule( RegistrationMethod::UPDATE_COMPOSITIVE );   break;
-        default:
-            throw std::runtime_error( "Update rule must fit in the range [0,2]." );
-        }
-
-
-        // Set gradient type
-        switch( param.gradientType )
-        {
-        case 0:
-            registration->SetGradientType( RegistrationMethod::GRADIENT_SYMMETRIZED );         break;
-        case 1:
-            registration->SetGradientType( RegistrationMethod::GRADIENT_FIXED_IMAGE );         break;
-        case 2:
-            registration->SetGradientType( RegistrationMethod::GRADIENT_WARPED_MOVING_IMAGE ); break;
-        case 3:
-            registration->SetGradientType( RegistrationMethod::GRADIENT_MAPPED_MOVING_IMAGE ); break;
-        default:
-            throw std::runtime_error( "Gradient type must fit in the range [0,3]." );
-        }
+        SetMethodParameters< TFixedImage, TMovingImage, TransformScalarType >( param, registration );
 
 
         // Set initialize transformation
@@ -316,9 +526,7 @@ int StartMainProgram(struct Param param)
 
         // Write the output transformation
         std::cout << "  Writing transformation                : " << std::flush;
-        rpi::writeDisplacementFieldTransformation<TransformScalarType, TFixedImage::ImageDimension>(
-                    registration->GetTransformation(),
-                    param.outputTransformPath );
+        WriteTransformation< TFixedImage, TMovingImage, TransformScalarType >( registration, param.outputTransformPath );
         std::cout << "OK" << std::endl;
 
 
@@ -353,16 +561,27 @@ int main(int argc, char** argv)
 {
     // Parse parameters
     struct Param param;
-    parseParameters( argc, argv, param);
+    try
+    {
+        parseParameters( argc, argv, param);
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
 
-    // Read image information
+    // Read image information. In batch mode, the moving image information is given by the first subject.
     itk::ImageIOBase::Pointer fixed_imageIO;
     itk::ImageIOBase::Pointer moving_imageIO;
     try
     {
         fixed_imageIO  = rpi::readImageInformation( param.fixedImagePath );
-        moving_imageIO = rpi::readImageInformation( param.movingImagePath );
+        if (param.manifestPath.empty())
+            moving_imageIO = rpi::readImageInformation( param.movingImagePath );
+        else
+            moving_imageIO = rpi::readImageInformation( rpi::readBatchManifest( param.manifestPath )[0].movingImagePath );
     }
     catch( std::exception& e )
     {
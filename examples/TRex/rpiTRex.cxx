@@ -1,11 +1,22 @@
 #ifndef _RPI_TREX_CXX_
 #define _RPI_TREX_CXX_
 
-#include <itkMattesMutualInformationImageToImageMetric.h>
-#include <itkImageRegistrationMethod.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <vector>
+#include <itkMattesMutualInformationImageToImageMetricv4.h>
+#include <itkImageRegistrationMethodv4.h>
 #include <itkCenteredTransformInitializer.h>
+#include <itkDiscreteGaussianImageFilter.h>
 #include <itkLinearInterpolateImageFunction.h>
-#include <itkRegularStepGradientDescentOptimizer.h>
+#include <itkMultiThreaderBase.h>
+#include <itkRegularStepGradientDescentOptimizerv4.h>
 
 #include "rpiTRex.hxx"
 
@@ -23,8 +34,20 @@ TRex< TFixedImage, TMovingImage, TTransformScalarType >
 {
 
     // Initialization
-    this->m_iterations = 5000;
-    this->m_transform  = TransformType::New();
+    this->m_iterations            = 5000;
+    this->m_convergenceWindowSize = 10;
+    this->m_convergenceThreshold  = 1e-6;
+    this->m_rotationStep          = 0.0;
+    this->m_numberOfKeptStarts    = 4;
+    this->m_transform             = TransformType::New();
+
+    // Default pyramid: images shrunk by 4, 2, then full resolution
+    this->m_shrinkFactors.push_back( 4 );
+    this->m_shrinkFactors.push_back( 2 );
+    this->m_shrinkFactors.push_back( 1 );
+    this->m_smoothingSigmas.push_back( 2.0f );
+    this->m_smoothingSigmas.push_back( 1.0f );
+    this->m_smoothingSigmas.push_back( 0.0f );
 }
 
 
@@ -58,6 +81,446 @@ TRex< TFixedImage, TMovingImage, TTransformScalarType >
 
 
 
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+std::vector<unsigned int>
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetShrinkFactors(void) const
+{
+    return this->m_shrinkFactors;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetShrinkFactors(std::vector<unsigned int> factors)
+{
+    this->m_shrinkFactors = factors;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+std::vector<float>
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetSmoothingSigmas(void) const
+{
+    return this->m_smoothingSigmas;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetSmoothingSigmas(std::vector<float> sigmas)
+{
+    this->m_smoothingSigmas = sigmas;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetConvergenceWindowSize(void) const
+{
+    return this->m_convergenceWindowSize;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetConvergenceWindowSize(unsigned int value)
+{
+    this->m_convergenceWindowSize = value;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+double
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetConvergenceThreshold(void) const
+{
+    return this->m_convergenceThreshold;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetConvergenceThreshold(double value)
+{
+    this->m_convergenceThreshold = value;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+double
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetRotationStep(void) const
+{
+    return this->m_rotationStep;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetRotationStep(double value)
+{
+    // Each start is a full registration at the coarsest level: a step of 30 degrees already gives
+    // several hundreds of starts
+    if ( value==0.0 || ( value>=30.0 && value<=360.0 ) )
+        this->m_rotationStep = value;
+    else
+        throw std::runtime_error( "Rotation step must be 0 (single start) or in the range [30,360] degrees." );
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetNumberOfKeptStarts(void) const
+{
+    return this->m_numberOfKeptStarts;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetNumberOfKeptStarts(unsigned int value)
+{
+    this->m_numberOfKeptStarts = value;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+std::vector< typename TRex< TFixedImage, TMovingImage, TTransformScalarType >::TransformPointerType >
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GenerateStarts(const TransformType * initialTransform) const
+{
+    // Angles of the grid: multiples of the step in [0, 2 pi)
+    std::vector<double> angles;
+    const double step = this->m_rotationStep * std::acos(-1.0) / 180.0;
+    for (unsigned int i=0; i*step < 2.0*std::acos(-1.0) - 1e-6; i++)
+        angles.push_back( i*step );
+
+    // Rotations around the center of the fixed image, the translation aligning the centers of the
+    // images being kept. Several triplets of Euler angles give the same rotation (e.g. gimbal lock): the
+    // rotations already generated are identified by their matrix, rounded to 1e-6, in a sorted set.
+    std::vector<TransformPointerType>      starts;
+    std::set< std::vector<long long> >     matrices;
+    for (unsigned int x=0; x<angles.size(); x++)
+        for (unsigned int y=0; y<angles.size(); y++)
+            for (unsigned int z=0; z<angles.size(); z++)
+            {
+                TransformPointerType start = TransformType::New();
+                start->SetCenter(      initialTransform->GetCenter() );
+                start->SetTranslation( initialTransform->GetTranslation() );
+                start->SetRotation(    angles[x], angles[y], angles[z] );
+
+                std::vector<long long> key;
+                for (unsigned int r=0; r<3; r++)
+                    for (unsigned int c=0; c<3; c++)
+                        key.push_back( std::llround( start->GetMatrix()[r][c] * 1e6 ) );
+                if ( matrices.insert( key ).second )
+                    starts.push_back( start );
+            }
+    return starts;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+const typename TRex< TFixedImage, TMovingImage, TTransformScalarType >::FixedImagePyramidType &
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::GetFixedImagePyramid(void) const
+{
+    return this->m_fixedImagePyramid;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SetFixedImagePyramid(const FixedImagePyramidType & pyramid)
+{
+    this->m_fixedImagePyramid = pyramid;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::ComputeFixedImagePyramid(void)
+{
+    if (this->m_fixedImage.IsNull())
+        throw std::runtime_error( "Fixed image has not been set." );
+
+    this->m_fixedImagePyramid.clear();
+    for (unsigned int i=0; i<this->m_smoothingSigmas.size(); i++)
+        this->m_fixedImagePyramid.push_back( SmoothImage< TFixedImage >( this->m_fixedImage, this->m_smoothingSigmas[i] ) );
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+template < class TImage >
+typename TImage::ConstPointer
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::SmoothImage(const TImage * image, float sigma)
+{
+    if (sigma==0.0f)
+        return image;
+
+    // Variance in physical units, the sigma being given in voxels
+    typedef itk::DiscreteGaussianImageFilter< TImage, TImage >  SmoothingFilterType;
+    typename SmoothingFilterType::ArrayType variance;
+    for (unsigned int d=0; d<TImage::ImageDimension; d++)
+        variance[d] = std::pow( sigma * image->GetSpacing()[d], 2 );
+
+    typename SmoothingFilterType::Pointer filter = SmoothingFilterType::New();
+    filter->SetInput(           image );
+    filter->SetVariance(        variance );
+    filter->SetUseImageSpacing( true );
+    filter->SetMaximumError(    0.01 );
+    try
+    {
+        filter->Update();
+    }
+    catch( itk::ExceptionObject & err )
+    {
+        std::string message = "Could not smooth the image: ";
+        message += err.GetDescription();
+        throw std::runtime_error( message );
+    }
+
+    typename TImage::Pointer output = filter->GetOutput();
+    output->DisconnectPipeline();
+    return output.GetPointer();
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+double
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::OptimizeLevels(TransformType * transform, unsigned int firstLevel, unsigned int numberOfLevels,
+                 unsigned int numberOfWorkUnits, bool notify)
+{
+
+    // Type definition
+    typedef itk::RegularStepGradientDescentOptimizerv4< double >                              OptimizerType;
+    typedef itk::MattesMutualInformationImageToImageMetricv4< TFixedImage, TMovingImage >     MetricType ;
+    typedef itk::LinearInterpolateImageFunction< TMovingImage, double >                       InterpolatorType;
+    typedef itk::ImageRegistrationMethodv4< TFixedImage, TMovingImage, TransformType >        RegistrationType;
+
+
+    // Each level is a single level registration on the smoothed images, the optimizer being restarted
+    // at each level as in a multi-level registration
+    double value = 0.0;
+    for (unsigned int level=firstLevel; level<firstLevel+numberOfLevels; level++)
+    {
+
+        // Create the metric, the optimizer, the interpolator, and the registration objects
+        typename MetricType::Pointer       metric       = MetricType::New();
+        typename OptimizerType::Pointer    optimizer    = OptimizerType::New();
+        typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+        typename RegistrationType::Pointer registration = RegistrationType::New();
+
+
+        // The images of the pyramids are shared: the registration works on shallow copies of them, so
+        // that its pipeline never modifies the shared images
+        typename TFixedImage::Pointer  fixedImage  = TFixedImage::New();
+        typename TMovingImage::Pointer movingImage = TMovingImage::New();
+        fixedImage->Graft(  this->m_fixedImagePyramid[level] );
+        movingImage->Graft( this->m_movingImagePyramid[level] );
+
+
+        // Initialize the registration method
+        metric->SetMovingInterpolator(     interpolator );
+        registration->SetMetric(           metric );
+        registration->SetOptimizer(        optimizer );
+        registration->SetFixedImage(       fixedImage );
+        registration->SetMovingImage(      movingImage );
+
+
+        // Level: the images are already smoothed, only the virtual domain is shrunk
+        typename RegistrationType::ShrinkFactorsArrayType   shrinkFactors(   1 );
+        typename RegistrationType::SmoothingSigmasArrayType smoothingSigmas( 1 );
+        shrinkFactors[0]   = this->m_shrinkFactors[level];
+        smoothingSigmas[0] = 0.0;
+        registration->SetNumberOfLevels(                             1 );
+        registration->SetShrinkFactorsPerLevel(                      shrinkFactors );
+        registration->SetSmoothingSigmasPerLevel(                    smoothingSigmas );
+        registration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits( false );
+
+
+        // Sampling of the metric: 50000 random samples at most per level, so that the coarse levels
+        // use all their voxels. The seed is fixed so that the registration is reproducible.
+        const typename TFixedImage::SizeType size = this->m_fixedImage->GetLargestPossibleRegion().GetSize();
+        double numberOfVoxels = 1.0;
+        for (unsigned int d=0; d<TFixedImage::ImageDimension; d++)
+            numberOfVoxels *= std::max( 1.0, std::floor( static_cast<double>(size[d]) / shrinkFactors[0] ) );
+        typename RegistrationType::MetricSamplingPercentageArrayType samplingPercentages( 1 );
+        samplingPercentages[0] = std::min( 1.0, 50000.0 / numberOfVoxels );
+        registration->SetMetricSamplingStrategy(          RegistrationType::MetricSamplingStrategyEnum::RANDOM );
+        registration->SetMetricSamplingPercentagePerLevel( samplingPercentages );
+        registration->SetMetricSamplingReinitializeSeed(   121212 );
+
+
+        // Initial transformation, optimized in place
+        registration->SetInitialTransform( transform );
+        registration->InPlaceOn();
+
+
+        // Initialize the metric
+        metric->SetNumberOfHistogramBins( 50 );
+
+
+        // Initialize the scale of the optimizer
+        typedef typename OptimizerType::ScalesType OptimizerScalesType;
+        OptimizerScalesType optimizerScales( transform->GetNumberOfParameters() );
+        const double translation_scale = 1.0 / 20.0;
+        optimizerScales[0] = 1.0;
+        optimizerScales[1] = 1.0;
+        optimizerScales[2] = 1.0;
+        optimizerScales[3] = translation_scale;
+        optimizerScales[4] = translation_scale;
+        optimizerScales[5] = translation_scale;
+        optimizer->SetScales( optimizerScales );
+
+
+        // Initialize the other variables of the optimizer (the learning rate is the maximum step length)
+        optimizer->SetRelaxationFactor(   0.6 );
+        optimizer->SetLearningRate(       0.1 );
+        optimizer->SetMinimumStepLength(  0.001 );
+        optimizer->SetNumberOfIterations( this->m_iterations );
+
+
+        // Split the threads between the starts optimized concurrently
+        if (numberOfWorkUnits>0)
+        {
+            metric->SetMaximumNumberOfWorkUnits( numberOfWorkUnits );
+            optimizer->SetNumberOfWorkUnits(     numberOfWorkUnits );
+            registration->SetNumberOfWorkUnits(  numberOfWorkUnits );
+        }
+
+
+        // Early stop: slope of the metric values over the convergence window (see
+        // itk::Function::WindowConvergenceMonitoringFunction)
+        optimizer->SetConvergenceWindowSize(  this->m_convergenceWindowSize );
+        optimizer->SetMinimumConvergenceValue( this->m_convergenceThreshold );
+
+
+        // Notify each iteration to the observers
+        if (notify)
+        {
+            OptimizerType * optimizerPtr = optimizer.GetPointer();
+            optimizer->AddObserver( itk::IterationEvent(), [this, optimizerPtr, level](const itk::EventObject &)
+            {
+                typename Superclass::IterationInformation information;
+                information.level            = level;
+                information.iteration        = optimizerPtr->GetCurrentIteration();
+                information.metricValue      = optimizerPtr->GetValue();
+                information.stepLength       = optimizerPtr->GetCurrentStepLength();
+                information.convergenceValue = optimizerPtr->GetConvergenceValue();
+                information.elapsedTime      = std::chrono::duration<double>( std::chrono::steady_clock::now() - this->m_startTime ).count();
+                this->NotifyIteration( information );
+            });
+        }
+
+
+        // Start the optimization
+        try
+        {
+            registration->Update();
+        }
+        catch( itk::ExceptionObject & err )
+        {
+            std::string message = "Unexpected error: ";
+            message += err.GetDescription();
+            throw std::runtime_error( message  );
+        }
+        value = optimizer->GetValue();
+    }
+    return value;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+TRex< TFixedImage, TMovingImage, TTransformScalarType >
+::OptimizeStarts(std::vector<TransformPointerType> & transforms, std::vector<double> & values,
+                 unsigned int firstLevel, unsigned int numberOfLevels)
+{
+    const unsigned int numberOfStarts = transforms.size();
+    std::vector<std::exception_ptr> errors( numberOfStarts );
+    values.assign( numberOfStarts, std::numeric_limits<double>::infinity() );
+
+    // The threads available to ITK are shared between the starts: each start gets its share of work units
+    const unsigned int numberOfCores     = std::max( 1u, itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() );
+    const unsigned int numberOfThreads   = std::max( 1u, std::min( numberOfCores, numberOfStarts ) );
+    const unsigned int numberOfWorkUnits = std::max( 1u, numberOfCores / numberOfThreads );
+    const bool         notify            = numberOfStarts==1;
+
+    // Each thread optimizes the next start not yet taken
+    std::atomic<unsigned int> next( 0 );
+    auto optimize = [&]()
+    {
+        for (unsigned int i=next++; i<numberOfStarts; i=next++)
+        {
+            try
+            {
+                values[i] = this->OptimizeLevels( transforms[i], firstLevel, numberOfLevels, notify ? 0 : numberOfWorkUnits, notify );
+            }
+            catch( ... )
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    if (numberOfThreads<=1)
+        optimize();
+    else
+    {
+        // The object factories are initialized before the threads query them
+        itk::ObjectFactoryBase::GetRegisteredFactories();
+
+        std::vector<std::thread> threads;
+        for (unsigned int t=1; t<numberOfThreads; t++)
+            threads.push_back( std::thread( optimize ) );
+        optimize();
+        for (unsigned int t=0; t<threads.size(); t++)
+            threads[t].join();
+    }
+
+    // A start may fail (e.g. no overlap between the images), the registration fails if all of them do
+    for (unsigned int i=0; i<numberOfStarts; i++)
+        if (!errors[i])
+            return;
+    if (numberOfStarts>0)
+        std::rethrow_exception( errors[0] );
+}
+
+
+
 template < class TFixedImage, class TMovingImage, class TTransformScalarType >
 void
 TRex< TFixedImage, TMovingImage, TTransformScalarType >
@@ -75,27 +538,24 @@ TRex< TFixedImage, TMovingImage, TTransformScalarType >
         throw std::runtime_error( "Moving image has not been set." );
 
 
-    // Type definition
-    typedef itk::RegularStepGradientDescentOptimizer                                    OptimizerType;
-    typedef itk::MattesMutualInformationImageToImageMetric< TFixedImage, TMovingImage > MetricType ;
-    typedef itk::LinearInterpolateImageFunction< TMovingImage, double >                 InterpolatorType;
-    typedef itk::ImageRegistrationMethod< TFixedImage, TMovingImage >                   RegistrationType;
-
-
-    // Create the metric, the optimizer, the interpolator, and the registration objects
-    typename MetricType::Pointer       metric       = MetricType::New();
-    typename OptimizerType::Pointer    optimizer    = OptimizerType::New();
-    typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-    typename RegistrationType::Pointer registration = RegistrationType::New();
+    // Check the levels of the pyramid
+    const unsigned int numberOfLevels = this->m_shrinkFactors.size();
+    if (numberOfLevels==0)
+        throw std::runtime_error( "At least one level is needed." );
+    if (this->m_smoothingSigmas.size()!=numberOfLevels)
+        throw std::runtime_error( "The numbers of shrink factors and of smoothing sigmas must be equal." );
+    for (unsigned int i=0; i<numberOfLevels; i++)
+        if (this->m_shrinkFactors[i]==0 || this->m_smoothingSigmas[i]<0.0f)
+            throw std::runtime_error( "The shrink factors must be strictly positive and the smoothing sigmas positive." );
+    if (this->m_convergenceWindowSize<2)
+        throw std::runtime_error( "The convergence window must contain at least 2 iterations." );
 
 
-    // Initialize the registration method
-    registration->SetMetric(           metric );
-    registration->SetOptimizer(        optimizer );
-    registration->SetInterpolator(     interpolator );
-    registration->SetFixedImage(       this->m_fixedImage );
-    registration->SetMovingImage(      this->m_movingImage );
-    registration->SetFixedImageRegion( this->m_fixedImage->GetBufferedRegion() );
+    // Check the multi-start parameters
+    if (this->m_rotationStep<0.0 || this->m_rotationStep>=360.0)
+        throw std::runtime_error( "The rotation step must be in [0, 360) degrees." );
+    if (this->m_rotationStep>0.0 && this->m_numberOfKeptStarts==0)
+        throw std::runtime_error( "At least one start must be kept." );
 
 
     // Initialize the transformation
@@ -107,50 +567,71 @@ TRex< TFixedImage, TMovingImage, TTransformScalarType >
     initializer->SetMovingImage( this->m_movingImage );
     initializer->GeometryOn(); // It's either GeometryOn (center of image) or MomentsOn (center of mass)
     initializer->InitializeTransform();
-    registration->SetTransform(                  transform );
-    registration->SetInitialTransformParameters( transform->GetParameters() );
-
-
-    // Initialize the metric
-    metric->SetNumberOfHistogramBins(  50 );
-    metric->SetNumberOfSpatialSamples( 50000 );
-    
-    
-    // Initialize the scale of the optimizer
-    typedef OptimizerType::ScalesType OptimizerScalesType;
-    OptimizerScalesType optimizerScales( transform->GetNumberOfParameters() );
-    const double translation_scale = 1.0 / 20.0;
-    optimizerScales[0] = 1.0;
-    optimizerScales[1] = 1.0;
-    optimizerScales[2] = 1.0;
-    optimizerScales[3] = translation_scale;
-    optimizerScales[4] = translation_scale;
-    optimizerScales[5] = translation_scale;
-    optimizer->SetScales( optimizerScales );
-
-
-    // Initialize the other variables of the optimizer
-    optimizer->SetRelaxationFactor(   0.6 );
-    optimizer->SetMaximumStepLength(  0.1 );
-    optimizer->SetMinimumStepLength(  0.001 );
-    optimizer->SetNumberOfIterations( this->m_iterations );
 
 
     // Start the registration process
+    this->m_startTime = std::chrono::steady_clock::now();
+    this->SetRegistrationStatus( Superclass::REGISTRATION_STATUS_PROCESSING );
+    const bool computeFixedImagePyramid = this->m_fixedImagePyramid.empty();
     try
     {
-        registration->UpdateLargestPossibleRegion();
+        // Smoothed images of each level, shared by the starts
+        if (computeFixedImagePyramid)
+            this->ComputeFixedImagePyramid();
+        else if (this->m_fixedImagePyramid.size()!=numberOfLevels)
+            throw std::runtime_error( "The fixed image pyramid must contain one image per level." );
+        this->m_movingImagePyramid.clear();
+        for (unsigned int i=0; i<numberOfLevels; i++)
+            this->m_movingImagePyramid.push_back( SmoothImage< TMovingImage >( this->m_movingImage, this->m_smoothingSigmas[i] ) );
+
+        if (this->m_rotationStep==0.0)
+            this->OptimizeLevels( transform, 0, numberOfLevels, 0, true );
+        else
+        {
+            // Coarsest level: all the starts of the grid
+            std::vector<TransformPointerType> starts = this->GenerateStarts( transform );
+            std::vector<double>               values;
+            this->OptimizeStarts( starts, values, 0, 1 );
+
+            // Finer levels: the best starts only
+            const unsigned int numberOfKeptStarts = std::min<unsigned int>( this->m_numberOfKeptStarts, starts.size() );
+            std::vector<unsigned int> order( starts.size() );
+            std::iota( order.begin(), order.end(), 0u );
+            std::stable_sort( order.begin(), order.end(), [&values](unsigned int a, unsigned int b){ return values[a] < values[b]; } );
+
+            std::vector<TransformPointerType> kept;
+            for (unsigned int i=0; i<numberOfKeptStarts; i++)
+                if (values[order[i]] < std::numeric_limits<double>::infinity())
+                    kept.push_back( starts[order[i]] );
+            std::vector<double> keptValues( kept.size() );
+            for (unsigned int i=0; i<kept.size(); i++)
+                keptValues[i] = values[order[i]];
+            if (numberOfLevels>1)
+                this->OptimizeStarts( kept, keptValues, 1, numberOfLevels-1 );
+
+            // Winner: lowest metric value at the finest level
+            const unsigned int best = std::min_element( keptValues.begin(), keptValues.end() ) - keptValues.begin();
+            transform = kept[best];
+        }
     }
-    catch( itk::ExceptionObject & err )
+    catch( ... )
     {
-        std::string message = "Unexpected error: ";
-        message += err.GetDescription();
-        throw std::runtime_error( message  );
+        this->m_movingImagePyramid.clear();
+        if (computeFixedImagePyramid)
+            this->m_fixedImagePyramid.clear();
+        this->SetRegistrationStatus( Superclass::REGISTRATION_STATUS_STOP );
+        throw;
     }
 
+    // Free the smoothed images, a fixed image pyramid set by the user being kept
+    this->m_movingImagePyramid.clear();
+    if (computeFixedImagePyramid)
+        this->m_fixedImagePyramid.clear();
+
     // Set the transformation parameters
     static_cast< TransformType * >(this->m_transform.GetPointer())->SetCenter(     transform->GetCenter() );
-    static_cast< TransformType * >(this->m_transform.GetPointer())->SetParameters( registration->GetLastTransformParameters() );
+    static_cast< TransformType * >(this->m_transform.GetPointer())->SetParameters( transform->GetParameters() );
+    this->SetRegistrationStatus( Superclass::REGISTRATION_STATUS_STOP );
 }
 
 
@@ -2,6 +2,8 @@
 #define _RPI_TREX_HXX_
 
 
+#include <chrono>
+#include <vector>
 #include <itkEuler3DTransform.h>
 #include "rpiRegistrationMethod.hxx"
 
@@ -16,6 +18,25 @@ namespace rpi
  * This method is a fully ITK registration method implemented into the RPI framework.
  * The method is simple and gives a clear example of how a registration method of RPI should be implemented.
  *
+ * The rigid transformation is estimated with a multi-resolution pyramid: at each level, the images are
+ * smoothed and shrunk, and the Mattes mutual information is maximized with a regular step gradient
+ * descent (ITKv4 registration framework, multithreaded metric). The coarse levels are computed on all
+ * the voxels, the finest levels on 50000 random samples at most.
+ *
+ * At each level, the optimization stops early when the metric stops decreasing: the convergence value,
+ * i.e. the slope of the normalized metric values over the last iterations (convergence window), is
+ * compared to a threshold. Each iteration is notified to the attached observers (see NotifyIteration).
+ *
+ * Large rotations (prone/supine or flipped acquisitions) are handled by a multi-start mode, enabled by
+ * a rotation step: the centered initial transformation is rotated by a grid of Euler angles (multiples
+ * of the step around each axis), each start is optimized at the coarsest level, and only the best
+ * starts (lowest metric values) are refined at the finer levels. The starts are optimized concurrently,
+ * the iterations being notified only when a single start is optimized.
+ *
+ * The smoothed images of each level are computed once per registration and shared by the starts. The
+ * smoothed fixed images (fixed image pyramid) can also be computed once and shared by the registrations
+ * of several moving images to the same fixed image (see SetFixedImagePyramid).
+ *
  * There are three templates for this class:
  *
  *   TFixedImage           Type of the fixed image. Must be an itk::Image< TPixel, 3 > where
@@ -34,21 +55,130 @@ class ITK_EXPORT TRex : public RegistrationMethod< TFixedImage, TMovingImage, TT
 
 public:
 
+    typedef RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >
+            Superclass;
+
     typedef itk::Euler3DTransform<TTransformScalarType>
             TransformType;
 
     typedef typename TransformType::Pointer
             TransformPointerType;
 
+    typedef std::vector< typename TFixedImage::ConstPointer >
+            FixedImagePyramidType;
+
+    typedef std::vector< typename TMovingImage::ConstPointer >
+            MovingImagePyramidType;
+
 
 protected:
 
     /**
-     * Maximal number of iterations.
+     * Maximal number of iterations per level.
      */
     unsigned int      m_iterations;
 
 
+    /**
+     * Shrink factors of the images, one per level (from the coarsest level).
+     */
+    std::vector<unsigned int>   m_shrinkFactors;
+
+
+    /**
+     * Standard deviations (voxels) of the Gaussian smoothing of the images, one per level.
+     */
+    std::vector<float>          m_smoothingSigmas;
+
+
+    /**
+     * Number of iterations over which the convergence is evaluated.
+     */
+    unsigned int      m_convergenceWindowSize;
+
+
+    /**
+     * Convergence value below which the optimization of a level stops.
+     */
+    double            m_convergenceThreshold;
+
+
+    /**
+     * Step (degrees) of the grid of initial rotations, 0 disabling the multi-start mode.
+     */
+    double            m_rotationStep;
+
+
+    /**
+     * Number of starts refined at the finer levels in multi-start mode.
+     */
+    unsigned int      m_numberOfKeptStarts;
+
+
+    /**
+     * Smoothed fixed images, one per level.
+     */
+    FixedImagePyramidType       m_fixedImagePyramid;
+
+
+    /**
+     * Smoothed moving images, one per level, computed by StartRegistration.
+     */
+    MovingImagePyramidType      m_movingImagePyramid;
+
+
+    /**
+     * Time at which the registration started.
+     */
+    std::chrono::steady_clock::time_point   m_startTime;
+
+
+    /**
+     * Smoothes an image with a Gaussian kernel, as done by the ITKv4 registration framework at each level.
+     * @param  image  image
+     * @param  sigma  standard deviation (voxels) of the Gaussian kernel, 0 returning the image itself
+     * @return smoothed image
+     */
+    template < class TImage >
+    static typename TImage::ConstPointer  SmoothImage(const TImage * image, float sigma);
+
+
+    /**
+     * Optimizes a transformation over some levels of the pyramid, starting from its current parameters.
+     * Each level is registered on the smoothed images of the pyramids.
+     * @param  transform          transformation, optimized in place
+     * @param  firstLevel         first level of the pyramid
+     * @param  numberOfLevels     number of levels optimized
+     * @param  numberOfWorkUnits  number of work units of the metric and of the optimizer (0: default)
+     * @param  notify             notify the iterations to the observers
+     * @return metric value at the last iteration
+     */
+    double            OptimizeLevels(TransformType * transform, unsigned int firstLevel, unsigned int numberOfLevels,
+                                     unsigned int numberOfWorkUnits, bool notify);
+
+
+    /**
+     * Optimizes several transformations concurrently over some levels of the pyramid (see OptimizeLevels).
+     * The metric value of a start that fails is infinite. If all the starts fail, the error of the
+     * first one is thrown.
+     * @param  transforms      transformations, optimized in place
+     * @param  values          metric values at the last iteration
+     * @param  firstLevel      first level of the pyramid
+     * @param  numberOfLevels  number of levels optimized
+     */
+    void              OptimizeStarts(std::vector<TransformPointerType> & transforms, std::vector<double> & values,
+                                     unsigned int firstLevel, unsigned int numberOfLevels);
+
+
+    /**
+     * Generates the starts of the multi-start mode: the initial transformation composed with the rotations
+     * of the grid of Euler angles. Identical rotations are only generated once.
+     * @param  initialTransform  centered initial transformation
+     * @return starts, the first one being the initial transformation
+     */
+    std::vector<TransformPointerType>  GenerateStarts(const TransformType * initialTransform) const;
+
+
 public:
 
 
@@ -65,20 +195,130 @@ public:
 
 
     /**
-     * Returns thenumber of iterations allowed for the registration process.
+     * Returns thenumber of iterations allowed at each level of the registration process.
      * @return  number of iterations
      */
     unsigned int      GetNumberOfIterations(void) const;
 
 
     /**
-     * Sets the number of iterations allowed for the registration process.
+     * Sets the number of iterations allowed at each level of the registration process.
      * This number must be greater than or equal to the number of interpolations.
      * @param  value  number of iterations
      */
     void              SetNumberOfIterations(unsigned int value);
 
 
+    /**
+     * Gets the shrink factors of the images, one per level from the coarsest one.
+     * @return  shrink factors
+     */
+    std::vector<unsigned int>   GetShrinkFactors(void) const;
+
+
+    /**
+     * Sets the shrink factors of the images, one per level from the coarsest one (default 4x2x1).
+     * The number of levels is given by the number of shrink factors.
+     * @param  factors  shrink factors
+     */
+    void              SetShrinkFactors(std::vector<unsigned int> factors);
+
+
+    /**
+     * Gets the standard deviations (voxels) of the Gaussian smoothing of the images, one per level.
+     * @return  standard deviations
+     */
+    std::vector<float>          GetSmoothingSigmas(void) const;
+
+
+    /**
+     * Sets the standard deviations (voxels) of the Gaussian smoothing of the images, one per level
+     * from the coarsest one (default 2x1x0). A standard deviation of 0 disables the smoothing.
+     * @param  sigmas  standard deviations
+     */
+    void              SetSmoothingSigmas(std::vector<float> sigmas);
+
+
+    /**
+     * Gets the number of iterations over which the convergence is evaluated.
+     * @return  size of the convergence window
+     */
+    unsigned int      GetConvergenceWindowSize(void) const;
+
+
+    /**
+     * Sets the number of iterations over which the convergence is evaluated (default 10).
+     * @param  value  size of the convergence window
+     */
+    void              SetConvergenceWindowSize(unsigned int value);
+
+
+    /**
+     * Gets the convergence value below which the optimization of a level stops.
+     * @return  convergence threshold
+     */
+    double            GetConvergenceThreshold(void) const;
+
+
+    /**
+     * Sets the convergence value below which the optimization of a level stops (default 1e-6).
+     * @param  value  convergence threshold
+     */
+    void              SetConvergenceThreshold(double value);
+
+
+    /**
+     * Gets the step (degrees) of the grid of initial rotations.
+     * @return  rotation step
+     */
+    double            GetRotationStep(void) const;
+
+
+    /**
+     * Sets the step (degrees) of the grid of initial rotations (default 0, i.e. a single start).
+     * A step of 90 degrees gives the 24 rotations mapping the axes onto the axes. The step must be 0 or
+     * in [30,360] degrees, a smaller step giving too many starts.
+     * @param  value  rotation step
+     */
+    void              SetRotationStep(double value);
+
+
+    /**
+     * Gets the number of starts refined at the finer levels in multi-start mode.
+     * @return  number of starts kept
+     */
+    unsigned int      GetNumberOfKeptStarts(void) const;
+
+
+    /**
+     * Sets the number of starts refined at the finer levels in multi-start mode (default 4).
+     * @param  value  number of starts kept
+     */
+    void              SetNumberOfKeptStarts(unsigned int value);
+
+
+    /**
+     * Gets the fixed image pyramid set by SetFixedImagePyramid or computed by ComputeFixedImagePyramid.
+     * @return  smoothed fixed images, one per level
+     */
+    const FixedImagePyramidType &  GetFixedImagePyramid(void) const;
+
+
+    /**
+     * Sets the fixed image pyramid, computed by ComputeFixedImagePyramid on a registration using the
+     * same fixed image and smoothing sigmas. The images are only read, so that the pyramid can be shared
+     * by registrations running concurrently. If no pyramid is set, it is computed by StartRegistration.
+     * @param  pyramid  smoothed fixed images, one per level
+     */
+    void              SetFixedImagePyramid(const FixedImagePyramidType & pyramid);
+
+
+    /**
+     * Computes the fixed image pyramid from the fixed image and the smoothing sigmas.
+     */
+    void              ComputeFixedImagePyramid(void);
+
+
     /**
      * Performs the image registration.
      */
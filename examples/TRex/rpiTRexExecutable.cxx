@@ -1,9 +1,15 @@
 #include <iostream>
+#include <iomanip>
 #include <cstdlib>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <tclap/CmdLine.h>
+#include <itkMultiThreaderBase.h>
 #include <rpiCommonTools.hxx>
+#include <rpiBatchProcessing.hxx>
 #include "rpiTRex.hxx"
 
 
@@ -27,10 +33,78 @@ struct Param{
     std::string  outputImagePath;
     std::string  outputTransformPath;
     unsigned int iterations;
+    std::string  shrinkFactors;
+    std::string  smoothingSigmas;
+    unsigned int convergenceWindow;
+    double       convergenceThreshold;
+    bool         trace;
+    double       rotationStep;
+    unsigned int keptStarts;
+    std::string  manifestPath;
+    unsigned int batchThreads;
+    unsigned int memoryBudget;
 };
 
 
 
+/**
+ * Observer printing the iterations of the registration (level, iteration, metric value, step length,
+ * convergence value and wall time), one line per iteration.
+ */
+template< class TFixedImage, class TMovingImage, class TTransformScalarType >
+class TraceObserver : public rpi::Observer< TFixedImage, TMovingImage, TTransformScalarType >
+{
+public:
+
+    typedef rpi::RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >  RegistrationMethodType;
+
+    virtual void Update(void)
+    {
+        RegistrationMethodType * method = this->GetRegistrationMethod();
+        if (method->GetRegistrationStatus()==RegistrationMethodType::REGISTRATION_STATUS_PROCESSING)
+        {
+            std::cout << std::endl << "  level  iteration  metric          step length     convergence     time (s)" << std::endl;
+            return;
+        }
+        if (method->GetRegistrationStatus()!=RegistrationMethodType::REGISTRATION_STATUS_ITERATION)
+            return;
+
+        const typename RegistrationMethodType::IterationInformation & information = method->GetIterationInformation();
+        std::cout << "  " << std::setw(5)  << information.level
+                  << "  " << std::setw(9)  << information.iteration
+                  << "  " << std::setw(14) << information.metricValue
+                  << "  " << std::setw(14) << information.stepLength
+                  << "  " << std::setw(14) << information.convergenceValue
+                  << "  " << std::setw(8)  << std::fixed << std::setprecision(2) << information.elapsedTime
+                  << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+};
+
+
+
+/**
+ * Parses a list of real values separated by "x" (e.g. "2x1x0.5").
+ * @param  str  string to parse
+ * @return values
+ */
+std::vector<float> parseRealValues(const std::string & str)
+{
+    std::vector<float> values;
+    std::istringstream stream(str);
+    std::string        token;
+    while (std::getline(stream, token, 'x'))
+    {
+        std::istringstream tokenStream(token);
+        float              value;
+        if (!(tokenStream >> value) || !tokenStream.eof())
+            throw std::runtime_error("Cannot parse the list of values " + str + ".");
+        values.push_back(value);
+    }
+    return values;
+}
+
+
+
 /**
  * Parses the command line arguments and deduces the corresponding Param structure.
  * @param  argc   number of arguments
@@ -43,7 +117,13 @@ void parseParameters(int argc, char** argv, struct Param & param)
     // Program description
     std::string description = "\b\b\bDESCRIPTION\n";
     description += "TRex registration method: Toy Registration EXample. The transformation ";
-    description += "computed is a rigid transformation.";
+    description += "computed is a rigid transformation, estimated from the coarsest to the finest level of a ";
+    description += "multi-resolution pyramid (Mattes mutual information, regular step gradient descent). ";
+    description += "In batch mode (--manifest), the moving images listed in the manifest are registered to the ";
+    description += "same fixed image, whose pyramid is computed once, several subjects being registered concurrently. ";
+    description += "Each line of the manifest contains a moving image, an output transformation and optionally ";
+    description += "an output image, separated by spaces ('#' starts a comment line). The moving images must have the same ";
+    description += "pixel type.";
     description += "\nAuthor : Vincent Garcia";
 
     try {
@@ -51,21 +131,41 @@ void parseParameters(int argc, char** argv, struct Param & param)
         // Define the command line parser
         TCLAP::CmdLine cmd( description, ' ', "1.0", true);
 
-        TCLAP::ValueArg<unsigned int> arg_iterations( "a", "iterations", "Number of iterations (default 5000)", false, 5000, "uint", cmd );
+        TCLAP::ValueArg<unsigned int> arg_memoryBudget( "", "memory-budget", "Batch mode: memory (MB) shared by the subjects registered concurrently, a subject starting once its estimated memory fits into the budget (default 0, i.e. no limit).", false, 0, "uint", cmd );
+        TCLAP::ValueArg<unsigned int> arg_batchThreads( "", "batch-threads", "Batch mode: maximum number of subjects registered concurrently (default 0, i.e. the number of cores).", false, 0, "uint", cmd );
+        TCLAP::ValueArg<std::string>  arg_manifest( "", "manifest", "Batch mode: path to the manifest listing the moving images and the output paths (replaces -m, -t and -i).", false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int> arg_keptStarts( "", "kept-starts", "Number of starts refined at the finer levels in multi-start mode (default 4).", false, 4, "uint", cmd );
+        TCLAP::ValueArg<double>       arg_rotationStep( "", "rotation-step", "Step (degrees) of the grid of initial rotations around each axis, each start being optimized at the coarsest level (default 0, i.e. a single start, otherwise at least 30). A step of 90 handles flipped or prone/supine acquisitions.", false, 0.0, "double", cmd );
+        TCLAP::SwitchArg              arg_trace( "", "trace", "Print the metric value, the step length, the convergence value and the wall time at each iteration.", cmd, false );
+        TCLAP::ValueArg<double>       arg_threshold( "", "convergence-threshold", "Convergence value (slope of the normalized metric values over the convergence window) below which a level stops (default 1e-6).", false, 1e-6, "double", cmd );
+        TCLAP::ValueArg<unsigned int> arg_window( "", "convergence-window", "Number of iterations over which the convergence is evaluated (default 10).", false, 10, "uint", cmd );
+        TCLAP::ValueArg<std::string>  arg_sigmas( "", "smoothing-sigmas", "Standard deviations (voxels) of the Gaussian smoothing of the images at each level, separated by \"x\" (default 2x1x0).", false, "2x1x0", "floatx...xfloat", cmd );
+        TCLAP::ValueArg<std::string>  arg_shrink( "", "shrink-factors", "Shrink factors of the images at each level, from the coarsest one, separated by \"x\" (default 4x2x1).", false, "4x2x1", "uintx...xuint", cmd );
+        TCLAP::ValueArg<unsigned int> arg_iterations( "a", "iterations", "Number of iterations per level (default 5000)", false, 5000, "uint", cmd );
         TCLAP::ValueArg<std::string>  arg_outputImage( "i", "output-image", "Path to the output image (default output_image.nii).", false, "output_image.nii", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_outputTransform( "t", "output-transform", "Path of the output transformation (default output_transform.txt).", false, "output_transform.txt", "string", cmd );
-        TCLAP::ValueArg<std::string>  arg_movingImage( "m", "moving-image", "Path to the moving image.", true, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_movingImage( "m", "moving-image", "Path to the moving image (required unless --manifest is set).", false, "", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_fixedImage( "f", "fixed-image", "Path to the fixed image.", true, "", "string", cmd );
 
         // Parse the command line
         cmd.parse( argc, argv );
 
         // Set the parameters
-        param.fixedImagePath      = arg_fixedImage.getValue();
-        param.movingImagePath     = arg_movingImage.getValue();
-        param.outputTransformPath = arg_outputTransform.getValue();
-        param.outputImagePath     = arg_outputImage.getValue();
-        param.iterations          = arg_iterations.getValue();
+        param.fixedImagePath       = arg_fixedImage.getValue();
+        param.movingImagePath      = arg_movingImage.getValue();
+        param.outputTransformPath  = arg_outputTransform.getValue();
+        param.outputImagePath      = arg_outputImage.getValue();
+        param.iterations           = arg_iterations.getValue();
+        param.shrinkFactors        = arg_shrink.getValue();
+        param.smoothingSigmas      = arg_sigmas.getValue();
+        param.convergenceWindow    = arg_window.getValue();
+        param.convergenceThreshold = arg_threshold.getValue();
+        param.trace                = arg_trace.getValue();
+        param.rotationStep         = arg_rotationStep.getValue();
+        param.keptStarts           = arg_keptStarts.getValue();
+        param.manifestPath         = arg_manifest.getValue();
+        param.batchThreads         = arg_batchThreads.getValue();
+        param.memoryBudget         = arg_memoryBudget.getValue();
 
     }
     catch (TCLAP::ArgException &e)
@@ -73,6 +173,12 @@ void parseParameters(int argc, char** argv, struct Param & param)
         std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
         throw std::runtime_error("Unable to parse the command line arguments.");
     }
+
+    // Either a moving image or a manifest
+    if (param.movingImagePath.empty() == param.manifestPath.empty())
+        throw std::runtime_error("Either a moving image (-m) or a manifest (--manifest) must be set.");
+    if (!param.manifestPath.empty() && param.trace)
+        throw std::runtime_error("The iterations cannot be traced in batch mode.");
 }
 
 
@@ -104,7 +210,140 @@ void PrintParameters( std::string fixedImagePath,
 
     // Print method parameters
     std::cout << "METHOD PARAMETER"                << std::endl;
-    std::cout << "  Number of iterations       : " << registration->GetNumberOfIterations()     << std::endl << std::endl;
+    std::cout << "  Number of iterations       : " << registration->GetNumberOfIterations()     << std::endl;
+    std::cout << "  Shrink factors             : " << rpi::VectorToString( registration->GetShrinkFactors() )   << std::endl;
+    std::cout << "  Smoothing sigmas           : " << rpi::VectorToString( registration->GetSmoothingSigmas() ) << std::endl;
+    std::cout << "  Convergence window         : " << registration->GetConvergenceWindowSize() << std::endl;
+    std::cout << "  Convergence threshold      : " << registration->GetConvergenceThreshold()  << std::endl;
+    std::cout << "  Rotation step (degrees)    : " << registration->GetRotationStep()          << std::endl;
+    std::cout << "  Number of kept starts      : " << registration->GetNumberOfKeptStarts()    << std::endl << std::endl;
+}
+
+
+/**
+  * Sets the parameters of the registration method (images excepted).
+  * @param  param         parameters
+  * @param  registration  registration object
+  */
+template< class TFixedImage, class TMovingImage, class TTransformScalarType >
+void SetMethodParameters( const struct Param & param,
+                          rpi::TRex<TFixedImage, TMovingImage, TTransformScalarType> * registration )
+{
+    registration->SetNumberOfIterations(    param.iterations );
+    registration->SetShrinkFactors(         rpi::StringToVector<unsigned int>( param.shrinkFactors ) );
+    registration->SetSmoothingSigmas(       parseRealValues( param.smoothingSigmas ) );
+    registration->SetConvergenceWindowSize( param.convergenceWindow );
+    registration->SetConvergenceThreshold(  param.convergenceThreshold );
+    registration->SetRotationStep(          param.rotationStep );
+    registration->SetNumberOfKeptStarts(    param.keptStarts );
+}
+
+
+/**
+  * Starts the batch program: registers the moving images of the manifest to the fixed image.
+  * @param   param  parameters needed for the image registration process
+  * @return  EXIT_SUCCESS if all the registrations succeded, EXIT_FAILURE otherwise
+  */
+template< class TFixedImage, class TMovingImage >
+int StartBatchProgram(struct Param param)
+{
+
+    // Type definition
+    typedef double                                                      TransformScalarType;
+    typedef rpi::TRex< TFixedImage, TMovingImage, TransformScalarType > RegistrationMethod;
+
+    try
+    {
+        // Read the manifest and the fixed image. The moving images are read with the type of the first
+        // one, so they must all have this type.
+        std::vector<rpi::BatchSubject> subjects   = rpi::readBatchManifest( param.manifestPath );
+        rpi::checkBatchImageTypes( subjects );
+        typename TFixedImage::Pointer  fixedImage = rpi::readImage< TFixedImage >( param.fixedImagePath );
+
+        // Print parameters
+        RegistrationMethod prototype;
+        prototype.SetFixedImage( fixedImage );
+        SetMethodParameters< TFixedImage, TMovingImage, TransformScalarType >( param, &prototype );
+        std::cout << std::endl;
+        std::cout << "I/O PARAMETERS"                  << std::endl;
+        std::cout << "  Fixed image path           : " << param.fixedImagePath << std::endl;
+        std::cout << "  Manifest path              : " << param.manifestPath   << std::endl;
+        std::cout << "  Number of subjects         : " << subjects.size()      << std::endl;
+        std::cout << "  Memory budget (MB)         : " << param.memoryBudget   << std::endl << std::endl;
+        std::cout << "METHOD PARAMETER"                << std::endl;
+        std::cout << "  Number of iterations       : " << prototype.GetNumberOfIterations()     << std::endl;
+        std::cout << "  Shrink factors             : " << rpi::VectorToString( prototype.GetShrinkFactors() )   << std::endl;
+        std::cout << "  Smoothing sigmas           : " << rpi::VectorToString( prototype.GetSmoothingSigmas() ) << std::endl;
+        std::cout << "  Convergence window         : " << prototype.GetConvergenceWindowSize() << std::endl;
+        std::cout << "  Convergence threshold      : " << prototype.GetConvergenceThreshold()  << std::endl;
+        std::cout << "  Rotation step (degrees)    : " << prototype.GetRotationStep()          << std::endl;
+        std::cout << "  Number of kept starts      : " << prototype.GetNumberOfKeptStarts()    << std::endl << std::endl;
+
+        // Display
+        std::cout << "STARTING BATCH PROGRAM" << std::endl;
+
+        // The fixed image pyramid is computed once and shared by the subjects
+        std::cout << "  Computing fixed pyramid    : " << std::flush;
+        prototype.ComputeFixedImagePyramid();
+        const typename RegistrationMethod::FixedImagePyramidType pyramid = prototype.GetFixedImagePyramid();
+        std::cout << "OK" << std::endl;
+
+        // The cores are shared between the subjects registered concurrently
+        unsigned int numberOfThreads = param.batchThreads;
+        if (numberOfThreads==0)
+            numberOfThreads = std::max( 1u, std::thread::hardware_concurrency() );
+        numberOfThreads = std::min<unsigned int>( numberOfThreads, subjects.size() );
+        itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(
+                std::max( 1u, itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() / numberOfThreads ) );
+
+        // Estimated memory of a subject: moving image, its smoothed copies and the copies made by the
+        // registration, copies of the fixed image made by the registration, and resampled image
+        const unsigned int numberOfLevels = prototype.GetShrinkFactors().size();
+        const std::size_t  fixedVoxels    = fixedImage->GetLargestPossibleRegion().GetNumberOfPixels();
+        auto estimate = [&](const rpi::BatchSubject & subject) -> std::size_t
+        {
+            return rpi::getImageMemorySize( subject.movingImagePath ) * (numberOfLevels + 2) +
+                   fixedVoxels * ( 2 * sizeof(typename TFixedImage::PixelType) + sizeof(typename TMovingImage::PixelType) );
+        };
+
+        // Registration of a subject. The fixed image is shared: each subject works on a shallow copy.
+        auto process = [&](const rpi::BatchSubject & subject)
+        {
+            typename TFixedImage::Pointer  fixed  = TFixedImage::New();
+            fixed->Graft( fixedImage );
+            typename TMovingImage::Pointer moving = rpi::readImage< TMovingImage >( subject.movingImagePath );
+
+            RegistrationMethod registration;
+            registration.SetFixedImage(        fixed );
+            registration.SetMovingImage(       moving );
+            SetMethodParameters< TFixedImage, TMovingImage, TransformScalarType >( param, &registration );
+            registration.SetFixedImagePyramid( pyramid );
+            registration.StartRegistration();
+
+            rpi::writeLinearTransformation<TransformScalarType, TFixedImage::ImageDimension>(
+                    registration.GetTransformation(),
+                    subject.outputTransformPath );
+            if (!subject.outputImagePath.empty())
+                rpi::resampleAndWriteImage<TFixedImage, TMovingImage, TransformScalarType>(
+                        fixed,
+                        moving,
+                        registration.GetTransformation(),
+                        subject.outputImagePath );
+        };
+
+        const unsigned int failures = rpi::processBatch( subjects, process, estimate, numberOfThreads,
+                                                         static_cast<std::size_t>(param.memoryBudget) << 20 );
+        std::cout << "  Subjects registered        : " << subjects.size() - failures << "/" << subjects.size() << std::endl << std::endl;
+        if (failures>0)
+            return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    };
+
+    return EXIT_SUCCESS;
 }
 
 
@@ -117,12 +356,19 @@ template< class TFixedImage, class TMovingImage >
 int StartMainProgram(struct Param param)
 {
 
+    // Batch mode
+    if (!param.manifestPath.empty())
+        return StartBatchProgram< TFixedImage, TMovingImage >(param);
+
     // Type definition
     typedef double                                                      TransformScalarType;
     typedef rpi::TRex< TFixedImage, TMovingImage, TransformScalarType > RegistrationMethod;
 
     // Create registration object
     RegistrationMethod * registration = new RegistrationMethod();
+    TraceObserver< TFixedImage, TMovingImage, TransformScalarType > trace;
+    if (param.trace)
+        registration->AttachObserver( &trace );
 
     try
     {
@@ -133,7 +379,7 @@ int StartMainProgram(struct Param param)
         // Set parameters
         registration->SetFixedImage(         fixedImage );
         registration->SetMovingImage(        movingImage );
-        registration->SetNumberOfIterations( param.iterations );
+        SetMethodParameters< TFixedImage, TMovingImage, TransformScalarType >( param, registration );
 
         // Print parameters
         PrintParameters<TFixedImage, TMovingImage, TransformScalarType>(
@@ -189,16 +435,27 @@ int main(int argc, char** argv)
 
     // Parse parameters
     struct Param param;
-    parseParameters( argc, argv, param);
+    try
+    {
+        parseParameters( argc, argv, param);
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
 
-    // Read image information
+    // Read image information. In batch mode, the type of the moving images is given by the first subject.
     itk::ImageIOBase::Pointer fixed_imageIO;
     itk::ImageIOBase::Pointer moving_imageIO;
     try
     {
         fixed_imageIO  = rpi::readImageInformation( param.fixedImagePath );
-        moving_imageIO = rpi::readImageInformation( param.movingImagePath );
+        if (param.manifestPath.empty())
+            moving_imageIO = rpi::readImageInformation( param.movingImagePath );
+        else
+            moving_imageIO = rpi::readImageInformation( rpi::readBatchManifest( param.manifestPath )[0].movingImagePath );
     }
     catch( std::exception& e )
     {
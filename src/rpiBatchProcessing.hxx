@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <itkObjectFactoryBase.h>
+
+#include "rpiCommonTools.hxx"
+
+/**
+ * Batch processing of several moving images against a shared fixed image, used by the registration
+ * executables to register many subjects to the same template in a single process.
+ *
+ * The subjects are listed in a manifest, one subject per line:
+ *
+ *   <moving image> <output transformation> [<output image>]
+ *
+ * The fields are separated by spaces or tabs. Empty lines and lines starting with '#' are ignored.
+ * The output image is optional: if it is missing, the resampled moving image is not written.
+ */
+
+
+// Namespace RPI : Registration Programming Interface
+namespace rpi
+{
+
+
+/**
+ * Subject of a batch: moving image and output paths.
+ */
+struct BatchSubject
+{
+    std::string  movingImagePath;
+    std::string  outputTransformPath;
+    std::string  outputImagePath;
+};
+
+
+/**
+ * Reads the manifest of a batch (see the format above).
+ * @param  fileName  path to the manifest
+ * @return subjects, in the order of the manifest
+ */
+inline std::vector<BatchSubject>
+readBatchManifest(const std::string & fileName)
+{
+    std::ifstream file(fileName.c_str());
+    if (!file)
+        throw std::runtime_error("Could not open the manifest " + fileName + ".");
+
+    std::vector<BatchSubject> subjects;
+    std::string               line;
+    unsigned int              lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+
+        std::istringstream       stream(line);
+        std::vector<std::string> fields;
+        std::string              field;
+        while (stream >> field)
+            fields.push_back(field);
+        if (fields.empty() || fields[0][0]=='#')
+            continue;
+
+        if (fields.size()<2 || fields.size()>3)
+        {
+            std::ostringstream message;
+            message << "Line " << lineNumber << " of the manifest " << fileName
+                    << " must contain a moving image, an output transformation and optionally an output image.";
+            throw std::runtime_error(message.str());
+        }
+
+        BatchSubject subject;
+        subject.movingImagePath     = fields[0];
+        subject.outputTransformPath = fields[1];
+        subject.outputImagePath     = fields.size()==3 ? fields[2] : "";
+        subjects.push_back(subject);
+    }
+
+    if (subjects.empty())
+        throw std::runtime_error("The manifest " + fileName + " does not contain any subject.");
+    return subjects;
+}
+
+
+/**
+ * Returns the memory (bytes) used by an image once loaded, read from its header.
+ * @param  fileName  path to the image
+ * @return size of the image in memory
+ */
+inline std::size_t
+getImageMemorySize(const std::string & fileName)
+{
+    itk::ImageIOBase::Pointer imageIO = readImageInformation(fileName);
+    return static_cast<std::size_t>(imageIO->GetImageSizeInBytes());
+}
+
+
+/**
+ * Checks that the moving images of a batch have the dimension, the pixel type and the component type
+ * of the first one. The moving images of a batch are read with the type of the first image: an image
+ * of another type would be cast (and possibly truncated) silently.
+ * @param  subjects  subjects of the batch
+ */
+inline void
+checkBatchImageTypes(const std::vector<BatchSubject> & subjects)
+{
+    if (subjects.empty())
+        return;
+
+    itk::ImageIOBase::Pointer first = readImageInformation(subjects[0].movingImagePath);
+    for (unsigned int i=1; i<subjects.size(); i++)
+    {
+        itk::ImageIOBase::Pointer io = readImageInformation(subjects[i].movingImagePath);
+        if (io->GetNumberOfDimensions() != first->GetNumberOfDimensions() ||
+            io->GetPixelType()          != first->GetPixelType()          ||
+            io->GetComponentType()      != first->GetComponentType())
+            throw std::runtime_error("The moving image " + subjects[i].movingImagePath +
+                                     " does not have the pixel type, component type and dimension of the moving image " +
+                                     subjects[0].movingImagePath + ".");
+    }
+}
+
+
+/**
+ * Processes the subjects of a batch concurrently. Each thread takes the next subject of the manifest
+ * and starts it once the memory it needs (given by the estimate function) fits into the budget with
+ * the subjects being processed. A subject needing more than the budget is processed alone. The
+ * subjects are started in the order of the manifest.
+ *
+ * A subject that fails does not stop the batch: the error is printed and the failure is counted.
+ * @param  subjects         subjects of the batch
+ * @param  process          processes a subject (registration and output)
+ * @param  estimate         estimates the memory (bytes) needed to process a subject
+ * @param  numberOfThreads  maximum number of subjects processed concurrently (0: number of cores)
+ * @param  memoryBudget     memory (bytes) shared by the subjects processed concurrently (0: no limit)
+ * @return number of subjects that failed
+ */
+inline unsigned int
+processBatch(const std::vector<BatchSubject> & subjects,
+             const std::function<void(const BatchSubject &)> & process,
+             const std::function<std::size_t(const BatchSubject &)> & estimate,
+             unsigned int numberOfThreads = 0, std::size_t memoryBudget = 0)
+{
+    const unsigned int numberOfSubjects = subjects.size();
+
+    std::mutex              mutex;
+    std::condition_variable released;
+    unsigned int            next     = 0;  // next subject taken by a thread
+    unsigned int            started  = 0;  // number of subjects started or dropped, in manifest order
+    unsigned int            running  = 0;
+    unsigned int            done     = 0;
+    unsigned int            failures = 0;
+    std::size_t             reserved = 0;
+
+    // Each thread takes the next subject, waits for its turn and for the memory it needs, then processes it
+    auto work = [&]()
+    {
+        for (;;)
+        {
+            unsigned int i;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (next>=numberOfSubjects)
+                    return;
+                i = next++;
+            }
+
+            // The estimate reads the image header, outside of the lock
+            std::size_t memory = 0;
+            std::string error;
+            try
+            {
+                memory = estimate(subjects[i]);
+            }
+            catch( std::exception & e )
+            {
+                error = e.what();
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                released.wait(lock, [&](){ return started==i && (!error.empty() || memoryBudget==0 || running==0 ||
+                                                                  reserved + memory <= memoryBudget); });
+                started++;
+                if (error.empty())
+                {
+                    running++;
+                    reserved += memory;
+                }
+            }
+            released.notify_all();
+
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (error.empty())
+            {
+                try
+                {
+                    process(subjects[i]);
+                }
+                catch( std::exception & e )
+                {
+                    error = e.what();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                running--;
+                reserved -= memory;
+            }
+            const double time = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done++;
+                std::cout << "  [" << done << "/" << numberOfSubjects << "] " << subjects[i].movingImagePath;
+                if (error.empty())
+                    std::cout << " : OK (" << time << " s)" << std::endl;
+                else
+                {
+                    failures++;
+                    std::cout << " : FAILED" << std::endl;
+                    std::cerr << "Error (" << subjects[i].movingImagePath << "): " << error << std::endl;
+                }
+            }
+            released.notify_all();
+        }
+    };
+
+    if (numberOfThreads==0)
+        numberOfThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    numberOfThreads = std::min( numberOfThreads, numberOfSubjects );
+
+    if (numberOfThreads<=1)
+        work();
+    else
+    {
+        // The object factories are initialized before the threads query them
+        itk::ObjectFactoryBase::GetRegisteredFactories();
+
+        std::vector<std::thread> threads;
+        for (unsigned int t=1; t<numberOfThreads; t++)
+            threads.push_back( std::thread( work ) );
+        work();
+        for (unsigned int t=0; t<threads.size(); t++)
+            threads[t].join();
+    }
+
+    return failures;
+}
+
+
+} // End of namespace
@@ -1,16 +1,26 @@
 #pragma once
 
 #include <iostream>
+#include <algorithm>
 #include <cstdlib>
 #include <stdexcept>
 #include <cerrno>
 #include <climits>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <sstream>
 
 #include <itkImage.h>
 #include <itkImageIOBase.h>
 #include <itkImageIOFactory.h>
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
+#include <itkCastImageFilter.h>
+#include <itkMetaDataObject.h>
+#include <itkMetaImageIO.h>
+#include <itkByteSwapper.h>
 
 #include <itkTransform.h>
 #include <itkTransformFactory.h>
@@ -23,12 +33,23 @@
 #include <itkTransformToDisplacementFieldFilter.h>
 #include <itkTransformToVelocityFieldSource.h>
 #include <itkResampleImageFilter.h>
+#include <itkMultiImageResampleImageFilter.h>
+#include <itkStreamingResampleImageFilter.h>
+#include <itkLinearInterpolateImageFunction.h>
 #include <itkNearestNeighborInterpolateImageFunction.h>
 #include <itkBSplineInterpolateImageFunction.h>
 #include <itkWindowedSincInterpolateImageFunction.h>
 #include <itkConstantBoundaryCondition.h>
 
 #include <rpiDisplacementFieldTransform.h>
+#include <rpiBSplineDisplacementFieldTransform.h>
+#include <rpiMappedImageContainer.h>
+#include <rpiParallelGzip.h>
+#ifdef RPI_USE_ZSTD
+#include <rpiZstdChunkedImageIO.h>
+#endif
+
+#include <itksys/SystemTools.hxx>
 
 #include "rpiCommonTools.hxx"
 
@@ -88,6 +109,357 @@ readTransformBase( std::string fileName )
 
 
 
+/**
+ * Settings of the exponential cache.
+ */
+struct ExponentialCacheSettings
+{
+    std::string  directory;   // cache directory
+    bool         isSet;       // true once setExponentialCacheDirectory has been called
+};
+
+
+
+/**
+ * Gets the settings of the exponential cache.
+ * @return settings
+ */
+inline
+ExponentialCacheSettings &
+exponentialCacheSettings( void )
+{
+    static ExponentialCacheSettings settings = { std::string(), false };
+    return settings;
+}
+
+
+
+/**
+ * Settings of the compression of the written files.
+ */
+struct CompressionSettings
+{
+    int   level;   // compression level, -1 for the default level of the codec
+    bool  isSet;   // true once setCompressionLevel has been called
+};
+
+
+
+/**
+ * Gets the settings of the compression.
+ * @return settings
+ */
+inline
+CompressionSettings &
+compressionSettings( void )
+{
+    static CompressionSettings settings = { -1, false };
+    return settings;
+}
+
+
+
+/**
+ * Registers the image IOs of RPI with the ITK object factory (zstd chunked container if RPI is
+ * built with zstd). The registration is only done once, whatever the number of threads calling it.
+ */
+inline void
+registerImageIOFactories( void )
+{
+#ifdef RPI_USE_ZSTD
+    static std::once_flag flag;
+    std::call_once( flag, [](){ rpi::ZstdChunkedImageIOFactory::RegisterOneFactory(); } );
+#endif
+}
+
+
+
+/**
+ * Updates an image writer whose input and file name are set, compressing the file if its
+ * extension requires it:
+ * - ".zvf": zstd chunked container (see rpi::ZstdChunkedImageIO),
+ * - ".gz" (e.g. ".nii.gz"): the file is written uncompressed under a temporary name, then
+ *   compressed with several threads into a standard gzip file (see rpi::compressFileWithGzip).
+ * The other files are written by the writer as usual.
+ * @param  writer    image writer
+ * @param  fileName  name of the output file
+ */
+template<class TWriter>
+void
+updateImageWriter( TWriter * writer, const std::string & fileName )
+{
+    const std::string extension = itksys::SystemTools::LowerCase( itksys::SystemTools::GetFilenameLastExtension( fileName ) );
+    const int         level     = getCompressionLevel();
+
+    // Zstd chunked container
+    if ( extension == ".zvf" )
+    {
+#ifdef RPI_USE_ZSTD
+        rpi::ZstdChunkedImageIO::Pointer io = rpi::ZstdChunkedImageIO::New();
+        if ( level >= 0 )
+            io->SetZstdCompressionLevel( level );
+        writer->SetImageIO( io );
+        writer->SetFileName( fileName );
+        writer->Update();
+        return;
+#else
+        throw std::runtime_error( "RPI is built without zstd: cannot write " + fileName + "." );
+#endif
+    }
+
+    // Other files
+    if ( extension != ".gz" )
+    {
+        writer->SetFileName( fileName );
+        writer->Update();
+        return;
+    }
+
+    // Gzip files: the uncompressed file keeps the extension of the format (e.g. ".nii")
+    const std::string uncompressed = fileName.substr( 0, fileName.size() - extension.size() );
+    const std::string format       = itksys::SystemTools::GetFilenameLastExtension( uncompressed );
+    std::random_device random;
+    std::ostringstream temporary;
+    temporary << uncompressed.substr( 0, uncompressed.size() - format.size() ) << "." << std::hex << random() << ".tmp" << format;
+
+    try
+    {
+        writer->SetFileName( temporary.str() );
+        writer->Update();
+        compressFileWithGzip( temporary.str(), fileName, (level >= 0) ? std::min(level, 9) : -1 );
+    }
+    catch( ... )
+    {
+        std::remove( temporary.str().c_str() );
+        throw;
+    }
+    std::remove( temporary.str().c_str() );
+}
+
+
+
+/**
+ * Computes a 64-bit FNV-1a hash of a buffer.
+ * @param  data  buffer
+ * @param  size  size of the buffer in bytes
+ * @param  hash  current value of the hash
+ * @return updated hash
+ */
+inline
+unsigned long long
+hashBuffer( const void * data, std::size_t size, unsigned long long hash = 14695981039346656037ULL )
+{
+    const unsigned char * bytes = static_cast<const unsigned char *>( data );
+    for ( std::size_t i=0; i<size; i++ )
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+
+/**
+ * Computes the hash of the content of a field: geometry and values (in single precision).
+ * @param  field  field
+ * @return hash as an hexadecimal string
+ */
+template<class TField>
+std::string
+hashFieldContent( const TField * field )
+{
+    const unsigned int Dimension = TField::ImageDimension;
+
+    unsigned long long hash = 14695981039346656037ULL;  // FNV-1a offset basis
+    for ( unsigned int i=0; i<Dimension; i++ )
+    {
+        const unsigned long long size    = field->GetLargestPossibleRegion().GetSize()[i];
+        const double             origin  = field->GetOrigin()[i];
+        const double             spacing = field->GetSpacing()[i];
+        hash = hashBuffer( &size,    sizeof(size),    hash );
+        hash = hashBuffer( &origin,  sizeof(origin),  hash );
+        hash = hashBuffer( &spacing, sizeof(spacing), hash );
+        for ( unsigned int j=0; j<Dimension; j++ )
+        {
+            const double direction = field->GetDirection()[i][j];
+            hash = hashBuffer( &direction, sizeof(direction), hash );
+        }
+    }
+
+    // The values are hashed in single precision, so that a field gets the same key whatever the
+    // precision it has been read with
+    const typename TField::PixelType * buffer = field->GetBufferPointer();
+    const itk::SizeValueType           size   = field->GetBufferedRegion().GetNumberOfPixels();
+    for ( itk::SizeValueType n=0; n<size; n++ )
+    {
+        float value[TField::PixelType::Dimension];
+        for ( unsigned int k=0; k<TField::PixelType::Dimension; k++ )
+            value[k] = static_cast<float>( buffer[n][k] );
+        hash = hashBuffer( value, sizeof(value), hash );
+    }
+
+    char text[17];
+    std::snprintf( text, sizeof(text), "%016llx", hash );
+    return std::string( text );
+}
+
+
+
+/**
+ * Checks that two images have the same geometry (up to the precision of the image headers).
+ * @param  image1  first image
+ * @param  image2  second image
+ * @return true if the geometries are the same
+ */
+template<class TImage1, class TImage2>
+bool
+haveSameGeometry( const TImage1 * image1, const TImage2 * image2 )
+{
+    const unsigned int Dimension = TImage1::ImageDimension;
+    for ( unsigned int i=0; i<Dimension; i++ )
+    {
+        const double spacing = image1->GetSpacing()[i];
+        if ( image1->GetLargestPossibleRegion().GetSize()[i] != image2->GetLargestPossibleRegion().GetSize()[i] )
+            return false;
+        if ( std::fabs( spacing - image2->GetSpacing()[i] ) > 1e-4 * spacing )
+            return false;
+        if ( std::fabs( image1->GetOrigin()[i] - image2->GetOrigin()[i] ) > 1e-4 * spacing )
+            return false;
+        for ( unsigned int j=0; j<Dimension; j++ )
+            if ( std::fabs( image1->GetDirection()[i][j] - image2->GetDirection()[i][j] ) > 1e-6 )
+                return false;
+    }
+    return true;
+}
+
+
+
+/**
+ * Maps an uncompressed MetaImage (.mha, or .mhd with its raw data file) in memory instead of
+ * reading it: the pages of the file are loaded when the voxels are accessed for the first time.
+ * The image must have the dimension, the number of components, the component type and the byte
+ * order of TImage. NIfTI vector images are not mapped since they store the components in planar
+ * order.
+ * @param  fileName  path to the image
+ * @param  imageIO   image information, read from the file
+ * @return mapped image, or a null pointer if the file cannot be mapped
+ */
+template<class TImage>
+typename TImage::Pointer
+mapImageFile( const std::string & fileName, itk::ImageIOBase * imageIO )
+{
+    typedef typename TImage::PixelType                                         PixelType;
+    typedef typename PixelType::ValueType                                      ValueType;
+    typedef rpi::MappedImageContainer<itk::SizeValueType, PixelType>           ContainerType;
+
+    const unsigned int Dimension = TImage::ImageDimension;
+
+    // Only uncompressed MetaImages with the memory layout of TImage can be mapped
+    itk::MetaImageIO * metaImageIO = dynamic_cast<itk::MetaImageIO *>( imageIO );
+    if ( !metaImageIO || metaImageIO->GetMetaImagePointer()->CompressedData() )
+        return ITK_NULLPTR;
+    if ( imageIO->GetNumberOfDimensions()!=Dimension ||
+         imageIO->GetNumberOfComponents()!=PixelType::Dimension ||
+         imageIO->GetComponentType()!=itk::ImageIOBase::MapPixelType<ValueType>::CType ||
+         imageIO->GetComponentSize()!=sizeof(ValueType) )
+        return ITK_NULLPTR;
+    const bool bigEndian = itk::ByteSwapper<ValueType>::SystemIsBigEndian();
+    if ( imageIO->GetByteOrder()!=( bigEndian ? itk::IOByteOrderEnum::BigEndian : itk::IOByteOrderEnum::LittleEndian ) )
+        return ITK_NULLPTR;
+
+    // Data file: the header itself (LOCAL) or a single raw file, relative to the header
+    MetaImage *        metaImage = metaImageIO->GetMetaImagePointer();
+    const std::string  element   = metaImage->ElementDataFileName();
+    const bool         local     = ( element=="LOCAL" || element=="Local" || element=="local" );
+    if ( !local && ( element.empty() || element.find("LIST")==0 || element.find('%')!=std::string::npos ) )
+        return ITK_NULLPTR;
+    std::string dataFileName = fileName;
+    if ( !local )
+    {
+        // A relative data file is given with respect to the directory of the header, which is empty
+        // for a header given by a bare file name
+        const std::string path = itksys::SystemTools::GetFilenamePath( fileName );
+        dataFileName = ( itksys::SystemTools::FileIsFullPath( element ) || path.empty() ) ? element : path + "/" + element;
+    }
+
+    // The data are at the end of the file, unless the header gives their position
+    itk::SizeValueType numberOfPixels = 1;
+    typename TImage::RegionType region;
+    for ( unsigned int i=0; i<Dimension; i++ )
+    {
+        region.SetSize( i, imageIO->GetDimensions(i) );
+        numberOfPixels *= imageIO->GetDimensions(i);
+    }
+    const std::size_t dataSize = numberOfPixels * sizeof(PixelType);
+    const std::size_t fileSize = static_cast<std::size_t>( itksys::SystemTools::FileLength( dataFileName ) );
+    std::size_t offset;
+    if ( !local && metaImage->HeaderSize()>0 )
+        offset = static_cast<std::size_t>( metaImage->HeaderSize() );
+    else if ( fileSize>=dataSize )
+        offset = fileSize - dataSize;
+    else
+        return ITK_NULLPTR;
+    if ( offset % sizeof(ValueType)!=0 )
+        return ITK_NULLPTR;
+
+    typename ContainerType::Pointer container = ContainerType::New();
+    if ( !container->MapFile( dataFileName, offset, numberOfPixels ) )
+        return ITK_NULLPTR;
+
+    // Image sharing the mapped pages
+    typename TImage::PointType     origin;
+    typename TImage::SpacingType   spacing;
+    typename TImage::DirectionType direction;
+    for ( unsigned int i=0; i<Dimension; i++ )
+    {
+        origin[i]  = imageIO->GetOrigin(i);
+        spacing[i] = imageIO->GetSpacing(i);
+        for ( unsigned int j=0; j<Dimension; j++ )
+            direction(i,j) = imageIO->GetDirection(j)[i];
+    }
+    typename TImage::Pointer image = TImage::New();
+    image->SetOrigin(    origin );
+    image->SetSpacing(   spacing );
+    image->SetDirection( direction );
+    image->SetRegions(   region );
+    image->SetPixelContainer( container );
+    image->SetMetaDataDictionary( imageIO->GetMetaDataDictionary() );
+    return image;
+}
+
+
+
+/**
+ * Reads a vector field, by mapping the file in memory when possible (see mapImageFile).
+ * @param  fileName  path to the field
+ * @param  imageIO   image information, read from the file
+ * @return vector field
+ */
+template<class TField>
+typename TField::Pointer
+readOrMapVectorField( const std::string & fileName, itk::ImageIOBase * imageIO )
+{
+    typename TField::Pointer field = mapImageFile<TField>( fileName, imageIO );
+    if ( field )
+        return field;
+
+    typedef itk::ImageFileReader<TField> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( fileName );
+    try
+    {
+        reader->Update();
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        throw std::runtime_error( "Could not read the input transformation." );
+    }
+    return reader->GetOutput();
+}
+
+
+
 /**
  * Casts the scalar type of an input Euler3D transformation.
  * @param  input input transformation
@@ -301,6 +673,94 @@ convertMatrixOffsetToAffine(itk::MatrixOffsetTransformBase<TMatrixOffsetScalarTy
 
 
 
+/**
+ * Keys of the header entries describing the encoding of a displacement field file.
+ */
+static const char * const FIELD_ENCODING_KEY = "rpi_field_encoding";
+static const char * const FIELD_SCALE_KEY    = "rpi_field_scale";
+static const char * const FIELD_OFFSET_KEY   = "rpi_field_offset";
+
+
+/**
+ * Keys of the header entries describing the field approximated by a B-spline displacement field.
+ */
+static const char * const BSPLINE_FIELD_ORIGIN_KEY  = "rpi_bspline_field_origin";
+static const char * const BSPLINE_FIELD_SPACING_KEY = "rpi_bspline_field_spacing";
+static const char * const BSPLINE_FIELD_SIZE_KEY    = "rpi_bspline_field_size";
+
+
+
+/**
+ * Formats the scales or offsets of an encoded field as a header entry.
+ * @param  values  values
+ * @param  size    number of values
+ * @return values separated by spaces
+ */
+inline std::string
+formatFieldEncodingParameters( const double * values, unsigned int size )
+{
+    std::ostringstream stream;
+    stream.precision(17);
+    for (unsigned int i=0; i<size; i++)
+        stream << (i ? " " : "") << values[i];
+    return stream.str();
+}
+
+
+
+/**
+ * Parses the scales or offsets of an encoded field from a header entry.
+ * @param  entry   values separated by spaces
+ * @param  values  values (output)
+ * @param  size    number of values
+ */
+inline void
+parseFieldEncodingParameters( const std::string & entry, double * values, unsigned int size )
+{
+    std::istringstream stream(entry);
+    for (unsigned int i=0; i<size; i++)
+        if (!(stream >> values[i]))
+            throw std::runtime_error("Invalid field encoding parameters: " + entry);
+}
+
+
+
+/**
+ * Creates an image interpolator of a given type.
+ * @param  interpolator  type of the image interpolation
+ * @return image interpolator
+ */
+template<class TImage, class TTransformScalarType>
+typename itk::InterpolateImageFunction<TImage, TTransformScalarType>::Pointer
+createImageInterpolator(ImageInterpolatorType interpolator)
+{
+    switch(interpolator) {
+
+    case INTERPOLATOR_NEAREST_NEIGHBOR:
+        return itk::NearestNeighborInterpolateImageFunction<TImage, TTransformScalarType>::New().GetPointer();
+
+    case INTERPOLATOR_LINEAR:
+        return itk::LinearInterpolateImageFunction<TImage, TTransformScalarType>::New().GetPointer();
+
+    case INTERPOLATOR_BSLPINE:
+        return itk::BSplineInterpolateImageFunction<TImage, TTransformScalarType>::New().GetPointer();
+
+    case INTERPOLATOR_SINUS_CARDINAL:
+        return itk::WindowedSincInterpolateImageFunction<
+                TImage,
+                TImage::ImageDimension,
+                itk::Function::HammingWindowFunction<TImage::ImageDimension>,
+                itk::ConstantBoundaryCondition<TImage>,
+                TTransformScalarType
+                >::New().GetPointer();
+
+    default:
+        throw std::runtime_error("Image interpolator not supported.");
+    }
+}
+
+
+
 //--------------------------------------------------------------------------------------------------
 //
 // Functions of rpi::CommonTools
@@ -313,6 +773,7 @@ readImageInformation( std::string fileName )
 {
 
     // Define image IO
+    registerImageIOFactories();
     itk::ImageIOBase::Pointer imageIO  = itk::ImageIOFactory::CreateImageIO( fileName.c_str(), itk::IOFileModeEnum::ReadMode );
 
     // Test if image exists
@@ -338,6 +799,7 @@ template<typename TImage>
 typename TImage::Pointer
 readImage( std::string fileName )
 {
+    registerImageIOFactories();
     typedef itk::ImageFileReader<TImage>  ImageReaderType;
     typename ImageReaderType::Pointer reader = ImageReaderType::New();
     reader->SetFileName( fileName );
@@ -528,21 +990,31 @@ readDisplacementField( std::string fileName )
     typedef typename FieldTransformType::VectorFieldType
             VectorFieldType;
 
-    typedef itk::ImageFileReader<VectorFieldType>
-            ReaderType;
+    typedef typename FieldTransformType::EncodedVectorFieldType
+            EncodedVectorFieldType;
 
-    // Read the displacement field (image)
-    typename ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName( fileName );
-    try
-    {
-        reader->Update();
-    }
-    catch( itk::ExceptionObject& err )
+    // Fields written with a 16-bit encoding are read as they are
+    itk::ImageIOBase::Pointer imageIO = readImageInformation( fileName );
+    std::string               encodingName;
+    if (itk::ExposeMetaData<std::string>( imageIO->GetMetaDataDictionary(), FIELD_ENCODING_KEY, encodingName ) &&
+        getFieldEncodingFromString( encodingName ) != FIELD_ENCODING_FLOAT)
     {
-        throw std::runtime_error( "Could not read the input transformation." );
+        std::string scaleEntry, offsetEntry;
+        double      scale[3], offset[3];
+        if (!itk::ExposeMetaData<std::string>( imageIO->GetMetaDataDictionary(), FIELD_SCALE_KEY,  scaleEntry ) ||
+            !itk::ExposeMetaData<std::string>( imageIO->GetMetaDataDictionary(), FIELD_OFFSET_KEY, offsetEntry ))
+            throw std::runtime_error( "The encoding parameters of the field " + fileName + " are missing." );
+        parseFieldEncodingParameters( scaleEntry,  scale,  3 );
+        parseFieldEncodingParameters( offsetEntry, offset, 3 );
+
+        typename EncodedVectorFieldType::Pointer encoded = readOrMapVectorField<EncodedVectorFieldType>( fileName, imageIO );
+        typename FieldTransformType::Pointer transform = FieldTransformType::New();
+        transform->SetParametersAsEncodedVectorField( encoded, getFieldEncodingFromString( encodingName ), scale, offset );
+        return transform;
     }
-    typename VectorFieldType::Pointer field = reader->GetOutput();
+
+    // Read the displacement field (image), or map it in memory
+    typename VectorFieldType::Pointer field = readOrMapVectorField<VectorFieldType>( fileName, imageIO );
 
     // Create the displacement field (transformation)
     typename FieldTransformType::Pointer transform = FieldTransformType::New();
@@ -553,40 +1025,220 @@ readDisplacementField( std::string fileName )
 
 
 template<class TTransformScalarType>
-typename itk::StationaryVelocityFieldTransform<TTransformScalarType, 3>::Pointer
-readStationaryVelocityField( std::string fileName )
+typename rpi::BSplineDisplacementFieldTransform<TTransformScalarType, 3>::Pointer
+readBSplineDisplacementField( std::string fileName )
 {
 
-    typedef itk::StationaryVelocityFieldTransform<TTransformScalarType, 3>
+    typedef rpi::BSplineDisplacementFieldTransform<TTransformScalarType, 3>
             FieldTransformType;
 
-    typedef typename FieldTransformType::VectorFieldType
-            VectorFieldType;
+    typedef typename FieldTransformType::CoefficientImageType
+            CoefficientImageType;
 
-    typedef itk::ImageFileReader<VectorFieldType>
-            ReaderType;
+    typedef typename FieldTransformType::FieldGeometryType
+            FieldGeometryType;
 
-    // Read the velocity field (image)
-    typename ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName( fileName );
+    // Read the coefficients (image)
+    typename CoefficientImageType::Pointer coefficients;
     try
     {
-        reader->Update();
+        coefficients = readImage<CoefficientImageType>( fileName );
     }
     catch( itk::ExceptionObject& err )
     {
         throw std::runtime_error( "Could not read the input transformation." );
     }
-    typename VectorFieldType::Pointer field = reader->GetOutput();
+
+    // Create the B-spline displacement field (transformation)
+    typename FieldTransformType::Pointer transform = FieldTransformType::New();
+    transform->SetCoefficients( coefficients );
+
+    // Geometry of the fitted field, if it is stored in the header
+    const itk::MetaDataDictionary & dictionary = coefficients->GetMetaDataDictionary();
+    std::string originEntry, spacingEntry, sizeEntry;
+    if (itk::ExposeMetaData<std::string>( dictionary, BSPLINE_FIELD_ORIGIN_KEY,  originEntry  ) &&
+        itk::ExposeMetaData<std::string>( dictionary, BSPLINE_FIELD_SPACING_KEY, spacingEntry ) &&
+        itk::ExposeMetaData<std::string>( dictionary, BSPLINE_FIELD_SIZE_KEY,    sizeEntry    ))
+    {
+        double values[3];
+        typename FieldGeometryType::PointType   origin;
+        typename FieldGeometryType::SpacingType spacing;
+        typename FieldGeometryType::RegionType  region;
+        parseFieldEncodingParameters( originEntry, values, 3 );
+        for (unsigned int i=0; i<3; i++)
+            origin[i] = values[i];
+        parseFieldEncodingParameters( spacingEntry, values, 3 );
+        for (unsigned int i=0; i<3; i++)
+            spacing[i] = values[i];
+        parseFieldEncodingParameters( sizeEntry, values, 3 );
+        for (unsigned int i=0; i<3; i++)
+            region.SetSize( i, static_cast<itk::SizeValueType>( values[i] ) );
+
+        typename FieldGeometryType::Pointer geometry = FieldGeometryType::New();
+        geometry->SetOrigin(    origin );
+        geometry->SetSpacing(   spacing );
+        geometry->SetDirection( coefficients->GetDirection() );
+        geometry->SetRegions(   region );
+        transform->SetFieldGeometry( geometry );
+    }
+
+    return transform;
+}
+
+
+
+template<class TTransformScalarType>
+typename itk::StationaryVelocityFieldTransform<TTransformScalarType, 3>::Pointer
+readStationaryVelocityField( std::string fileName, bool useExponentialCache )
+{
+
+    typedef itk::StationaryVelocityFieldTransform<TTransformScalarType, 3>
+            FieldTransformType;
+
+    typedef typename FieldTransformType::VectorFieldType
+            VectorFieldType;
+
+    // Read the velocity field (image), or map it in memory
+    itk::ImageIOBase::Pointer         imageIO = readImageInformation( fileName );
+    typename VectorFieldType::Pointer field   = readOrMapVectorField<VectorFieldType>( fileName, imageIO );
 
     // Create the velocity field (transformation)
     typename FieldTransformType::Pointer transform = FieldTransformType::New();
     transform->SetParametersAsVectorField( static_cast<typename VectorFieldType::ConstPointer>( field.GetPointer() ) );
+
+    // Get its exponential from the cache
+    if ( useExponentialCache && !getExponentialCacheDirectory().empty() )
+        fetchExponentialFromCache<TTransformScalarType>( transform );
+
     return transform;
 }
 
 
 
+inline void
+setExponentialCacheDirectory( std::string directory )
+{
+    exponentialCacheSettings().directory = directory;
+    exponentialCacheSettings().isSet     = true;
+}
+
+
+
+inline std::string
+getExponentialCacheDirectory( void )
+{
+    if ( exponentialCacheSettings().isSet )
+        return exponentialCacheSettings().directory;
+
+    const char * variable = std::getenv( "RPI_EXPONENTIAL_CACHE_DIRECTORY" );
+    return ( variable!=0 ) ? std::string( variable ) : std::string();
+}
+
+
+
+inline void
+setCompressionLevel( int level )
+{
+    compressionSettings().level = std::max( level, -1 );
+    compressionSettings().isSet = true;
+}
+
+
+
+inline int
+getCompressionLevel( void )
+{
+    if ( compressionSettings().isSet )
+        return compressionSettings().level;
+
+    const char * variable = std::getenv( "RPI_COMPRESSION_LEVEL" );
+    return ( variable!=0 ) ? std::max( std::atoi( variable ), -1 ) : -1;
+}
+
+
+
+template<class TTransformScalarType>
+bool
+fetchExponentialFromCache( itk::StationaryVelocityFieldTransform<TTransformScalarType, 3> * transform )
+{
+
+    typedef itk::StationaryVelocityFieldTransform<TTransformScalarType, 3>
+            FieldTransformType;
+
+    typedef typename FieldTransformType::VectorFieldType
+            VectorFieldType;
+
+    const std::string directory = getExponentialCacheDirectory();
+    if ( directory.empty() )
+        return false;
+
+    // The cached exponentials are stored in single precision
+    typedef itk::Image<itk::Vector<float, 3>, 3>
+            CachedFieldType;
+
+    // The key depends on the content of the field and on the numerical scheme
+    const VectorFieldType * velocity = transform->GetParametersAsVectorField();
+    const std::string       path     = directory + "/" + hashFieldContent<VectorFieldType>( velocity ) + "_scaling_and_squaring.mha";
+
+    // Read the exponential if it is in the cache
+    if ( itksys::SystemTools::FileExists( path.c_str(), true ) )
+    {
+        try
+        {
+            typedef itk::ImageFileReader<VectorFieldType> ReaderType;
+            typename ReaderType::Pointer reader = ReaderType::New();
+            reader->SetFileName( path );
+            reader->Update();
+            typename VectorFieldType::Pointer exponential = reader->GetOutput();
+            if ( haveSameGeometry( exponential.GetPointer(), velocity ) )
+            {
+                exponential->CopyInformation( velocity );
+                transform->SetCachedDisplacementField( exponential );
+                return true;
+            }
+        }
+        catch( itk::ExceptionObject & )
+        {
+            std::cerr << "Warning: could not read the cached exponential " << path << "." << std::endl;
+        }
+    }
+
+    // Compute the exponential and store it. The file is written under a temporary name and then
+    // renamed, so that concurrent processes never read a partial file.
+    const VectorFieldType * exponential = transform->GetCachedDisplacementField();
+    try
+    {
+        itksys::SystemTools::MakeDirectory( directory.c_str() );
+
+        std::random_device random;
+        std::ostringstream temporary;
+        temporary << path << "." << std::hex << random() << ".tmp.mha";
+
+        typedef itk::CastImageFilter<VectorFieldType, CachedFieldType> CasterType;
+        typename CasterType::Pointer caster = CasterType::New();
+        caster->SetInput( exponential );
+
+        typedef itk::ImageFileWriter<CachedFieldType> WriterType;
+        typename WriterType::Pointer writer = WriterType::New();
+        writer->SetInput( caster->GetOutput() );
+        writer->SetFileName( temporary.str() );
+        writer->Update();
+
+        if ( std::rename( temporary.str().c_str(), path.c_str() )!=0 )
+        {
+            std::remove( temporary.str().c_str() );
+            std::cerr << "Warning: could not store the exponential in the cache " << path << "." << std::endl;
+        }
+    }
+    catch( itk::ExceptionObject & )
+    {
+        std::cerr << "Warning: could not store the exponential in the cache " << path << "." << std::endl;
+    }
+    return false;
+}
+
+
+
 template<class TLinearScalarType, class TFieldScalarType, class TImage>
 typename rpi::DisplacementFieldTransform<TFieldScalarType, TImage::ImageDimension>::Pointer
 linearToDisplacementFieldTransformation(
@@ -695,21 +1347,102 @@ template<class TTransformScalarType, int TDimension>
 void
 writeDisplacementFieldTransformation(
         itk::Transform<TTransformScalarType, TDimension, TDimension> * field,
-        std::string fileName )
+        std::string fileName,
+        FieldEncoding encoding )
 {
     // Type definition
     typedef rpi::DisplacementFieldTransform<TTransformScalarType, TDimension>  FieldTransformType;
     typedef typename FieldTransformType::VectorFieldType                       VectorFieldType;
+    typedef typename FieldTransformType::EncodedVectorFieldType                EncodedVectorFieldType;
     typedef itk::ImageFileWriter<VectorFieldType>                              FieldWriterType;
+    typedef itk::ImageFileWriter<EncodedVectorFieldType>                       EncodedFieldWriterType;
 
     // Cast the transformation into a displacement field
     FieldTransformType * transform = dynamic_cast<FieldTransformType *>(field);
 
+    // Write the field with 16 bits per component, reusing the codes of the transformation if it is
+    // already encoded the same way
+    if (encoding != FIELD_ENCODING_FLOAT)
+    {
+        const std::string extension = itksys::SystemTools::LowerCase( itksys::SystemTools::GetFilenameLastExtension( fileName ) );
+        if (extension != ".mha" && extension != ".mhd" && extension != ".nrrd" && extension != ".nhdr" && extension != ".zvf")
+            throw std::runtime_error( "Encoded displacement fields can only be written in MetaImage, NRRD or zvf files." );
+
+        typename EncodedVectorFieldType::Pointer encoded;
+        double                                   scale[TDimension];
+        double                                   offset[TDimension];
+        if (transform->GetEncodedVectorField() && transform->GetEncoding() == encoding)
+        {
+            encoded = EncodedVectorFieldType::New();
+            encoded->Graft( transform->GetEncodedVectorField() );
+            std::copy( transform->GetEncodingScale(),  transform->GetEncodingScale()  + TDimension, scale );
+            std::copy( transform->GetEncodingOffset(), transform->GetEncodingOffset() + TDimension, offset );
+        }
+        else
+            encoded = encodeVectorField<VectorFieldType>( transform->GetParametersAsVectorField(), encoding, scale, offset );
+
+        itk::MetaDataDictionary & dictionary = encoded->GetMetaDataDictionary();
+        itk::EncapsulateMetaData<std::string>( dictionary, FIELD_ENCODING_KEY, getFieldEncodingAsString( encoding ) );
+        itk::EncapsulateMetaData<std::string>( dictionary, FIELD_SCALE_KEY,    formatFieldEncodingParameters( scale,  TDimension ) );
+        itk::EncapsulateMetaData<std::string>( dictionary, FIELD_OFFSET_KEY,   formatFieldEncodingParameters( offset, TDimension ) );
+
+        typename EncodedFieldWriterType::Pointer encodedWriter = EncodedFieldWriterType::New();
+        encodedWriter->SetInput( encoded );
+        updateImageWriter( encodedWriter.GetPointer(), fileName );
+        return;
+    }
+
     // Write the output field
     typename FieldWriterType::Pointer fieldWriter = FieldWriterType::New();
-    fieldWriter->SetInput(    transform->GetParametersAsVectorField() );
-    fieldWriter->SetFileName( fileName );
-    fieldWriter->Update();
+    fieldWriter->SetInput( transform->GetParametersAsVectorField() );
+    updateImageWriter( fieldWriter.GetPointer(), fileName );
+}
+
+
+
+template<class TTransformScalarType, int TDimension>
+void
+writeBSplineDisplacementFieldTransformation(
+        itk::Transform<TTransformScalarType, TDimension, TDimension> * field,
+        std::string fileName )
+{
+    // Type definition
+    typedef rpi::BSplineDisplacementFieldTransform<TTransformScalarType, TDimension>  FieldTransformType;
+    typedef typename FieldTransformType::CoefficientImageType                          CoefficientImageType;
+    typedef typename FieldTransformType::FieldGeometryType                             FieldGeometryType;
+    typedef itk::ImageFileWriter<CoefficientImageType>                                 CoefficientWriterType;
+
+    // Cast the transformation into a B-spline displacement field
+    FieldTransformType * transform = dynamic_cast<FieldTransformType *>(field);
+    if (!transform || !transform->GetCoefficients())
+        throw std::runtime_error( "The transformation is not a B-spline displacement field." );
+
+    // The coefficients are grafted so that the header entries do not modify the transformation
+    typename CoefficientImageType::Pointer coefficients = CoefficientImageType::New();
+    coefficients->Graft( transform->GetCoefficients() );
+
+    // Geometry of the fitted field
+    const FieldGeometryType * geometry = transform->GetFieldGeometry();
+    if (geometry)
+    {
+        double origin[TDimension], spacing[TDimension], size[TDimension];
+        for (int i=0; i<TDimension; i++)
+        {
+            origin[i]  = geometry->GetOrigin()[i];
+            spacing[i] = geometry->GetSpacing()[i];
+            size[i]    = static_cast<double>( geometry->GetLargestPossibleRegion().GetSize(i) );
+        }
+        itk::MetaDataDictionary dictionary;
+        itk::EncapsulateMetaData<std::string>( dictionary, BSPLINE_FIELD_ORIGIN_KEY,  formatFieldEncodingParameters( origin,  TDimension ) );
+        itk::EncapsulateMetaData<std::string>( dictionary, BSPLINE_FIELD_SPACING_KEY, formatFieldEncodingParameters( spacing, TDimension ) );
+        itk::EncapsulateMetaData<std::string>( dictionary, BSPLINE_FIELD_SIZE_KEY,    formatFieldEncodingParameters( size,    TDimension ) );
+        coefficients->SetMetaDataDictionary( dictionary );
+    }
+
+    // Write the coefficients
+    typename CoefficientWriterType::Pointer writer = CoefficientWriterType::New();
+    writer->SetInput( coefficients );
+    updateImageWriter( writer.GetPointer(), fileName );
 }
 
 
@@ -730,9 +1463,8 @@ writeStationaryVelocityFieldTransformation(
 
     // Write the output field
     typename FieldWriterType::Pointer fieldWriter = FieldWriterType::New();
-    fieldWriter->SetInput(    transform->GetParametersAsVectorField() );
-    fieldWriter->SetFileName( fileName );
-    fieldWriter->Update();
+    fieldWriter->SetInput( transform->GetParametersAsVectorField() );
+    updateImageWriter( fieldWriter.GetPointer(), fileName );
 }
 
 
@@ -785,34 +1517,7 @@ resampleImage(
     resampler->SetDefaultPixelValue( 0 );
 
     // Set the image interpolator
-    switch(interpolator) {
-
-    case INTERPOLATOR_NEAREST_NEIGHBOR:
-        resampler->SetInterpolator(itk::NearestNeighborInterpolateImageFunction<TImage, TTransformScalarType>::New());
-        break;
-
-    case INTERPOLATOR_LINEAR:
-        // Nothing to do ; linear interpolator by default
-        break;
-
-    case INTERPOLATOR_BSLPINE:
-        resampler->SetInterpolator(itk::BSplineInterpolateImageFunction<TImage, TTransformScalarType>::New());
-        break;
-
-    case INTERPOLATOR_SINUS_CARDINAL:
-        resampler->SetInterpolator(itk::WindowedSincInterpolateImageFunction<
-                                   TImage,
-                                   TImage::ImageDimension,
-                                   itk::Function::HammingWindowFunction<TImage::ImageDimension>,
-                                   itk::ConstantBoundaryCondition<TImage>,
-                                   TTransformScalarType
-                                   >::New());
-        break;
-
-    default:
-        throw std::runtime_error("Image interpolator not supported.");
-        break;
-    }
+    resampler->SetInterpolator( createImageInterpolator<TImage, TTransformScalarType>(interpolator) );
 
     // Resample the image
     try
@@ -925,9 +1630,8 @@ resampleAndWriteImage(
     // Write the output image
     typedef itk::ImageFileWriter<TImage> ImageWriterType;
     typename ImageWriterType::Pointer imageWriter = ImageWriterType::New();
-    imageWriter->SetFileName( fileName );
     imageWriter->SetInput( resampled_image );
-    imageWriter->Update();
+    updateImageWriter( imageWriter.GetPointer(), fileName );
 }
 
 
@@ -954,6 +1658,143 @@ resampleAndWriteImage(
 
 
 
+template<class TImage, class TTransformScalarType>
+std::vector<typename TImage::Pointer>
+resampleImages(
+    const std::vector<typename TImage::Pointer> & images,
+    const typename TImage::PointType     & origin,
+    const typename TImage::SpacingType   & spacing,
+    const typename TImage::SizeType      & size,
+    const typename TImage::DirectionType & direction,
+    itk::Transform<TTransformScalarType, TImage::ImageDimension, TImage::ImageDimension> * transform,
+    ImageInterpolatorType interpolator )
+{
+
+    // Create and initialize the resample filter ; the mapped points are computed once for all the images
+    typedef itk::MultiImageResampleImageFilter<TImage, TTransformScalarType> ResampleFilterType;
+    typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+    resampler->SetTransform(         transform );
+    resampler->SetSize(              size );
+    resampler->SetOutputOrigin(      origin );
+    resampler->SetOutputSpacing(     spacing );
+    resampler->SetOutputDirection(   direction );
+    resampler->SetDefaultPixelValue( 0 );
+    for (unsigned int i=0; i<images.size(); i++)
+    {
+        resampler->SetInput(        i, images[i] );
+        resampler->SetInterpolator( i, createImageInterpolator<TImage, TTransformScalarType>(interpolator) );
+    }
+
+    // Resample the images
+    try
+    {
+        resampler->Update();
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        throw std::runtime_error("Image resampling failure.");
+    }
+
+    // Return resampled images
+    std::vector<typename TImage::Pointer> outputs(images.size());
+    for (unsigned int i=0; i<images.size(); i++)
+    {
+        outputs[i] = resampler->GetOutput(i);
+        outputs[i]->DisconnectPipeline();
+    }
+    return outputs;
+}
+
+
+
+template<class TImage, class TTransformScalarType>
+void
+resampleAndWriteImages(
+    const std::vector<typename TImage::Pointer> & images,
+    const typename TImage::PointType     & origin,
+    const typename TImage::SpacingType   & spacing,
+    const typename TImage::SizeType      & size,
+    const typename TImage::DirectionType & direction,
+    itk::Transform<TTransformScalarType, TImage::ImageDimension, TImage::ImageDimension> * transform,
+    const std::vector<std::string> & fileNames,
+    ImageInterpolatorType interpolator )
+{
+    if (images.size() != fileNames.size())
+        throw std::runtime_error("The number of output files does not match the number of images.");
+
+    // Resample images
+    std::vector<typename TImage::Pointer> resampled_images = resampleImages<TImage, TTransformScalarType>(
+                images,
+                origin,
+                spacing,
+                size,
+                direction,
+                transform,
+                interpolator);
+
+    // Write the output images
+    typedef itk::ImageFileWriter<TImage> ImageWriterType;
+    for (unsigned int i=0; i<resampled_images.size(); i++)
+    {
+        typename ImageWriterType::Pointer imageWriter = ImageWriterType::New();
+        imageWriter->SetInput( resampled_images[i] );
+        updateImageWriter( imageWriter.GetPointer(), fileNames[i] );
+    }
+}
+
+
+
+template<class TImage, class TTransformScalarType>
+void
+streamResampleAndWriteImage(
+    std::string inputFileName,
+    const typename TImage::PointType     & origin,
+    const typename TImage::SpacingType   & spacing,
+    const typename TImage::SizeType      & size,
+    const typename TImage::DirectionType & direction,
+    itk::Transform<TTransformScalarType, TImage::ImageDimension, TImage::ImageDimension> * transform,
+    std::string fileName,
+    unsigned int numberOfStreamDivisions,
+    ImageInterpolatorType interpolator )
+{
+
+    // Type definition
+    typedef itk::ImageFileReader<TImage>                                              ImageReaderType;
+    typedef itk::StreamingResampleImageFilter<TImage, TImage, TTransformScalarType>   ResampleFilterType;
+    typedef itk::ImageFileWriter<TImage>                                              ImageWriterType;
+
+    // The reader is not updated: each slab of the output only pulls the input region it needs
+    typename ImageReaderType::Pointer reader = ImageReaderType::New();
+    reader->SetFileName( inputFileName );
+
+    // Create and initialize the resample image filter
+    typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+    resampler->SetInput(             reader->GetOutput() );
+    resampler->SetTransform(         transform );
+    resampler->SetSize(              size );
+    resampler->SetOutputOrigin(      origin );
+    resampler->SetOutputSpacing(     spacing );
+    resampler->SetOutputDirection(   direction );
+    resampler->SetDefaultPixelValue( 0 );
+    resampler->SetInterpolator(      createImageInterpolator<TImage, TTransformScalarType>(interpolator) );
+
+    // Resample and write the image slab by slab
+    typename ImageWriterType::Pointer writer = ImageWriterType::New();
+    writer->SetInput( resampler->GetOutput() );
+    writer->SetNumberOfStreamDivisions( std::max(numberOfStreamDivisions, 1u) );
+    try
+    {
+        updateImageWriter( writer.GetPointer(), fileName );
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cerr << err << std::endl;
+        throw std::runtime_error("Image resampling failure.");
+    }
+}
+
+
+
 template <unsigned int NDimension>
 void
 getGeometryFromImageHeader(
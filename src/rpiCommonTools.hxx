@@ -2,7 +2,9 @@
 
 #include <iostream>
 #include <sstream>
+#include <vector>
 #include <rpiDisplacementFieldTransform.h>
+#include <rpiBSplineDisplacementFieldTransform.h>
 #include <itkImageBase.h>
 #include <itkImageIOBase.h>
 #include <itkStationaryVelocityFieldTransform.h>
@@ -73,7 +75,11 @@ readLinearTransformation( std::string fileName );
 
 
 /**
- * Reads an ITK displacement field 3D from an input image.
+ * Reads an ITK displacement field 3D from an input image. A field written with a 16-bit
+ * encoding (see writeDisplacementFieldTransformation) is kept encoded in memory.
+ * Uncompressed MetaImage files (.mha, .mhd) whose components have the requested type are mapped
+ * in memory instead of being read: only the parts of the field actually used are loaded. The file
+ * must then not be modified while the field is used.
  * @param   filename  input image name
  * @return  displacement field
  */
@@ -83,13 +89,80 @@ readDisplacementField( std::string fileName );
 
 
 /**
- * Reads an ITK stationary velocity field 3D from an input image.
+ * Reads a B-spline displacement field 3D from an input image containing its coefficients (see
+ * writeBSplineDisplacementFieldTransformation).
  * @param   filename  input image name
+ * @return  B-spline displacement field
+ */
+template<class TTransformScalarType>
+typename rpi::BSplineDisplacementFieldTransform<TTransformScalarType, 3>::Pointer
+readBSplineDisplacementField( std::string fileName );
+
+
+/**
+ * Reads an ITK stationary velocity field 3D from an input image. Uncompressed MetaImage files are
+ * mapped in memory, as in readDisplacementField.
+ * If the exponential cache is enabled (see setExponentialCacheDirectory) and useExponentialCache
+ * is true, the exponential of the field is fetched from the cache, or computed and stored in it.
+ * @param   filename             input image name
+ * @param   useExponentialCache  use the exponential cache if it is enabled
  * @return  stationary velocity field
  */
 template<class TTransformScalarType>
 typename itk::StationaryVelocityFieldTransform<TTransformScalarType, 3>::Pointer
-readStationaryVelocityField( std::string fileName );
+readStationaryVelocityField( std::string fileName, bool useExponentialCache = true );
+
+
+/**
+ * Sets the directory where the exponentials of the stationary velocity fields are stored.
+ * An empty string disables the cache. If this function is not called, the directory is given by
+ * the environment variable RPI_EXPONENTIAL_CACHE_DIRECTORY (cache disabled if not defined).
+ * @param  directory  cache directory
+ */
+inline void
+setExponentialCacheDirectory( std::string directory );
+
+
+/**
+ * Gets the directory where the exponentials of the stationary velocity fields are stored.
+ * @return  cache directory, empty string if the cache is disabled
+ */
+inline std::string
+getExponentialCacheDirectory( void );
+
+
+/**
+ * Sets the compression level of the compressed files written by the write functions: gzip files
+ * (extension ".gz", e.g. ".nii.gz", level 1 to 9) and zstd chunked containers (extension ".zvf",
+ * available if RPI is built with RPI_USE_ZSTD). The gzip files are compressed with several
+ * threads and remain readable by any gzip decoder. If this function is not called, the level is
+ * given by the environment variable RPI_COMPRESSION_LEVEL.
+ * @param  level  compression level, -1 for the default level of the codec
+ */
+inline void
+setCompressionLevel( int level );
+
+
+/**
+ * Gets the compression level of the compressed files written by the write functions.
+ * @return  compression level, -1 for the default level of the codec
+ */
+inline int
+getCompressionLevel( void );
+
+
+/**
+ * Sets the exponential (scaling and squaring) of a stationary velocity field from the cache
+ * directory. If the exponential is not in the cache yet, it is computed and stored. The cache key
+ * is a hash of the content (values and geometry) of the field, so that the cached exponential is
+ * found whatever the file the field comes from. The cached exponentials are stored in single
+ * precision. Cache failures are not fatal: the exponential is then computed as usual.
+ * @param   transform  stationary velocity field
+ * @return  true if the exponential was found in the cache
+ */
+template<class TTransformScalarType>
+bool
+fetchExponentialFromCache( itk::StationaryVelocityFieldTransform<TTransformScalarType, 3> * transform );
 
 
 /**
@@ -133,13 +206,33 @@ writeLinearTransformation(
 
 
 /**
- * Writes a displacement field into an output file.
+ * Writes a displacement field into an output file. With a 16-bit encoding, the field is written
+ * as a vector image of 16-bit integers, the encoding and the scale and offset of each component
+ * being stored in the header (keys rpi_field_encoding, rpi_field_scale and rpi_field_offset).
+ * Only the formats keeping these keys (MetaImage, NRRD) can be used in this case.
  * @param  field     displacement field
  * @param  fileName  name of the output file
+ * @param  encoding  encoding of the field in the file
  */
 template<class TTransformScalarType, int TDimension>
 void
 writeDisplacementFieldTransformation(
+        itk::Transform<TTransformScalarType, TDimension, TDimension> * field,
+        std::string fileName,
+        FieldEncoding encoding = FIELD_ENCODING_FLOAT );
+
+
+/**
+ * Writes a B-spline displacement field into an output file. The coefficients are written as a
+ * vector image having the geometry of the control grid. The geometry of the fitted field, if
+ * known, is stored in the header (keys rpi_bspline_field_origin, rpi_bspline_field_spacing and
+ * rpi_bspline_field_size), which is only kept by some formats (MetaImage, NRRD).
+ * @param  field     B-spline displacement field
+ * @param  fileName  name of the output file
+ */
+template<class TTransformScalarType, int TDimension>
+void
+writeBSplineDisplacementFieldTransformation(
         itk::Transform<TTransformScalarType, TDimension, TDimension> * field,
         std::string fileName );
 
@@ -296,6 +389,89 @@ resampleAndWriteImage(
     );
 
 
+/**
+ * Resamples a set of images given a geometry and a transformation. The transformation is evaluated
+ * once per output voxel, and the mapped points are reused for all the images, which is faster than
+ * resampling the images one after the other (e.g. several modalities or the frames of a 4D series).
+ * @param  images        images to resample
+ * @param  origin        origin of the ouptut images
+ * @param  spacing       voxel size of the ouptut images
+ * @param  size          size of the ouptut images
+ * @param  direction     orientation of the ouptut images
+ * @param  transform     transformation
+ * @param  interpolator  type of the image interpolation
+ * @return resampled images, in the order of the input images
+ */
+template<class TImage, class TTransformScalarType>
+std::vector<typename TImage::Pointer>
+resampleImages(
+    const std::vector<typename TImage::Pointer> & images,
+    const typename TImage::PointType     & origin,
+    const typename TImage::SpacingType   & spacing,
+    const typename TImage::SizeType      & size,
+    const typename TImage::DirectionType & direction,
+    itk::Transform<TTransformScalarType, TImage::ImageDimension, TImage::ImageDimension> * transform,
+    ImageInterpolatorType interpolator = INTERPOLATOR_LINEAR
+    );
+
+
+/**
+ * Resamples a set of images given a geometry and a transformation (see resampleImages) and saves
+ * the resampled images into output files.
+ * @param  images        images to resample
+ * @param  origin        origin of the ouptut images
+ * @param  spacing       voxel size of the ouptut images
+ * @param  size          size of the ouptut images
+ * @param  direction     orientation of the ouptut images
+ * @param  transform     transformation
+ * @param  fileNames     names of the output files, one per image
+ * @param  interpolator  type of the image interpolation
+ */
+template<class TImage, class TTransformScalarType>
+void
+resampleAndWriteImages(
+    const std::vector<typename TImage::Pointer> & images,
+    const typename TImage::PointType     & origin,
+    const typename TImage::SpacingType   & spacing,
+    const typename TImage::SizeType      & size,
+    const typename TImage::DirectionType & direction,
+    itk::Transform<TTransformScalarType, TImage::ImageDimension, TImage::ImageDimension> * transform,
+    const std::vector<std::string> & fileNames,
+    ImageInterpolatorType interpolator = INTERPOLATOR_LINEAR
+    );
+
+
+/**
+ * Resamples an image file given a geometry and a transformation and saves the resampled image
+ * into an output file, without loading the whole images in memory. The output is written by
+ * slabs along the last dimension, and only the part of the input needed by the current slab is
+ * read. This requires streamable file formats (e.g. uncompressed MetaImage, NRRD or NIfTI);
+ * otherwise the whole input is read and/or the whole output is computed at once.
+ * @param  inputFileName            name of the image to resample
+ * @param  origin                   origin of the ouptut image
+ * @param  spacing                  voxel size of the ouptut image
+ * @param  size                     size of the ouptut image
+ * @param  direction                orientation of the ouptut image
+ * @param  transform                transformation
+ * @param  fileName                 name of the output file
+ * @param  numberOfStreamDivisions  number of slabs
+ * @param  interpolator             type of the image interpolation
+ */
+template<class TImage, class TTransformScalarType>
+void
+streamResampleAndWriteImage(
+    std::string inputFileName,
+    const typename TImage::PointType     & origin,
+    const typename TImage::SpacingType   & spacing,
+    const typename TImage::SizeType      & size,
+    const typename TImage::DirectionType & direction,
+    itk::Transform<TTransformScalarType, TImage::ImageDimension, TImage::ImageDimension> * transform,
+    std::string fileName,
+    unsigned int numberOfStreamDivisions,
+    ImageInterpolatorType interpolator = INTERPOLATOR_LINEAR
+    );
+
+
 /**
  * Gets the geometry of an image from its header. The geometry is writen into the input references
  * (origin, spacing, size, direction). The function has one template NDimension representing the
@@ -0,0 +1,141 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <tclap/CmdLine.h>
+
+#ifdef MIPS_FOUND
+#include <mipsInrimageImageIOFactory.h>
+#endif
+
+#include "rpiCommonTools.hxx"
+
+
+
+/**
+ * Approximates a displacement field by a cubic B-spline control grid. The coefficients of the grid
+ * are saved into a 3D vector image having the geometry of the grid, which can be used as a
+ * "bsplinedisplacementfield" in the lists of rpiFuseTransformations. For the smooth fields
+ * produced by the non-linear registrations, control points spaced by a few voxels are enough,
+ * which reduces the size of the field by one to two orders of magnitude.
+ */
+
+
+
+/**
+ * Structure containing the parameters.
+ */
+struct Param{
+    std::string inputTransformPath;
+    std::string outputTransformPath;
+    float       controlPointSpacing;
+    bool        verbose;
+};
+
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Approximates a 3D displacement field by a cubic B-spline control grid (least squares fit). ";
+    description += "The control grid has the orientation of the field and extends one control point beyond it ";
+    description += "on each side. The coefficients are stored into a 3D vector image having the geometry of the ";
+    description += "grid. The geometry of the field is stored in the header of MetaImage and NRRD files so that ";
+    description += "rpiFuseTransformations can generate a dense field with the original geometry.";
+
+    // Option description
+    std::string dInputTransform  = "Path to the input displacement field.";
+    std::string dOutputTransform = "Path to the output B-spline displacement field.";
+    std::string dSpacing         = "Spacing of the control points in physical units (default 10).";
+    std::string dVerbose         = "Verbose mode (prints the size of the grid and the fit errors).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+        TCLAP::SwitchArg             aVerbose(         "",  "verbose",          dVerbose,         cmd, false );
+        TCLAP::ValueArg<float>       aSpacing(         "s", "spacing",          dSpacing,         false, 10.0f, "float", cmd );
+        TCLAP::ValueArg<std::string> aOutputTransform( "o", "output-transform", dOutputTransform, true, "", "string", cmd );
+        TCLAP::ValueArg<std::string> aInputTransform(  "i", "input-transform",  dInputTransform,  true, "", "string", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.inputTransformPath  = aInputTransform.getValue();
+        param.outputTransformPath = aOutputTransform.getValue();
+        param.controlPointSpacing = aSpacing.getValue();
+        param.verbose             = aVerbose.getValue();
+
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+
+/**
+ * Main function.
+ */
+int main(int argc, char** argv)
+{
+
+#ifdef MIPS_FOUND
+    // Allows the executable to read and write Inrimage
+    itk::InrimageImageIOFactory::RegisterOneFactory();
+#endif
+
+    // Type definition
+    typedef  float                                                        FieldScalarType;
+    typedef  rpi::DisplacementFieldTransform< FieldScalarType, 3 >        FieldTransformType;
+    typedef  rpi::BSplineDisplacementFieldTransform< FieldScalarType, 3 > BSplineTransformType;
+
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters(argc, argv, param);
+        if (!(param.controlPointSpacing > 0.0f))
+            throw std::runtime_error("The control point spacing must be strictly positive.");
+
+        // Read displacement field
+        FieldTransformType::Pointer field = rpi::readDisplacementField<FieldScalarType>( param.inputTransformPath );
+
+        // Fit the control grid
+        BSplineTransformType::SpacingType spacing;
+        spacing.Fill( param.controlPointSpacing );
+        BSplineTransformType::Pointer bspline = BSplineTransformType::New();
+        bspline->SetControlPointSpacing( spacing );
+        bspline->FitVectorField( field->GetParametersAsVectorField() );
+
+        if (param.verbose)
+        {
+            const itk::SizeValueType fieldSize = field->GetFieldGeometry()->GetLargestPossibleRegion().GetNumberOfPixels();
+            const itk::SizeValueType gridSize  = bspline->GetCoefficients()->GetLargestPossibleRegion().GetNumberOfPixels();
+            std::cout << "  Control grid size : " << bspline->GetCoefficients()->GetLargestPossibleRegion().GetSize() << std::endl;
+            std::cout << "  Reduction factor  : " << static_cast<double>(fieldSize) / gridSize << std::endl;
+            std::cout << "  Maximum fit error : " << bspline->GetFitMaximumError() << std::endl;
+            std::cout << "  RMS fit error     : " << bspline->GetFitRMSError() << std::endl;
+        }
+
+        // Write B-spline displacement field
+        rpi::writeBSplineDisplacementFieldTransformation<FieldScalarType,3>( bspline, param.outputTransformPath );
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+}
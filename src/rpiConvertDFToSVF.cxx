@@ -0,0 +1,182 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <tclap/CmdLine.h>
+
+#include <itkDisplacementFieldLogarithm.h>
+
+#ifdef MIPS_FOUND
+#include <mipsInrimageImageIOFactory.h>
+#endif
+
+#include "rpiCommonTools.hxx"
+
+
+
+/**
+ * Converts a displacement field into a stationary velocity field, i.e. computes the logarithm of the
+ * transformation. The stationary velocity field can then be inverted by negation (see the <invert>
+ * tag of rpiFuseTransformations), fused in the log domain, or averaged with other velocity fields,
+ * without inverting the displacement field with a fixed point algorithm.
+ */
+
+
+
+/**
+ * Structure containing the parameters.
+ */
+struct Param{
+    std::string  inputTransformPath;
+    std::string  outputTransformPath;
+    std::string  cacheDirectory;
+    unsigned int iterations;
+    float        tolerance;
+    unsigned int bchOrder;
+    bool         verbose;
+};
+
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Computes the stationary velocity field whose exponential is the input 3D displacement field ";
+    description += "(logarithm of the transformation). The velocity field is first approximated by the displacement ";
+    description += "field, then refined by fixed point iterations: the residual transformation Exp(-V) o Phi is ";
+    description += "computed and composed with the velocity field using the Baker-Campbell-Hausdorff formula. ";
+    description += "The logarithm only exists for diffeomorphic transformations: the iterations may not converge ";
+    description += "for large or folding displacements.";
+
+    // Option description
+    std::string dInputTransform  = "Path to the input displacement field.";
+    std::string dOutputTransform = "Path to the output stationary velocity field.";
+    std::string dIterations      = "Maximum number of iterations (default 20).";
+    std::string dTolerance       = "Tolerance on the maximum norm of the residual displacement, as a fraction of the ";
+    dTolerance                  += "smallest spacing of the field (default 0.01).";
+    std::string dBCHOrder        = "Order of the Baker-Campbell-Hausdorff approximation used by the updates: 1, 2 ";
+    dBCHOrder                   += "(default), 3 or 4.";
+    std::string dCache           = "Directory where the exponentials of the stationary velocity fields are cached. ";
+    dCache                      += "If set (or if the environment variable RPI_EXPONENTIAL_CACHE_DIRECTORY is defined), ";
+    dCache                      += "the exponential of the output field is computed and stored in the cache.";
+    std::string dVerbose         = "Verbose mode (prints the number of iterations and the residual).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+        TCLAP::SwitchArg              aVerbose(         "",  "verbose",           dVerbose,         cmd, false );
+        TCLAP::ValueArg<std::string>  aCache(           "",  "exponential-cache", dCache,           false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int> aBCHOrder(        "",  "bch-order",         dBCHOrder,        false, 2, "int", cmd );
+        TCLAP::ValueArg<float>        aTolerance(       "",  "tolerance",         dTolerance,       false, 0.01f, "float", cmd );
+        TCLAP::ValueArg<unsigned int> aIterations(      "n", "iterations",        dIterations,      false, 20, "int", cmd );
+        TCLAP::ValueArg<std::string>  aOutputTransform( "o", "output-transform",  dOutputTransform, true, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  aInputTransform(  "i", "input-transform",   dInputTransform,  true, "", "string", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.inputTransformPath  = aInputTransform.getValue();
+        param.outputTransformPath = aOutputTransform.getValue();
+        param.cacheDirectory      = aCache.getValue();
+        param.iterations          = aIterations.getValue();
+        param.tolerance           = aTolerance.getValue();
+        param.bchOrder            = aBCHOrder.getValue();
+        param.verbose             = aVerbose.getValue();
+
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+
+/**
+ * Main function.
+ */
+int main(int argc, char** argv)
+{
+
+#ifdef MIPS_FOUND
+    // Allows the executable to read and write Inrimage
+    itk::InrimageImageIOFactory::RegisterOneFactory();
+#endif
+
+    // Type definition
+    typedef  float                                                        FieldScalarType;
+    typedef  rpi::DisplacementFieldTransform< FieldScalarType, 3 >        DFTransformType;
+    typedef  itk::StationaryVelocityFieldTransform< FieldScalarType, 3 >  SVFTransformType;
+    typedef  DFTransformType::VectorFieldType                             VectorFieldType;
+    typedef  itk::DisplacementFieldLogarithm< VectorFieldType, VectorFieldType > LogarithmType;
+
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters(argc, argv, param);
+        if (param.bchOrder<1 || param.bchOrder>4)
+            throw std::runtime_error("The order of the Baker-Campbell-Hausdorff approximation must be 1, 2, 3 or 4.");
+        if (!(param.tolerance > 0.0f))
+            throw std::runtime_error("The tolerance must be strictly positive.");
+
+        // Read displacement field
+        DFTransformType::Pointer field = rpi::readDisplacementField<FieldScalarType>( param.inputTransformPath );
+
+        // Compute the logarithm
+        LogarithmType::Pointer logarithm = LogarithmType::New();
+        logarithm->SetInput( field->GetParametersAsVectorField() );
+        logarithm->SetMaximumNumberOfIterations( param.iterations );
+        logarithm->SetTolerance( param.tolerance );
+        logarithm->SetApproximationOrder( param.bchOrder );
+        try
+        {
+            logarithm->Update();
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            std::cerr << err << std::endl;
+            throw std::runtime_error( "Could not compute the logarithm of the displacement field." );
+        }
+
+        if (param.verbose)
+        {
+            std::cout << "  Iterations        : " << logarithm->GetNumberOfIterations() << std::endl;
+            std::cout << "  Residual (max)    : " << logarithm->GetResidualMaximumNorm() << std::endl;
+        }
+        if (!logarithm->GetConverged())
+            std::cerr << "Warning: the logarithm did not converge (maximum residual "
+                      << logarithm->GetResidualMaximumNorm() << ")." << std::endl;
+
+        // Write stationary velocity field
+        VectorFieldType::Pointer velocity = logarithm->GetOutput();
+        velocity->DisconnectPipeline();
+        SVFTransformType::Pointer svf = SVFTransformType::New();
+        svf->SetParametersAsVectorField( velocity.GetPointer() );
+        rpi::writeStationaryVelocityFieldTransformation<FieldScalarType,3>( svf, param.outputTransformPath );
+
+        // Prime the exponential cache. The field is read back so that the cache key matches the
+        // one computed by the tools reading this file.
+        if (param.cacheDirectory.compare("")!=0)
+            rpi::setExponentialCacheDirectory(param.cacheDirectory);
+        if (rpi::getExponentialCacheDirectory().compare("")!=0)
+            rpi::readStationaryVelocityField<FieldScalarType>( param.outputTransformPath );
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+}
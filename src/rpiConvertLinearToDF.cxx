@@ -34,6 +34,7 @@ struct Param{
     std::string inputTransformPath;
     std::string inputImagePath;
     std::string outputTransformPath;
+    rpi::FieldEncoding fieldEncoding;
 };
 
 
@@ -62,11 +63,14 @@ void parseParameters(int argc, char** argv, struct Param & param)
     dInputTransform             += "type is 'double'.";
     std::string dInputImage      = "Path to the input 3D Image.";
     std::string dOutputTransform = "Path to the output displacement field transformation.";
+    std::string dEncoding        = "Encoding of the output displacement field: \"float\" (default), or \"float16\" and \"int16\" ";
+    dEncoding                   += "(16 bits per component with a scale and an offset per component, MetaImage or NRRD output only).";
 
     try {
 
         // Define the command line parser
         TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+        TCLAP::ValueArg<std::string> aEncoding(        "",  "field-encoding",   dEncoding,        false, "float", "string", cmd );
         TCLAP::ValueArg<std::string> aOutputTransform( "o", "output-transform", dOutputTransform, true, "", "string", cmd );
         TCLAP::ValueArg<std::string> aInputImage(      "i", "input-image",      dInputImage,      true, "", "string", cmd );
         TCLAP::ValueArg<std::string> aInputTransform(  "t", "input-transform",  dInputTransform,  true, "", "string", cmd );
@@ -78,6 +82,7 @@ void parseParameters(int argc, char** argv, struct Param & param)
         param.inputTransformPath  = aInputTransform.getValue();
         param.inputImagePath      = aInputImage.getValue();
         param.outputTransformPath = aOutputTransform.getValue();
+        param.fieldEncoding       = rpi::getFieldEncodingFromString( aEncoding.getValue() );
 
     }
     catch (TCLAP::ArgException &e)
@@ -130,7 +135,7 @@ int main(int argc, char** argv)
         FieldTransformType::Pointer field = rpi::linearToDisplacementFieldTransformation<LinearScalarType, FieldScalarType, ImageType>( image, linear );
 
         // Write displacement field
-        rpi::writeDisplacementFieldTransformation<FieldScalarType,3>(field, param.outputTransformPath );
+        rpi::writeDisplacementFieldTransformation<FieldScalarType,3>(field, param.outputTransformPath, param.fieldEncoding );
     }
     catch( std::exception& e )
     {
@@ -34,6 +34,7 @@ struct Param{
     std::string inputTransformPath;
     std::string inputImagePath;
     std::string outputTransformPath;
+    std::string cacheDirectory;
 };
 
 
@@ -62,6 +63,9 @@ void parseParameters(int argc, char** argv, struct Param & param)
     dInputTransform             += "type is 'double'.";
     std::string dInputImage      = "Path to the input 3D Image.";
     std::string dOutputTransform = "Path to the output stationnary velocity field transformation.";
+    std::string dCache           = "Directory where the exponentials of the stationary velocity fields are cached. ";
+    dCache                      += "If set (or if the environment variable RPI_EXPONENTIAL_CACHE_DIRECTORY is defined), ";
+    dCache                      += "the exponential of the output field is computed and stored in the cache.";
 
     try {
 
@@ -70,6 +74,7 @@ void parseParameters(int argc, char** argv, struct Param & param)
         TCLAP::ValueArg<std::string> aOutputTransform( "o", "output-transform", dOutputTransform, true, "", "string", cmd );
         TCLAP::ValueArg<std::string> aInputImage(      "i", "input-image",      dInputImage,      true, "", "string", cmd );
         TCLAP::ValueArg<std::string> aInputTransform(  "t", "input-transform",  dInputTransform,  true, "", "string", cmd );
+        TCLAP::ValueArg<std::string> aCache(           "",  "exponential-cache", dCache,          false, "", "string", cmd );
 
         // Parse the command line
         cmd.parse( argc, argv );
@@ -78,6 +83,7 @@ void parseParameters(int argc, char** argv, struct Param & param)
         param.inputTransformPath  = aInputTransform.getValue();
         param.inputImagePath      = aInputImage.getValue();
         param.outputTransformPath = aOutputTransform.getValue();
+        param.cacheDirectory      = aCache.getValue();
 
     }
     catch (TCLAP::ArgException &e)
@@ -131,6 +137,13 @@ int main(int argc, char** argv)
 
         // Write displacement field
         rpi::writeStationaryVelocityFieldTransformation<FieldScalarType,3>(field, param.outputTransformPath );
+
+        // Prime the exponential cache. The field is read back so that the cache key matches the
+        // one computed by the tools reading this file.
+        if (param.cacheDirectory.compare("")!=0)
+            rpi::setExponentialCacheDirectory(param.cacheDirectory);
+        if (rpi::getExponentialCacheDirectory().compare("")!=0)
+            rpi::readStationaryVelocityField<FieldScalarType>( param.outputTransformPath );
     }
     catch( std::exception& e )
     {
@@ -5,23 +5,28 @@
 #include <string>
 
 #include <tclap/CmdLine.h>
-#include <tinyxml.h>
 
 #include <itkTransform.h>
 #include <rpiDisplacementFieldTransform.h>
+#include <rpiBSplineDisplacementFieldTransform.h>
 #include <itkStationaryVelocityFieldTransform.h>
 #include <itkGeneralTransform.h>
 #include <itkImageIOBase.h>
 #include <itkImageIOFactory.h>
 #include <itkImageFileReader.h>
+#include <itkResampleImageFilter.h>
+#include <itkVectorLinearInterpolateImageFunction.h>
+#include <itkIdentityTransform.h>
 
-#include <itkTransformToDisplacementFieldFilter.h>
+#include <itkTransformChainToDisplacementFieldSource.h>
+#include <itkVelocityFieldBCHCompositionFilter.h>
 
 #ifdef MIPS_FOUND
 #include <mipsInrimageImageIOFactory.h>
 #endif
 
 #include "rpiCommonTools.hxx"
+#include "rpiTransformationList.hxx"
 
 /**
  * Fuse a list of transformations into a single transformation. The list of transformations must
@@ -54,7 +59,8 @@
  *   <listoftransformations>. This tag is mandatory.
  *
  *  -Tag <type> contains the type of the considered transformation. The available types are "linear",
- *   "displacemendfield", and "stiaionaryvelocityfield". This tag must be an element of the tag
+ *   "displacemendfield", "stiaionaryvelocityfield", and "bsplinedisplacementfield" (B-spline control
+ *   grid written by rpiConvertDFToBSpline). This tag must be an element of the tag
  *   <transformation>. This tag is mandatory.
  *
  *  -Tag <path> contains the path to the file containing the transformation. A displacement field
@@ -75,21 +81,23 @@
  * No checking on the file extension will be performed since the output transformation type is
  * easily predictable.
  *
+ * With the option "--log-domain", a list of stationary velocity fields and linear transformations is
+ * fused in the log domain into a stationary velocity field: the linear transformations are converted
+ * into velocity fields with the matrix logarithm, and the velocity fields are composed with the
+ * Baker-Campbell-Hausdorff formula (see itk::VelocityFieldBCHCompositionFilter). No exponential is
+ * computed, and the output is inverted by negating it.
+ *
+ * With the option "--mask", the output displacement field is only computed in the bounding box of
+ * the voxels of a mask image: the field written is cropped to this box, its origin being moved
+ * accordingly. With "--mask-voxels", only the voxels of the mask are computed, the displacement
+ * being zero elsewhere. The displacement fields to invert are then only inverted over the region
+ * where they are evaluated.
+ *
  * @author Vincent Garcia
  * @date   2011/05/31
  */
 
 
-/**
- * Transformation type
- */
-enum Transformation {
-    LINEAR,                    /** Linear                    */
-    DISPLACEMENT_FIELD,        /** Displacement field        */
-    STATIONARY_VELOCITY_FIELD  /** Stationary velocity field */
-};
-
-
 /**
  * Structure containing the IO parameters, the verbosity,
  * and eventually the output transformation type.
@@ -99,40 +107,17 @@ struct Param
     std::string inputFile;
     std::string outputFile;
     std::string geometryFile;
+    std::string maskFile;
+    bool        maskVoxels;
+    std::string cacheDirectory;
+    rpi::FieldEncoding fieldEncoding;
     bool        forceDisplacementField;
+    bool        logDomain;
+    unsigned int bchOrder;
     bool        verbose;
 };
 
 
-/**
- * Structure containing the information of the transformations (type, path, inversion).
- */
-struct Data
-{
-    std::vector<Transformation> type;
-    std::vector<std::string>    path;
-    std::vector<bool>           invert;
-};
-
-
-/**
- * Returns the transformation type as string.
- * @param  transformation transformation
- * @return string describing the transformation
- */
-std::string getTransformationAsString(Transformation transformation)
-{
-    if (transformation==LINEAR)
-        return "linear";
-    else if (transformation==DISPLACEMENT_FIELD)
-        return "displacement field";
-    else if (transformation==STATIONARY_VELOCITY_FIELD)
-        return "stationary velocity field";
-    else
-        return "transformation not recognized";
-}
-
-
 /**
  * Parses the command line arguments and deduces the corresponding Param structure.
  * @param  argc   number of arguments
@@ -177,7 +162,7 @@ void parseParameters(int argc, char** argv, struct Param & param)
     description += "  <listoftransformations>. This tag is mandatory.\n";
 
     description += " -Tag <type> contains the type of the considered transformation. The available types are \"linear\", ";
-    description += "  \"displacemendfield\", and \"stiaionaryvelocityfield\". This tag must be an element of the tag ";
+    description += "  \"displacemendfield\", \"stiaionaryvelocityfield\", and \"bsplinedisplacementfield\". This tag must be an element of the tag ";
     description += "  <transformation>. This tag is mandatory.\n";
 
     description += " -Tag <path> contains the path to the file containing the transformation. A displacement field ";
@@ -195,7 +180,14 @@ void parseParameters(int argc, char** argv, struct Param & param)
     description += "One should choose the output file extension according to the transformation computed. Indeed, if ";
     description += "the output transformation is a displacement field, only image format are supported (e.g. .nii). ";
     description += "No checking on the file extension will be performed since the output transformation type is ";
-    description += "easily predictable.";
+    description += "easily predictable.\n";
+
+    description += "With the option \"--log-domain\", a list of stationary velocity fields and linear transformations is ";
+    description += "fused in the log domain into a stationary velocity field, using the Baker-Campbell-Hausdorff formula. ";
+    description += "No exponential is computed. The approximation is accurate for small or nearly commuting transformations.\n";
+
+    description += "With the option \"--mask\", the output displacement field is only computed and written in the bounding ";
+    description += "box of a mask, and the displacement fields of the list are only inverted where they are needed.";
 
     description += "";
     description += "\nAuthors : Vincent Garcia";
@@ -211,6 +203,23 @@ void parseParameters(int argc, char** argv, struct Param & param)
 
     std::string dForce     = "Force the output transformation to be a displacement field.";
 
+    std::string dMask      = "Path to a mask image (non zero voxels). The output transformation is a displacement field ";
+    dMask                 += "computed in the bounding box of the mask only: the output field is cropped to this box.";
+
+    std::string dMaskVox   = "Only compute the voxels of the mask (see --mask), the displacement being zero elsewhere.";
+
+    std::string dCache     = "Directory where the exponentials of the stationary velocity fields are cached ";
+    dCache                += "(default: environment variable RPI_EXPONENTIAL_CACHE_DIRECTORY, if defined).";
+
+    std::string dEncoding  = "Encoding of an output displacement field: \"float\" (default), or \"float16\" and \"int16\" ";
+    dEncoding             += "(16 bits per component with a scale and an offset per component, MetaImage or NRRD output only).";
+
+    std::string dLogDomain = "Fuse the list in the log domain into a stationary velocity field. The list must only contain ";
+    dLogDomain            += "stationary velocity fields and linear transformations.";
+
+    std::string dBCHOrder  = "Order of the Baker-Campbell-Hausdorff approximation used by the log-domain fusion: 1 (sum of ";
+    dBCHOrder             += "the velocity fields), 2, 3 (default) or 4.";
+
     std::string dVerbose   = "Verbose mode.";
 
     try {
@@ -221,7 +230,13 @@ void parseParameters(int argc, char** argv, struct Param & param)
         // Set options
         TCLAP::SwitchArg              aVerbose(  "",  "verbose",                  dVerbose, cmd, false);
         TCLAP::SwitchArg              aForce(    "f", "force-displacement-field", dForce,   cmd, false);
+        TCLAP::SwitchArg              aLogDomain("",  "log-domain",               dLogDomain, cmd, false);
+        TCLAP::SwitchArg              aMaskVox(  "",  "mask-voxels",              dMaskVox, cmd, false);
+        TCLAP::ValueArg<std::string>  aMask(     "m", "mask",             dMask,     false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int> aBCHOrder( "",  "bch-order",        dBCHOrder, false, 3, "int", cmd );
         TCLAP::ValueArg<std::string>  aGeometry( "g", "geometry",         dGeometry, false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  aCache(    "",  "exponential-cache", dCache,   false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  aEncoding( "",  "field-encoding",   dEncoding, false, "float", "string", cmd );
         TCLAP::ValueArg<std::string>  aOutput(   "o", "output-transform", dOutput,   true,  "", "string", cmd );
         TCLAP::ValueArg<std::string>  aInput(    "i", "input-list",       dInput,    true,  "", "string", cmd );
 
@@ -232,7 +247,13 @@ void parseParameters(int argc, char** argv, struct Param & param)
         param.inputFile              = aInput.getValue();
         param.outputFile             = aOutput.getValue();
         param.geometryFile           = aGeometry.getValue();
+        param.maskFile               = aMask.getValue();
+        param.maskVoxels             = aMaskVox.getValue();
+        param.cacheDirectory         = aCache.getValue();
+        param.fieldEncoding          = rpi::getFieldEncodingFromString( aEncoding.getValue() );
         param.forceDisplacementField = aForce.getValue();
+        param.logDomain              = aLogDomain.getValue();
+        param.bchOrder               = aBCHOrder.getValue();
         param.verbose                = aVerbose.getValue();
     }
     catch (TCLAP::ArgException &e)
@@ -243,100 +264,6 @@ void parseParameters(int argc, char** argv, struct Param & param)
 }
 
 
-/**
- * Parses the XML file anf fill the data structure.
- * @param fileName  path to the XML file
- * @param data      Data structure
- */
-void parseXML(const char* fileName, struct Data & data)
-{
-
-    // Load XML document
-    TiXmlDocument doc(fileName);
-    bool loadOkay = doc.LoadFile();
-    if (loadOkay)
-    {
-
-        // Variables
-        TiXmlElement *pRoot, *pParm, *pType, *pPath, *pInvert;
-
-        // Get XML root
-        pRoot = doc.FirstChildElement( "listoftransformations" );
-        if ( pRoot )
-        {
-            // Get first transformation
-            pParm = pRoot->FirstChildElement("transformation");
-            while ( pParm )
-            {
-                // Get transformation type, transformation path, and the inversion
-                pType   = pParm->FirstChildElement("type");
-                pPath   = pParm->FirstChildElement("path");
-                pInvert = pParm->FirstChildElement("invert");
-
-                // Process transformation
-                if ( pType && pPath )
-                {
-
-                    // Type and path
-                    std::string type(pType->GetText());
-                    std::string path(pPath->GetText());
-
-                    // Process type
-                    if (type.compare("linear")==0)
-                        data.type.push_back(LINEAR);
-                    else if (type.compare("displacementfield")==0)
-                        data.type.push_back(DISPLACEMENT_FIELD);
-                    else if (type.compare("stationaryvelocityfield")==0)
-                        data.type.push_back(STATIONARY_VELOCITY_FIELD);
-                    else
-                    {
-                        std::string warning;
-                        warning += "Warning : the transformation type \"" + type + "\" is not ";
-                        warning += "supported. The transformation " + path + " will be ignored.";
-                        std::cout << warning << std::endl;
-                        pParm = pParm->NextSiblingElement("transformation");
-                        break;
-                    }
-
-                    // Process path
-                    data.path.push_back(path);
-
-                    // Process inversion
-                    if ( pInvert )
-                    {
-                        std::string invert(pInvert->GetText());
-                        if (invert.compare("1")==0)
-                        {
-                            if ( type.compare("stationaryvelocityfield")==0 )
-                            {
-                                std::string warning;
-                                warning += "Warning : a transformation of type \"" + type + "\" cannot ";
-                                warning += "be inverted. The inversion will not be performed.";
-                                std::cout << warning << std::endl;
-                                data.invert.push_back(false);
-                            }
-                            else
-                                data.invert.push_back(true);
-                        }
-                        else
-                            data.invert.push_back(false);
-                    }
-                    else
-                        data.invert.push_back(false);
-                }
-                else
-                    throw std::runtime_error("Transformation must contain tags \"type\" and \"path\".");
-
-                // Get next transformation
-                pParm = pParm->NextSiblingElement("transformation");
-            }
-        }
-    }
-    else
-        throw std::runtime_error( std::string("Failed to load file ") + fileName + "." );
-}
-
-
 /**
  * Prints the Param structure.
  * @param param    Param structure
@@ -353,6 +280,14 @@ void printParam(struct Param & param, bool verbose)
     std::cout << "  Output transform         : " << param.outputFile << std::endl;
     if (param.geometryFile.compare("")!=0)
         std::cout << "  Geometry                 : " << param.geometryFile << std::endl;
+    if (param.maskFile.compare("")!=0)
+        std::cout << "  Mask                     : " << param.maskFile << (param.maskVoxels ? " (voxels)" : " (bounding box)") << std::endl;
+    if (param.cacheDirectory.compare("")!=0)
+        std::cout << "  Exponential cache        : " << param.cacheDirectory << std::endl;
+    if (param.fieldEncoding != rpi::FIELD_ENCODING_FLOAT)
+        std::cout << "  Field encoding           : " << rpi::getFieldEncodingAsString(param.fieldEncoding) << std::endl;
+    if (param.logDomain)
+        std::cout << "  Log-domain fusion        : BCH order " << param.bchOrder << std::endl;
     if (param.forceDisplacementField)
         std::cout << "  Force displacement field : true" << std::endl;
     else
@@ -360,101 +295,6 @@ void printParam(struct Param & param, bool verbose)
 }
 
 
-/**
- * Prints the Data structure.
- * @param data     Data structure
- * @param verbose  prints if and only if verbose is true
- */
-void printData(struct Data & data, bool verbose)
-{
-    if (!verbose)
-        return;
-
-    std::cout << std::endl;
-    std::cout << "TRANSFORMATION LIST" << std::endl << std::endl;
-    for (unsigned int i=0; i<data.type.size(); i++)
-    {
-        std::cout << "  Transformation " << i << std::endl;
-
-        if (data.type[i]==LINEAR)
-            std::cout << "  Type   : linear" << std::endl;
-        else if (data.type[i]==DISPLACEMENT_FIELD)
-            std::cout << "  Type   : displacement field" << std::endl;
-        else if (data.type[i]==STATIONARY_VELOCITY_FIELD)
-            std::cout << "  Type   : stationary velocity field" << std::endl;
-
-        std::cout << "  Path   : " << data.path[i]   << std::endl;
-
-        std::cout << "  Invert : " << data.invert[i] << std::endl << std::endl;
-    }
-}
-
-
-/**
- * Build the list of transformations.
- * @param  data data structure
- * @return list of transformations
- */
-template<class TScalarType>
-typename itk::GeneralTransform<TScalarType,3>::Pointer
-buildListOfTransformations(struct Data & data)
-{
-    // Type definition
-    typedef itk::GeneralTransform<TScalarType,3>               ListType;
-    typedef itk::Transform<TScalarType,3,3>                    LinearType;
-    typedef itk::MatrixOffsetTransformBase<TScalarType,3,3>    MatrixType;
-    typedef rpi::DisplacementFieldTransform<TScalarType>       DFType;
-    typedef itk::StationaryVelocityFieldTransform<TScalarType> SVFType;
-
-    // Create and fill the list of transformations
-    typename ListType::Pointer list = ListType::New();
-    for (unsigned int i=0; i<data.type.size(); i++)
-    {
-
-        if (data.type[i]==LINEAR)
-        {
-
-            typename LinearType::Pointer linear = rpi::readLinearTransformation<TScalarType>(data.path[i]);
-
-            if (data.invert[i]==false)
-                list->InsertTransform( linear.GetPointer() );
-            else
-            {
-                MatrixType * matrix = dynamic_cast<MatrixType *>(linear.GetPointer());
-                if (matrix==0)
-                    throw std::runtime_error("Cannot cast the transformation into an itk::MatrixOffsetTransformBase.");
-                typename MatrixType::Pointer inverse = MatrixType::New();
-                inverse->SetCenter(matrix->GetCenter());
-                matrix->GetInverse(inverse);
-                list->InsertTransform( inverse.GetPointer() );
-            }
-
-        }
-        else if (data.type[i]==DISPLACEMENT_FIELD)
-        {
-            typename DFType::Pointer field = rpi::readDisplacementField<TScalarType>(data.path[i]);
-
-            if (data.invert[i]==true)
-                field->GetInverse(field);
-            list->InsertTransform( field.GetPointer() );
-
-
-        }
-        else if (data.type[i]==STATIONARY_VELOCITY_FIELD)
-        {
-            typename SVFType::Pointer field = rpi::readStationaryVelocityField<TScalarType>(data.path[i]);
-
-            if (data.invert[i]==true)
-                field->GetInverse(field);
-            list->InsertTransform( field.GetPointer() );
-        }
-        else
-            throw std::runtime_error("Transformation not supported.");
-    }
-    return list;
-}
-
-
 /**
  * Decides the type of transformation computed.
  * @param  list list of transformation
@@ -498,100 +338,30 @@ void exportLinearTransformation(itk::GeneralTransform<TScalarType,3> * list, std
 
 /**
  * Generates a displacement field from the transformation list and exports it as image.
- * @param list              list of transformations
- * @param data              data structure
- * @param geometryFileName  path to the image containing the geometry
- * @param fileName          output file name
+ * @param list      list of transformations
+ * @param geometry  geometry of the displacement field
+ * @param fileName  output file name
+ * @param encoding  encoding of the output field
+ * @param mask      mask of the voxels computed, with the grid of the geometry, or null pointer
  */
 template<class TScalarType>
-void exportDFTransformation(itk::GeneralTransform<TScalarType,3> * list, struct Data data, std::string geometryFileName, std::string fileName)
+void exportDFTransformation(itk::GeneralTransform<TScalarType,3> * list, const itk::ImageBase<3> * geometry, std::string fileName,
+                            rpi::FieldEncoding encoding, const itk::Image<unsigned char,3> * mask = ITK_NULLPTR)
 {
 
     // Type definition
     typedef  itk::GeneralTransform<TScalarType,3>                                    TransformListType;
     typedef  rpi::DisplacementFieldTransform< TScalarType, 3 >                       DFType;
-    typedef  itk::StationaryVelocityFieldTransform< TScalarType, 3 >                 SVFType;
     typedef  typename DFType::VectorFieldType                                        VectorFieldType;
-    typedef  itk::TransformToDisplacementFieldFilter< VectorFieldType, TScalarType >  GeneratorType;
+    typedef  itk::TransformChainToDisplacementFieldSource< VectorFieldType, TScalarType > GeneratorType;
 
-    // Create a field generator
+    // Create a field generator (the list of transformations is simplified by the generator)
     typename GeneratorType::Pointer fieldGenerator = GeneratorType::New();
     fieldGenerator->SetTransform( list );
 
     // Sets the geometry of the displacement field
-    if (geometryFileName.compare("")!=0)
-    {
-        // Type definition
-        typedef  itk::ImageIOBase                     ImageIOBase;
-        typedef typename GeneratorType::PointType     OriginType;
-        typedef typename GeneratorType::SpacingType   SpacingType;
-        typedef typename GeneratorType::DirectionType DirectionType;
-        typedef typename GeneratorType::RegionType    RegionType;
-
-        // Read image header
-        typename ImageIOBase::Pointer imageBase = rpi::readImageInformation( geometryFileName );
-
-        // Check the image dimension
-        if (imageBase->GetNumberOfDimensions()!=3)
-            throw std::runtime_error("Only 3D images are supported yet.");
-
-        // Create and fill origin, spacing, direction, and region from image header
-        OriginType    origin;
-        SpacingType   spacing;
-        DirectionType direction;
-        RegionType    region;
-        for (int i=0; i<3; i++)
-        {
-            origin[i]  = imageBase->GetOrigin(i);
-            spacing[i] = imageBase->GetSpacing(i);
-            region.SetSize(i,imageBase->GetDimensions(i));
-            for (int j=0; j<3; j++)
-                direction(i,j) = imageBase->GetDirection(j)[i];
-        }
-
-        // Set the geometry of the field generator
-        fieldGenerator->SetOutputOrigin(    origin );
-        fieldGenerator->SetOutputSpacing(   spacing );
-        fieldGenerator->SetOutputDirection( direction );
-        fieldGenerator->SetSize(    region.GetSize() );
-        fieldGenerator->SetOutputStartIndex(    region.GetIndex() );
-    }
-    else
-    {
-        // Locate the first non linear transformation in the list to get its geometry
-        unsigned int index;
-        for (index=0; index<data.type.size(); index++)
-            if ( data.type[index]==DISPLACEMENT_FIELD || data.type[index]==STATIONARY_VELOCITY_FIELD )
-                break;
-
-        // Stop if there is no non linear transformation in the list
-        if (index==data.type.size())
-            throw std::runtime_error("No geometry was found in the transformation list.");
-
-        // Get the geometry for the field located
-        const DFType  * df  = dynamic_cast<const DFType*>( list->GetTransform(index).GetPointer());
-        const SVFType * svf = dynamic_cast<const SVFType*>(list->GetTransform(index).GetPointer());
-        if (df!=0)
-        {
-            typename VectorFieldType::ConstPointer container = df->GetParametersAsVectorField();
-            fieldGenerator->SetOutputOrigin(    container->GetOrigin() );
-            fieldGenerator->SetOutputSpacing(   container->GetSpacing() );
-            fieldGenerator->SetOutputDirection( container->GetDirection() );
-            fieldGenerator->SetSize(    container->GetLargestPossibleRegion().GetSize() );
-            fieldGenerator->SetOutputStartIndex(    container->GetLargestPossibleRegion().GetIndex() );
-        }
-        else if (svf!=0)
-        {
-            typename VectorFieldType::ConstPointer container = svf->GetParametersAsVectorField();
-            fieldGenerator->SetOutputOrigin(    container->GetOrigin() );
-            fieldGenerator->SetOutputSpacing(   container->GetSpacing() );
-            fieldGenerator->SetOutputDirection( container->GetDirection() );
-            fieldGenerator->SetSize(    container->GetLargestPossibleRegion().GetSize() );
-            fieldGenerator->SetOutputStartIndex(    container->GetLargestPossibleRegion().GetIndex() );
-        }
-        else
-            throw std::runtime_error("No geometry can be extracted from the transformation.");
-    }
+    fieldGenerator->SetOutputParametersFromImage( geometry );
+    fieldGenerator->SetMaskImage( mask );
 
     // Update the field generator
     try
@@ -612,7 +382,157 @@ void exportDFTransformation(itk::GeneralTransform<TScalarType,3> * list, struct
     field->SetParametersAsVectorField( static_cast<typename VectorFieldType::ConstPointer>( container.GetPointer() ) );
 
     // Write displacement field
-    rpi::writeDisplacementFieldTransformation<TScalarType,3>(field, fileName );
+    rpi::writeDisplacementFieldTransformation<TScalarType,3>(field, fileName, encoding );
+}
+
+
+/**
+ * Generates a displacement field from the transformation list in the bounding box of a mask and
+ * exports it as image. The displacement fields to invert are loaded as they are, then only inverted
+ * over the region where they are evaluated (see invertDisplacementFieldsOverGeometry).
+ * @param data              data structure
+ * @param geometryFileName  path to the image containing the geometry
+ * @param maskFileName      path to the mask image
+ * @param maskVoxels        only compute the voxels of the mask
+ * @param fileName          output file name
+ * @param encoding          encoding of the output field
+ */
+template<class TScalarType>
+void exportDFTransformationInMask(struct Data & data, std::string geometryFileName, std::string maskFileName, bool maskVoxels,
+                                  std::string fileName, rpi::FieldEncoding encoding)
+{
+    // Type definition
+    typedef  itk::GeneralTransform<TScalarType,3>                                      TransformListType;
+    typedef  itk::Transform<TScalarType,3,3>                                           TransformType;
+    typedef  itk::ImageBase<3>                                                         GeometryType;
+    typedef  itk::Image<unsigned char,3>                                               MaskImageType;
+
+    // Read the transformations, the displacement fields being not inverted yet
+    std::vector<typename TransformType::Pointer> transforms = loadTransformations<TScalarType>(data, 0, true, false);
+    typename TransformListType::Pointer list = TransformListType::New();
+    for (unsigned int i=0; i<transforms.size(); i++)
+        list->InsertTransform( transforms[i].GetPointer() );
+
+    // Geometry of the output field, cropped to the bounding box of the mask
+    MaskImageType::Pointer       mask     = rpi::readImage<MaskImageType>( maskFileName );
+    GeometryType::Pointer        geometry = getGeometryOfTransformationList<TScalarType>( list, data, geometryFileName );
+    geometry = cropGeometryToMask( geometry, mask );
+    if (maskVoxels)
+        mask = resampleMask( mask, geometry );
+    else
+        mask = ITK_NULLPTR;
+
+    // Invert the displacement fields over the region they are evaluated on, and rebuild the list
+    invertDisplacementFieldsOverGeometry<TScalarType>( transforms, data, geometry, mask );
+    list = TransformListType::New();
+    for (unsigned int i=0; i<transforms.size(); i++)
+        list->InsertTransform( transforms[i].GetPointer() );
+
+    exportDFTransformation<TScalarType>( list, geometry, fileName, encoding, mask );
+}
+
+
+/**
+ * Fuses a list of stationary velocity fields and linear transformations in the log domain and exports
+ * the resulting stationary velocity field as image. The linear transformations are converted into
+ * velocity fields with the matrix logarithm, the velocity fields which do not have the output geometry
+ * are resampled, and the fields are composed from the left with the Baker-Campbell-Hausdorff formula:
+ * log(T0 o T1 o T2) ~ BCH( BCH(v0,v1), v2 ).
+ * @param data              data structure
+ * @param geometryFileName  path to the image containing the geometry
+ * @param fileName          output file name
+ * @param order             order of the Baker-Campbell-Hausdorff approximation
+ */
+template<class TScalarType>
+void exportSVFTransformationInLogDomain(struct Data & data, std::string geometryFileName, std::string fileName, unsigned int order)
+{
+
+    // Type definition
+    typedef  itk::GeneralTransform<TScalarType,3>                                      TransformListType;
+    typedef  itk::Transform<TScalarType,3,3>                                           TransformType;
+    typedef  itk::StationaryVelocityFieldTransform<TScalarType,3>                      SVFType;
+    typedef  typename SVFType::VectorFieldType                                         VectorFieldType;
+    typedef  itk::ImageBase<3>                                                         GeometryType;
+    typedef  itk::ResampleImageFilter<VectorFieldType,VectorFieldType>                 ResampleFilterType;
+    typedef  itk::VectorLinearInterpolateImageFunction<VectorFieldType,double>         InterpolatorType;
+    typedef  itk::IdentityTransform<double,3>                                          IdentityType;
+    typedef  itk::VelocityFieldBCHCompositionFilter<VectorFieldType,VectorFieldType>   BCHFilterType;
+
+    if (order<1 || order>4)
+        throw std::runtime_error("The order of the Baker-Campbell-Hausdorff approximation must be 1, 2, 3 or 4.");
+
+    // Read the transformations: the exponentials of the velocity fields are not needed
+    for (unsigned int i=0; i<data.type.size(); i++)
+        if (data.type[i]!=STATIONARY_VELOCITY_FIELD && data.type[i]!=LINEAR)
+            throw std::runtime_error("The log-domain fusion only supports stationary velocity fields and linear transformations.");
+    std::vector<typename TransformType::Pointer> transforms = loadTransformations<TScalarType>(data, 0, false);
+    typename TransformListType::Pointer list = TransformListType::New();
+    for (unsigned int i=0; i<transforms.size(); i++)
+        list->InsertTransform( transforms[i].GetPointer() );
+
+    // Geometry of the output velocity field
+    typename GeometryType::Pointer geometry = getGeometryOfTransformationList<TScalarType>( list, data, geometryFileName );
+
+    // Velocity field of each transformation, with the output geometry
+    std::vector<typename VectorFieldType::ConstPointer> velocities;
+    for (unsigned int i=0; i<data.type.size(); i++)
+    {
+        if (data.type[i]==LINEAR)
+        {
+            typename SVFType::Pointer field =
+                    rpi::linearToStationaryVelocityFieldTransformation<TScalarType,TScalarType>( geometry.GetPointer(), transforms[i].GetPointer() );
+            velocities.push_back( field->GetParametersAsVectorField() );
+            continue;
+        }
+
+        const SVFType * svf = dynamic_cast<const SVFType *>( list->GetTransform(i).GetPointer() );
+        typename VectorFieldType::ConstPointer velocity = svf->GetParametersAsVectorField();
+        if (!rpi::haveSameGeometry( velocity.GetPointer(), geometry.GetPointer() ))
+        {
+            typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+            resampler->SetInput( velocity );
+            resampler->SetTransform( IdentityType::New() );
+            resampler->SetInterpolator( InterpolatorType::New() );
+            resampler->SetOutputParametersFromImage( geometry );
+            try
+            {
+                resampler->Update();
+            }
+            catch( itk::ExceptionObject& err )
+            {
+                throw std::runtime_error( "Could not resample a stationary velocity field on the output geometry." );
+            }
+            velocity = resampler->GetOutput();
+        }
+        velocities.push_back( velocity );
+    }
+
+    // Composition in the log domain
+    typename VectorFieldType::ConstPointer fused = velocities[0];
+    for (unsigned int i=1; i<velocities.size(); i++)
+    {
+        typename BCHFilterType::Pointer filter = BCHFilterType::New();
+        filter->SetFirstVelocityField(  fused );
+        filter->SetSecondVelocityField( velocities[i] );
+        filter->SetApproximationOrder(  order );
+        try
+        {
+            filter->Update();
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            throw std::runtime_error( "Could not compose the stationary velocity fields in the log domain." );
+        }
+        typename VectorFieldType::Pointer output = filter->GetOutput();
+        output->DisconnectPipeline();
+        fused = output;
+        velocities[i] = ITK_NULLPTR;
+    }
+
+    // Write the stationary velocity field
+    typename SVFType::Pointer field = SVFType::New();
+    field->SetParametersAsVectorField( fused );
+    rpi::writeStationaryVelocityFieldTransformation<TScalarType,3>( field, fileName );
 }
 
 
@@ -641,10 +561,51 @@ int main(int argc, char** argv)
         parseParameters(argc, argv, param);
         printParam(param, param.verbose);
 
+        // Exponential cache
+        if (param.cacheDirectory.compare("")!=0)
+            rpi::setExponentialCacheDirectory(param.cacheDirectory);
+
         // Parse XML file
         parseXML(param.inputFile.c_str(), data);
         printData(data, param.verbose);
 
+        // Log-domain fusion: the list of transformations is not built since the exponentials are not needed
+        if (param.logDomain)
+        {
+            if (param.forceDisplacementField)
+                throw std::runtime_error("The options --log-domain and --force-displacement-field are not compatible.");
+            if (param.maskFile.compare("")!=0)
+                throw std::runtime_error("The options --log-domain and --mask are not compatible.");
+            if (param.verbose)
+            {
+                std::cout << "INFORMATIONS" << std::endl;
+                std::cout << "  Output transformation type : " << getTransformationAsString(STATIONARY_VELOCITY_FIELD) << std::endl;
+                std::cout << "  Fusion progress            : " << std::flush;
+            }
+            exportSVFTransformationInLogDomain<ScalarType>(data, param.geometryFile, param.outputFile, param.bchOrder);
+            if (param.verbose)
+                std::cout << "done" << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        // Fusion in a mask: the displacement fields are inverted once the region they are evaluated on is known
+        if (param.maskFile.compare("")!=0)
+        {
+            if (param.verbose)
+            {
+                std::cout << "INFORMATIONS" << std::endl;
+                std::cout << "  Output transformation type : " << getTransformationAsString(DISPLACEMENT_FIELD) << std::endl;
+                std::cout << "  Fusion progress            : " << std::flush;
+            }
+            exportDFTransformationInMask<ScalarType>(data, param.geometryFile, param.maskFile, param.maskVoxels,
+                                                     param.outputFile, param.fieldEncoding);
+            if (param.verbose)
+                std::cout << "done" << std::endl;
+            return EXIT_SUCCESS;
+        }
+        if (param.maskVoxels)
+            throw std::runtime_error("The option --mask-voxels requires the option --mask.");
+
         // Build the list of transformations
         TransformListType::Pointer list = buildListOfTransformations<ScalarType>(data);
 
@@ -667,7 +628,8 @@ int main(int argc, char** argv)
         if (output==LINEAR)
             exportLinearTransformation<ScalarType>(list, param.outputFile);
         else if (output==DISPLACEMENT_FIELD)
-            exportDFTransformation<ScalarType>(list, data, param.geometryFile, param.outputFile);
+            exportDFTransformation<ScalarType>(list, getGeometryOfTransformationList<ScalarType>( list, data, param.geometryFile ),
+                                               param.outputFile, param.fieldEncoding);
         else
             throw std::runtime_error( "Transformation type not supported yet." );
         if (param.verbose)
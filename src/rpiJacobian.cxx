@@ -0,0 +1,213 @@
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include <tclap/CmdLine.h>
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkGeneralTransform.h>
+#include <itkTransformChainToJacobianDeterminantSource.h>
+
+#ifdef MIPS_FOUND
+#include <mipsInrimageImageIOFactory.h>
+#endif
+
+#include "rpiCommonTools.hxx"
+#include "rpiTransformationList.hxx"
+
+
+
+/**
+ * Computes the map of the Jacobian determinant (or of its logarithm) of a transformation, for
+ * quality assessment or tensor-based morphometry. The transformation is either a single field or a
+ * list of transformations stored into an XML file (see rpiFuseTransformations). The determinant of
+ * a list is computed with the chain rule, without generating the composed field.
+ */
+
+
+
+/**
+ * Structure containing the parameters.
+ */
+struct Param
+{
+    std::string  inputFile;
+    std::string  inputType;
+    std::string  outputFile;
+    std::string  geometryFile;
+    unsigned int stencilRadius;
+    bool         logarithm;
+    bool         verbose;
+};
+
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Computes the map of the Jacobian determinant of a 3D transformation, or of its natural logarithm. ";
+    description += "The input is a displacement field, a stationary velocity field, a B-spline displacement field, or a ";
+    description += "list of transformations stored into an XML file (same format as rpiFuseTransformations). The determinant ";
+    description += "of a list is the product of the determinants of its transformations (chain rule). The determinant of a ";
+    description += "displacement field is computed with centered finite differences along the axes of its grid, the one of ";
+    description += "a stationary velocity field from the log-Jacobian computed along its exponential.";
+
+    // Option description
+    std::string dInput    = "Path to the input transformation or list of transformations.";
+    std::string dType     = "Type of the input: \"list\" (XML list of transformations, default), \"displacementfield\", ";
+    dType                += "\"stationaryvelocityfield\", \"bsplinedisplacementfield\" or \"linear\".";
+    std::string dOutput   = "Path to the output image.";
+    std::string dGeometry = "Path to the image defining the geometry of the output. By default, the geometry of the first ";
+    dGeometry            += "non linear transformation is used.";
+    std::string dStencil  = "Number of neighbors used along each axis by the finite differences of the displacement fields: ";
+    dStencil             += "1 (second order, default), 2 (fourth order) or 3 (sixth order).";
+    std::string dLog      = "Output the natural logarithm of the determinant (the non positive determinants are clamped to 1e-6).";
+    std::string dVerbose  = "Verbose mode (prints the range of the determinant and the number of folded voxels).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+        TCLAP::SwitchArg                aVerbose(  "",  "verbose",        dVerbose,  cmd, false );
+        TCLAP::SwitchArg                aLog(      "l", "log",            dLog,      cmd, false );
+        TCLAP::ValueArg<unsigned int>   aStencil(  "s", "stencil-radius", dStencil,  false, 1, "int", cmd );
+        TCLAP::ValueArg<std::string>    aGeometry( "g", "geometry",       dGeometry, false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>    aOutput(   "o", "output-image",   dOutput,   true,  "", "string", cmd );
+        TCLAP::ValueArg<std::string>    aType(     "t", "input-type",     dType,     false, "list", "string", cmd );
+        TCLAP::ValueArg<std::string>    aInput(    "i", "input",          dInput,    true,  "", "string", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.inputFile     = aInput.getValue();
+        param.inputType     = aType.getValue();
+        param.outputFile    = aOutput.getValue();
+        param.geometryFile  = aGeometry.getValue();
+        param.stencilRadius = aStencil.getValue();
+        param.logarithm     = aLog.getValue();
+        param.verbose       = aVerbose.getValue();
+
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+
+/**
+ * Main function.
+ */
+int main(int argc, char** argv)
+{
+
+    // Type definition
+    typedef float                                                                    ScalarType;
+    typedef itk::GeneralTransform<ScalarType,3>                                      TransformListType;
+    typedef itk::Image<float,3>                                                      ImageType;
+    typedef itk::TransformChainToJacobianDeterminantSource<ImageType, ScalarType>    GeneratorType;
+
+#ifdef MIPS_FOUND
+    // Allows the executable to read and write Inrimage
+    itk::InrimageImageIOFactory::RegisterOneFactory();
+#endif
+
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters(argc, argv, param);
+        if (param.stencilRadius<1 || param.stencilRadius>3)
+            throw std::runtime_error("The stencil radius must be 1, 2 or 3.");
+
+        // Read the transformations
+        struct Data data;
+        if (param.inputType.compare("list")==0)
+            parseXML(param.inputFile.c_str(), data);
+        else
+        {
+            Transformation transformation;
+            if (!getTransformationFromString(param.inputType, transformation))
+                throw std::runtime_error("Input type \"" + param.inputType + "\" not supported.");
+            data.type.push_back(transformation);
+            data.path.push_back(param.inputFile);
+            data.invert.push_back(false);
+        }
+        printData(data, param.verbose);
+        TransformListType::Pointer list = buildListOfTransformations<ScalarType>(data);
+
+        // Compute the determinant map
+        GeneratorType::Pointer generator = GeneratorType::New();
+        generator->SetTransform( list );
+        generator->SetOutputParametersFromImage( getGeometryOfTransformationList<ScalarType>( list, data, param.geometryFile ) );
+        generator->SetStencilRadius( param.stencilRadius );
+        generator->SetUseLogarithm( param.logarithm );
+        try
+        {
+            generator->Update();
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            std::cerr << err << std::endl;
+            throw std::runtime_error( "Could not compute the Jacobian determinant map." );
+        }
+        ImageType::Pointer map = generator->GetOutput();
+
+        // Range of the determinant and folded voxels
+        if (param.verbose)
+        {
+            const float   threshold = param.logarithm ? static_cast<float>( std::log( generator->GetMinimumDeterminant() ) ) : 0.0f;
+            float         minimum   = itk::NumericTraits<float>::max();
+            float         maximum   = itk::NumericTraits<float>::NonpositiveMin();
+            unsigned long folded    = 0;
+            itk::ImageRegionConstIterator<ImageType> it( map, map->GetLargestPossibleRegion() );
+            for (; !it.IsAtEnd(); ++it)
+            {
+                minimum = std::min( minimum, it.Get() );
+                maximum = std::max( maximum, it.Get() );
+                if (it.Get() <= threshold)
+                    folded++;
+            }
+            std::cout << "  Minimum        : " << minimum << std::endl;
+            std::cout << "  Maximum        : " << maximum << std::endl;
+            std::cout << "  Folded voxels  : " << folded  << std::endl;
+        }
+
+        // Write the map
+        typedef itk::ImageFileWriter<ImageType> WriterType;
+        WriterType::Pointer writer = WriterType::New();
+        writer->SetFileName( param.outputFile );
+        writer->SetInput( map );
+        try
+        {
+            writer->Update();
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            throw std::runtime_error( "Could not write the output image." );
+        }
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+}
@@ -22,6 +22,12 @@ RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >::Registrat
 
     // Initialize registration status
     this->m_registrationStatus = REGISTRATION_STATUS_STOP;
+    this->m_iterationInformation.level            = 0;
+    this->m_iterationInformation.iteration        = 0;
+    this->m_iterationInformation.metricValue      = 0.0;
+    this->m_iterationInformation.stepLength       = 0.0;
+    this->m_iterationInformation.convergenceValue = 0.0;
+    this->m_iterationInformation.elapsedTime      = 0.0;
 }
 
 
@@ -93,6 +99,26 @@ Notify(void)
 }
 
 
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >::
+NotifyIteration(const IterationInformation & information)
+{
+    this->m_iterationInformation = information;
+    this->m_registrationStatus   = REGISTRATION_STATUS_ITERATION;
+    Notify();
+    this->m_registrationStatus   = REGISTRATION_STATUS_PROCESSING;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+const typename RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >::IterationInformation &
+RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >::GetIterationInformation(void) const
+{
+    return this->m_iterationInformation;
+}
+
+
 template < class TFixedImage, class TMovingImage, class TTransformScalarType >
 typename RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >::RegistrationStatus
 RegistrationMethod< TFixedImage, TMovingImage, TTransformScalarType >::GetRegistrationStatus(void)
@@ -54,9 +54,22 @@ public:
      */
     enum RegistrationStatus {
         REGISTRATION_STATUS_PROCESSING, /** Processing registration */
+        REGISTRATION_STATUS_ITERATION,  /** Processing registration, an iteration has just been performed */
         REGISTRATION_STATUS_STOP        /** Stop: no activity       */
     };
 
+    /**
+     * Information about the last iteration performed, for the methods notifying their iterations.
+     */
+    struct IterationInformation {
+        unsigned int level;             /** Level of the pyramid (0 for the coarsest level)               */
+        unsigned int iteration;         /** Iteration in the level                                        */
+        double       metricValue;       /** Value of the metric                                           */
+        double       stepLength;        /** Length of the step of the optimizer                           */
+        double       convergenceValue;  /** Value tested by the convergence criterion of the method, if any */
+        double       elapsedTime;       /** Wall time since the start of the registration (seconds)       */
+    };
+
 
 protected:
 
@@ -85,6 +98,11 @@ protected:
      */
     RegistrationStatus           m_registrationStatus;
 
+    /**
+     * Information about the last iteration performed
+     */
+    IterationInformation         m_iterationInformation;
+
 
 public :
 
@@ -141,6 +159,20 @@ public :
      */
     void                         Notify(void);
 
+    /**
+     * Notify observer that an iteration has been performed: the registration status is set to
+     * REGISTRATION_STATUS_ITERATION while the observers are updated, then set back to
+     * REGISTRATION_STATUS_PROCESSING.
+     * @param information information about the iteration
+     */
+    void                         NotifyIteration(const IterationInformation & information);
+
+    /**
+     * Gets the information about the last iteration performed.
+     * @return information about the iteration
+     */
+    const IterationInformation & GetIterationInformation(void) const;
+
     /**
      * Gets the registration status.
      * @return registration status
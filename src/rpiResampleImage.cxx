@@ -1,6 +1,8 @@
 #include <itkImage.h>
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
+#include <itkExtractImageFilter.h>
+#include <itkJoinSeriesImageFilter.h>
 #include <itkResampleImageFilter.h>
 #include <itkNearestNeighborInterpolateImageFunction.h>
 #include <itkBSplineInterpolateImageFunction.h>
@@ -43,12 +45,14 @@ enum TransformationEnum {
  */
 struct Param
 {
-    std::string                inputPath;
-    std::string                outputPath;
+    std::vector<std::string>   inputPaths;
+    std::vector<std::string>   outputPaths;
     std::string                geometryPath;
     rpi::ImageInterpolatorType interpType;
     std::string                transformPath;
     TransformationEnum         transformType;
+    std::string                cachePath;
+    unsigned int               streamDivisions;
     bool                       verbose;
 };
 
@@ -72,18 +76,25 @@ void parseParameters(int argc, char** argv, struct Param & param)
     description += "resampled image will be either similar to the input image geometry if the input ";
     description += "transformation is a linear transformation, or will be similar to the geometry ";
     description += "of the input field is the input transformation is a displacement field or a ";
-    description += "stationary velocity field. Several image interpolation methods are proposed.";
+    description += "stationary velocity field. Several image interpolation methods are proposed. ";
+    description += "Several images can be resampled at once by repeating the \"-i\" and \"-o\" options: ";
+    description += "the transformation is then evaluated once for all the images. A 4D input image is ";
+    description += "resampled frame by frame in the same way. With the \"--stream-divisions\" option, ";
+    description += "3D images are resampled slab by slab without being loaded in memory (the input and ";
+    description += "output images should then use a streamable format, e.g. uncompressed MHA, NRRD or NIfTI).";
     description += "\nAuthors : Vincent Garcia";
 
     // Option description
-    std::string dInput   = "Path to the input image.";
-    std::string dOutput  = "Path to the output resampled image.";
+    std::string dInput   = "Path to the input image (can be repeated to resample several images sharing the same output geometry and the same pixel type).";
+    std::string dOutput  = "Path to the output resampled image (one per input image, in the same order).";
     std::string dGeom    = "Path to the image containing to output image geometry.";
     std::string dIT      = "If activated, this options implies to use the identity transformation (i.e. no transformation).";
     std::string dLT      = "Path to the input linear transformation.";
     std::string dDFT     = "Path to the input displacement field transformation.";
     std::string dSVFT    = "Path to the input stationary velocity field transformation.";
     std::string dInterp  = "Interpolation mode : 0 = nearest neighbor, 1 = linear, 2 = b-spline, and 3 = sinus cardinal (default 1).";
+    std::string dCache   = "Directory where the exponentials of the stationary velocity fields are cached (default: environment variable RPI_EXPONENTIAL_CACHE_DIRECTORY, if defined).";
+    std::string dStream  = "Number of slabs used to stream the resampling of large 3D images (default 1 = no streaming).";
     std::string dVerbose = "Verbose mode.";
 
     try {
@@ -94,9 +105,11 @@ void parseParameters(int argc, char** argv, struct Param & param)
         // Set options
         TCLAP::SwitchArg              aVerbose(  "",  "verbose", dVerbose, cmd, true);
         TCLAP::ValueArg<unsigned int> aInterp( "", "interpolation", dInterp, false, 1, "uint", cmd );
+        TCLAP::ValueArg<std::string>  aCache( "", "exponential-cache", dCache, false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int> aStream( "", "stream-divisions", dStream, false, 1, "uint", cmd );
         TCLAP::ValueArg<std::string>  aGeom( "g", "geometry", dGeom, false, "", "string", cmd );
-        TCLAP::ValueArg<std::string>  aOutput( "o", "output", dOutput, true, "", "string", cmd );
-        TCLAP::ValueArg<std::string>  aInput( "i", "input", dInput, true, "", "string", cmd );
+        TCLAP::MultiArg<std::string>  aOutput( "o", "output", dOutput, true, "string", cmd );
+        TCLAP::MultiArg<std::string>  aInput( "i", "input", dInput, true, "string", cmd );
 
         TCLAP::SwitchArg              aIT(  "",  "identity-transform", dIT, false);
         TCLAP::ValueArg<std::string>  aLT( "l", "linear-transform", dLT, false, "", "string" );
@@ -113,11 +126,17 @@ void parseParameters(int argc, char** argv, struct Param & param)
         cmd.parse( argc, argv );
 
         // Set parameters
-        param.inputPath    = aInput.getValue();
-        param.outputPath   = aOutput.getValue();
+        param.inputPaths   = aInput.getValue();
+        param.outputPaths  = aOutput.getValue();
         param.geometryPath = aGeom.getValue();
+        param.cachePath    = aCache.getValue();
+        param.streamDivisions = aStream.getValue();
         param.verbose      = aVerbose.getValue();
 
+        // Check the number of outputs
+        if (param.inputPaths.size() != param.outputPaths.size())
+            throw std::runtime_error("The number of output images must match the number of input images.");
+
         // Set transformation parameter
         if (aIT.getValue())
         {
@@ -170,14 +189,23 @@ void printParameters(struct Param param)
     if (!param.verbose)
         return;
 
-    std::cout << "Input image    : " << param.inputPath << std::endl;
-    std::cout << "Output image   : " << param.outputPath << std::endl;
+    for (unsigned int i=0; i<param.inputPaths.size(); i++)
+    {
+        std::cout << "Input image    : " << param.inputPaths[i] << std::endl;
+        std::cout << "Output image   : " << param.outputPaths[i] << std::endl;
+    }
 
     if (param.geometryPath.compare(""))
         std::cout << "Geometry       : " << param.geometryPath << std::endl;
 
     std::cout << "Transformation : " << param.transformPath << std::endl;
 
+    if (param.cachePath.compare(""))
+        std::cout << "Exp. cache     : " << param.cachePath << std::endl;
+
+    if (param.streamDivisions > 1)
+        std::cout << "Stream div.    : " << param.streamDivisions << std::endl;
+
     std::cout << "Interpolation  : ";
     if (param.interpType == rpi::INTERPOLATOR_NEAREST_NEIGHBOR)
         std::cout << "nearest neighbor" << std::endl;
@@ -191,21 +219,104 @@ void printParameters(struct Param param)
 
 
 /**
- * Reads the input image in the correct format, ressamples it, and save it.
- * @param  param  parameters
+ * Reads the transformation and gets the geometry of the resampled images.
+ * @param  param      parameters
+ * @param  reference  first input image, whose geometry is used for the identity and linear transformations
+ * @param  origin     origin of the resampled images
+ * @param  spacing    voxel size of the resampled images
+ * @param  size       size of the resampled images
+ * @param  direction  orientation of the resampled images
+ * @return transformation
  */
-template <class TPixelType, unsigned int NDimension>
-void resample(Param param)
+template <unsigned int NDimension>
+typename itk::Transform<double, NDimension, NDimension>::Pointer
+readTransformationAndGeometry(
+    const Param & param,
+    const itk::ImageBase<NDimension> * reference,
+    typename itk::ImageBase<NDimension>::PointType     & origin,
+    typename itk::ImageBase<NDimension>::SpacingType   & spacing,
+    typename itk::ImageBase<NDimension>::SizeType      & size,
+    typename itk::ImageBase<NDimension>::DirectionType & direction)
 {
 
     // Type definition
-    typedef itk::Image<TPixelType, NDimension>                        ImageType;
+    typedef itk::ImageBase<NDimension>                                ImageBaseType;
+    typedef itk::Transform<double, NDimension, NDimension>            TransformType;
     typedef itk::IdentityTransform<double, NDimension>                IdentityTransformType;
-    typedef itk::Transform<double, NDimension, NDimension>            LinearTransformType;
     typedef rpi::DisplacementFieldTransform<double, NDimension>       DFTransformType;
     typedef itk::StationaryVelocityFieldTransform<double, NDimension> SVFTransformType;
     typedef typename DFTransformType::VectorFieldType                 VectorFieldType;
 
+    // Geometry of the reference image, used if the transformation has no geometry
+    const ImageBaseType * geometry = reference;
+    typename TransformType::Pointer transform;
+
+    // Switch on transformation type
+    switch (param.transformType)
+    {
+
+        case IDENTITY_TRANSFORMATION :
+            {
+                transform = IdentityTransformType::New().GetPointer();
+            }
+            break;
+
+        case LINEAR_TRANSFORMATION :
+            {
+                transform = rpi::readLinearTransformation<double>(param.transformPath).GetPointer();
+            }
+            break;
+
+        case DISPLACEMENT_FIELD_TRANSFORMATION :
+            {
+                typename DFTransformType::Pointer df = rpi::readDisplacementField<double>(param.transformPath);
+                geometry  = df->GetFieldGeometry();
+                transform = df.GetPointer();
+            }
+            break;
+
+        case STATIONARY_VELOCITY_FIELD_TRANSFORMATION :
+            {
+                typename SVFTransformType::Pointer svf = rpi::readStationaryVelocityField<double>(param.transformPath);
+
+                // Create a displacement field from the stationary velocity field (the exponential
+                // may come from the cache)
+                typename DFTransformType::Pointer df = DFTransformType::New();
+                df->SetParametersAsVectorField( svf->GetCachedDisplacementField() );
+                geometry  = df->GetFieldGeometry();
+                transform = df.GetPointer();
+            }
+            break;
+
+        default :
+        {
+            throw std::runtime_error("Transformation type not supported.");
+        }
+    }
+
+    // Get geometry
+    if (param.geometryPath.compare("")!=0)
+        rpi::getGeometryFromImageHeader<NDimension>(param.geometryPath, origin, spacing, size, direction);
+    else
+        rpi::getGeometryFromImage<ImageBaseType>(geometry, origin, spacing, size, direction);
+
+    return transform;
+}
+
+
+/**
+ * Reads the input 3D images in the correct format, ressamples them, and save them. The
+ * transformation is evaluated once for all the images.
+ * @param  param  parameters
+ */
+template <class TPixelType>
+void resample(Param param)
+{
+
+    // Type definition
+    typedef itk::Image<TPixelType, 3>               ImageType;
+    typedef itk::Transform<double, 3, 3>            TransformType;
+
     try
     {
 
@@ -215,90 +326,106 @@ void resample(Param param)
         typename ImageType::SizeType      size;
         typename ImageType::DirectionType direction;
 
-        // Read image
-        typename ImageType::Pointer input = rpi::readImage<ImageType>( param.inputPath );
-
-        // Switch on transformation type
-        switch (param.transformType)
+        // Streamed resampling: the images are processed one after the other, only their geometry is read here
+        if (param.streamDivisions > 1)
         {
+            typedef itk::ImageFileReader<ImageType> ReaderType;
+            typename ReaderType::Pointer reader = ReaderType::New();
+            reader->SetFileName( param.inputPaths[0] );
+            reader->UpdateOutputInformation();
+
+            typename TransformType::Pointer transform = readTransformationAndGeometry<3>(param, reader->GetOutput(), origin, spacing, size, direction);
+            for (unsigned int i=0; i<param.inputPaths.size(); i++)
+                rpi::streamResampleAndWriteImage<ImageType,double>(param.inputPaths[i], origin, spacing, size, direction, transform, param.outputPaths[i], param.streamDivisions, param.interpType );
+            return;
+        }
 
-            case IDENTITY_TRANSFORMATION :
-                {
-                    // Read transformation
-                    typename IdentityTransformType::Pointer identity = IdentityTransformType::New();
-
-                    // Get geometry
-                    if (param.geometryPath.compare("")!=0)
-                        rpi::getGeometryFromImageHeader<NDimension>(param.geometryPath, origin, spacing, size, direction);
-                    else
-                        rpi::getGeometryFromImage<ImageType>(input, origin, spacing, size, direction);
-
-                    // Resample and write image
-                    rpi::resampleAndWriteImage<ImageType,double>(input, origin, spacing, size, direction, identity, param.outputPath, param.interpType );
-                }
-                break;
-
-            case LINEAR_TRANSFORMATION :
-                {
-                    // Read transformation
-                    typename LinearTransformType::Pointer linear = rpi::readLinearTransformation<double>(param.transformPath);
-
-                    // Get geometry
-                    if (param.geometryPath.compare("")!=0)
-                        rpi::getGeometryFromImageHeader<NDimension>(param.geometryPath, origin, spacing, size, direction);
-                    else
-                        rpi::getGeometryFromImage<ImageType>(input, origin, spacing, size, direction);
-
-                    // Resample and write image
-                    rpi::resampleAndWriteImage<ImageType,double>(input, origin, spacing, size, direction, linear, param.outputPath, param.interpType );
-                }
-                break;
-
-
-            case DISPLACEMENT_FIELD_TRANSFORMATION :
-                {
-                    // Read transformation
-                    typename DFTransformType::Pointer df = rpi::readDisplacementField<double>(param.transformPath);
-
-                    // Get geometry
-                    if (param.geometryPath.compare("")!=0)
-                        rpi::getGeometryFromImageHeader<NDimension>(param.geometryPath, origin, spacing, size, direction);
-                    else
-                        rpi::getGeometryFromImage<VectorFieldType>(df->GetParametersAsVectorField(), origin, spacing, size, direction);
-
-                    // Resample and write image
-                    rpi::resampleAndWriteImage<ImageType,double>(input, origin, spacing, size, direction, df, param.outputPath, param.interpType );
-                }
-                break;
-
-
-            case STATIONARY_VELOCITY_FIELD_TRANSFORMATION :
-                {
-                    // Read transformation
-                    typename SVFTransformType::Pointer svf = rpi::readStationaryVelocityField<double>(param.transformPath);
-
-                    // Get geometry
-                    if (param.geometryPath.compare("")!=0)
-                        rpi::getGeometryFromImageHeader<NDimension>(param.geometryPath, origin, spacing, size, direction);
-                    else
-                        rpi::getGeometryFromImage<VectorFieldType>(svf->GetParametersAsVectorField(), origin, spacing, size, direction);
-
-                    // Create a displacement field from the stationary velocity field
-                    typename DFTransformType::Pointer df = DFTransformType::New();
-                    df->SetParametersAsVectorField( svf->GetDisplacementFieldAsVectorField() );
-
-                    // Resample and write image
-                    rpi::resampleAndWriteImage<ImageType,double>(input, origin, spacing, size, direction, df, param.outputPath, param.interpType );
-                }
-                break;
-
-            default :
-            {
-                throw std::runtime_error("Transformation type not supported.");
-            }
+        // Read images
+        std::vector<typename ImageType::Pointer> inputs;
+        for (unsigned int i=0; i<param.inputPaths.size(); i++)
+            inputs.push_back( rpi::readImage<ImageType>( param.inputPaths[i] ) );
+
+        // Read transformation
+        typename TransformType::Pointer transform = readTransformationAndGeometry<3>(param, inputs[0], origin, spacing, size, direction);
+
+        // Resample and write images
+        rpi::resampleAndWriteImages<ImageType,double>(inputs, origin, spacing, size, direction, transform, param.outputPaths, param.interpType );
+    }
+    catch( itk::ExceptionObject& e )
+    {
+        std::cerr << e << std::endl;
+        throw std::runtime_error("Image resampling fail.");
+    }
+}
+
+
+/**
+ * Reads a 4D input image in the correct format, ressamples its frames with a 3D transformation,
+ * and save it. The transformation is evaluated once for all the frames.
+ * @param  param  parameters
+ */
+template <class TPixelType>
+void resampleSeries(Param param)
+{
+
+    // Type definition
+    typedef itk::Image<TPixelType, 4>                               SeriesType;
+    typedef itk::Image<TPixelType, 3>                               ImageType;
+    typedef itk::Transform<double, 3, 3>                            TransformType;
+    typedef itk::ExtractImageFilter<SeriesType, ImageType>          ExtractFilterType;
+    typedef itk::JoinSeriesImageFilter<ImageType, SeriesType>       JoinFilterType;
+    typedef itk::ImageFileWriter<SeriesType>                        WriterType;
+
+    if (param.inputPaths.size() != 1)
+        throw std::runtime_error("4D images must be resampled one at a time.");
+    if (param.streamDivisions > 1)
+        throw std::runtime_error("Streaming is only supported for 3D images.");
+
+    try
+    {
+
+        // Output image geometry
+        typename ImageType::PointType     origin;
+        typename ImageType::SpacingType   spacing;
+        typename ImageType::SizeType      size;
+        typename ImageType::DirectionType direction;
+
+        // Read the series and extract its frames
+        typename SeriesType::Pointer series = rpi::readImage<SeriesType>( param.inputPaths[0] );
+        const typename SeriesType::RegionType region = series->GetLargestPossibleRegion();
+        std::vector<typename ImageType::Pointer> frames;
+        for (unsigned int t=0; t<region.GetSize(3); t++)
+        {
+            typename SeriesType::RegionType frameRegion = region;
+            frameRegion.SetIndex(3, region.GetIndex(3) + t);
+            frameRegion.SetSize( 3, 0 );
+
+            typename ExtractFilterType::Pointer extractor = ExtractFilterType::New();
+            extractor->SetInput( series );
+            extractor->SetExtractionRegion( frameRegion );
+            extractor->SetDirectionCollapseToSubmatrix();
+            extractor->Update();
+            frames.push_back( extractor->GetOutput() );
         }
 
+        // Read transformation
+        typename TransformType::Pointer transform = readTransformationAndGeometry<3>(param, frames[0], origin, spacing, size, direction);
 
+        // Resample the frames
+        std::vector<typename ImageType::Pointer> resampled = rpi::resampleImages<ImageType,double>(frames, origin, spacing, size, direction, transform, param.interpType );
+
+        // Rebuild the series, with the original time spacing and origin
+        typename JoinFilterType::Pointer joiner = JoinFilterType::New();
+        joiner->SetSpacing( series->GetSpacing()[3] );
+        joiner->SetOrigin(  series->GetOrigin()[3] );
+        for (unsigned int t=0; t<resampled.size(); t++)
+            joiner->SetInput( t, resampled[t] );
+
+        // Write the output series
+        typename WriterType::Pointer writer = WriterType::New();
+        writer->SetFileName( param.outputPaths[0] );
+        writer->SetInput( joiner->GetOutput() );
+        writer->Update();
     }
     catch( itk::ExceptionObject& e )
     {
@@ -308,6 +435,23 @@ void resample(Param param)
 }
 
 
+/**
+ * Calls the resampling function corresponding to the dimension of the input images.
+ * @param  param  parameters
+ * @param  dim    dimension of the input images
+ */
+template <class TPixelType>
+void resample(Param param, unsigned int dim)
+{
+    if ( dim==3 )
+        resample<TPixelType>(param);
+    else if ( dim==4 )
+        resampleSeries<TPixelType>(param);
+    else
+        throw std::runtime_error( "Dimension not supported yet." );
+}
+
+
 /**
  * Main function.
  */
@@ -328,43 +472,51 @@ int main(int argc, char** argv)
         parseParameters( argc, argv, param );
         printParameters( param );
 
+        // Exponential cache
+        if (param.cachePath.compare("")!=0)
+            rpi::setExponentialCacheDirectory(param.cachePath);
+
         // Read ImageIO
-        itk::ImageIOBase::Pointer         imageIO        = rpi::readImageInformation(param.inputPath);
+        itk::ImageIOBase::Pointer         imageIO        = rpi::readImageInformation(param.inputPaths[0]);
         unsigned int                      dim            = imageIO->GetNumberOfDimensions();
         itk::ImageIOBase::IOPixelType     pixel_type     = imageIO->GetPixelType();
         itk::ImageIOBase::IOComponentType component_type = imageIO->GetComponentType();
 
+        // The images of a set are read with the type of the first one: the other images must have
+        // the same type, otherwise they would be cast (and possibly truncated) silently
+        for (unsigned int i=1; i<param.inputPaths.size(); i++)
+        {
+            itk::ImageIOBase::Pointer io = rpi::readImageInformation(param.inputPaths[i]);
+            if ( io->GetNumberOfDimensions()!=dim || io->GetPixelType()!=pixel_type || io->GetComponentType()!=component_type )
+                throw std::runtime_error( "The image " + param.inputPaths[i] + " does not have the pixel type, component type and dimension of the image " + param.inputPaths[0] + "." );
+        }
+
         // Switch on pixel type
         if ( pixel_type==itk::ImageIOBase::SCALAR )
         {
-            // Switch on pixel type and dimension
-            if ( dim==3 )
-            {
-                if      ( component_type == itk::ImageIOBase::UCHAR  )
-                    resample<unsigned char,  3>(param);
-                else if ( component_type == itk::ImageIOBase::CHAR   )
-                    resample<char,           3>(param);
-                else if ( component_type == itk::ImageIOBase::USHORT )
-                    resample<unsigned short, 3>(param);
-                else if ( component_type == itk::ImageIOBase::SHORT  )
-                    resample<short,          3>(param);
-                else if ( component_type == itk::ImageIOBase::UINT   )
-                    resample<unsigned int,   3>(param);
-                else if ( component_type == itk::ImageIOBase::INT    )
-                    resample<int,            3>(param);
-                else if ( component_type == itk::ImageIOBase::ULONG  )
-                    resample<unsigned long,  3>(param);
-                else if ( component_type == itk::ImageIOBase::LONG   )
-                    resample<long,           3>(param);
-                else if ( component_type == itk::ImageIOBase::FLOAT  )
-                    resample<float,          3>(param);
-                else if ( component_type == itk::ImageIOBase::DOUBLE )
-                    resample<double,         3>(param);
-                else
-                    throw std::runtime_error( "Component type not supported supported." );
-            }
+            // Switch on component type and dimension (3D images, or 4D series resampled frame by frame)
+            if      ( component_type == itk::ImageIOBase::UCHAR  )
+                resample<unsigned char>(param, dim);
+            else if ( component_type == itk::ImageIOBase::CHAR   )
+                resample<char>(param, dim);
+            else if ( component_type == itk::ImageIOBase::USHORT )
+                resample<unsigned short>(param, dim);
+            else if ( component_type == itk::ImageIOBase::SHORT  )
+                resample<short>(param, dim);
+            else if ( component_type == itk::ImageIOBase::UINT   )
+                resample<unsigned int>(param, dim);
+            else if ( component_type == itk::ImageIOBase::INT    )
+                resample<int>(param, dim);
+            else if ( component_type == itk::ImageIOBase::ULONG  )
+                resample<unsigned long>(param, dim);
+            else if ( component_type == itk::ImageIOBase::LONG   )
+                resample<long>(param, dim);
+            else if ( component_type == itk::ImageIOBase::FLOAT  )
+                resample<float>(param, dim);
+            else if ( component_type == itk::ImageIOBase::DOUBLE )
+                resample<double>(param, dim);
             else
-                throw std::runtime_error( "Dimension not supported yet." );
+                throw std::runtime_error( "Component type not supported supported." );
         }
         else
             throw std::runtime_error( "Pixel type not supported. Only scalar images are supported yet." );
@@ -0,0 +1,691 @@
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <string>
+
+#include <tinyxml.h>
+
+#include <itkTransform.h>
+#include <itkImageBase.h>
+#include <itkImage.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkResampleImageFilter.h>
+#include <itkNearestNeighborInterpolateImageFunction.h>
+#include <itkObjectFactoryBase.h>
+#include <itkMatrixOffsetTransformBase.h>
+#include <rpiDisplacementFieldTransform.h>
+#include <rpiBSplineDisplacementFieldTransform.h>
+#include <itkStationaryVelocityFieldTransform.h>
+#include <itkGeneralTransform.h>
+
+#include "rpiCommonTools.hxx"
+
+/**
+ * Lists of transformations stored into XML files, shared by the tools working on a composition of
+ * transformations (see rpiFuseTransformations for the format of the XML files).
+ */
+
+
+/**
+ * Transformation type
+ */
+enum Transformation {
+    LINEAR,                    /** Linear                    */
+    DISPLACEMENT_FIELD,        /** Displacement field        */
+    STATIONARY_VELOCITY_FIELD, /** Stationary velocity field */
+    BSPLINE_DISPLACEMENT_FIELD /** B-spline displacement field */
+};
+
+
+/**
+ * Structure containing the information of the transformations (type, path, inversion).
+ */
+struct Data
+{
+    std::vector<Transformation> type;
+    std::vector<std::string>    path;
+    std::vector<bool>           invert;
+};
+
+
+/**
+ * Returns the transformation type as string.
+ * @param  transformation transformation
+ * @return string describing the transformation
+ */
+inline std::string getTransformationAsString(Transformation transformation)
+{
+    if (transformation==LINEAR)
+        return "linear";
+    else if (transformation==DISPLACEMENT_FIELD)
+        return "displacement field";
+    else if (transformation==STATIONARY_VELOCITY_FIELD)
+        return "stationary velocity field";
+    else if (transformation==BSPLINE_DISPLACEMENT_FIELD)
+        return "B-spline displacement field";
+    else
+        return "transformation not recognized";
+}
+
+
+/**
+ * Gets the transformation type from its name in the lists of transformations.
+ * @param  type            name of the type ("linear", "displacementfield", "stationaryvelocityfield"
+ *                         or "bsplinedisplacementfield")
+ * @param  transformation  transformation type (output)
+ * @return false if the name is not supported
+ */
+inline bool getTransformationFromString(const std::string & type, Transformation & transformation)
+{
+    if (type.compare("linear")==0)
+        transformation = LINEAR;
+    else if (type.compare("displacementfield")==0)
+        transformation = DISPLACEMENT_FIELD;
+    else if (type.compare("stationaryvelocityfield")==0)
+        transformation = STATIONARY_VELOCITY_FIELD;
+    else if (type.compare("bsplinedisplacementfield")==0)
+        transformation = BSPLINE_DISPLACEMENT_FIELD;
+    else
+        return false;
+    return true;
+}
+
+
+/**
+ * Parses the XML file anf fill the data structure.
+ * @param fileName  path to the XML file
+ * @param data      Data structure
+ */
+inline void parseXML(const char* fileName, struct Data & data)
+{
+
+    // Load XML document
+    TiXmlDocument doc(fileName);
+    bool loadOkay = doc.LoadFile();
+    if (loadOkay)
+    {
+
+        // Variables
+        TiXmlElement *pRoot, *pParm, *pType, *pPath, *pInvert;
+
+        // Get XML root
+        pRoot = doc.FirstChildElement( "listoftransformations" );
+        if ( pRoot )
+        {
+            // Get first transformation
+            pParm = pRoot->FirstChildElement("transformation");
+            while ( pParm )
+            {
+                // Get transformation type, transformation path, and the inversion
+                pType   = pParm->FirstChildElement("type");
+                pPath   = pParm->FirstChildElement("path");
+                pInvert = pParm->FirstChildElement("invert");
+
+                // Process transformation
+                if ( pType && pPath )
+                {
+
+                    // Type and path
+                    std::string type(pType->GetText());
+                    std::string path(pPath->GetText());
+
+                    // Process type
+                    Transformation transformation;
+                    if (getTransformationFromString(type, transformation))
+                        data.type.push_back(transformation);
+                    else
+                    {
+                        std::string warning;
+                        warning += "Warning : the transformation type \"" + type + "\" is not ";
+                        warning += "supported. The transformation " + path + " will be ignored.";
+                        std::cout << warning << std::endl;
+                        pParm = pParm->NextSiblingElement("transformation");
+                        break;
+                    }
+
+                    // Process path
+                    data.path.push_back(path);
+
+                    // Process inversion
+                    if ( pInvert )
+                    {
+                        std::string invert(pInvert->GetText());
+                        if (invert.compare("1")==0)
+                        {
+                            if ( type.compare("stationaryvelocityfield")==0 || type.compare("bsplinedisplacementfield")==0 )
+                            {
+                                std::string warning;
+                                warning += "Warning : a transformation of type \"" + type + "\" cannot ";
+                                warning += "be inverted. The inversion will not be performed.";
+                                std::cout << warning << std::endl;
+                                data.invert.push_back(false);
+                            }
+                            else
+                                data.invert.push_back(true);
+                        }
+                        else
+                            data.invert.push_back(false);
+                    }
+                    else
+                        data.invert.push_back(false);
+                }
+                else
+                    throw std::runtime_error("Transformation must contain tags \"type\" and \"path\".");
+
+                // Get next transformation
+                pParm = pParm->NextSiblingElement("transformation");
+            }
+        }
+    }
+    else
+        throw std::runtime_error( std::string("Failed to load file ") + fileName + "." );
+}
+
+
+/**
+ * Prints the Data structure.
+ * @param data     Data structure
+ * @param verbose  prints if and only if verbose is true
+ */
+inline void printData(struct Data & data, bool verbose)
+{
+    if (!verbose)
+        return;
+
+    std::cout << std::endl;
+    std::cout << "TRANSFORMATION LIST" << std::endl << std::endl;
+    for (unsigned int i=0; i<data.type.size(); i++)
+    {
+        std::cout << "  Transformation " << i << std::endl;
+
+        if (data.type[i]==LINEAR)
+            std::cout << "  Type   : linear" << std::endl;
+        else if (data.type[i]==DISPLACEMENT_FIELD)
+            std::cout << "  Type   : displacement field" << std::endl;
+        else if (data.type[i]==STATIONARY_VELOCITY_FIELD)
+            std::cout << "  Type   : stationary velocity field" << std::endl;
+        else if (data.type[i]==BSPLINE_DISPLACEMENT_FIELD)
+            std::cout << "  Type   : B-spline displacement field" << std::endl;
+
+        std::cout << "  Path   : " << data.path[i]   << std::endl;
+
+        std::cout << "  Invert : " << data.invert[i] << std::endl << std::endl;
+    }
+}
+
+
+/**
+ * Reads a transformation of the list and inverts it if required.
+ * @param  data                     data structure
+ * @param  i                        index of the transformation in the list
+ * @param  useExponentialCache      use the exponential cache for the stationary velocity fields
+ * @param  invertDisplacementField  invert a displacement field if required; if false, the inversion
+ *                                  is left to the caller (see invertDisplacementFieldsOverGeometry)
+ * @return transformation
+ */
+template<class TScalarType>
+typename itk::Transform<TScalarType,3,3>::Pointer
+loadTransformation(struct Data & data, unsigned int i, bool useExponentialCache = true, bool invertDisplacementField = true)
+{
+    // Type definition
+    typedef itk::Transform<TScalarType,3,3>                    LinearType;
+    typedef itk::MatrixOffsetTransformBase<TScalarType,3,3>    MatrixType;
+    typedef rpi::DisplacementFieldTransform<TScalarType>       DFType;
+    typedef itk::StationaryVelocityFieldTransform<TScalarType> SVFType;
+    typedef rpi::BSplineDisplacementFieldTransform<TScalarType> BSplineType;
+
+    if (data.type[i]==LINEAR)
+    {
+
+        typename LinearType::Pointer linear = rpi::readLinearTransformation<TScalarType>(data.path[i]);
+
+        if (data.invert[i]==false)
+            return linear;
+
+        MatrixType * matrix = dynamic_cast<MatrixType *>(linear.GetPointer());
+        if (matrix==0)
+            throw std::runtime_error("Cannot cast the transformation into an itk::MatrixOffsetTransformBase.");
+        typename MatrixType::Pointer inverse = MatrixType::New();
+        inverse->SetCenter(matrix->GetCenter());
+        matrix->GetInverse(inverse);
+        return inverse.GetPointer();
+
+    }
+    else if (data.type[i]==DISPLACEMENT_FIELD)
+    {
+        typename DFType::Pointer field = rpi::readDisplacementField<TScalarType>(data.path[i]);
+
+        if (data.invert[i]==true && invertDisplacementField)
+            field->GetInverse(field);
+        return field.GetPointer();
+    }
+    else if (data.type[i]==STATIONARY_VELOCITY_FIELD)
+    {
+        // The cached exponential is only useful if the field is not inverted
+        typename SVFType::Pointer field = rpi::readStationaryVelocityField<TScalarType>(data.path[i], useExponentialCache && !data.invert[i]);
+
+        if (data.invert[i]==true)
+            field->GetInverse(field);
+        return field.GetPointer();
+    }
+    else if (data.type[i]==BSPLINE_DISPLACEMENT_FIELD)
+    {
+        typename BSplineType::Pointer field = rpi::readBSplineDisplacementField<TScalarType>(data.path[i]);
+        return field.GetPointer();
+    }
+    else
+        throw std::runtime_error("Transformation not supported.");
+}
+
+
+/**
+ * Reads and inverts the transformations of the list concurrently, most of the time being spent
+ * decompressing the fields. If several transformations cannot be read, the error of the first one
+ * is thrown.
+ * @param  data                      data structure
+ * @param  numberOfThreads           number of threads loading the transformations (0: number of cores)
+ * @param  useExponentialCache       use the exponential cache for the stationary velocity fields
+ * @param  invertDisplacementFields  invert the displacement fields if required (see loadTransformation)
+ * @return transformations, in the order of the data structure
+ */
+template<class TScalarType>
+std::vector<typename itk::Transform<TScalarType,3,3>::Pointer>
+loadTransformations(struct Data & data, unsigned int numberOfThreads = 0, bool useExponentialCache = true,
+                    bool invertDisplacementFields = true)
+{
+    // Type definition
+    typedef itk::Transform<TScalarType,3,3>                    TransformType;
+
+    const unsigned int numberOfTransformations = data.type.size();
+    std::vector<typename TransformType::Pointer> transforms( numberOfTransformations );
+    std::vector<std::exception_ptr>              errors(     numberOfTransformations );
+
+    // Each thread loads the next transformation not yet taken
+    std::atomic<unsigned int> next( 0 );
+    auto load = [&]()
+    {
+        for (unsigned int i=next++; i<numberOfTransformations; i=next++)
+        {
+            try
+            {
+                transforms[i] = loadTransformation<TScalarType>(data, i, useExponentialCache, invertDisplacementFields);
+            }
+            catch( ... )
+            {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    if (numberOfThreads==0)
+        numberOfThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    numberOfThreads = std::min( numberOfThreads, numberOfTransformations );
+
+    if (numberOfThreads<=1)
+        load();
+    else
+    {
+        // The object factories are initialized before the threads query them
+        itk::ObjectFactoryBase::GetRegisteredFactories();
+
+        std::vector<std::thread> threads;
+        for (unsigned int t=1; t<numberOfThreads; t++)
+            threads.push_back( std::thread( load ) );
+        load();
+        for (unsigned int t=0; t<threads.size(); t++)
+            threads[t].join();
+    }
+
+    for (unsigned int i=0; i<numberOfTransformations; i++)
+        if (errors[i])
+            std::rethrow_exception( errors[i] );
+    return transforms;
+}
+
+
+/**
+ * Build the list of transformations. The transformations are loaded concurrently (see
+ * loadTransformations) and inserted into the list in the order of the data structure.
+ * @param  data             data structure
+ * @param  numberOfThreads  number of threads loading the transformations (0: number of cores)
+ * @return list of transformations
+ */
+template<class TScalarType>
+typename itk::GeneralTransform<TScalarType,3>::Pointer
+buildListOfTransformations(struct Data & data, unsigned int numberOfThreads = 0)
+{
+    // Type definition
+    typedef itk::GeneralTransform<TScalarType,3>               ListType;
+    typedef itk::Transform<TScalarType,3,3>                    TransformType;
+
+    std::vector<typename TransformType::Pointer> transforms = loadTransformations<TScalarType>(data, numberOfThreads);
+
+    // Create and fill the list of transformations
+    typename ListType::Pointer list = ListType::New();
+    for (unsigned int i=0; i<transforms.size(); i++)
+        list->InsertTransform( transforms[i].GetPointer() );
+    return list;
+}
+
+
+/**
+ * Gets the geometry of the fields generated from a list of transformations: the geometry of an
+ * image if a path is given, the geometry of the first non linear transformation of the list
+ * otherwise.
+ * @param  list              list of transformations
+ * @param  data              data structure
+ * @param  geometryFileName  path to the image containing the geometry, or empty string
+ * @return geometry (origin, spacing, direction and largest possible region)
+ */
+template<class TScalarType>
+typename itk::ImageBase<3>::Pointer
+getGeometryOfTransformationList(itk::GeneralTransform<TScalarType,3> * list, struct Data & data, std::string geometryFileName)
+{
+
+    // Type definition
+    typedef  itk::ImageBase<3>                                         GeometryType;
+    typedef  rpi::DisplacementFieldTransform< TScalarType, 3 >         DFType;
+    typedef  itk::StationaryVelocityFieldTransform< TScalarType, 3 >   SVFType;
+    typedef  rpi::BSplineDisplacementFieldTransform< TScalarType, 3 >  BSplineType;
+
+    typename GeometryType::Pointer geometry = GeometryType::New();
+
+    // Geometry of an image
+    if (geometryFileName.compare("")!=0)
+    {
+        GeometryType::PointType     origin;
+        GeometryType::SpacingType   spacing;
+        GeometryType::SizeType      size;
+        GeometryType::DirectionType direction;
+        rpi::getGeometryFromImageHeader<3>(geometryFileName, origin, spacing, size, direction);
+
+        GeometryType::RegionType region;
+        region.SetSize(size);
+        geometry->SetOrigin(    origin );
+        geometry->SetSpacing(   spacing );
+        geometry->SetDirection( direction );
+        geometry->SetLargestPossibleRegion( region );
+        return geometry;
+    }
+
+    // Locate the first non linear transformation in the list to get its geometry
+    unsigned int index;
+    for (index=0; index<data.type.size(); index++)
+        if ( data.type[index]==DISPLACEMENT_FIELD || data.type[index]==STATIONARY_VELOCITY_FIELD ||
+             data.type[index]==BSPLINE_DISPLACEMENT_FIELD )
+            break;
+
+    // Stop if there is no non linear transformation in the list
+    if (index==data.type.size())
+        throw std::runtime_error("No geometry was found in the transformation list.");
+
+    // Get the geometry for the field located
+    const DFType      * df      = dynamic_cast<const DFType*>(     list->GetTransform(index).GetPointer());
+    const SVFType     * svf     = dynamic_cast<const SVFType*>(    list->GetTransform(index).GetPointer());
+    const BSplineType * bspline = dynamic_cast<const BSplineType*>(list->GetTransform(index).GetPointer());
+    const GeometryType * container = ITK_NULLPTR;
+    if (df!=0)
+    {
+        // The geometry is read without decoding an encoded field
+        container = df->GetFieldGeometry();
+    }
+    else if (svf!=0)
+        container = svf->GetParametersAsVectorField();
+    else if (bspline!=0)
+    {
+        // The geometry of the field approximated by the control grid
+        container = bspline->GetFieldGeometry();
+        if (!container)
+            throw std::runtime_error("The B-spline displacement field has no field geometry, use the option --geometry.");
+    }
+    else
+        throw std::runtime_error("No geometry can be extracted from the transformation.");
+
+    geometry->SetOrigin(    container->GetOrigin() );
+    geometry->SetSpacing(   container->GetSpacing() );
+    geometry->SetDirection( container->GetDirection() );
+    geometry->SetLargestPossibleRegion( container->GetLargestPossibleRegion() );
+    return geometry;
+}
+
+
+/**
+ * Crops a geometry to the bounding box of the voxels of a mask. The mask can have any geometry:
+ * the voxels of the output geometry overlapping the bounding box of the mask are kept.
+ * @param  geometry  geometry (origin, spacing, direction and largest possible region)
+ * @param  mask      mask, the voxels of the mask having a non zero value
+ * @return cropped geometry, with the spacing and direction of the input geometry
+ */
+inline
+itk::ImageBase<3>::Pointer
+cropGeometryToMask(const itk::ImageBase<3> * geometry, const itk::Image<unsigned char,3> * mask)
+{
+    // Type definition
+    typedef itk::ImageBase<3>                                    GeometryType;
+    typedef itk::Image<unsigned char,3>                          MaskImageType;
+    typedef itk::ImageRegionConstIteratorWithIndex<MaskImageType> IteratorType;
+    typedef itk::ContinuousIndex<double,3>                       ContinuousIndexType;
+
+    // Bounding box of the mask, as indices of the mask
+    MaskImageType::IndexType first, last;
+    first.Fill( itk::NumericTraits<itk::IndexValueType>::max() );
+    last.Fill(  itk::NumericTraits<itk::IndexValueType>::min() );
+    bool empty = true;
+    for (IteratorType it(mask, mask->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+        if (it.Get()==0)
+            continue;
+        const MaskImageType::IndexType index = it.GetIndex();
+        for (unsigned int i=0; i<3; i++)
+        {
+            first[i] = std::min(first[i], index[i]);
+            last[i]  = std::max(last[i],  index[i]);
+        }
+        empty = false;
+    }
+    if (empty)
+        throw std::runtime_error("The mask is empty.");
+
+    // Bounding box of the corners of the mask voxels, as continuous indices of the geometry
+    double lower[3], upper[3];
+    std::fill(lower, lower+3,  std::numeric_limits<double>::max());
+    std::fill(upper, upper+3, -std::numeric_limits<double>::max());
+    for (unsigned int corner=0; corner<8; corner++)
+    {
+        ContinuousIndexType maskIndex, index;
+        for (unsigned int i=0; i<3; i++)
+            maskIndex[i] = ( (corner >> i) & 1 ) ? last[i] + 0.5 : first[i] - 0.5;
+        GeometryType::PointType point;
+        mask->TransformContinuousIndexToPhysicalPoint(maskIndex, point);
+        geometry->TransformPhysicalPointToContinuousIndex(point, index);
+        for (unsigned int i=0; i<3; i++)
+        {
+            lower[i] = std::min(lower[i], index[i]);
+            upper[i] = std::max(upper[i], index[i]);
+        }
+    }
+
+    // Is the mask on the grid of the geometry?
+    bool sameGrid = true;
+    for (unsigned int i=0; i<3; i++)
+    {
+        const double tolerance = 1e-6 * geometry->GetSpacing()[i];
+        sameGrid = sameGrid && std::abs( mask->GetSpacing()[i] - geometry->GetSpacing()[i] ) <= tolerance
+                            && std::abs( mask->GetOrigin()[i]  - geometry->GetOrigin()[i]  ) <= tolerance;
+        for (unsigned int j=0; j<3; j++)
+            sameGrid = sameGrid && std::abs( mask->GetDirection()[i][j] - geometry->GetDirection()[i][j] ) <= 1e-6;
+    }
+
+    // Region of the geometry overlapping the bounding box. On the same grid, it is the bounding box of
+    // the mask. Otherwise both bounds are rounded to the nearest index, ties (up to a tolerance absorbing
+    // the rounding errors of the transforms above) toward the inside of the box.
+    const double                     epsilon = 1e-6;
+    const GeometryType::RegionType & largest = geometry->GetLargestPossibleRegion();
+    GeometryType::RegionType         region;
+    for (unsigned int i=0; i<3; i++)
+    {
+        const itk::IndexValueType lowerIndex = sameGrid ? first[i] : static_cast<itk::IndexValueType>( std::floor(lower[i] + 0.5 + epsilon) );
+        const itk::IndexValueType upperIndex = sameGrid ? last[i]  : static_cast<itk::IndexValueType>( std::ceil( upper[i] - 0.5 - epsilon) );
+        const itk::IndexValueType start = std::max( lowerIndex, largest.GetIndex(i) );
+        const itk::IndexValueType end   = std::min( upperIndex,
+                                                    largest.GetIndex(i) + static_cast<itk::IndexValueType>( largest.GetSize(i) ) - 1 );
+        if (end<start)
+            throw std::runtime_error("The mask does not overlap the output geometry.");
+        region.SetIndex(i, start);
+        region.SetSize( i, static_cast<itk::SizeValueType>( end - start + 1 ));
+    }
+
+    // Cropped geometry: the origin is moved to the first voxel of the region
+    GeometryType::PointType origin;
+    geometry->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+    region.GetModifiableIndex().Fill(0);
+
+    GeometryType::Pointer cropped = GeometryType::New();
+    cropped->SetOrigin(    origin );
+    cropped->SetSpacing(   geometry->GetSpacing() );
+    cropped->SetDirection( geometry->GetDirection() );
+    cropped->SetLargestPossibleRegion( region );
+    return cropped;
+}
+
+
+/**
+ * Resamples a mask on a geometry (nearest neighbor interpolation, voxels outside of the mask set to 0).
+ * @param  mask      mask
+ * @param  geometry  geometry of the output mask
+ * @return resampled mask
+ */
+inline
+itk::Image<unsigned char,3>::Pointer
+resampleMask(const itk::Image<unsigned char,3> * mask, const itk::ImageBase<3> * geometry)
+{
+    // Type definition
+    typedef itk::Image<unsigned char,3>                                              MaskImageType;
+    typedef itk::ResampleImageFilter<MaskImageType,MaskImageType,double>             ResampleFilterType;
+    typedef itk::NearestNeighborInterpolateImageFunction<MaskImageType,double>       InterpolatorType;
+
+    ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+    resampler->SetInput( mask );
+    resampler->SetInterpolator( InterpolatorType::New() );
+    resampler->SetOutputParametersFromImage( geometry );
+    resampler->SetDefaultPixelValue( 0 );
+    try
+    {
+        resampler->Update();
+    }
+    catch( itk::ExceptionObject& )
+    {
+        throw std::runtime_error( "Could not resample the mask on the output geometry." );
+    }
+    return resampler->GetOutput();
+}
+
+
+/**
+ * Inverts the displacement fields of the list marked for inversion and loaded without inverting them
+ * (see loadTransformations), each field being only inverted over the region where it is evaluated
+ * when the list is evaluated on a geometry. The transformations of the list are applied from the last
+ * one: the region of a field is the bounding box of the voxels of the geometry (or of the mask) mapped
+ * by the transformations following it, which are therefore inverted first. The points mapped outside
+ * of a field are extrapolated with its border voxels, as for the whole inverse, so the values of the
+ * list on the geometry are the ones given by the whole inverses.
+ * @param  transforms  transformations, in the order of the data structure
+ * @param  data        data structure
+ * @param  geometry    geometry on which the list is evaluated
+ * @param  mask        mask of the voxels evaluated, with the grid of the geometry, or null pointer
+ */
+template<class TScalarType>
+void
+invertDisplacementFieldsOverGeometry(std::vector<typename itk::Transform<TScalarType,3,3>::Pointer> & transforms, struct Data & data,
+                                     const itk::ImageBase<3> * geometry, const itk::Image<unsigned char,3> * mask = ITK_NULLPTR)
+{
+    // Type definition
+    typedef itk::GeneralTransform<TScalarType,3>               ListType;
+    typedef rpi::DisplacementFieldTransform<TScalarType>       DFType;
+    typedef typename ListType::InputPointType                  PointType;
+    typedef typename DFType::RegionType                        RegionType;
+    typedef itk::ContinuousIndex<double,3>                     ContinuousIndexType;
+
+    const itk::ImageBase<3>::RegionType & region = geometry->GetLargestPossibleRegion();
+    const itk::SizeValueType              sliceSize = region.GetSize(0) * region.GetSize(1);
+
+    for (unsigned int n=transforms.size(); n>0; n--)
+    {
+        const unsigned int i = n-1;
+        if (data.type[i]!=DISPLACEMENT_FIELD || !data.invert[i])
+            continue;
+        typename DFType::Pointer field = dynamic_cast<DFType *>( transforms[i].GetPointer() );
+        const itk::ImageBase<3> * fieldGeometry = field->GetFieldGeometry();
+        const RegionType &        fieldRegion   = fieldGeometry->GetLargestPossibleRegion();
+
+        // Transformations applied before the field
+        typename ListType::Pointer chain = ListType::New();
+        for (unsigned int j=i+1; j<transforms.size(); j++)
+            chain->InsertTransform( transforms[j].GetPointer() );
+
+        // Bounding box of the mapped points, slice by slice, clamped to the field
+        double lower[3], upper[3];
+        std::fill(lower, lower+3,  std::numeric_limits<double>::max());
+        std::fill(upper, upper+3, -std::numeric_limits<double>::max());
+        std::vector<PointType> points;
+        points.reserve(sliceSize);
+        for (itk::SizeValueType z=0; z<region.GetSize(2); z++)
+        {
+            points.clear();
+            itk::ImageBase<3>::IndexType index;
+            index[2] = region.GetIndex(2) + z;
+            for (itk::SizeValueType y=0; y<region.GetSize(1); y++)
+            {
+                index[1] = region.GetIndex(1) + y;
+                for (itk::SizeValueType x=0; x<region.GetSize(0); x++)
+                {
+                    index[0] = region.GetIndex(0) + x;
+                    if (mask && mask->GetPixel(index)==0)
+                        continue;
+                    PointType point;
+                    geometry->TransformIndexToPhysicalPoint(index, point);
+                    points.push_back(point);
+                }
+            }
+            if (points.empty())
+                continue;
+            if (chain->GetNumberOfTransformsInStack()>0)
+                chain->TransformPoints(&points[0], &points[0], points.size());
+
+            for (unsigned int p=0; p<points.size(); p++)
+            {
+                ContinuousIndexType continuousIndex;
+                fieldGeometry->TransformPhysicalPointToContinuousIndex(points[p], continuousIndex);
+                for (unsigned int k=0; k<3; k++)
+                {
+                    const double first = static_cast<double>( fieldRegion.GetIndex(k) );
+                    const double last  = first + static_cast<double>( fieldRegion.GetSize(k) ) - 1.0;
+                    const double value = std::min( std::max(continuousIndex[k], first), last );
+                    lower[k] = std::min(lower[k], value);
+                    upper[k] = std::max(upper[k], value);
+                }
+            }
+        }
+
+        // Region of the field used by the linear interpolation
+        RegionType inversionRegion = fieldRegion;
+        if (lower[0]<=upper[0])
+            for (unsigned int k=0; k<3; k++)
+            {
+                const itk::IndexValueType start = static_cast<itk::IndexValueType>( std::floor(lower[k]) );
+                const itk::IndexValueType end   = static_cast<itk::IndexValueType>( std::ceil(upper[k]) );
+                inversionRegion.SetIndex(k, start);
+                inversionRegion.SetSize( k, static_cast<itk::SizeValueType>( end - start + 1 ));
+            }
+
+        field->GetInverse(field, inversionRegion);
+    }
+}